@@ -26,8 +26,7 @@ uniform sampler2DArray textureSampler;
 uniform sampler2D fogSampler;
 
 in vec3 vfNormal;
-in vec2 vfTexturePosition;
-in vec2 vfCornerPosition;
+centroid in vec2 vfCornerPosition;
 in vec3 vfRealPosition;
 in float[4] vfShadowLevels;
 flat in uint vfTextureIndex;
@@ -35,12 +34,14 @@ flat in uint vfTextureIndex;
 out vec4 fColor;
  
 void main() {
-	vec2 cp = clamp(vfCornerPosition, 0.0, 1.0);
+	// every block of a quad repeats the shadows and the texture
+	vec2 cp = fract(vfCornerPosition);
 	float shadowLevel = vfShadowLevels[0] * (1 - cp.x) * (1 - cp.y)
 						+ vfShadowLevels[1] * cp.x * (1 - cp.y)
 						+ vfShadowLevels[3] * (1 - cp.x) * cp.y
 						+ vfShadowLevels[2] * cp.x * cp.y;
-	vec4 texColor = texture(textureSampler, vec3(vfTexturePosition, vfTextureIndex));
+	vec2 tp = vec2(vfCornerPosition.x, -vfCornerPosition.y);
+	vec4 texColor = textureGrad(textureSampler, vec3(fract(tp), vfTextureIndex), dFdx(tp), dFdy(tp));
 
 	vec4 sceneColor = texColor * vec4(vec3(1.0 - shadowLevel / 2.0), 1.0);
 	if (lightEnabled) {
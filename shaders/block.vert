@@ -18,18 +18,23 @@ const vec3 NORMALS[6] = vec3[6](
 	vec3( 0.0,  0.0, -1.0)
 );
 
-const vec2 CORNER_POSITIONS[4] = vec2[4](
-	vec2(0.0, 0.0),
-	vec2(1.0, 0.0),
-	vec2(1.0, 1.0),
-	vec2(0.0, 1.0)
+// the axes along which the corner positions of a face grow
+const vec3 FACE_X_AXES[6] = vec3[6](
+	vec3( 0.0,  1.0,  0.0),
+	vec3(-1.0,  0.0,  0.0),
+	vec3( 1.0,  0.0,  0.0),
+	vec3( 0.0, -1.0,  0.0),
+	vec3( 1.0,  0.0,  0.0),
+	vec3(-1.0,  0.0,  0.0)
 );
 
-const vec2 TEXTURE_POSITIONS[4] = vec2[4](
-	vec2(0.0, 1.0),
-	vec2(1.0, 1.0),
-	vec2(1.0, 0.0),
-	vec2(0.0, 0.0)
+const vec3 FACE_Y_AXES[6] = vec3[6](
+	vec3( 0.0,  0.0,  1.0),
+	vec3( 0.0,  0.0,  1.0),
+	vec3( 0.0,  1.0,  0.0),
+	vec3( 0.0,  0.0,  1.0),
+	vec3( 0.0,  0.0,  1.0),
+	vec3( 0.0,  1.0,  0.0)
 );
 
 uniform mat4 projectionMatrix;
@@ -38,13 +43,13 @@ uniform mat4 modelMatrix;
 
 layout(location = 0) in uint posIndex;
 layout(location = 1) in uint textureIndex;
-layout(location = 2) in uint dirIndexCornerIndex;
+layout(location = 2) in uint dirIndex;
 layout(location = 3) in uint shadowLevels;
 
 out vec3 vfNormal;
 flat out uint vfTextureIndex;
-out vec2 vfTexturePosition;
-out vec2 vfCornerPosition;
+// counts blocks, a quad can span several of them
+centroid out vec2 vfCornerPosition;
 out vec3 vfRealPosition;
 out float[4] vfShadowLevels;
 
@@ -56,14 +61,11 @@ void main() {
 	
 	vfTextureIndex = textureIndex;
 	
-	int dirIndex = int(dirIndexCornerIndex & 7u);
 	vfNormal = NORMALS[dirIndex];
 
 	for (int i = 0; i < 4; i++) {
 		vfShadowLevels[i] = float((shadowLevels >> 2 * i) & 3u) / 3.0;
 	}
 
-	uint cornerIndex = dirIndexCornerIndex >> 3u;
-	vfCornerPosition = CORNER_POSITIONS[cornerIndex];
-	vfTexturePosition = TEXTURE_POSITIONS[cornerIndex];
+	vfCornerPosition = vec2(dot(position.xyz, FACE_X_AXES[dirIndex]), dot(position.xyz, FACE_Y_AXES[dirIndex]));
 }
\ No newline at end of file
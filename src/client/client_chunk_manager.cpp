@@ -12,41 +12,39 @@ using namespace std;
 static logging::Logger logger("ccm");
 
 ClientChunkManager::ClientChunkManager(Client *client, std::unique_ptr<ChunkArchive> archive) :
-	threadOutQueue(1024),
-	threadInQueue(1024),
 	chunks(0, vec3i64HashFunc),
 	cachedRevisions(0, vec3i64HashFunc),
 	needCounter(0, vec3i64HashFunc),
 	client(client),
-	archive(std::move(archive))
+	archive(std::move(archive)),
+	archiveWorkers(this->archive.get(), this->archive->getConf().io_threads)
 {
 	for (int i = 0; i < CHUNK_POOL_SIZE; i++) {
 		chunkPool[i] = new Chunk(Chunk::ChunkFlags::VISUAL);
 		unusedChunks.push(chunkPool[i]);
 	}
-	dispatch();
 }
 
 ClientChunkManager::~ClientChunkManager() {
 	LOG_TRACE(logger) << "Destroying ChunkManager";
-	requestTermination();
-	ArchiveOperation op;
-	while(threadOutQueue.pop(op));
-	wait();
+	archiveWorkers.stop();
+	// everything left goes to the archive in one batch
+	std::vector<const Chunk *> storeBatchChunks;
 	while (!preThreadInQueue.empty()) {
 		ArchiveOperation op = preThreadInQueue.front();
 		preThreadInQueue.pop();
-		if (op.type != STORE)
+		if (op.type != ArchiveWorkers::STORE)
 			continue;
-		archive->storeChunk(*op.chunk);
+		storeBatchChunks.push_back(op.chunk);
 	}
 	for (auto it1 = chunks.begin(); it1 != chunks.end(); ++it1) {
 		Chunk *chunk = it1->second;
 		uint32 revision;
 		bool cached = archive->hasChunk(chunk->getCC(), &revision);
 		if (!cached || revision != chunk->getRevision())
-			archive->storeChunk(*chunk);
+			storeBatchChunks.push_back(chunk);
 	}
+	archive->storeChunks(storeBatchChunks);
 	for (int i = 0; i < CHUNK_POOL_SIZE; i++) {
 		delete chunkPool[i];
 	}
@@ -77,24 +75,24 @@ void ClientChunkManager::tick() {
 			insertReceivedChunk(chunk);
 			numSessionChunkGens++;
 		} else {
-			ArchiveOperation op = {chunk, LOAD};
+			ArchiveOperation op = {chunk, ArchiveWorkers::LOAD};
 			preThreadInQueue.push(op);
 		}
 	}
 
 	while (!preThreadInQueue.empty()) {
 		ArchiveOperation op = preThreadInQueue.front();
-		if (!threadInQueue.push(op))
+		if (!archiveWorkers.push(op))
 			break;
-		if (op.type == STORE)
+		if (op.type == ArchiveWorkers::STORE)
 			cachedRevisions.insert({op.chunk->getCC(), op.chunk->getRevision()});
 		preThreadInQueue.pop();
 	}
 
 	ArchiveOperation op;
-	while (threadOutQueue.pop(op)) {
+	while (archiveWorkers.pop(op)) {
 		switch(op.type) {
-		case LOAD:
+		case ArchiveWorkers::LOAD:
 			if (op.chunk->isInitialized()) {
 				insertLoadedChunk(op.chunk);
 				numSessionChunkLoads++;
@@ -102,7 +100,7 @@ void ClientChunkManager::tick() {
 				LOG_ERROR(logger) << "Chunk archive did not load chunk";
 			}
 			break;
-		case STORE:
+		case ArchiveWorkers::STORE:
 			cachedRevisions.erase(op.chunk->getCC());
 			recycleChunk(op.chunk);
 			break;
@@ -112,37 +110,6 @@ void ClientChunkManager::tick() {
 	}
 }
 
-void ClientChunkManager::doWork() {
-	ArchiveOperation op;
-	if (threadInQueue.pop(op)) {
-		switch (op.type) {
-		case LOAD:
-			archive->loadChunk(op.chunk);
-			break;
-		case STORE:
-			archive->storeChunk(*op.chunk);
-			break;
-		case STORE_SILENTLY:
-			archive->storeChunk(*op.chunk);
-			break;
-		}
-		while (op.type != STORE_SILENTLY && !threadOutQueue.push(op)) {
-			sleepFor(millis(50));
-		}
-	} else {
-		sleepFor(millis(100));
-	}
-}
-
-void ClientChunkManager::onStop() {
-	ArchiveOperation op;
-	while (threadInQueue.pop(op)) {
-		if (op.type == STORE) {
-			archive->storeChunk(*op.chunk);
-		}
-	}
-}
-
 void ClientChunkManager::placeBlock(vec3i64 chunkCoords, size_t intraChunkIndex,
 		uint blockType, uint32 revision) {
 	auto it = chunks.find(chunkCoords);
@@ -186,7 +153,7 @@ void ClientChunkManager::releaseChunk(vec3i64 chunkCoords) {
 				uint32 revision;
 				bool cached = archive->hasChunk(chunk->getCC(), &revision);
 				if (!cached || chunk->getRevision() != revision)
-					preThreadInQueue.push(ArchiveOperation{chunk, STORE});
+					preThreadInQueue.push(ArchiveOperation{chunk, ArchiveWorkers::STORE});
 				else
 					recycleChunk(chunk);
 			}
@@ -227,10 +194,16 @@ void ClientChunkManager::insertReceivedChunk(Chunk *chunk) {
 	auto it = needCounter.find(chunk->getCC());
 	if (it != needCounter.end()) {
 		chunks.insert({chunk->getCC(), chunk});
-		ArchiveOperation op = {chunk, STORE_SILENTLY};
-		preThreadInQueue.push(op);
+		// the chunk can be edited while it's being stored, so a copy goes to the archive
+		if (!unusedChunks.empty()) {
+			Chunk *copy = unusedChunks.top();
+			unusedChunks.pop();
+			copy->initCopy(*chunk);
+			ArchiveOperation op = {copy, ArchiveWorkers::STORE};
+			preThreadInQueue.push(op);
+		}
 	} else {
-		ArchiveOperation op = {chunk, STORE};
+		ArchiveOperation op = {chunk, ArchiveWorkers::STORE};
 		preThreadInQueue.push(op);
 	}
 }
@@ -6,33 +6,26 @@
 #include <future>
 #include <queue>
 #include <stack>
+#include <unordered_map>
+#include <vector>
 
 #include "shared/chunk_manager.hpp"
 
 #include "shared/engine/vmath.hpp"
 #include "shared/engine/queue.hpp"
-#include "shared/engine/thread.hpp"
 #include "shared/game/chunk.hpp"
 #include "shared/block_utils.hpp"
+#include "shared/archive_workers.hpp"
 #include "shared/chunk_archive.hpp"
 
 class Client;
 
-class ClientChunkManager : public ChunkManager, public Thread {
+class ClientChunkManager : public ChunkManager {
 public:
 	static const int CHUNK_POOL_SIZE = 20000;
 
 private:
-	enum ArchiveOperationType {
-		LOAD = 0,
-		STORE,
-		STORE_SILENTLY,
-	};
-
-	struct ArchiveOperation {
-		Chunk *chunk;
-		ArchiveOperationType type;
-	};
+	typedef ArchiveWorkers::Operation ArchiveOperation;
 
 	Chunk *chunkPool[CHUNK_POOL_SIZE];
 	std::stack<Chunk *> unusedChunks;
@@ -40,8 +33,6 @@ private:
 	std::queue<vec3i64> requiredQueue;
 	std::queue<Chunk *> notInCacheQueue;
 	std::queue<ArchiveOperation> preThreadInQueue;
-	ProducerQueue<ArchiveOperation> threadOutQueue;
-	ProducerQueue<ArchiveOperation> threadInQueue;
 	std::unordered_map<vec3i64, Chunk *, size_t(*)(vec3i64)> chunks;
 	std::unordered_map<vec3i64, uint32, size_t(*)(vec3i64)> cachedRevisions;
 	std::unordered_map<vec3i64, int, size_t(*)(vec3i64)> needCounter;
@@ -52,14 +43,13 @@ private:
 	Client *client = nullptr;
 
 	std::unique_ptr<ChunkArchive> archive;
+	ArchiveWorkers archiveWorkers;
 
 public:
 	ClientChunkManager(Client *client, std::unique_ptr<ChunkArchive> archive);
 	virtual ~ClientChunkManager();
 
 	void tick();
-	virtual void doWork() override;
-	virtual void onStop() override;
 
 	void placeBlock(vec3i64 chunkCoords, size_t intraChunkIndex,
 			uint blockType, uint32 revision);
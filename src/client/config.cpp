@@ -20,6 +20,8 @@ AntiAliasing  DEFAULT_ANTI_ALIASING   = AntiAliasing::MSAA_4;
 Fog           DEFAULT_FOG             = Fog::FANCY;
 uint          DEFAULT_RENDER_DISTANCE = 8;
 float         DEFAULT_FOV             = 120;
+bool          DEFAULT_GREEDY_MESHING  = true;
+uint          DEFAULT_MESH_THREADS    = 0;
 uint          DEFAULT_TEX_MIPMAPPING  = 1000;
 TexFiltering  DEFAULT_TEX_FILTERING   = TexFiltering::LINEAR;
 bool          DEFAULT_TEX_ATLAS       = false;
@@ -236,6 +238,8 @@ void store(const char *filename, const GraphicsConf &conf) {
 	out << YAML::Key << "fog" << YAML::Value << conf.fog;
 	out << YAML::Key << "render_distance" << YAML::Value << conf.render_distance;
 	out << YAML::Key << "fov" << YAML::Value << conf.fov;
+	out << YAML::Key << "greedy_meshing" << YAML::Value << conf.greedy_meshing;
+	out << YAML::Key << "mesh_threads" << YAML::Value << conf.mesh_threads;
 	out << YAML::Key << "textures" << YAML::Value;
 	out << YAML::BeginMap;
 	out << YAML::Key << "mipmapping" << YAML::Value << conf.tex_mipmapping;
@@ -288,6 +292,12 @@ void load(const char *filename, GraphicsConf *conf) {
 	node = root["config"]["graphics"]["fov"];
 	conf->fov = node ? node.as<float>() : DEFAULT_FOV;
 
+	node = root["config"]["graphics"]["greedy_meshing"];
+	conf->greedy_meshing = node ? node.as<bool>() : DEFAULT_GREEDY_MESHING;
+
+	node = root["config"]["graphics"]["mesh_threads"];
+	conf->mesh_threads = node ? node.as<uint>() : DEFAULT_MESH_THREADS;
+
 	node = root["config"]["graphics"]["mipmapping"];
 	conf->tex_mipmapping = node ? node.as<uint>() : DEFAULT_TEX_MIPMAPPING;
 
@@ -38,6 +38,8 @@ extern AntiAliasing  DEFAULT_ANTI_ALIASING;
 extern Fog           DEFAULT_FOG;
 extern uint          DEFAULT_RENDER_DISTANCE;
 extern float         DEFAULT_FOV;
+extern bool          DEFAULT_GREEDY_MESHING;
+extern uint          DEFAULT_MESH_THREADS;
 extern uint          DEFAULT_TEX_MIPMAPPING;
 extern TexFiltering  DEFAULT_TEX_FILTERING;
 extern bool          DEFAULT_TEX_ATLAS;
@@ -54,6 +56,9 @@ struct GraphicsConf {
 	Fog fog;
 	uint render_distance;
 	float fov;
+	bool greedy_meshing;
+	// 0 for one less than the hardware threads
+	uint mesh_threads;
 
 	uint tex_mipmapping;
 	TexFiltering tex_filtering;
@@ -1,8 +1,14 @@
 #include "chunk_renderer.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
 #include "../../shared/game/character.hpp"
 #include "shared/engine/logging.hpp"
+#include "shared/engine/math.hpp"
 #include "shared/engine/stopwatch.hpp"
+#include "shared/engine/thread.hpp"
 #include "shared/block_utils.hpp"
 #include "shared/chunk_manager.hpp"
 #include "shared/constants.hpp"
@@ -15,10 +21,59 @@ using namespace std;
 
 static logging::Logger logger("render");
 
+static const size_t QUAD_BUFFERS_PER_WORKER = 16;
+
+class ChunkRenderer::BuildWorker : public Thread {
+public:
+	BuildWorker(ChunkRenderer *chunkRenderer) :
+		Thread("mesher"), outQueue(1024), quadBuffers(QUAD_BUFFERS_PER_WORKER),
+		chunkRenderer(chunkRenderer) {}
+
+	ProducerQueue<ChunkVisuals> outQueue;
+	// the quads of finished chunks come back to be filled again
+	ProducerQueue<std::vector<Quad>> quadBuffers;
+
+	void doWork() override;
+
+private:
+	ChunkRenderer *chunkRenderer;
+	ChunkMesher mesher;
+	uint8 unmergedFaces[256];
+};
+
+void ChunkRenderer::BuildWorker::doWork() {
+	BuildJob job;
+	{
+		std::unique_lock<std::mutex> lock(chunkRenderer->buildLock);
+		if (isTerminationRequested())
+			return;
+		std::vector<BuildJob> &jobs = chunkRenderer->buildJobs;
+		if (jobs.empty()) {
+			// new jobs and stopping wake us up
+			chunkRenderer->buildWake.wait(lock);
+			return;
+		}
+		std::pop_heap(jobs.begin(), jobs.end());
+		job = std::move(jobs.back());
+		jobs.pop_back();
+		memcpy(unmergedFaces, chunkRenderer->unmergedFaces, sizeof(unmergedFaces));
+	}
+
+	// keeps the memory of a mesh that was already uploaded
+	std::vector<Quad> quads;
+	quadBuffers.pop(quads);
+	quads.clear();
+
+	ChunkVisuals cv = chunkRenderer->buildChunk(job, &mesher, unmergedFaces, std::move(quads));
+	// the main thread takes finished chunks until we are stopped
+	while (!outQueue.push(std::move(cv)))
+		sleepFor(millis(10));
+}
+
 ChunkRenderer::ChunkRenderer(Client *client, Renderer *renderer) :
 		inBuildQueue(0, vec3i64HashFunc),
-		toBuildQueue(1024),
-		toFinishQueue(1024),
+		changedWhileBuilding(0, vec3i64HashFunc),
+		buildCenter(0, 0, 0),
 		builtChunks(0, vec3i64HashFunc),
 		vsChunks(0, vec3i64HashFunc),
 		vsInFringe(0, vec3i64HashFunc),
@@ -27,20 +82,33 @@ ChunkRenderer::ChunkRenderer(Client *client, Renderer *renderer) :
 	renderChunks[0] = std::map<vec3i64, vec3i64, bool(*)(vec3i64, vec3i64)>(vec3i64CompFunc);
 	renderChunks[1] = std::map<vec3i64, vec3i64, bool(*)(vec3i64, vec3i64)>(vec3i64CompFunc);
 	renderDistance = client->getConf().render_distance;
-	dispatch();
+	greedyMeshing = client->getConf().greedy_meshing;
+	startBuildWorkers(client->getConf().mesh_threads);
 }
 
 ChunkRenderer::~ChunkRenderer() {
-	requestTermination();
-	ChunkVisuals cv;
-	while (toFinishQueue.pop(cv));
-	wait();
+	stopBuildWorkers(false);
 }
 
 void ChunkRenderer::setConf(const GraphicsConf &conf, const GraphicsConf &old) {
 	if (conf.render_distance != old.render_distance) {
 		checkChunkIndex = 0; // TODO make smarter
 		this->renderDistance = conf.render_distance;
+		updateBuildJobs(oldCharacterChunk);
+	}
+	if (conf.mesh_threads != old.mesh_threads) {
+		stopBuildWorkers(true);
+		startBuildWorkers(conf.mesh_threads);
+	}
+	if (conf.greedy_meshing != old.greedy_meshing) {
+		// build every chunk again, what is still being built is dropped and queued again when finished
+		greedyMeshing = conf.greedy_meshing;
+		for (auto it = builtChunks.begin(); it != builtChunks.end(); ++it)
+			destroyChunkData(it->first);
+		builtChunks.clear();
+		numFaces = 0;
+		numBlockFaces = 0;
+		checkChunkIndex = 0;
 	}
 }
 
@@ -71,11 +139,14 @@ void ChunkRenderer::tick() {
 			if ((it->first - pc).norm() > renderDistance) {
 				destroyChunkData(it->first);
 				numFaces -= it->second.numFaces;
+				numBlockFaces -= it->second.numBlockFaces;
 				it = builtChunks.erase(it);
 			} else {
 				++it;
 			}
 		}
+
+		updateBuildJobs(pc);
 	}
 
 	// put chunks into render queue
@@ -84,26 +155,30 @@ void ChunkRenderer::tick() {
 		vec3i64 cd = LOADING_ORDER[checkChunkIndex].cast<int64>();
 		if (cd.norm() <= renderDistance) {
 			vec3i64 cc = pc + cd;
-			auto it = builtChunks.find(cc);
-			if (it == builtChunks.end()) {
-				auto it = inBuildQueue.find(cc);
-				if (it == inBuildQueue.end()) {
-					inBuildQueue.insert(cc);
-					buildQueue.push_back(cc);
-					for (size_t i = 0; i < 27; ++i) {
-						client->getChunkManager()->requireChunk(cc + BIG_CUBE_CYCLE[i].cast<int64>());
-					}
-				}
-			}
+			if (builtChunks.find(cc) == builtChunks.end())
+				queueChunk(cc, false);
 		}
 		checkChunkIndex++;
 	}
 
 	client->getStopwatch()->start(CLOCK_IBQ);
+	// merged faces can only have one texture, the textures are loaded after we are made
+	const uint8 *varyingFaces = getVaryingFaces();
+	if (memcmp(unmergedFaces, varyingFaces, sizeof(unmergedFaces)) != 0) {
+		std::lock_guard<std::mutex> lock(buildLock);
+		memcpy(unmergedFaces, varyingFaces, sizeof(unmergedFaces));
+	}
+
 	// build chunks in render queue
 	newFaces = 0;
 	newChunks = 0;
-	while (!buildQueue.empty()) {
+	size_t numJobs;
+	{
+		std::lock_guard<std::mutex> lock(buildLock);
+		numJobs = buildJobs.size();
+	}
+	std::vector<BuildJob> newJobs;
+	while (!buildQueue.empty() && numJobs + newJobs.size() < MAX_BUILD_JOBS) {
 		vec3i64 cc = buildQueue.front();
 		ChunkArea area;
 		if (!getChunkArea(cc, &area))
@@ -112,26 +187,36 @@ void ChunkRenderer::tick() {
 		const Chunk *chunk = area.chunks[BIG_CUBE_CYCLE_BASE_INDEX];
 
 		if (!chunkHasQuads(area)) {
-			finishChunk(ChunkVisuals{cc, chunk->getRevision(), std::vector<Quad>()});
-			for (int i = 0; i < 27; ++i) {
-				client->getChunkManager()->releaseChunk(cc + BIG_CUBE_CYCLE[i].cast<int64>());
-			}
-		} else if (!toBuildQueue.push(area)) // TODO data must be copied or locked for thread safety
-			break;
+			finishChunk(ChunkVisuals{cc, chunk->getRevision(), chunk->getPassThroughs(),
+					std::vector<Quad>(), greedyMeshing});
+			inBuildQueue.erase(cc);
+		} else {
+			// stays in inBuildQueue until it is built
+			newJobs.push_back(makeBuildJob(cc, area));
+		}
+		// the blocks were copied just now
+		changedWhileBuilding.erase(cc);
+		releaseChunkArea(cc);
 
 		buildQueue.pop_front();
-		inBuildQueue.erase(inBuildQueue.find(cc));
+	}
+	if (!newJobs.empty()) {
+		{
+			std::lock_guard<std::mutex> lock(buildLock);
+			for (BuildJob &job : newJobs) {
+				vec3i64 cd = job.cc - buildCenter;
+				job.distance = cd * cd;
+				buildJobs.push_back(std::move(job));
+				std::push_heap(buildJobs.begin(), buildJobs.end());
+			}
+		}
+		buildWake.notify_all();
 	}
 	client->getStopwatch()->stop(CLOCK_IBQ);
 
 	client->getStopwatch()->start(CLOCK_BCH);
-	ChunkVisuals cv;
-	while(toFinishQueue.pop(cv)) {
-		finishChunk(cv);
-		for (int i = 0; i < 27; ++i) {
-			client->getChunkManager()->releaseChunk(cv.cc + BIG_CUBE_CYCLE[i].cast<int64>());
-		}
-	}
+	for (auto &worker : buildWorkers)
+		finishBuiltChunks(worker.get());
 	client->getStopwatch()->stop(CLOCK_BCH);
 
 	client->getStopwatch()->start(CLOCK_VS);
@@ -155,6 +240,7 @@ void ChunkRenderer::render() {
 
 	visibleChunks = 0;
 	visibleFaces = 0;
+	visibleBlockFaces = 0;
 
 	vec3i64 pc = character.getChunkPos();
 	for (int i = 0; i < 27; i++) {
@@ -164,6 +250,7 @@ void ChunkRenderer::render() {
 			renderChunk(cc);
 			visibleChunks++;
 			visibleFaces += builtIt->second.numFaces;
+			visibleBlockFaces += builtIt->second.numBlockFaces;
 		}
 	}
 
@@ -177,6 +264,7 @@ void ChunkRenderer::render() {
 			renderChunk(cc);
 			visibleChunks++;
 			visibleFaces += builtIt->second.numFaces;
+			visibleBlockFaces += builtIt->second.numBlockFaces;
 		}
 	}
 
@@ -185,39 +273,31 @@ void ChunkRenderer::render() {
 	client->getStopwatch()->stop(CLOCK_CRR);
 }
 
-void ChunkRenderer::doWork() {
-	ChunkArea area;
-	if(toBuildQueue.pop(area)) {
-		ChunkVisuals cv = buildChunk(area);
-		while(!toFinishQueue.push(cv))
-			sleepFor(millis(50));
-	} else {
-		sleepFor(millis(100));
-	}
-}
-
 void ChunkRenderer::rebuildChunk(vec3i64 chunkCoords) {
+	// a job might have copied the blocks before they changed
+	if (inBuildQueue.find(chunkCoords) != inBuildQueue.end())
+		changedWhileBuilding.insert(chunkCoords);
+
 	auto it = builtChunks.find(chunkCoords);
 	if (it == builtChunks.end())
 		return;
 
 	ChunkArea area;
-	if (!getChunkArea(chunkCoords, &area) && inBuildQueue.find(chunkCoords) == inBuildQueue.end()) {
-		inBuildQueue.insert(chunkCoords);
-		buildQueue.push_front(chunkCoords);
-		for (size_t i = 0; i < 27; ++i) {
-			client->getChunkManager()->requireChunk(chunkCoords + BIG_CUBE_CYCLE[i].cast<int64>());
-		}
+	if (!getChunkArea(chunkCoords, &area)) {
+		queueChunk(chunkCoords, true);
 		return;
 	}
 
 	const Chunk *chunk = area.chunks[BIG_CUBE_CYCLE_BASE_INDEX];
 
 	ChunkVisuals cv;
-	if (!chunkHasQuads(area))
-		cv = ChunkVisuals{chunkCoords, chunk->getRevision(), std::vector<Quad>()};
-	else
-		cv = buildChunk(area);
+	if (!chunkHasQuads(area)) {
+		cv = ChunkVisuals{chunkCoords, chunk->getRevision(), chunk->getPassThroughs(),
+				std::vector<Quad>(), greedyMeshing};
+	} else {
+		ChunkMesher mesher;
+		cv = buildChunk(makeBuildJob(chunkCoords, area), &mesher, unmergedFaces, std::vector<Quad>());
+	}
 	finishChunk(cv);
 }
 
@@ -227,114 +307,153 @@ ChunkRendererDebugInfo ChunkRenderer::getDebugInfo() {
 	info.newFaces = newFaces;
 	info.newChunks = newChunks;
 	info.totalFaces = numFaces;
+	info.totalBlockFaces = numBlockFaces;
 	info.visibleChunks = visibleChunks;
 	info.visibleFaces = visibleFaces;
+	info.visibleBlockFaces = visibleBlockFaces;
 	info.buildQueueSize = (int)buildQueue.size();
+	{
+		std::lock_guard<std::mutex> lock(buildLock);
+		info.buildJobs = (int)buildJobs.size();
+	}
 
 	return info;
 }
 
-ChunkRenderer::ChunkVisuals ChunkRenderer::buildChunk(ChunkArea area) {
-	const Chunk &chunk = *(area.chunks[BIG_CUBE_CYCLE_BASE_INDEX]);
-	vec3i64 cc = chunk.getCC();
+ChunkRenderer::BuildJob ChunkRenderer::makeBuildJob(vec3i64 chunkCoords, ChunkArea area) {
+	BuildJob job;
+	job.cc = chunkCoords;
+	job.revision = area.chunks[BIG_CUBE_CYCLE_BASE_INDEX]->getRevision();
+	job.passThroughs = area.chunks[BIG_CUBE_CYCLE_BASE_INDEX]->getPassThroughs();
+	job.blocks.resize(ChunkMesher::PADDED_SIZE);
+	ChunkMesher::copyBlocks(area.chunks, job.blocks.data());
+	job.distance = 0;
+	return job;
+}
 
-	std::vector<Quad> quads;
-	quads.reserve(Chunk::WIDTH * Chunk::WIDTH * (Chunk::WIDTH + 1) * 3);
-
-	const uint8 *blocks = chunk.getBlocks();
-	for (uint8 d = 0; d < 3; d++) {
-		vec3i64 dir = DIRS[d].cast<int64>();
-		uint dimFlipIndexDiff = (uint) (((dir[2] * Chunk::WIDTH + dir[1]) * Chunk::WIDTH + dir[0]) * (Chunk::WIDTH - 1));
-		uint i = 0;
-		uint ni = 0;
-		for (int z = (d == 2) ? -1 : 0; z < (int) Chunk::WIDTH; z++) {
-			for (int y = (d == 1) ? -1 : 0; y < (int) Chunk::WIDTH; y++) {
-				for (int x = (d == 0) ? -1 : 0; x < (int) Chunk::WIDTH; x++) {
-					uint8 thatType;
-					uint8 thisType;
-					bool thisOutside = x == -1 || y == -1 || z == -1;
-					bool thatOutside = !thisOutside
-							&& ((x == Chunk::WIDTH - 1 && d==0)
-							|| (y == Chunk::WIDTH - 1 && d==1)
-							|| (z == Chunk::WIDTH - 1 && d==2));
-					if (thatOutside) {
-						const Chunk &otherChunk = *area.chunks[DIR_TO_BIG_CUBE_CYCLE_INDEX[d]];
-						thatType = otherChunk.getBlocks()[i - dimFlipIndexDiff];
-						if (thatType != 0) {
-							if (!thisOutside)
-								i++;
-							continue;
-						}
-					} else
-						thatType = blocks[ni++];
+ChunkRenderer::ChunkVisuals ChunkRenderer::buildChunk(const BuildJob &job,
+		ChunkMesher *mesher, const uint8 *unmergedFaces, std::vector<Quad> quads) {
+	bool greedy = greedyMeshing;
+	mesher->mesh(job.blocks.data(), greedy, &quads, unmergedFaces);
+	return ChunkVisuals{job.cc, job.revision, job.passThroughs, std::move(quads), greedy};
+}
 
-					if (thisOutside) {
-						const Chunk &otherChunk = *area.chunks[DIR_TO_BIG_CUBE_CYCLE_INDEX[d + 3]];
-						thisType = otherChunk.getBlocks()[ni - 1 + dimFlipIndexDiff];
-						if (thisType != 0)
-							continue;
-					} else {
-						thisType = blocks[i++];
-					}
+void ChunkRenderer::startBuildWorkers(uint numThreads) {
+	if (numThreads == 0) {
+		// the main thread has enough to do on its own
+		uint hardwareThreads = std::thread::hardware_concurrency();
+		numThreads = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+	for (uint i = 0; i < numThreads; ++i) {
+		buildWorkers.emplace_back(new BuildWorker(this));
+		buildWorkers.back()->dispatch();
+	}
+}
 
-					if ((thisType == 0) != (thatType == 0)) {
-						Quad quad;
-						if (thisType == 0) {
-							quad.icc = vec3ui8(x, y, z) + DIRS[d].cast<uint8>();
-							quad.faceDir = (uint8) (d + 3);
-							quad.faceType = thatType;
-						} else {
-							quad.icc = vec3ui8(x, y, z);
-							quad.faceDir = d;
-							quad.faceType = thisType;
-						}
+void ChunkRenderer::stopBuildWorkers(bool finish) {
+	for (auto &worker : buildWorkers)
+		worker->requestTermination();
+	{
+		// a worker either sees the request before waiting or is woken up
+		std::lock_guard<std::mutex> lock(buildLock);
+	}
+	buildWake.notify_all();
+
+	// the jobs nobody took stay for the next workers
+	for (auto &worker : buildWorkers) {
+		ChunkVisuals cv;
+		// a worker might wait for room for its last chunk
+		do {
+			if (finish)
+				finishBuiltChunks(worker.get());
+			else
+				while (worker->outQueue.pop(cv));
+		} while (!worker->waitFor(millis(10)));
+		if (finish)
+			finishBuiltChunks(worker.get());
+	}
+	buildWorkers.clear();
+}
 
-						uint8 corners = 0;
-						for (int j = 0; j < 8; ++j) {
-							vec3i v = DIR_QUAD_EIGHT_NEIGHBOR_CYCLES[quad.faceDir][j];
-							vec3i dIcc = quad.icc.cast<int>() + v;
-							vec3i8 ncc(0, 0, 0);
-							for (int i = 0; i < 3; i++) {
-								if (dIcc[i] < 0) {
-									ncc[i] = -1;
-									dIcc[i] += Chunk::WIDTH;
-								} else if (dIcc[i] >= (int) Chunk::WIDTH) {
-									ncc[i] = 1;
-									dIcc[i] -= Chunk::WIDTH;
-								}
-							}
-							const Chunk &otherChunk = *area.chunks[vec2BigCubeCycleIndex(ncc)];
-							uint8 cornerBlock = otherChunk.getBlock(dIcc.cast<uint8>());
-							if (cornerBlock != 0) {
-								corners |= 1 << j;
-							}
-						}
-						quad.bc = chunk.getCC() * chunk.WIDTH + quad.icc.cast<int64>();
-
-						for (int j = 0; j < 4; j++) {
-							quad.shadowLevels[j] = 0;
-							bool s1 = (corners & QUAD_CORNER_MASK[j][0]) > 0;
-							bool s2 = (corners & QUAD_CORNER_MASK[j][2]) > 0;
-							bool m = (corners & QUAD_CORNER_MASK[j][1]) > 0;
-							if (s1)
-								quad.shadowLevels[j]++;
-							if (s2)
-								quad.shadowLevels[j]++;
-							if (m || (s1 && s2))
-								quad.shadowLevels[j]++;
-						}
-						quads.push_back(quad);
-					}
-				}
+void ChunkRenderer::finishBuiltChunks(BuildWorker *worker) {
+	ChunkVisuals cv;
+	while (worker->outQueue.pop(cv)) {
+		inBuildQueue.erase(cv.cc);
+		bool changed = changedWhileBuilding.erase(cv.cc) > 0;
+		// the character might have moved away while it was built
+		if ((cv.cc - oldCharacterChunk).norm() <= renderDistance) {
+			finishChunk(cv);
+			// edits of neighbors don't change the revision, so rebuildChunk told us about them,
+			// and so it did about edits of a chunk that was unloaded since its job was made
+			const Chunk *chunk = client->getChunkManager()->getChunk(cv.cc);
+			bool stale = changed || (chunk && chunk->getRevision() != cv.revision);
+			// finishChunk dropped it or it shows old blocks, nothing else builds it again
+			if (stale || cv.greedy != greedyMeshing)
+				queueChunk(cv.cc, stale);
+		}
+		// uploaded, the worker can fill it again
+		worker->quadBuffers.push(std::move(cv.quads));
+	}
+}
+
+void ChunkRenderer::queueChunk(vec3i64 chunkCoords, bool front) {
+	if (!inBuildQueue.insert(chunkCoords).second)
+		return;
+	if (front)
+		buildQueue.push_front(chunkCoords);
+	else
+		buildQueue.push_back(chunkCoords);
+	for (size_t i = 0; i < 27; ++i)
+		client->getChunkManager()->requireChunk(chunkCoords + BIG_CUBE_CYCLE[i].cast<int64>());
+}
+
+void ChunkRenderer::releaseChunkArea(vec3i64 chunkCoords) {
+	for (int i = 0; i < 27; ++i)
+		client->getChunkManager()->releaseChunk(chunkCoords + BIG_CUBE_CYCLE[i].cast<int64>());
+}
+
+void ChunkRenderer::updateBuildJobs(vec3i64 center) {
+	std::vector<vec3i64> cancelled;
+	{
+		std::lock_guard<std::mutex> lock(buildLock);
+		buildCenter = center;
+		size_t numKept = 0;
+		for (BuildJob &job : buildJobs) {
+			vec3i64 cd = job.cc - center;
+			if (cd.norm() > renderDistance) {
+				// its chunks were released when the job was made
+				inBuildQueue.erase(job.cc);
+				changedWhileBuilding.erase(job.cc);
+				continue;
 			}
+			buildJobs[numKept] = std::move(job);
+			buildJobs[numKept++].distance = cd * cd;
 		}
+		buildJobs.resize(numKept);
+		std::make_heap(buildJobs.begin(), buildJobs.end());
 	}
 
-	quads.shrink_to_fit();
-	return ChunkVisuals{cc, chunk.getRevision(), quads};
+	for (auto it = buildQueue.begin(); it != buildQueue.end();) {
+		if ((*it - center).norm() > renderDistance) {
+			cancelled.push_back(*it);
+			it = buildQueue.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	for (vec3i64 cc : cancelled) {
+		releaseChunkArea(cc);
+		inBuildQueue.erase(cc);
+		changedWhileBuilding.erase(cc);
+	}
 }
 
-void ChunkRenderer::finishChunk(ChunkVisuals cv) {
+void ChunkRenderer::finishChunk(const ChunkVisuals &cv) {
+	// built before the meshing mode changed, it is built again anyway
+	if (cv.greedy != greedyMeshing)
+		return;
+
 	auto it = builtChunks.find(cv.cc);
 	if (it == builtChunks.end()) {
 		auto pair = builtChunks.insert({cv.cc, ChunkBuildInfo()});
@@ -345,21 +464,21 @@ void ChunkRenderer::finishChunk(ChunkVisuals cv) {
 		return;
 
 	numFaces -= it->second.numFaces;
+	numBlockFaces -= it->second.numBlockFaces;
 
 	applyChunkVisuals(cv);
 	newChunks++;
 
 	it->second.numFaces = (int)cv.quads.size() * 2;
+	it->second.numBlockFaces = 0;
+	for (const Quad &quad : cv.quads)
+		it->second.numBlockFaces += quad.width * quad.height;
 	it->second.revision = cv.revision;
-	const Chunk *chunk = client->getChunkManager()->getChunk(cv.cc);
-	if (!chunk) {
-		LOG_ERROR(logger) << "missing chunk for finish";
-		it->second.passThroughs = 0x3F;
-	} else
-		it->second.passThroughs = chunk->getPassThroughs();
+	it->second.passThroughs = cv.passThroughs;
 
 	newFaces += it->second.numFaces;
 	numFaces += it->second.numFaces;
+	numBlockFaces += it->second.numBlockFaces;
 	changedChunksQueue.push_back(cv.cc);
 }
 
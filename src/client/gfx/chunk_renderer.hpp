@@ -1,7 +1,11 @@
 #ifndef CHUNK_RENDERER_HPP
 #define CHUNK_RENDERER_HPP
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <deque>
@@ -10,6 +14,7 @@
 #include "shared/engine/vmath.hpp"
 #include "shared/engine/queue.hpp"
 #include "shared/game/chunk.hpp"
+#include "shared/game/chunk_mesher.hpp"
 #include "client/client.hpp"
 #include "client/client_chunk_manager.hpp"
 #include "client/gfx/component_renderer.hpp"
@@ -22,27 +27,49 @@ struct ChunkRendererDebugInfo {
 	int newFaces = 0;
 	int newChunks = 0;
 	int totalFaces = 0;
+	int totalBlockFaces = 0;
 	int visibleChunks = 0;
 	int visibleFaces = 0;
+	int visibleBlockFaces = 0;
 	int buildQueueSize = 0;
+	int buildJobs = 0;
 };
 
-class ChunkRenderer : public ComponentRenderer, public Thread {
+class ChunkRenderer : public ComponentRenderer {
 private:
 	// performance limits
 	// must be smaller than ChunkManager::CHUNK_POOL_SIZE / 27
 	static const int MAX_BUILD_QUEUE_SIZE =
 			ClientChunkManager::CHUNK_POOL_SIZE / 27 > 1000 ?
 			1000 : ClientChunkManager::CHUNK_POOL_SIZE / 27;
+	// every job holds a copy of the blocks around its chunk, about 39 KB
+	static const int MAX_BUILD_JOBS = 256;
 	static const int MAX_VS_CHUNKS = 3000;
 
 	struct ChunkArea {
 		const Chunk *chunks[27];
 	};
 
+	struct BuildJob {
+		vec3i64 cc;
+		// the chunk might be unloaded by the time the job is finished
+		uint32 revision;
+		uint16 passThroughs;
+		// as made by ChunkMesher::copyBlocks, the workers don't touch the chunks
+		std::vector<uint8> blocks;
+		// squared distance to buildCenter
+		int64 distance;
+
+		// puts the nearest job on top of a heap
+		bool operator < (const BuildJob &other) const { return distance > other.distance; }
+	};
+
+	class BuildWorker;
+
 	struct ChunkBuildInfo {
 		uint32 revision = 0;
 		int numFaces = 0;
+		int numBlockFaces = 0;
 		uint16 passThroughs = 0;
 	};
 
@@ -55,18 +82,14 @@ private:
 	};
 
 protected:
-	struct Quad {
-		vec3i64 bc;
-		vec3ui8 icc;
-		uint faceType;
-		uint faceDir;
-		int shadowLevels[4];
-	};
+	typedef ChunkMesher::Quad Quad;
 
 	struct ChunkVisuals {
 		vec3i64 cc;
 		uint32 revision;
+		uint16 passThroughs;
 		std::vector<Quad> quads;
+		bool greedy;
 	};
 
 private:
@@ -75,10 +98,16 @@ private:
 	int checkChunkIndex = 0;
 	std::unordered_set<vec3i64, size_t(*)(vec3i64)> inBuildQueue;
 	std::deque<vec3i64> buildQueue;
+	// chunks of jobs that were rebuilt while the job was waiting or being built
+	std::unordered_set<vec3i64, size_t(*)(vec3i64)> changedWhileBuilding;
 
 	// building
-	ProducerQueue<ChunkArea> toBuildQueue;
-	ProducerQueue<ChunkVisuals> toFinishQueue;
+	std::vector<std::unique_ptr<BuildWorker>> buildWorkers;
+	// jobs no worker took yet, a heap with the one nearest to buildCenter on top
+	std::vector<BuildJob> buildJobs;
+	vec3i64 buildCenter;
+	std::mutex buildLock;
+	std::condition_variable buildWake;
 	std::unordered_map<vec3i64, ChunkBuildInfo, size_t(*)(vec3i64)> builtChunks;
 
 	// visibility search
@@ -100,8 +129,15 @@ private:
 	int newFaces = 0;
 	int newChunks = 0;
 	int numFaces = 0;
+	int numBlockFaces = 0;
 	int visibleChunks = 0;
 	int visibleFaces = 0;
+	int visibleBlockFaces = 0;
+
+	// read by the worker building the chunks
+	std::atomic<bool> greedyMeshing;
+	// the faces with a texture per block, see ChunkMesher::mesh, written under buildLock
+	uint8 unmergedFaces[256] = {};
 
 protected:
 	Client *client;
@@ -118,17 +154,27 @@ public:
 	void tick() override;
 	void render() override;
 
-	virtual void doWork() override;
-
 	void rebuildChunk(vec3i64 chunkCoords);
 
 	ChunkRendererDebugInfo getDebugInfo();
 
 private:
-	ChunkVisuals buildChunk(ChunkArea area);
+	BuildJob makeBuildJob(vec3i64 chunkCoords, ChunkArea area);
+	// quads is filled and moved into the result
+	ChunkVisuals buildChunk(const BuildJob &, ChunkMesher *, const uint8 *unmergedFaces,
+			std::vector<Quad> quads);
+	void startBuildWorkers(uint numThreads);
+	// finished chunks are discarded if finish is false
+	void stopBuildWorkers(bool finish);
+	void finishBuiltChunks(BuildWorker *);
+	// requires the area of the chunk and queues it unless it is queued already
+	void queueChunk(vec3i64 chunkCoords, bool front);
+	void releaseChunkArea(vec3i64 chunkCoords);
+	// cancels what left the render distance and sorts the rest by the distance to center
+	void updateBuildJobs(vec3i64 center);
 	bool getChunkArea(vec3i64 chunkCoordinates, ChunkArea *area);
 	bool chunkHasQuads(ChunkArea area);
-	void finishChunk(ChunkVisuals);
+	void finishChunk(const ChunkVisuals &);
 	void visibilitySearch();
 	int updateVsChunk(vec3i64 chunkCoords, ChunkVSInfo *vsInfo, int passThroughs);
 	int getOuts(int ins, int passThroughs, vec3i64 chunkDiff, int tolerance);
@@ -139,8 +185,10 @@ protected:
 	virtual void beginRender() = 0;
 	virtual void renderChunk(vec3i64 chunkCoords) = 0;
 	virtual void finishRender() = 0;
-	virtual void applyChunkVisuals(ChunkVisuals chunkVisuals) = 0;
+	virtual void applyChunkVisuals(const ChunkVisuals &chunkVisuals) = 0;
 	virtual void destroyChunkData(vec3i64 chunkCoords) = 0;
+	// see TextureManager::getVaryingFaces
+	virtual const uint8 *getVaryingFaces() = 0;
 };
 
 #endif // CHUNK_RENDERER_HPP
@@ -31,12 +31,29 @@ void GL2ChunkRenderer::renderChunk(vec3i64 chunkCoords) {
 	GL(PopMatrix());
 }
 
-void GL2ChunkRenderer::applyChunkVisuals(ChunkVisuals chunkVisuals) {
+void GL2ChunkRenderer::applyChunkVisuals(const ChunkVisuals &chunkVisuals) {
 	numQuads = 0;
 
-	for (Quad quad : chunkVisuals.quads) {
+	// the atlas can't repeat textures, merged quads are split into their blocks again
+	std::vector<Quad> quads;
+	for (const Quad &merged : chunkVisuals.quads) {
+		Quad quad = merged;
+		quad.width = 1;
+		quad.height = 1;
+		vec3ui8 size = merged.getSize();
+		for (uint8 z = 0; z < size[2]; ++z)
+		for (uint8 y = 0; y < size[1]; ++y)
+		for (uint8 x = 0; x < size[0]; ++x) {
+			quad.icc = merged.icc + vec3ui8(x, y, z);
+			quads.push_back(quad);
+		}
+	}
+
+	vec3i64 chunkBc = chunkVisuals.cc * (int64) Chunk::WIDTH;
+	for (const Quad &quad : quads) {
 		vec2f texs[4];
-		GL2TextureManager::Entry tex_entry = ((GL2Renderer *) renderer)->getTextureManager()->get(quad.faceType, quad.bc, quad.faceDir);
+		vec3i64 bc = chunkBc + quad.icc.cast<int64>();
+		GL2TextureManager::Entry tex_entry = ((GL2Renderer *) renderer)->getTextureManager()->get(quad.faceType, bc, quad.faceDir);
 		GL2TextureManager::getTextureCoords(tex_entry.index, tex_entry.type, texs);
 
 		faceIndexBuffer[numQuads] = FaceIndexData{tex_entry.tex, numQuads};
@@ -48,7 +65,7 @@ void GL2ChunkRenderer::applyChunkVisuals(ChunkVisuals chunkVisuals) {
 		for (int j = 0; j < 4; j++) {
 			vb[numQuads].tex[j][0] = texs[j][0];
 			vb[numQuads].tex[j][1] = texs[j][1];
-			float light = 1.0f - quad.shadowLevels[j] * 0.2f;
+			float light = 1.0f - quad.getShadowLevel(j) * 0.2f;
 			vb[numQuads].color[j][0] = light;
 			vb[numQuads].color[j][1] = light;
 			vb[numQuads].color[j][2] = light;
@@ -113,3 +130,7 @@ void GL2ChunkRenderer::destroyChunkData(vec3i64 chunkCoords) {
 		renderInfos.erase(it);
 	}
 }
+
+const uint8 *GL2ChunkRenderer::getVaryingFaces() {
+	return ((GL2Renderer *) renderer)->getTextureManager()->getVaryingFaces();
+}
@@ -47,8 +47,9 @@ protected:
 	void beginRender() override {}
 	void renderChunk(vec3i64 chunkCoords) override;
 	void finishRender() override {}
-	void applyChunkVisuals(ChunkVisuals chunkVisuals) override;
+	void applyChunkVisuals(const ChunkVisuals &chunkVisuals) override;
 	void destroyChunkData(vec3i64 chunkCoords) override;
+	const uint8 *getVaryingFaces() override;
 };
 
 #endif //GL2_CHUNK_RENDERER_HPP_
@@ -88,27 +88,29 @@ void GL3ChunkRenderer::finishRender() {
 	GL(BindVertexArray(0));
 }
 
-void GL3ChunkRenderer::applyChunkVisuals(ChunkVisuals chunkVisuals) {
+void GL3ChunkRenderer::applyChunkVisuals(const ChunkVisuals &chunkVisuals) {
 	bufferSize = 0;
 
-	for (Quad quad : chunkVisuals.quads) {
+	vec3i64 chunkBc = chunkVisuals.cc * (int64) Chunk::WIDTH;
+	for (const Quad &quad : chunkVisuals.quads) {
 		ushort posIndices[4];
-		uint8 compactShadowLevels = 0;
+		vec3ui8 size = quad.getSize();
 		for (int i = 0; i < 4; i++) {
-			vec3i64 v = quad.icc.cast<int64>() + DIR_QUAD_CORNER_CYCLES_3D[quad.faceDir][i].cast<int64>();
+			vec3i64 v = quad.icc.cast<int64>();
+			for (int j = 0; j < 3; j++)
+				v[j] += DIR_QUAD_CORNER_CYCLES_3D[quad.faceDir][i][j] * size[j];
 			posIndices[i] = (ushort) ((v[2] * (Chunk::WIDTH + 1) + v[1]) * (Chunk::WIDTH + 1) + v[0]);
-			compactShadowLevels |= quad.shadowLevels[i] << 2 * i;
 		}
 		static const int INDICES[6] = {0, 1, 2, 2, 3, 0};
 
 		GL3TextureManager *texManager = static_cast<GL3Renderer *>(renderer)->getTextureManager();
-		GL3TextureManager::Entry entry = texManager->get(quad.faceType, quad.bc, quad.faceDir);
+		GL3TextureManager::Entry entry = texManager->get(quad.faceType, chunkBc + quad.icc.cast<int64>(), quad.faceDir);
 
 		for (int i = 0; i < 6; i++) {
 			blockVertexBuffer[bufferSize].positionIndex = posIndices[INDICES[i]];
 			blockVertexBuffer[bufferSize].textureIndex = entry.layer;
-			blockVertexBuffer[bufferSize].dirIndexCornerIndex = quad.faceDir | (INDICES[i] << 3);
-			blockVertexBuffer[bufferSize].shadowLevels = compactShadowLevels;
+			blockVertexBuffer[bufferSize].dirIndex = quad.faceDir;
+			blockVertexBuffer[bufferSize].shadowLevels = quad.shadowLevels;
 			bufferSize++;
 		}
 	}
@@ -157,3 +159,7 @@ void GL3ChunkRenderer::destroyChunkData(vec3i64 chunkCoords) {
 		renderInfos.erase(it);
 	}
 }
+
+const uint8 *GL3ChunkRenderer::getVaryingFaces() {
+	return static_cast<GL3Renderer *>(renderer)->getTextureManager()->getVaryingFaces();
+}
@@ -17,7 +17,7 @@ private:
 	struct BlockVertexData {
 		GLushort positionIndex;
 		GLubyte textureIndex;
-		GLubyte dirIndexCornerIndex;
+		GLubyte dirIndex;
 		GLubyte shadowLevels;
 	};
 #pragma pack(pop)
@@ -43,8 +43,9 @@ protected:
 	void beginRender() override;
 	void renderChunk(vec3i64 chunkCoords) override;
 	void finishRender() override;
-	void applyChunkVisuals(ChunkVisuals chunkVisuals) override;
+	void applyChunkVisuals(const ChunkVisuals &chunkVisuals) override;
 	void destroyChunkData(vec3i64 chunkCoords) override;
+	const uint8 *getVaryingFaces() override;
 };
 
 #endif // GL3_CHUNK_RENDERER_HPP_
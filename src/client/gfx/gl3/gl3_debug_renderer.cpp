@@ -192,10 +192,11 @@ void GL3DebugRenderer::renderDebug() {
 	RENDER_LINE("checked distance: %d", crdi.checkedDistance);
 	RENDER_LINE("new chunks/t: %.0f", newChunkValue * frequency / TICK_SPEED);
 	RENDER_LINE("new faces/t: %.0f", newFaceValue * frequency / TICK_SPEED);
-	RENDER_LINE("total faces: %d", crdi.totalFaces);
+	RENDER_LINE("total faces: %d (%d block faces)", crdi.totalFaces, crdi.totalBlockFaces);
 	RENDER_LINE("visible chunks: %d", crdi.visibleChunks);
-	RENDER_LINE("visible faces: %d", crdi.visibleFaces);
+	RENDER_LINE("visible faces: %d (%d block faces)", crdi.visibleFaces, crdi.visibleBlockFaces);
 	RENDER_LINE("build queue size: %d", crdi.buildQueueSize);
+	RENDER_LINE("build jobs: %d", crdi.buildJobs);
 
 	const ClientChunkManager *chunkManager = client->getChunkManager();
 	RENDER_LINE(" ");
@@ -44,6 +44,7 @@ int TextureLoader::load() {
 	int height = 1;
 
 	auto finishTexture = [&]() {
+		this->tm->addTextureTypes(entries);
 		this->tm->add(img.get(), entries);
 		entries.clear();
 		entry = zero_entry;
@@ -1,5 +1,7 @@
 #include "texture_manager.hpp"
 
+#include <cstring>
+
 #include "shared/engine/logging.hpp"
 #include "shared/block_utils.hpp"
 #include "client/gfx/texture_loader.hpp"
@@ -22,6 +24,7 @@ int TextureManager::load(const char *path) {
 
 int TextureManager::reloadAll() {
 	clear();
+	memset(varyingFaces, 0, sizeof(varyingFaces));
 	int result = 0;
 	for (std::string &file : files) {
 		result |= load(file.c_str());
@@ -29,6 +32,18 @@ int TextureManager::reloadAll() {
 	return result;
 }
 
+void TextureManager::addTextureTypes(const std::vector<TextureLoadEntry> &entries) {
+	for (const auto &entry : entries) {
+		if (entry.id < 0 || entry.id > 255)
+			continue;
+		// later textures replace earlier ones, like in add
+		if (entry.type == TextureType::SINGLE_TEXTURE)
+			varyingFaces[entry.id] &= ~entry.dir_mask;
+		else
+			varyingFaces[entry.id] |= entry.dir_mask;
+	}
+}
+
 uint8 TextureManager::scrambleBlockCoordinate(vec3i64 bc) {
 	static const uint8 shuffle[256] = {
 		0xa3,0xd7,0x09,0x83,0xf8,0x48,0xf6,0xf4,
@@ -11,6 +11,8 @@ class TextureManager {
 protected:
 	Client *_client = nullptr;
 	std::vector<std::string> files;
+	// bit dir of varyingFaces[block] is set if the texture of that face depends on the block coordinates
+	uint8 varyingFaces[256] = {};
 
 public:
 	virtual ~TextureManager() = default;
@@ -24,8 +26,11 @@ public:
 	static void getTextureCoords(int index, TextureType type, vec2f out[4]);
 	static int getMultitileIndex(TextureType type, vec3i64 bc, uint8 dir);
 
+	const uint8 *getVaryingFaces() const { return varyingFaces; }
+
 protected:
 	friend TextureLoader;
+	void addTextureTypes(const std::vector<TextureLoadEntry> &entries);
 	virtual void add(SDL_Surface *img, const std::vector<TextureLoadEntry> &entries) = 0;
 	virtual void clear() = 0;
 };
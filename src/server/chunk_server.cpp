@@ -5,7 +5,8 @@
 static logging::Logger logger("cserver");
 
 ChunkServer::ChunkServer(Server *server) : server(server),
-		encodedBuffer(new uint8[Chunk::SIZE * MAX_CHUNKS_PER_MESSAGE])
+		encodedBuffer(new uint8[Chunk::SIZE * MAX_CHUNKS_PER_MESSAGE]),
+		blockBuffer(new uint8[Chunk::SIZE])
 {
 	LOG_INFO(logger) << "Creating chunk server";
 	chunkManager = server->getChunkManager();
@@ -55,7 +56,8 @@ void ChunkServer::tick() {
 			msg.chunkMessageData[msgChunks].relCoords = scr.coords - messageAnchors[i];
 			msg.chunkMessageData[msgChunks].revision = chunk->getRevision();
 			if (!scr.cached || chunk->getRevision() != scr.cachedRevision) {
-				size_t el = encodeBlocks_RLE(chunk->getBlocks(), eb, Chunk::SIZE);
+				chunk->getBlocks(blockBuffer.get());
+				size_t el = encodeBlocks_RLE(blockBuffer.get(), eb, Chunk::SIZE);
 				msg.chunkMessageData[msgChunks].encodedLength = el;
 				eb += el;
 			} else {
@@ -21,6 +21,7 @@ private:
 	vec3i64 messageAnchors[MAX_CLIENTS];
 
 	std::unique_ptr<uint8> encodedBuffer; // TODO make this obsolete
+	std::unique_ptr<uint8[]> blockBuffer;
 
 public:
 	ChunkServer(Server *server);
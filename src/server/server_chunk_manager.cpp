@@ -11,40 +11,38 @@ static logging::Logger logger("chm");
 ServerChunkManager::ServerChunkManager(
 		std::unique_ptr<WorldGenerator> worldGenerator,
 		std::unique_ptr<ChunkArchive> archive) :
-	threadOutQueue(1024),
-	threadInQueue(1024),
 	chunks(0, vec3i64HashFunc),
 	cacheRevisions(0, vec3i64HashFunc),
 	needCounter(0, vec3i64HashFunc),
 	worldGenerator(std::move(worldGenerator)),
 	asyncWorldGenerator(this->worldGenerator.get()),
-	archive(std::move(archive))
+	archive(std::move(archive)),
+	archiveWorkers(this->archive.get(), this->archive->getConf().io_threads)
 {
 	for (int i = 0; i < CHUNK_POOL_SIZE; i++) {
 		chunkPool[i] = new Chunk(Chunk::ChunkFlags::VISUAL);
 		unusedChunks.push(chunkPool[i]);
 	}
-	dispatch();
 }
 
 ServerChunkManager::~ServerChunkManager() {
 	LOG_TRACE(logger) << "Destroying ChunkManager";
-	requestTermination();
-	ArchiveOperation op;
-	while(threadOutQueue.pop(op));
-	wait();
+	archiveWorkers.stop();
+	// everything left goes to the archive in one batch
+	std::vector<const Chunk *> storeBatchChunks;
 	while (!prethreadInQueue.empty()) {
 		ArchiveOperation op = prethreadInQueue.front();
 		prethreadInQueue.pop();
-		if (op.type != STORE)
+		if (op.type != ArchiveWorkers::STORE)
 			continue;
-		archive->storeChunk(*op.chunk);
+		storeBatchChunks.push_back(op.chunk);
 	}
 	for (auto it1 = chunks.begin(); it1 != chunks.end(); ++it1) {
 		auto it2 = cacheRevisions.find(it1->first);
 		if (it2 == cacheRevisions.end() || it1->second->getRevision() != it2->second)
-			archive->storeChunk(*it1->second);
+			storeBatchChunks.push_back(it1->second);
 	}
+	archive->storeChunks(storeBatchChunks);
 	for (int i = 0; i < CHUNK_POOL_SIZE; i++) {
 		delete chunkPool[i];
 	}
@@ -57,7 +55,7 @@ void ServerChunkManager::tick() {
 		if (!chunk)
 			LOG_ERROR(logger) << "Chunk allocation failed";
 		chunk->initCC(cc);
-		ArchiveOperation op = {chunk, LOAD};
+		ArchiveOperation op = {chunk, ArchiveWorkers::LOAD};
 		prethreadInQueue.push(op);
 		requestedQueue.pop();
 		unusedChunks.pop();
@@ -65,7 +63,7 @@ void ServerChunkManager::tick() {
 
 	while (!prethreadInQueue.empty()) {
 		ArchiveOperation op = prethreadInQueue.front();
-		if (!threadInQueue.push(op))
+		if (!archiveWorkers.push(op))
 			break;
 		prethreadInQueue.pop();
 	}
@@ -78,18 +76,20 @@ void ServerChunkManager::tick() {
 	}
 
 	ArchiveOperation op;
-	while (threadOutQueue.pop(op)) {
+	while (archiveWorkers.pop(op)) {
 		switch(op.type) {
-		case LOAD:
+		case ArchiveWorkers::LOAD:
 			if (op.chunk->isInitialized())
 				insertLoadedChunk(op.chunk);
 			else
 				toGenerateQueue.push(op.chunk);
 			numSessionChunkLoads++;
 			break;
-		case STORE:
+		case ArchiveWorkers::STORE:
 			recycleChunk(op.chunk);
 			break;
+		default:
+			break;
 		}
 	}
 
@@ -102,34 +102,6 @@ void ServerChunkManager::tick() {
 	}
 }
 
-void ServerChunkManager::doWork() {
-	ArchiveOperation op;
-	if (threadInQueue.pop(op)) {
-		switch (op.type) {
-		case LOAD:
-			archive->loadChunk(op.chunk);
-			break;
-		case STORE:
-			archive->storeChunk(*op.chunk);
-			break;
-		}
-		while (!threadOutQueue.push(op)) {
-			sleepFor(millis(50));
-		}
-	} else {
-		sleepFor(millis(100));
-	}
-}
-
-void ServerChunkManager::onStop() {
-	ArchiveOperation op;
-	while (threadInQueue.pop(op)) {
-		if (op.type == STORE) {
-			archive->storeChunk(*op.chunk);
-		}
-	}
-}
-
 void ServerChunkManager::placeBlock(vec3i64 chunkCoords, size_t intraChunkIndex,
 		uint blockType, uint32 revision) {
 	auto it = chunks.find(chunkCoords);
@@ -169,7 +141,7 @@ void ServerChunkManager::releaseChunk(vec3i64 chunkCoords) {
 			if (it2 != chunks.end()) {
 				auto it3 = cacheRevisions.find(chunkCoords);
 				if (it3 == cacheRevisions.end() || it2->second->getRevision() != it3->second)
-					prethreadInQueue.push(ArchiveOperation{it2->second, STORE});
+					prethreadInQueue.push(ArchiveOperation{it2->second, ArchiveWorkers::STORE});
 				else
 					recycleChunk(it2->second);
 				chunks.erase(it2);
@@ -215,7 +187,7 @@ void ServerChunkManager::insertReceivedChunk(Chunk *chunk) {
 	if (it != needCounter.end()) {
 		chunks.insert({chunk->getCC(), chunk});
 	} else {
-		ArchiveOperation op = {chunk, STORE};
+		ArchiveOperation op = {chunk, ArchiveWorkers::STORE};
 		prethreadInQueue.push(op);
 	}
 }
@@ -6,32 +6,25 @@
 #include <future>
 #include <queue>
 #include <stack>
+#include <vector>
 
 #include "shared/chunk_manager.hpp"
 
 #include "shared/engine/vmath.hpp"
 #include "shared/engine/queue.hpp"
-#include "shared/engine/thread.hpp"
 #include "shared/game/chunk.hpp"
 #include "shared/game/world_generator.hpp"
 #include "shared/async_world_generator.hpp"
 #include "shared/block_utils.hpp"
+#include "shared/archive_workers.hpp"
 #include "shared/chunk_archive.hpp"
 
-class ServerChunkManager : public ChunkManager, public Thread {
+class ServerChunkManager : public ChunkManager {
 public:
 	static const int CHUNK_POOL_SIZE = 20000;
 
 private:
-	enum ArchiveOperationType {
-		LOAD = 0,
-		STORE,
-	};
-
-	struct ArchiveOperation {
-		Chunk *chunk;
-		ArchiveOperationType type;
-	};
+	typedef ArchiveWorkers::Operation ArchiveOperation;
 
 	Chunk *chunkPool[CHUNK_POOL_SIZE];
 	std::stack<Chunk *> unusedChunks;
@@ -39,8 +32,6 @@ private:
 	std::queue<vec3i64> requestedQueue;
 	std::queue<Chunk *> toGenerateQueue;
 	std::queue<ArchiveOperation> prethreadInQueue;
-	ProducerQueue<ArchiveOperation> threadOutQueue;
-	ProducerQueue<ArchiveOperation> threadInQueue;
 	std::unordered_map<vec3i64, Chunk *, size_t(*)(vec3i64)> chunks;
 	std::unordered_map<vec3i64, uint32, size_t(*)(vec3i64)> cacheRevisions;
 	std::unordered_map<vec3i64, int, size_t(*)(vec3i64)> needCounter;
@@ -52,6 +43,7 @@ private:
 	AsyncWorldGenerator asyncWorldGenerator;
 
 	std::unique_ptr<ChunkArchive> archive;
+	ArchiveWorkers archiveWorkers;
 
 public:
 	ServerChunkManager(std::unique_ptr<WorldGenerator> worldGenerator,
@@ -59,8 +51,6 @@ public:
 	virtual ~ServerChunkManager();
 
 	void tick();
-	virtual void doWork() override;
-	virtual void onStop() override;
 	void storeChunks();
 
 	void placeBlock(vec3i64 chunkCoords, size_t intraChunkIndex,
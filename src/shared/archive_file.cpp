@@ -0,0 +1,686 @@
+#include "archive_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <boost/filesystem.hpp>
+
+#include "engine/math.hpp"
+#include "engine/logging.hpp"
+
+#include "block_utils.hpp"
+#include "content_store.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+static const uint8 MAGIC[4] = { 0x59, 0x97, 0x22, 0xDF };
+
+static const int32 ENDIANESS_BYTES = 0x01020304;
+static const int32 ENDIANESS_BYTES_FLIPPED = 0x04030201;
+
+static const uint HEAP_BLOCK_SIZE = 256;
+
+static const int32 RECENT_HEADER_VERSION = 3;
+
+ArchiveFile::~ArchiveFile() {
+	// nothing
+}
+
+ArchiveFile::ArchiveFile(uint region_size, const ArchiveConf &conf,
+		WorldGenerator *generator, Mutex *generator_lock, ContentStore *content_store) :
+	_region_size(region_size), _last_access(getCurrentTime()), _conf(conf),
+	_generator(generator), _content_store(content_store),
+	_encoder(conf, generator, generator_lock),
+	_dir(region_size * region_size * region_size)
+{
+	// nothing
+}
+
+void ArchiveFile::open(const char *filename, vec3i64 rc) {
+	close();
+	_filename = filename;
+	_last_access = getCurrentTime();
+	_good = true;
+
+	// the directory is filled while _open is false, so lock-free readers ignore it
+	_storage = ArchiveStorage::create(_conf.io);
+	bool opened = _storage->open(filename);
+	if (!opened && _conf.io != ArchiveIO::STREAM) {
+		LOG_WARNING(logger) << "Could not map ArchiveFile '" << _filename << "', falling back to streams";
+		_storage = ArchiveStorage::create(ArchiveIO::STREAM);
+		opened = _storage->open(filename);
+	}
+	if (!opened) {
+		LOG_ERROR(logger) << "Could not open ArchiveFile '" << _filename << "'";
+		_good = false;
+	}
+
+	if (_good && _storage->getSize() == 0) {
+		// file was empty, we can safely nuke it (we probably created it)
+		initialize();
+	}
+
+	if (_good) {
+		loadHeader();
+		if (!_good) {
+			LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had bad header";
+			_storage.reset();
+		}
+	}
+
+	if (_good && _header.version != RECENT_HEADER_VERSION) {
+		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had unknown version ("
+				<< _header.version << ")";
+		_storage.reset();
+		_good = false;
+	}
+
+	if (_good)
+		loadDirectory();
+
+	// even a broken file is open, it just doesn't have any chunks
+	_dir_monitor.startWrite();
+	_rc = rc;
+	_open = true;
+	_dir_monitor.finishWrite();
+}
+
+void ArchiveFile::close() {
+	if (!_open)
+		return;
+	_dir_monitor.startWrite();
+	_open = false;
+	_dir_monitor.finishWrite();
+	_storage.reset();
+	_heap_map.clear();
+}
+
+void ArchiveFile::loadHeader() {
+	if (_storage->read(0, &_header, sizeof(Header)) < sizeof(Header)) {
+		LOG_ERROR(logger) << "Archive file '" << _filename << "' ended abruptly";
+		_good = false;
+		return;
+	}
+
+	if (memcmp(_header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+		LOG_ERROR(logger) << "Archive file '" << _filename << "' had wrong magic (0x"
+				<< std::hex << std::uppercase << (uint) _header.magic[0]
+				<< (uint) _header.magic[1]
+				<< (uint) _header.magic[2]
+				<< (uint) _header.magic[3]
+				<< " instead of 0x"
+				<< std::hex << std::uppercase << (uint) MAGIC[0]
+				<< (uint) MAGIC[1]
+				<< (uint) MAGIC[2]
+				<< (uint) MAGIC[3]
+				<< ")";
+		_good = false;
+		return;
+	}
+
+	if (_header.endianess_bytes != ENDIANESS_BYTES) {
+		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had wrong endianess";
+		_good = false;
+		return;
+	}
+
+	if (_header.dir_size != _region_size * _region_size * _region_size) {
+		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had wrong size ("
+				<< _header.dir_size << " instead of "
+				<< _region_size * _region_size * _region_size << ")";
+		_good = false;
+		return;
+	}
+
+	_dir.clear();
+	_dir.resize(_header.dir_size);
+	memset((char *)_dir.data(), 0, _header.dir_size * sizeof(DirectoryEntry));
+}
+
+void ArchiveFile::loadDirectory() {
+	const size_t total_directory_bytes = _header.dir_size * sizeof(DirectoryEntry);
+	if (_storage->read(_header.directory_offset, _dir.data(), total_directory_bytes) < total_directory_bytes) {
+		LOG_ERROR(logger) << "Archive file '" << _filename << "' ended abruptly";
+		_good = false;
+		return;
+	}
+
+	size_t heap_bytes = _storage->getSize() - std::min(_storage->getSize(), getChunkHeapStart());
+	_heap_map.assign((heap_bytes + _header.heap_block_size - 1) / _header.heap_block_size, false);
+	for (auto &entry : _dir) {
+		if (entry.size > 0)
+			markBlocks(entry.offset, entry.size, true);
+	}
+}
+
+void ArchiveFile::initialize() {
+	memset((char *)&_header, 0, sizeof(Header));
+	memcpy(_header.magic, MAGIC, sizeof (MAGIC));
+	_header.endianess_bytes = ENDIANESS_BYTES;
+	_header.version = RECENT_HEADER_VERSION;
+	uint num_chunks = _region_size * _region_size * _region_size;
+	_header.dir_size = num_chunks;
+	_header.directory_offset = sizeof (Header);
+	_header.heap_block_size = HEAP_BLOCK_SIZE;
+
+	// write header and empty directory
+	std::vector<uint8> empty_directory(num_chunks * sizeof(DirectoryEntry), 0);
+	bool written = _storage->write(0, &_header, sizeof (Header))
+			&& _storage->write(sizeof (Header), empty_directory.data(), empty_directory.size());
+
+	if (!written) {
+		LOG_ERROR(logger) << "Could not initialize ArchiveFile '" << _filename << "'";
+		_good = false;
+		return;
+	}
+
+	_dir.clear();
+	_dir.resize(_header.dir_size);
+	memset((char *)_dir.data(), 0, _header.dir_size * sizeof(DirectoryEntry));
+}
+
+bool ArchiveFile::tryHasChunk(vec3i64 rc, vec3i64 cc, bool *has_chunk, uint32 *revision) {
+	size_t x = cycle(cc[0], _region_size);
+	size_t y = cycle(cc[1], _region_size);
+	size_t z = cycle(cc[2], _region_size);
+	size_t id = x + (_region_size * (y + (_region_size * z)));
+
+	bool is_region;
+	bool good;
+	DirectoryEntry dir_entry;
+	Monitor::handle_t handle;
+	do {
+		handle = _dir_monitor.startRead();
+		is_region = _open && _rc == rc;
+		good = _good;
+		dir_entry = _dir[id];
+	} while (!_dir_monitor.finishRead(handle));
+
+	if (!is_region)
+		return false;
+	*has_chunk = good && (dir_entry.size != 0 || dir_entry.flags != 0);
+	if (revision != nullptr && *has_chunk)
+		*revision = dir_entry.revision;
+	return true;
+}
+
+bool ArchiveFile::loadChunk(Chunk *chunk) {
+	_io_lock.lock();
+	bool result = unsafe_loadChunk(chunk);
+	_io_lock.unlock();
+	return result;
+}
+
+void ArchiveFile::loadChunks(Chunk *const *chunks, size_t num_chunks) {
+	_io_lock.lock();
+	unsafe_loadChunks(chunks, num_chunks);
+	_io_lock.unlock();
+}
+
+void ArchiveFile::storeChunk(const Chunk &chunk) {
+	const Chunk *chunks[1] = { &chunk };
+	storeChunks(chunks, 1);
+}
+
+void ArchiveFile::storeChunks(const Chunk *const *chunks, size_t num_chunks) {
+	_io_lock.lock();
+	unsafe_storeChunks(chunks, num_chunks);
+	_io_lock.unlock();
+}
+
+bool ArchiveFile::compact(uint max_moves, float threshold) {
+	if (!_io_lock.tryLock())
+		return false;
+	bool moved = getChunkFragmentation() > threshold && unsafe_compact(max_moves);
+	_io_lock.unlock();
+	return moved;
+}
+
+// the caller of this function needs to hold _io_lock
+bool ArchiveFile::unsafe_loadChunk(Chunk *chunk) {
+	if (!_good) return false;
+
+	_last_access = getCurrentTime();
+
+	// get entry from directory
+	vec3i64 cc = chunk->getCC();
+	size_t x = cycle(cc[0], _region_size);
+	size_t y = cycle(cc[1], _region_size);
+	size_t z = cycle(cc[2], _region_size);
+	size_t id = x + (_region_size * (y + (_region_size * z)));
+
+	// we hold _io_lock, nobody else writes the directory
+	const DirectoryEntry dir_entry = _dir[id];
+
+	if (dir_entry.size == 0 && dir_entry.flags == 0) {
+		return false;
+	}
+	
+	chunk->initRevision(dir_entry.revision);
+	// an empty edit list doesn't have any data on the heap either
+	bool has_data = dir_entry.size > 0 || (dir_entry.flags & LAYOUT_SHARED);
+	if (dir_entry.flags == LAYOUT_EMPTY || dir_entry.flags == LAYOUT_UNIFORM || !has_data) {
+		return _encoder.decode(chunk, dir_entry.flags, dir_entry.visibility,
+				dir_entry.uniform_type, nullptr, 0);
+	}
+
+	size_t size;
+	const uint8 *data = readEncoded(dir_entry, &size);
+	if (!data) {
+		LOG_ERROR(logger) << "Chunk (" << cc << ") was corrupt";
+		return false;
+	}
+	return _encoder.decode(chunk, dir_entry.flags, dir_entry.visibility,
+			dir_entry.uniform_type, data, size);
+}
+
+/* Loads many chunks of this file with a single batch of reads
+
+	The heap data of all chunks is handed to the storage at once, so it can
+	have the reads in flight together instead of waiting for one after the
+	other.  Chunks that were never stored stay uninitialized.  The caller
+	needs to hold _io_lock.
+*/
+void ArchiveFile::unsafe_loadChunks(Chunk *const *chunks, size_t num_chunks) {
+	if (!_good) return;
+
+	_last_access = getCurrentTime();
+
+	_batch_reads.clear();
+	_batch_ids.clear();
+	size_t buffer_size = 0;
+	for (size_t i = 0; i < num_chunks; ++i) {
+		vec3i64 cc = chunks[i]->getCC();
+		size_t x = cycle(cc[0], _region_size);
+		size_t y = cycle(cc[1], _region_size);
+		size_t z = cycle(cc[2], _region_size);
+		size_t id = x + (_region_size * (y + (_region_size * z)));
+		// shared chunks come from the content store and the rest has no heap data at all
+		const DirectoryEntry &dir_entry = _dir[id];
+		if (dir_entry.size == 0 || (dir_entry.flags & LAYOUT_SHARED))
+			continue;
+		ArchiveRead read;
+		read.offset = getChunkHeapStart() + dir_entry.offset * _header.heap_block_size;
+		read.size = dir_entry.size * _header.heap_block_size;
+		read.bytes_read = 0;
+		_batch_reads.push_back(read);
+		_batch_ids.push_back(i);
+		buffer_size += read.size;
+	}
+
+	_batch_buffer.resize(buffer_size);
+	size_t buffer_offset = 0;
+	for (ArchiveRead &read : _batch_reads) {
+		read.buffer = &_batch_buffer[buffer_offset];
+		buffer_offset += read.size;
+	}
+	if (!_batch_reads.empty())
+		_storage->readBatch(_batch_reads.data(), _batch_reads.size());
+
+	size_t next_read = 0;
+	for (size_t i = 0; i < num_chunks; ++i) {
+		if (next_read >= _batch_ids.size() || _batch_ids[next_read] != i) {
+			unsafe_loadChunk(chunks[i]);
+			continue;
+		}
+		const ArchiveRead &read = _batch_reads[next_read++];
+		Chunk *chunk = chunks[i];
+		vec3i64 cc = chunk->getCC();
+		size_t x = cycle(cc[0], _region_size);
+		size_t y = cycle(cc[1], _region_size);
+		size_t z = cycle(cc[2], _region_size);
+		const DirectoryEntry dir_entry = _dir[x + (_region_size * (y + (_region_size * z)))];
+
+		chunk->initRevision(dir_entry.revision);
+		_encoder.decode(chunk, dir_entry.flags, dir_entry.visibility, dir_entry.uniform_type,
+				(const uint8 *) read.buffer, read.bytes_read);
+	}
+}
+
+/* Writes a batch of chunks copy-on-write
+
+	All heap data goes into one freshly allocated run of blocks with a single
+	write.  Only after that the directory entries are changed and written in
+	one piece, and only after that the old blocks are given back.  The caller
+	needs to hold _io_lock.
+*/
+void ArchiveFile::unsafe_storeChunks(const Chunk *const *chunks, size_t num_chunks) {
+	if (!_good) return;
+
+	_last_access = getCurrentTime();
+
+	// if a chunk is in the batch twice, only the last version counts
+	_pending.clear();
+	for (size_t i = 0; i < num_chunks; ++i) {
+		const Chunk &chunk = *chunks[i];
+		// chunks that were never edited can be generated again
+		if (_conf.policy == ArchivePolicy::DIFF && _generator && chunk.getRevision() == 0)
+			continue;
+		vec3i64 cc = chunk.getCC();
+		size_t x = cycle(cc[0], _region_size);
+		size_t y = cycle(cc[1], _region_size);
+		size_t z = cycle(cc[2], _region_size);
+		PendingChunk pending;
+		pending.id = x + (_region_size * (y + (_region_size * z)));
+		pending.chunk = &chunk;
+		_pending.push_back(pending);
+	}
+	std::stable_sort(_pending.begin(), _pending.end(),
+			[](const PendingChunk &a, const PendingChunk &b) { return a.id < b.id; });
+	auto last = std::unique(_pending.rbegin(), _pending.rend(),
+			[](const PendingChunk &a, const PendingChunk &b) { return a.id == b.id; });
+	_pending.erase(_pending.begin(), last.base());
+	if (_pending.empty())
+		return;
+
+	// encode everything back to back, every chunk starting at a heap block
+	_write_buffer.clear();
+	size_t heap_bytes = 0;
+	for (auto &pending : _pending) {
+		const vec3i64 cc = pending.chunk->getCC();
+		pending.entry = _dir[pending.id];
+		pending.old_offset = pending.entry.offset;
+		pending.old_size = pending.entry.size;
+		pending.old_flags = pending.entry.flags;
+
+		size_t start = _write_buffer.size();
+		_write_buffer.resize(start + Chunk::SIZE + 4);
+		int bytes_written = encodeChunk(*pending.chunk, &pending.entry, &_write_buffer[start]);
+		if (bytes_written < 0) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") could not be written";
+			_write_buffer.resize(start);
+			pending.chunk = nullptr;
+			continue;
+		}
+
+		// chunks that look like others go to the content store instead of the heap
+		uint32 shared_id;
+		uint64 owner = (uint64) vec3i64HashFunc(_rc) * _dir.size() + pending.id;
+		if (bytes_written > 0 && _content_store
+				&& _content_store->acquire(&_write_buffer[start], bytes_written, owner, &shared_id)) {
+			pending.entry.flags |= LAYOUT_SHARED;
+			pending.entry.offset = shared_id;
+			pending.entry.size = 0;
+			_write_buffer.resize(start);
+			continue;
+		}
+
+		uint num_blocks = bytes_written > 0 ? ((uint)bytes_written - 1) / _header.heap_block_size + 1 : 0;
+		pending.entry.offset = num_blocks > 0 ? (uint32) (start / _header.heap_block_size) : 0;
+		pending.entry.size = num_blocks;
+		if (num_blocks > 0)
+			heap_bytes = start + bytes_written;
+		// clear the rest of the last block instead of writing whatever the encoder left there
+		memset(&_write_buffer[start + bytes_written], 0, num_blocks * _header.heap_block_size - bytes_written);
+		_write_buffer.resize(start + num_blocks * _header.heap_block_size);
+	}
+
+	// the batch gets its own blocks, so the old ones stay intact until the directory is written
+	uint32 heap_offset = 0;
+	bool written = true;
+	if (heap_bytes > 0) {
+		uint num_blocks = (uint) (_write_buffer.size() / _header.heap_block_size);
+		heap_offset = allocateBlocks(num_blocks);
+		written = _storage->write(getChunkHeapStart() + heap_offset * _header.heap_block_size,
+				_write_buffer.data(), heap_bytes);
+		if (written && _conf.sync)
+			written = _storage->sync();
+		if (!written) {
+			markBlocks(heap_offset, num_blocks, false);
+			for (auto &pending : _pending) {
+				if (pending.chunk && (pending.entry.flags & LAYOUT_SHARED))
+					_content_store->release(pending.entry.offset);
+			}
+			LOG_ERROR(logger) << "Could not write " << _pending.size() << " chunks to '" << _filename << "'";
+			return;
+		}
+	}
+
+	size_t first_id = _dir.size();
+	size_t last_id = 0;
+	_dir_monitor.startWrite();
+	for (auto &pending : _pending) {
+		if (!pending.chunk)
+			continue;
+		if (pending.entry.size > 0)
+			pending.entry.offset += heap_offset;
+		_dir[pending.id] = pending.entry;
+		first_id = std::min(first_id, pending.id);
+		last_id = std::max(last_id, pending.id);
+	}
+	_dir_monitor.finishWrite();
+	if (first_id > last_id)
+		return;
+
+	written = _storage->write(_header.directory_offset + first_id * sizeof (DirectoryEntry),
+			&_dir[first_id], (last_id - first_id + 1) * sizeof (DirectoryEntry));
+	if (written && _conf.sync)
+		written = _storage->sync();
+	if (!written)
+		LOG_ERROR(logger) << "Could not write directory of '" << _filename << "'";
+
+	// now nothing refers to the old blocks anymore
+	for (auto &pending : _pending) {
+		if (pending.chunk && pending.old_size > 0)
+			markBlocks(pending.old_offset, pending.old_size, false);
+		if (pending.chunk && (pending.old_flags & LAYOUT_SHARED) && _content_store)
+			_content_store->release(pending.old_offset);
+	}
+}
+
+/* Encodes a chunk the way it should go onto the heap
+
+	Fills in the layout of the directory entry and returns the number of bytes
+	written to buffer, which has to hold Chunk::SIZE + 4 bytes.  Returns 0 if
+	the chunk doesn't need any heap space and -1 on failure.  Offset and size
+	of the entry are left to the caller.
+*/
+int ArchiveFile::encodeChunk(const Chunk &chunk, DirectoryEntry *dir_entry, uint8 *buffer) {
+	dir_entry->revision = chunk.getRevision();
+	uint16 flags;
+	uint16 visibility;
+	uint8 uniform_type;
+	int bytes_written = _encoder.encode(chunk, &flags, &visibility, &uniform_type,
+			buffer, _header.heap_block_size);
+	dir_entry->flags = flags;
+	dir_entry->visibility = visibility;
+	dir_entry->uniform_type = uniform_type;
+
+	// an empty edit list doesn't need any space on the heap
+	if ((flags & ~LAYOUT_VISIBILITY) == LAYOUT_DIFF && bytes_written <= 2)
+		return 0;
+	return bytes_written;
+}
+
+/* Moves chunks from the end of the heap into gaps further in front
+
+	Every move writes the chunk to its new place before the directory points
+	there, so hasChunk and crashes only ever see one valid copy.  The file is
+	truncated once the end of the heap is unused.  Returns whether a chunk was
+	moved.  The caller needs to hold _io_lock.
+*/
+bool ArchiveFile::unsafe_compact(uint max_moves) {
+	if (!_good) return false;
+
+	_last_access = getCurrentTime();
+
+	std::vector<size_t> ids;
+	for (size_t id = 0; id < _dir.size(); ++id) {
+		if (_dir[id].size > 0)
+			ids.push_back(id);
+	}
+	std::sort(ids.begin(), ids.end(), [this](size_t a, size_t b) {
+		return _dir[a].offset > _dir[b].offset;
+	});
+
+	uint num_moves = 0;
+	for (size_t id : ids) {
+		if (num_moves >= max_moves)
+			break;
+		DirectoryEntry dir_entry = _dir[id];
+		uint32 offset = allocateBlocks(dir_entry.size, dir_entry.offset);
+		if (offset == (uint32) -1)
+			continue;
+
+		size_t size = dir_entry.size * _header.heap_block_size;
+		_read_buffer.resize(size);
+		size = _storage->read(getChunkHeapStart() + dir_entry.offset * _header.heap_block_size,
+				_read_buffer.data(), size);
+		if (!_storage->write(getChunkHeapStart() + offset * _header.heap_block_size,
+				_read_buffer.data(), size)) {
+			markBlocks(offset, dir_entry.size, false);
+			LOG_ERROR(logger) << "Could not move chunk in '" << _filename << "'";
+			return num_moves > 0;
+		}
+
+		const uint32 old_offset = dir_entry.offset;
+		dir_entry.offset = offset;
+		writeDirectoryEntry(id, dir_entry);
+		markBlocks(old_offset, dir_entry.size, false);
+		num_moves++;
+	}
+
+	// cut off unused blocks at the end of the heap
+	size_t heap_end = _heap_map.size();
+	while (heap_end > 0 && !_heap_map[heap_end - 1])
+		heap_end--;
+	if (heap_end < _heap_map.size()) {
+		_heap_map.resize(heap_end);
+		size_t file_end = getChunkHeapStart() + heap_end * _header.heap_block_size;
+		if (_storage->getSize() > file_end)
+			_storage->truncate(file_end);
+	}
+
+	return num_moves > 0;
+}
+
+bool ArchiveFile::countSharedReferences(std::vector<uint32> *references) {
+	_io_lock.lock();
+	bool good = _good;
+	for (auto &entry : _dir) {
+		if (!good || !(entry.flags & LAYOUT_SHARED))
+			continue;
+		if (entry.offset >= references->size())
+			references->resize(entry.offset + 1, 0);
+		++(*references)[entry.offset];
+	}
+	_io_lock.unlock();
+	return good;
+}
+
+bool ArchiveFile::sync() {
+	_io_lock.lock();
+	bool synced = !_good || _storage->sync();
+	_io_lock.unlock();
+	return synced;
+}
+
+int ArchiveFile::getFileSize() {
+	using namespace boost::filesystem;
+	// callers hold locks, so this must not throw
+	boost::system::error_code ec;
+	uintmax_t size = file_size(path(_filename), ec);
+	return ec ? 0 : (int) size;
+}
+
+int ArchiveFile::getUsedChunkBytes() {
+	size_t blocks = 0;
+	for (auto &entry : _dir) {
+		blocks += entry.size;
+	}
+	return (int) blocks * _header.heap_block_size;
+}
+
+int ArchiveFile::getTotalChunkBytes() {
+	size_t blocks = 0;
+	for (auto &entry : _dir) {
+		if (entry.size > 0)
+			blocks = std::max(blocks, (size_t) entry.size + entry.offset);
+	}
+	return (int) blocks * _header.heap_block_size;
+}
+
+float ArchiveFile::getChunkFragmentation() {
+	size_t used = getUsedChunkBytes();
+	size_t total = getTotalChunkBytes();
+	return total > 0 ? (float) (total - used) / total : 0.0f;
+}
+
+size_t ArchiveFile::getChunkHeapStart() {
+	return _header.directory_offset + _header.dir_size * sizeof(DirectoryEntry);
+}
+
+void ArchiveFile::writeDirectoryEntry(size_t id, const DirectoryEntry &dir_entry) {
+	_dir_monitor.startWrite();
+	_dir[id] = dir_entry;
+	_dir_monitor.finishWrite();
+
+	if (!_storage->write(_header.directory_offset + id * sizeof (DirectoryEntry),
+			&dir_entry, sizeof (DirectoryEntry))) {
+		LOG_ERROR(logger) << "Could not write directory of '" << _filename << "'";
+	}
+}
+
+/* Find the first gap of num_blocks unused heap blocks and mark them as used
+
+	The gap has to end before limit.  Without a limit, the heap grows if there is
+	no such gap, otherwise (uint32) -1 is returned.
+*/
+uint32 ArchiveFile::allocateBlocks(uint num_blocks, size_t limit) {
+	const size_t end = std::min(limit, _heap_map.size());
+	size_t gap_start = 0;
+	for (size_t i = 0; i < end; ++i) {
+		if (_heap_map[i]) {
+			gap_start = i + 1;
+		} else if (i + 1 - gap_start == num_blocks) {
+			markBlocks((uint32) gap_start, num_blocks, true);
+			return (uint32) gap_start;
+		}
+	}
+
+	if (limit < _heap_map.size())
+		return (uint32) -1;
+
+	// append, possibly reusing a gap at the end of the heap
+	markBlocks((uint32) gap_start, num_blocks, true);
+	return (uint32) gap_start;
+}
+
+void ArchiveFile::markBlocks(uint32 offset, uint num_blocks, bool used) {
+	if (offset + num_blocks > _heap_map.size())
+		_heap_map.resize(offset + num_blocks, false);
+	std::fill(_heap_map.begin() + offset, _heap_map.begin() + offset + num_blocks, used);
+}
+
+/* Get the heap blocks of a chunk, or its payload if it is in the content store
+
+	Returns nullptr if the chunk was corrupt.  The data stays valid until the next
+	call or the next write, it points right into the file if the storage is mapped.
+*/
+const uint8 *ArchiveFile::readEncoded(const DirectoryEntry &dir_entry, size_t *size) {
+	// we only know how many heap blocks the chunk has, the encodings find their end themselves
+	const size_t offset = getChunkHeapStart() + dir_entry.offset * _header.heap_block_size;
+	*size = dir_entry.size * _header.heap_block_size;
+	const uint8 *data = nullptr;
+	if (dir_entry.flags & LAYOUT_SHARED) {
+		if (!_content_store || !_content_store->read(dir_entry.offset, &_read_buffer))
+			return nullptr;
+		*size = _read_buffer.size();
+		data = _read_buffer.data();
+	} else {
+		data = _storage->map(offset, size);
+	}
+	if (!data) {
+		_read_buffer.resize(*size);
+		// the last chunk in the heap doesn't necessarily fill its last block
+		*size = _storage->read(offset, _read_buffer.data(), *size);
+		data = _read_buffer.data();
+	}
+	// the file was cut off before the chunk
+	if (*size == 0 && dir_entry.size > 0)
+		return nullptr;
+
+	return data;
+}
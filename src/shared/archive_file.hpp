@@ -0,0 +1,175 @@
+#ifndef ARCHIVE_FILE_HPP_
+#define ARCHIVE_FILE_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "engine/vmath.hpp"
+#include "engine/macros.hpp"
+#include "engine/monitor.hpp"
+#include "engine/mutex.hpp"
+#include "engine/time.hpp"
+
+#include "archive_storage.hpp"
+#include "chunk_archive.hpp"
+#include "chunk_encoder.hpp"
+
+#include "game/chunk.hpp"
+
+class ContentStore;
+class WorldGenerator;
+
+/* A region file, the storage of RegionBackend
+
+	The file starts with a header, followed by a directory with one entry per
+	chunk of the region and a heap of fixed size blocks the encoded chunks are
+	kept in.
+*/
+class ArchiveFile {
+private:
+
+	PACKED(
+	struct Header {
+		uint8 magic[4];
+		int32 endianess_bytes;
+		int32 version;
+		uint32 dir_size;
+		uint32 directory_offset;
+		uint16 heap_block_size;
+		uint8 reserved[10];
+	});
+
+	// with LAYOUT_SHARED, offset is the id of the chunk in the content store
+	PACKED(
+	struct DirectoryEntry {
+		uint32 offset;
+		uint16 size;
+		uint16 flags;
+		uint32 revision;
+		uint16 visibility;
+		uint8  uniform_type;
+		uint8  reserved[1];
+	});
+
+public:
+	enum Endianess {
+		UNKNOWN = -1,
+		NATIVE,
+		FLIPPED
+	};
+
+	~ArchiveFile();
+	ArchiveFile(uint size = 16, const ArchiveConf & = ArchiveConf(),
+			WorldGenerator *generator = nullptr, Mutex *generator_lock = nullptr,
+			ContentStore *content_store = nullptr);
+
+	ArchiveFile(const ArchiveFile &) = delete;
+	ArchiveFile(ArchiveFile &&) = delete;
+
+	ArchiveFile &operator = (const ArchiveFile &) = delete;
+	ArchiveFile &operator = (ArchiveFile &&) = delete;
+
+	// memory the directory of an open file takes
+	static size_t getDirectoryBytes(uint region_size) {
+		return region_size * region_size * region_size * sizeof(DirectoryEntry);
+	}
+
+	Time getLastAccess() const { return _last_access; }
+	bool isOpen() const { return _open; }
+	vec3i64 getRegion() const { return _rc; }
+
+	// closes the file that was open before, if any
+	void open(const char *filename, vec3i64 rc = vec3i64(0, 0, 0));
+	void close();
+
+	void loadHeader();
+	void loadDirectory();
+	void initialize();
+
+	/* Look up a chunk without taking any lock
+
+		Returns false if the file is not open for region rc, which may change at
+		any time unless the caller prevents files from being closed.
+	*/
+	bool tryHasChunk(vec3i64 rc, vec3i64 cc, bool *has_chunk, uint32 *revision);
+	bool loadChunk(Chunk *);
+	// chunks that were never stored stay uninitialized
+	void loadChunks(Chunk *const *, size_t num_chunks);
+	void storeChunk(const Chunk &);
+	void storeChunks(const Chunk *const *, size_t num_chunks);
+
+	// adds the references to the content store to references[id], returns false if the file is broken
+	bool countSharedReferences(std::vector<uint32> *references);
+
+	// returns false right away if another thread is using the file
+	bool compact(uint max_moves, float threshold);
+	// a broken file never writes anything, so there is nothing to sync
+	bool sync();
+
+	int getFileSize();
+	int getUsedChunkBytes();
+	int getTotalChunkBytes();
+	float getChunkFragmentation();
+
+private:
+	bool unsafe_loadChunk(Chunk *);
+	void unsafe_loadChunks(Chunk *const *, size_t num_chunks);
+	void unsafe_storeChunks(const Chunk *const *, size_t num_chunks);
+	bool unsafe_compact(uint max_moves);
+
+	size_t getChunkHeapStart();
+	const uint8 *readEncoded(const DirectoryEntry &, size_t *);
+	int encodeChunk(const Chunk &, DirectoryEntry *, uint8 *);
+	void writeDirectoryEntry(size_t id, const DirectoryEntry &);
+	uint32 allocateBlocks(uint num_blocks, size_t limit = (size_t) -1);
+	void markBlocks(uint32 offset, uint num_blocks, bool used);
+
+	std::unique_ptr<ArchiveStorage> _storage;
+	vec3i64 _rc;
+	bool _open = false;
+	const uint _region_size;
+	Time _last_access;
+	std::string _filename;
+	ArchiveConf _conf;
+	WorldGenerator *_generator;
+	ContentStore *_content_store;
+	ChunkEncoder _encoder;
+	bool _good = true;
+
+	Header _header;
+	std::vector<DirectoryEntry> _dir;
+
+	// one entry per heap block, true if a chunk uses it
+	std::vector<bool> _heap_map;
+
+	std::vector<uint8> _read_buffer;
+
+	// scratch space of loadChunks
+	std::vector<ArchiveRead> _batch_reads;
+	std::vector<size_t> _batch_ids;
+	std::vector<uint8> _batch_buffer;
+
+	struct PendingChunk {
+		size_t id;
+		const Chunk *chunk;
+		DirectoryEntry entry;
+		uint32 old_offset;
+		uint old_size;
+		uint16 old_flags;
+	};
+
+	// scratch space of storeChunks, kept around so storing doesn't allocate
+	std::vector<PendingChunk> _pending;
+	std::vector<uint8> _write_buffer;
+
+	/* Guards _open, _rc and _dir for readers that don't take _io_lock
+
+		Writers hold _io_lock, so they can read _dir directly.  It never
+		reallocates, so optimistic reads stay within valid memory.
+	*/
+	Monitor _dir_monitor;
+	Mutex _io_lock;
+};
+
+#endif // ARCHIVE_FILE_HPP_
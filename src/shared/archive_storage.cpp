@@ -0,0 +1,535 @@
+#include "archive_storage.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#ifdef _MSC_VER
+	#include <fcntl.h>
+	#include <io.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
+	#include <unistd.h>
+#endif
+
+#ifdef __linux__
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+	#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+		#define HAVE_IO_URING
+	#endif
+#endif
+
+#include "engine/logging.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+void ArchiveStorage::readBatch(ArchiveRead *reads, size_t num_reads) {
+	for (size_t i = 0; i < num_reads; ++i)
+		reads[i].bytes_read = read(reads[i].offset, reads[i].buffer, reads[i].size);
+}
+
+#ifdef HAVE_IO_URING
+
+// reads until size bytes were read or the file ends
+static size_t preadFully(int fd, void *buffer, size_t size, size_t offset) {
+	size_t bytes_read = 0;
+	while (bytes_read < size) {
+		ssize_t ret = pread(fd, (uint8 *) buffer + bytes_read, size - bytes_read, offset + bytes_read);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		bytes_read += ret;
+	}
+	return bytes_read;
+}
+
+/* A ring for batches of reads, set up with raw system calls
+
+	Rings can't be shared between threads, every thread reading batches gets
+	its own the first time it does.  Reads the kernel refuses or cuts short
+	are finished with pread.  If the ring itself fails, the reads it already
+	took are waited for and everything else is read with pread.
+*/
+class UringReader {
+public:
+	static const unsigned ENTRIES = 64;
+
+	~UringReader();
+
+	bool init();
+	void read(int fd, ArchiveRead *reads, size_t num_reads);
+	// the ring is not used anymore after that
+	bool hasFailed() const { return _failed; }
+
+private:
+	int _ring_fd = -1;
+	void *_sq_ring = nullptr;
+	size_t _sq_ring_size = 0;
+	void *_cq_ring = nullptr;
+	size_t _cq_ring_size = 0;
+	io_uring_sqe *_sqes = nullptr;
+	size_t _sqes_size = 0;
+
+	unsigned *_sq_head;
+	unsigned *_sq_tail;
+	unsigned *_sq_mask;
+	unsigned *_sq_array;
+	unsigned *_cq_head;
+	unsigned *_cq_tail;
+	unsigned *_cq_mask;
+	io_uring_cqe *_cqes;
+
+	struct iovec _iovecs[ENTRIES];
+	bool _done[ENTRIES];
+	bool _failed = false;
+};
+
+UringReader::~UringReader() {
+	if (_sqes) munmap(_sqes, _sqes_size);
+	if (_cq_ring) munmap(_cq_ring, _cq_ring_size);
+	if (_sq_ring) munmap(_sq_ring, _sq_ring_size);
+	if (_ring_fd >= 0) close(_ring_fd);
+}
+
+bool UringReader::init() {
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	_ring_fd = (int) syscall(__NR_io_uring_setup, ENTRIES, &params);
+	if (_ring_fd < 0)
+		return false;
+
+	_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void *sq_ring = mmap(nullptr, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			_ring_fd, IORING_OFF_SQ_RING);
+	void *cq_ring = mmap(nullptr, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			_ring_fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			_ring_fd, IORING_OFF_SQES);
+	_sq_ring = sq_ring == MAP_FAILED ? nullptr : sq_ring;
+	_cq_ring = cq_ring == MAP_FAILED ? nullptr : cq_ring;
+	_sqes = sqes == MAP_FAILED ? nullptr : (io_uring_sqe *) sqes;
+	if (!_sq_ring || !_cq_ring || !_sqes)
+		return false;
+
+	uint8 *sq = (uint8 *) _sq_ring;
+	uint8 *cq = (uint8 *) _cq_ring;
+	_sq_head = (unsigned *) (sq + params.sq_off.head);
+	_sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	_sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	_sq_array = (unsigned *) (sq + params.sq_off.array);
+	_cq_head = (unsigned *) (cq + params.cq_off.head);
+	_cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	_cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	_cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+	return true;
+}
+
+void UringReader::read(int fd, ArchiveRead *reads, size_t num_reads) {
+	for (size_t first = 0; first < num_reads; first += ENTRIES) {
+		unsigned count = (unsigned) std::min(num_reads - first, (size_t) ENTRIES);
+		if (_failed) {
+			for (unsigned i = 0; i < count; ++i) {
+				ArchiveRead &read = reads[first + i];
+				read.bytes_read = preadFully(fd, read.buffer, read.size, read.offset);
+			}
+			continue;
+		}
+
+		// we wait for every completion, so the submission queue is always empty here
+		unsigned tail = *_sq_tail;
+		for (unsigned i = 0; i < count; ++i) {
+			ArchiveRead &read = reads[first + i];
+			read.bytes_read = 0;
+			_done[i] = false;
+			_iovecs[i].iov_base = read.buffer;
+			_iovecs[i].iov_len = read.size;
+
+			unsigned index = (tail + i) & *_sq_mask;
+			io_uring_sqe &sqe = _sqes[index];
+			memset(&sqe, 0, sizeof(io_uring_sqe));
+			sqe.opcode = IORING_OP_READV;
+			sqe.fd = fd;
+			sqe.off = read.offset;
+			sqe.addr = (uint64) (uintptr_t) &_iovecs[i];
+			sqe.len = 1;
+			sqe.user_data = i;
+			_sq_array[index] = index;
+		}
+		__atomic_store_n(_sq_tail, tail + count, __ATOMIC_RELEASE);
+
+		unsigned to_submit = count;
+		// the reads the kernel took, they write into the buffers until they complete
+		unsigned submitted = count;
+		unsigned completed = 0;
+		while (completed < submitted) {
+			int ret = (int) syscall(__NR_io_uring_enter, _ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (ret < 0) {
+				if (errno == EINTR || (_failed && (errno == EAGAIN || errno == EBUSY)))
+					continue;
+				if (_failed) {
+					LOG_ERROR(logger) << "Could not wait for io_uring reads: " << strerror(errno);
+					break;
+				}
+				LOG_ERROR(logger) << "io_uring failed: " << strerror(errno);
+				_failed = true;
+				// the kernel only looks at the submission queue when we enter, so what it didn't take is taken back
+				unsigned sq_head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+				__atomic_store_n(_sq_tail, sq_head, __ATOMIC_RELEASE);
+				submitted = sq_head - tail;
+				to_submit = 0;
+				continue;
+			}
+			to_submit -= std::min((unsigned) ret, to_submit);
+
+			unsigned head = *_cq_head;
+			unsigned cq_tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+			for (; head != cq_tail; ++head) {
+				const io_uring_cqe &cqe = _cqes[head & *_cq_mask];
+				if (cqe.user_data < count && cqe.res >= 0) {
+					reads[first + cqe.user_data].bytes_read = cqe.res;
+					_done[cqe.user_data] = true;
+				}
+				++completed;
+			}
+			__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		for (unsigned i = 0; i < count; ++i) {
+			ArchiveRead &read = reads[first + i];
+			if (!_done[i])
+				read.bytes_read = 0;
+			if (read.bytes_read < read.size) {
+				read.bytes_read += preadFully(fd, (uint8 *) read.buffer + read.bytes_read,
+						read.size - read.bytes_read, read.offset + read.bytes_read);
+			}
+		}
+	}
+}
+
+static std::atomic<bool> uring_enabled(true);
+
+// the ring of the calling thread, nullptr if io_uring is off or not supported
+static UringReader *getUringReader() {
+	static thread_local std::unique_ptr<UringReader> reader;
+	static thread_local bool failed = false;
+	if (!uring_enabled.load(std::memory_order_relaxed))
+		return nullptr;
+	if (reader && reader->hasFailed()) {
+		reader.reset();
+		failed = true;
+	}
+	if (!reader && !failed) {
+		reader.reset(new UringReader());
+		if (!reader->init()) {
+			LOG_DEBUG(logger) << "io_uring is not available, reading batches without it";
+			reader.reset();
+			failed = true;
+		}
+	}
+	return reader.get();
+}
+
+#endif // HAVE_IO_URING
+
+bool ArchiveStorage::enableUring(bool enable) {
+#ifdef HAVE_IO_URING
+	uring_enabled = enable;
+	if (enable && !getUringReader()) {
+		uring_enabled = false;
+		return false;
+	}
+	return true;
+#else
+	return !enable;
+#endif
+}
+
+class StreamStorage : public ArchiveStorage {
+	std::fstream _file;
+	std::string _filename;
+#ifdef HAVE_IO_URING
+	// io_uring needs a descriptor, streams don't expose theirs
+	int _read_fd = -1;
+#endif
+
+public:
+	~StreamStorage();
+
+	bool open(const char *filename) override;
+	size_t getSize() override;
+	size_t read(size_t offset, void *buffer, size_t size) override;
+#ifdef HAVE_IO_URING
+	void readBatch(ArchiveRead *reads, size_t num_reads) override;
+#endif
+	bool write(size_t offset, const void *data, size_t size) override;
+	bool truncate(size_t size) override;
+	bool sync() override;
+};
+
+StreamStorage::~StreamStorage() {
+	if (_file.is_open()) _file.close();
+#ifdef HAVE_IO_URING
+	if (_read_fd >= 0) close(_read_fd);
+#endif
+}
+
+bool StreamStorage::open(const char *filename) {
+	_filename = filename;
+#ifdef HAVE_IO_URING
+	if (_read_fd >= 0) close(_read_fd);
+	_read_fd = -1;
+#endif
+	_file.open(filename, ios_base::in | ios_base::out | ios_base::binary);
+	if (!_file.is_open()) {
+		// file might have not existed, try to create it
+		_file.clear();
+		_file.open(filename, ios_base::out);
+		if (_file.is_open()) {
+			_file.close();
+		}
+		// try again
+		_file.clear();
+		_file.open(filename, ios_base::in | ios_base::out | ios_base::binary);
+	}
+	return _file.is_open();
+}
+
+size_t StreamStorage::getSize() {
+	_file.clear();
+	_file.seekg(0, ios_base::end);
+	return (size_t) _file.tellg();
+}
+
+size_t StreamStorage::read(size_t offset, void *buffer, size_t size) {
+	_file.clear();
+	_file.seekg(offset);
+	_file.read((char *) buffer, size);
+	size_t bytes_read = (size_t) _file.gcount();
+	// reading up to the end of the file is fine
+	if (_file.eof())
+		_file.clear();
+	return bytes_read;
+}
+
+#ifdef HAVE_IO_URING
+void StreamStorage::readBatch(ArchiveRead *reads, size_t num_reads) {
+	UringReader *reader = getUringReader();
+	if (reader && _read_fd < 0)
+		_read_fd = ::open(_filename.c_str(), O_RDONLY);
+	if (!reader || _read_fd < 0) {
+		ArchiveStorage::readBatch(reads, num_reads);
+		return;
+	}
+	reader->read(_read_fd, reads, num_reads);
+}
+#endif
+
+bool StreamStorage::write(size_t offset, const void *data, size_t size) {
+	_file.seekp(offset);
+	_file.write((const char *) data, size);
+	_file.flush();
+	return _file.good();
+}
+
+bool StreamStorage::truncate(size_t size) {
+	_file.flush();
+	boost::system::error_code ec;
+	boost::filesystem::resize_file(_filename, size, ec);
+	if (ec) {
+		LOG_ERROR(logger) << "Could not truncate '" << _filename << "': " << ec.message();
+		return false;
+	}
+	return true;
+}
+
+bool StreamStorage::sync() {
+	_file.flush();
+	if (!_file.good())
+		return false;
+	// streams don't expose their descriptor, but syncing any descriptor of the file will do
+#ifdef _MSC_VER
+	int fd = _open(_filename.c_str(), _O_RDWR | _O_BINARY);
+	bool synced = fd >= 0 && _commit(fd) == 0;
+	if (fd >= 0) _close(fd);
+#else
+	int fd = ::open(_filename.c_str(), O_RDWR);
+	bool synced = fd >= 0 && fdatasync(fd) == 0;
+	if (fd >= 0) close(fd);
+#endif
+	if (!synced)
+		LOG_ERROR(logger) << "Could not sync '" << _filename << "': " << strerror(errno);
+	return synced;
+}
+
+#ifndef _MSC_VER
+
+/* Maps the whole file read-only and writes with pwrite
+
+	The mapping is larger than the file, so it only has to be renewed once
+	the file grew beyond it.  Pages past the end of the file are never
+	touched.
+*/
+class MappedStorage : public ArchiveStorage {
+	static const size_t MAP_GRANULARITY = 1024 * 1024;
+
+	int _fd = -1;
+	uint8 *_map = nullptr;
+	size_t _map_size = 0;
+	size_t _size = 0;
+
+	bool remap(size_t min_size);
+
+public:
+	~MappedStorage();
+
+	bool open(const char *filename) override;
+	size_t getSize() override { return _size; }
+	size_t read(size_t offset, void *buffer, size_t size) override;
+	void readBatch(ArchiveRead *reads, size_t num_reads) override;
+	bool write(size_t offset, const void *data, size_t size) override;
+	bool truncate(size_t size) override;
+	bool sync() override;
+	const uint8 *map(size_t offset, size_t *size) override;
+};
+
+MappedStorage::~MappedStorage() {
+	if (_map) munmap(_map, _map_size);
+	if (_fd >= 0) close(_fd);
+}
+
+bool MappedStorage::open(const char *filename) {
+	_fd = ::open(filename, O_RDWR | O_CREAT, 0644);
+	if (_fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(_fd, &st) != 0) {
+		LOG_ERROR(logger) << "Could not stat '" << filename << "': " << strerror(errno);
+		return false;
+	}
+	_size = (size_t) st.st_size;
+	return remap(_size);
+}
+
+bool MappedStorage::remap(size_t min_size) {
+	if (min_size <= _map_size)
+		return true;
+	size_t new_size = std::max(_map_size * 2, (min_size / MAP_GRANULARITY + 1) * MAP_GRANULARITY);
+
+	if (_map) {
+		munmap(_map, _map_size);
+		_map = nullptr;
+		_map_size = 0;
+	}
+	void *p = mmap(nullptr, new_size, PROT_READ, MAP_SHARED, _fd, 0);
+	if (p == MAP_FAILED) {
+		LOG_ERROR(logger) << "Could not map archive file: " << strerror(errno);
+		return false;
+	}
+	_map = (uint8 *) p;
+	_map_size = new_size;
+	return true;
+}
+
+size_t MappedStorage::read(size_t offset, void *buffer, size_t size) {
+	const uint8 *data = map(offset, &size);
+	if (!data)
+		return 0;
+	memcpy(buffer, data, size);
+	return size;
+}
+
+void MappedStorage::readBatch(ArchiveRead *reads, size_t num_reads) {
+#ifdef HAVE_IO_URING
+	// pwrite goes through the page cache as well, so reading around the mapping is fine
+	UringReader *reader = getUringReader();
+	if (reader) {
+		reader->read(_fd, reads, num_reads);
+		return;
+	}
+#endif
+	// let the kernel fetch every range before we fault on the first one
+	static const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	for (size_t i = 0; i < num_reads; ++i) {
+		if (!_map || reads[i].offset >= _size)
+			continue;
+		size_t start = reads[i].offset / page_size * page_size;
+		size_t end = std::min(reads[i].offset + reads[i].size, _size);
+		madvise(_map + start, end - start, MADV_WILLNEED);
+	}
+	for (size_t i = 0; i < num_reads; ++i)
+		reads[i].bytes_read = read(reads[i].offset, reads[i].buffer, reads[i].size);
+}
+
+bool MappedStorage::write(size_t offset, const void *data, size_t size) {
+	const char *head = (const char *) data;
+	size_t left = size;
+	while (left > 0) {
+		ssize_t written = pwrite(_fd, head, left, offset + (head - (const char *) data));
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR(logger) << "Could not write archive file: " << strerror(errno);
+			return false;
+		}
+		head += written;
+		left -= written;
+	}
+	_size = std::max(_size, offset + size);
+	return remap(_size);
+}
+
+bool MappedStorage::truncate(size_t size) {
+	// the mapping stays, we just never look past the end of the file
+	if (ftruncate(_fd, size) != 0) {
+		LOG_ERROR(logger) << "Could not truncate archive file: " << strerror(errno);
+		return false;
+	}
+	_size = size;
+	return true;
+}
+
+bool MappedStorage::sync() {
+	// pwrite went straight to the page cache, the mapping itself is never dirty
+	if (fdatasync(_fd) != 0) {
+		LOG_ERROR(logger) << "Could not sync archive file: " << strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+const uint8 *MappedStorage::map(size_t offset, size_t *size) {
+	if (!_map || offset >= _size) {
+		*size = 0;
+		return _map;
+	}
+	*size = std::min(*size, _size - offset);
+	return _map + offset;
+}
+
+#endif // _MSC_VER
+
+std::unique_ptr<ArchiveStorage> ArchiveStorage::create(ArchiveIO io) {
+	switch (io) {
+#ifndef _MSC_VER
+	case ArchiveIO::MMAP:
+		return std::unique_ptr<ArchiveStorage>(new MappedStorage());
+#endif
+	default:
+		return std::unique_ptr<ArchiveStorage>(new StreamStorage());
+	}
+}
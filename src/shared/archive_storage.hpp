@@ -0,0 +1,63 @@
+#ifndef ARCHIVE_STORAGE_HPP_
+#define ARCHIVE_STORAGE_HPP_
+
+#include <memory>
+
+#include "engine/std_types.hpp"
+
+enum class ArchiveIO {
+	// seek, read and write through std::fstream
+	STREAM,
+	// map the whole file and decode straight from the page cache, falls back to STREAM
+	MMAP,
+};
+
+// one read of a batch, readBatch fills in bytes_read
+struct ArchiveRead {
+	size_t offset;
+	void *buffer;
+	size_t size;
+	size_t bytes_read;
+};
+
+/** The file an ArchiveFile keeps its header, directory and chunk heap in
+
+	Only one thread may use a storage at a time.
+*/
+class ArchiveStorage {
+public:
+	static std::unique_ptr<ArchiveStorage> create(ArchiveIO);
+
+	// returns false and leaves io_uring off if the kernel doesn't support it
+	static bool enableUring(bool enable);
+
+	virtual ~ArchiveStorage() = default;
+
+	// opens the file and creates it if it doesn't exist yet
+	virtual bool open(const char *filename) = 0;
+
+	virtual size_t getSize() = 0;
+
+	// returns the number of bytes read, which is less than size at the end of the file
+	virtual size_t read(size_t offset, void *buffer, size_t size) = 0;
+	/** Reads many ranges at once
+
+		On Linux, the reads are submitted to an io_uring together, so the disk can work
+		on all of them at once instead of one after the other.  Without io_uring, mapped
+		files ask the kernel to read all ranges ahead before copying them.
+	*/
+	virtual void readBatch(ArchiveRead *reads, size_t num_reads);
+	virtual bool write(size_t offset, const void *data, size_t size) = 0;
+	virtual bool truncate(size_t size) = 0;
+	// blocks until everything written so far is on the disk
+	virtual bool sync() = 0;
+
+	/** Get the bytes at offset without copying them
+
+		Returns nullptr if the storage can't do that, otherwise size is reduced to the
+		number of bytes left in the file.  The pointer is valid until the next write.
+	*/
+	virtual const uint8 *map(size_t offset, size_t *size) { (void) offset; (void) size; return nullptr; }
+};
+
+#endif // ARCHIVE_STORAGE_HPP_
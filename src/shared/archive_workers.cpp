@@ -0,0 +1,173 @@
+#include "archive_workers.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include "engine/queue.hpp"
+#include "engine/thread.hpp"
+#include "engine/time.hpp"
+
+#include "block_utils.hpp"
+#include "chunk_archive.hpp"
+
+using namespace std;
+
+static const size_t MAX_STORE_BATCH = 256;
+static const size_t MAX_LOAD_BATCH = 64;
+
+class ArchiveWorkers::Worker : public Thread {
+public:
+	Worker(ChunkArchive *archive, size_t queue_size) :
+		Thread("archive"), inQueue(queue_size), outQueue(queue_size), _archive(archive) {}
+
+	ProducerQueue<Operation> inQueue;
+	ProducerQueue<Operation> outQueue;
+
+	void doWork() override;
+	void onStop() override;
+
+	// wakes the thread up if it is waiting for work
+	void notify();
+
+private:
+	void flushStoreBatch();
+	void flushLoadBatch();
+	void finish(const Operation &);
+
+	ChunkArchive *_archive;
+	std::vector<Operation> _store_batch;
+	std::vector<const Chunk *> _store_batch_chunks;
+	std::vector<Operation> _load_batch;
+	std::vector<Chunk *> _load_batch_chunks;
+
+	std::mutex _wake_lock;
+	std::condition_variable _wake;
+	bool _has_work = false;
+};
+
+void ArchiveWorkers::Worker::doWork() {
+	Operation op;
+	if (!inQueue.pop(op)) {
+		if (_archive->compact())
+			return;
+		// the timeout only matters for compaction, new work wakes us up right away
+		std::unique_lock<std::mutex> lock(_wake_lock);
+		if (!_has_work && !isTerminationRequested())
+			_wake.wait_for(lock, std::chrono::milliseconds(100));
+		_has_work = false;
+		return;
+	}
+
+	// consecutive operations of the same kind are done as one batch, in order
+	for (;;) {
+		if (op.type == LOAD) {
+			flushStoreBatch();
+			_load_batch.push_back(op);
+			if (_load_batch.size() >= MAX_LOAD_BATCH)
+				flushLoadBatch();
+		} else {
+			// the stores might overwrite a chunk that is about to be loaded
+			flushLoadBatch();
+			_store_batch.push_back(op);
+			if (_store_batch.size() >= MAX_STORE_BATCH)
+				flushStoreBatch();
+		}
+		if (!inQueue.pop(op))
+			break;
+	}
+	flushLoadBatch();
+	flushStoreBatch();
+}
+
+void ArchiveWorkers::Worker::notify() {
+	{
+		std::lock_guard<std::mutex> lock(_wake_lock);
+		_has_work = true;
+	}
+	_wake.notify_one();
+}
+
+void ArchiveWorkers::Worker::onStop() {
+	Operation op;
+	while (inQueue.pop(op)) {
+		if (op.type != LOAD)
+			_store_batch.push_back(op);
+	}
+	flushStoreBatch();
+}
+
+void ArchiveWorkers::Worker::flushStoreBatch() {
+	if (_store_batch.empty())
+		return;
+	_store_batch_chunks.clear();
+	for (const Operation &op : _store_batch)
+		_store_batch_chunks.push_back(op.chunk);
+	_archive->storeChunks(_store_batch_chunks);
+	for (const Operation &op : _store_batch)
+		finish(op);
+	_store_batch.clear();
+}
+
+void ArchiveWorkers::Worker::flushLoadBatch() {
+	if (_load_batch.empty())
+		return;
+	_load_batch_chunks.clear();
+	for (const Operation &op : _load_batch)
+		_load_batch_chunks.push_back(op.chunk);
+	_archive->loadChunks(_load_batch_chunks);
+	for (const Operation &op : _load_batch)
+		finish(op);
+	_load_batch.clear();
+}
+
+void ArchiveWorkers::Worker::finish(const Operation &op) {
+	// nobody picks up finished operations anymore once we are stopping
+	while (!outQueue.push(op) && !isTerminationRequested()) {
+		sleepFor(millis(50));
+	}
+}
+
+ArchiveWorkers::ArchiveWorkers(ChunkArchive *archive, int num_threads, size_t queue_size) {
+	for (int i = 0; i < std::max(num_threads, 1); ++i) {
+		_workers.emplace_back(new Worker(archive, queue_size));
+		_workers.back()->dispatch();
+	}
+}
+
+ArchiveWorkers::~ArchiveWorkers() {
+	stop();
+}
+
+bool ArchiveWorkers::push(const Operation &op) {
+	vec3i64 rc = ChunkArchive::getRegionCoords(op.chunk->getCC());
+	Worker &worker = *_workers[vec3i64HashFunc(rc) % _workers.size()];
+	if (!worker.inQueue.push(op))
+		return false;
+	worker.notify();
+	return true;
+}
+
+bool ArchiveWorkers::pop(Operation &op) {
+	for (size_t i = 0; i < _workers.size(); ++i) {
+		Worker &worker = *_workers[_next_pop];
+		_next_pop = (_next_pop + 1) % _workers.size();
+		if (worker.outQueue.pop(op))
+			return true;
+	}
+	return false;
+}
+
+void ArchiveWorkers::stop() {
+	for (auto &worker : _workers) {
+		worker->requestTermination();
+		worker->notify();
+	}
+	for (auto &worker : _workers) {
+		Operation op;
+		while (worker->outQueue.pop(op));
+		worker->wait();
+	}
+	_workers.clear();
+}
@@ -0,0 +1,57 @@
+#ifndef ARCHIVE_WORKERS_HPP_
+#define ARCHIVE_WORKERS_HPP_
+
+#include <memory>
+#include <vector>
+
+#include "engine/std_types.hpp"
+#include "game/chunk.hpp"
+
+class ChunkArchive;
+
+/** Threads that load and store chunks for a chunk manager
+
+	Every region belongs to exactly one thread, so operations on the same
+	chunk are done in the order they were pushed, while different regions
+	are served in parallel.  Consecutive stores are written as one batch and
+	consecutive loads are read as one batch (see ChunkArchive::loadChunks).
+	Threads with nothing to do compact the archive and wait for the next push.
+*/
+class ArchiveWorkers {
+public:
+	enum OperationType {
+		LOAD = 0,
+		STORE,
+	};
+
+	struct Operation {
+		Chunk *chunk;
+		OperationType type;
+	};
+
+	ArchiveWorkers(ChunkArchive *, int num_threads, size_t queue_size = 1024);
+	~ArchiveWorkers();
+
+	ArchiveWorkers(const ArchiveWorkers &) = delete;
+	ArchiveWorkers &operator = (const ArchiveWorkers &) = delete;
+
+	// returns false if the queue of the thread responsible for the chunk is full
+	bool push(const Operation &);
+	// finished operations, in no particular order across regions
+	bool pop(Operation &);
+
+	/** Stops all threads
+
+		Stores that were pushed are written, loads that didn't happen yet are
+		dropped and finished operations are discarded.
+	*/
+	void stop();
+
+private:
+	class Worker;
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	size_t _next_pop = 0;
+};
+
+#endif // ARCHIVE_WORKERS_HPP_
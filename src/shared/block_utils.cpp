@@ -134,6 +134,17 @@ size_t vec3i64HashFunc(vec3i64 v) {
 	return result;
 }
 
+uint64 getMortonCode(vec3i64 v) {
+	// 21 bits per coordinate, shifted so small negative coordinates come before positive ones
+	uint64 code = 0;
+	for (int i = 0; i < 3; ++i) {
+		uint64 bits = (uint64) (v[i] + (1 << 20)) & 0x1FFFFF;
+		for (uint bit = 0; bit < 21; ++bit)
+			code |= ((bits >> bit) & 1) << (3 * bit + i);
+	}
+	return code;
+}
+
 size_t vec2i64HashFunc(vec2i64 v) {
 	static const int prime = 31;
 	size_t result = 1;
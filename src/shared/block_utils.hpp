@@ -46,6 +46,8 @@ int64 gridCycleIndex(vec3i64 v, int64 gridSize);
 size_t vec3i64HashFunc(vec3i64 v);
 size_t vec2i64HashFunc(vec2i64 v);
 bool vec3i64CompFunc(vec3i64 v1, vec3i64 v2);
+// interleaves the bits of the coordinates, so points close in space tend to get close codes
+uint64 getMortonCode(vec3i64 v);
 
 void initUtil();
 
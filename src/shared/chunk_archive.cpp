@@ -1,563 +1,225 @@
 #include "chunk_archive.hpp"
 
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <memory>
 
 #include <boost/filesystem.hpp>
 
 #include "engine/math.hpp"
 #include "engine/logging.hpp"
 
+#include "game/world_generator.hpp"
+
+#include "archive_file.hpp"
 #include "block_utils.hpp"
-#include "chunk_compression.hpp"
+#include "log_backend.hpp"
+#include "region_backend.hpp"
 
 using namespace std;
 
 static logging::Logger logger("io");
 
-static const uint8 MAGIC[4] = { 0x59, 0x97, 0x22, 0xDF };
-
-static const int32 ENDIANESS_BYTES = 0x01020304;
-static const int32 ENDIANESS_BYTES_FLIPPED = 0x04030201;
-
-static const uint HEAP_BLOCK_SIZE = 256;
-
-static const int32 RECENT_HEADER_VERSION = 3;
-
-static const uint REGION_SIZE = 16;
-
-class ArchiveFile {
-private:
-
-	PACKED(
-	struct Header {
-		uint8 magic[4];
-		int32 endianess_bytes;
-		int32 version;
-		uint32 dir_size;
-		uint32 directory_offset;
-		uint16 heap_block_size;
-		uint8 reserved[10];
-	});
-
-	enum Layout {
-		LAYOUT_PLAIN      = 0x0000,
-		LAYOUT_DIFF       = 0x0001,
-		LAYOUT_RLE        = 0x0002,
-		LAYOUT_ZLIB       = 0x0004,
-		LAYOUT_ENC_MASK   = 0x0007,
-		LAYOUT_VISIBILITY = 0x0008,
-		LAYOUT_EMPTY      = 0x8000,
-	};
-
-	PACKED(
-	struct DirectoryEntry {
-		uint32 offset;
-		uint16 size;
-		uint16 flags;
-		uint32 revision;
-		uint16 visibility;
-		uint8  reserved[2];
-	});
-
-public:
-	enum Endianess {
-		UNKNOWN = -1,
-		NATIVE,
-		FLIPPED
-	};
-
-	~ArchiveFile();
-	ArchiveFile(const char *, uint size = 16);
-
-	ArchiveFile() = delete;
-	ArchiveFile(const ArchiveFile &) = delete;
-	ArchiveFile(ArchiveFile &&) = delete;
-
-	ArchiveFile &operator = (const ArchiveFile &) = delete;
-	ArchiveFile &operator = (ArchiveFile &&) = delete;
-
-	Time getLastAccess() const { return _last_access; }
-	
-	void loadHeader();
-	void loadDirectory();
-	void initialize();
-
-	bool hasChunk(vec3i64, uint32 *);
-	bool loadChunk(Chunk *);
-	void storeChunk(const Chunk &);
-
-	int getFileSize();
-	int getUsedChunkBytes();
-	int getTotalChunkBytes();
-	float getChunkFragmentation();
-
-private:
-	size_t getChunkHeapStart();
-
-	std::fstream _file;
-	const uint _region_size;
-	Time _last_access;
-	std::string _filename;
-	bool _good = true;
-
-	Header _header;
-	std::vector<DirectoryEntry> _dir;
-
-	ReadWriteLock _dir_lock;
-
-
-};
-
-ArchiveFile::~ArchiveFile() {
-	if(_file.is_open()) _file.close();
+ChunkArchive::~ChunkArchive() {
+	// nothing
 }
 
-ArchiveFile::ArchiveFile(const char *filename, uint region_size) :
-	_region_size(region_size), _last_access(getCurrentTime()), _filename(filename)
+ChunkArchive::ChunkArchive(const char *str, const ArchiveConf &conf,
+		std::unique_ptr<WorldGenerator> generator) :
+	_conf(conf)
 {
-	_file.open(_filename, ios_base::in | ios_base::out | ios_base::binary);
-	if (!_file.is_open()) {
-		// file might have not existed, try to create it
-		_file.clear();
-		_file.open(_filename, ios_base::out);
-		if (_file.is_open()) {
-			_file.close();
-		}
-		// try again
-		_file.clear();
-		_file.open(_filename, ios_base::in | ios_base::out | ios_base::binary);
-		if (!_file.is_open()) {
-			LOG_ERROR(logger) << "Could not open ArchiveFile '" << _filename << "'";
-			_good = false;
-			return;
-		} else {
-			int c = _file.get();
-			if (c == EOF) {
-				// file was empty, we can safely nuke it (we probably created it)
-				initialize();
-			} else {
-				LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had content after creation";
-				_file.close();
-				_good = false;
-				return;
-			}
-		}
-	}
-
-	loadHeader();
-	if (!_good) {
-		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had bad header";
-		_file.close();
-		_good = false;
-		return;
+	switch (_conf.backend) {
+	case ArchiveBackend::LOG:
+		_backend.reset(new LogBackend(str, _conf, std::move(generator)));
+		break;
+	default:
+		_backend.reset(new RegionBackend(str, _conf, std::move(generator)));
+		break;
 	}
-
-	if (_header.version != RECENT_HEADER_VERSION) {
-		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had unknown version ("
-				<< _header.version << ")";
-		_file.close();
-		_good = false;
-		return;
-	}
-
-	loadDirectory();
 }
 
-void ArchiveFile::loadHeader() {
-	_file.clear();
-	_file.seekg(0);
-	_file.read((char *)(&_header), sizeof(Header));
-	if (_file.eof()) {
-		LOG_ERROR(logger) << "Archive file '" << _filename << "' ended abruptly";
-		_good = false;
-		return;
-	}
-
-	if (memcmp(_header.magic, MAGIC, sizeof(MAGIC)) != 0) {
-		LOG_ERROR(logger) << "Archive file '" << _filename << "' had wrong magic (0x"
-				<< std::hex << std::uppercase << (uint) _header.magic[0]
-				<< (uint) _header.magic[1]
-				<< (uint) _header.magic[2]
-				<< (uint) _header.magic[3]
-				<< " instead of 0x"
-				<< std::hex << std::uppercase << (uint) MAGIC[0]
-				<< (uint) MAGIC[1]
-				<< (uint) MAGIC[2]
-				<< (uint) MAGIC[3]
-				<< ")";
-		_good = false;
-		return;
-	}
-
-	if (_header.endianess_bytes != ENDIANESS_BYTES) {
-		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had wrong endianess";
-		_good = false;
-		return;
-	}
-
-	if (_header.dir_size != _region_size * _region_size * _region_size) {
-		LOG_ERROR(logger) << "ArchiveFile '" << _filename << "' had wrong size ("
-				<< _header.dir_size << " instead of "
-				<< _region_size * _region_size * _region_size << ")";
-		_good = false;
-		return;
-	}
-
-	_dir.clear();
-	_dir.resize(_header.dir_size);
-	memset((char *)_dir.data(), 0, _header.dir_size * sizeof(DirectoryEntry));
+bool ChunkArchive::hasChunk(vec3i64 cc, uint32 *revision) {
+	return _backend->hasChunk(cc, revision);
 }
 
-void ArchiveFile::loadDirectory() {
-	_file.seekg(_header.directory_offset);
-	_file.read((char *)(_dir.data()), _header.dir_size * sizeof (DirectoryEntry));
+bool ChunkArchive::loadChunk(Chunk *chunk) {
+	return _backend->loadChunk(chunk);
 }
 
-void ArchiveFile::initialize() {
-	_file.clear();
-	_file.seekp(0);
-
-	memset((char *)&_header, 0, sizeof(Header));
-	memcpy(_header.magic, MAGIC, sizeof (MAGIC));
-	_header.endianess_bytes = ENDIANESS_BYTES;
-	_header.version = RECENT_HEADER_VERSION;
-	uint num_chunks = _region_size * _region_size * _region_size;
-	_header.dir_size = num_chunks;
-	_header.directory_offset = sizeof (Header);
-	_header.heap_block_size = HEAP_BLOCK_SIZE;
-
-	// write header and empty directory
-	_file.write((char *)(&_header), sizeof (Header));
-	const size_t total_directory_bytes = num_chunks * sizeof(DirectoryEntry);
-	for (uint i = 0; i < total_directory_bytes; ++i) {
-		_file.put(0);
-	}
-	_file.flush();
-
-	if (!_file.good()) {
-		LOG_ERROR(logger) << "Could not initialize ArchiveFile '" << _filename << "'";
-		_good = false;
-		return;
-	}
-
-	_dir.clear();
-	_dir.resize(_header.dir_size);
-	memset((char *)_dir.data(), 0, _header.dir_size * sizeof(DirectoryEntry));
+void ChunkArchive::storeChunk(const Chunk &chunk) {
+	_backend->storeChunk(chunk);
 }
 
-bool ArchiveFile::hasChunk(vec3i64 cc, uint32 *revision) {
-	if (!_good) return false;
-	size_t x = cycle(cc[0], _region_size);
-	size_t y = cycle(cc[1], _region_size);
-	size_t z = cycle(cc[2], _region_size);
-	size_t id = x + (_region_size * (y + (_region_size * z)));
-
-	_dir_lock.lockRead();
-	const DirectoryEntry dir_entry = _dir[id];
-	_dir_lock.unlockRead();
-
-	bool has_chunk = dir_entry.size != 0 || dir_entry.flags != 0;
-	if (revision != nullptr && has_chunk)
-		*revision = dir_entry.revision;
-	return has_chunk;
+void ChunkArchive::storeChunks(const std::vector<const Chunk *> &chunks) {
+	_backend->storeChunks(chunks);
 }
 
-bool ArchiveFile::loadChunk(Chunk *chunk) {
-	if (!_good) return false;
-
-	_last_access = getCurrentTime();
-
-	// get entry from directory
-	vec3i64 cc = chunk->getCC();
-	size_t x = cycle(cc[0], _region_size);
-	size_t y = cycle(cc[1], _region_size);
-	size_t z = cycle(cc[2], _region_size);
-	size_t id = x + (_region_size * (y + (_region_size * z)));
-
-	_dir_lock.lockRead();
-	const DirectoryEntry dir_entry = _dir[id];
-	_dir_lock.unlockRead();
-
-	if (dir_entry.size == 0 && dir_entry.flags == 0) {
-		return false;
-	}
-	
-	chunk->initRevision(dir_entry.revision);
-	if (dir_entry.flags == LAYOUT_EMPTY) {
-		uint8 *blocks = chunk->getBlocksForInit();
-		memset((char *)blocks, 0, Chunk::SIZE * sizeof(uint8));
-		chunk->initNumAirBlocks(Chunk::SIZE);
-		chunk->initPassThroughs(0x7FFF);
-		chunk->finishInitialization();
-		return true;
-	}
-
-	_file.seekg(getChunkHeapStart() + dir_entry.offset * _header.heap_block_size);
-
-	if ((dir_entry.flags & LAYOUT_ENC_MASK) == LAYOUT_RLE) {
-		decodeBlocks_RLE(&_file, chunk->getBlocksForInit());
-	} else if ((dir_entry.flags & LAYOUT_ENC_MASK) == LAYOUT_PLAIN) {
-		decodeBlocks_PLAIN(&_file, chunk->getBlocksForInit());
-	} else {
-		LOG_ERROR(logger) << "Chunk Layout " << dir_entry.flags << " unsupported";
-		return false;
-	}
-
-	if (!_file.good()) {
-		LOG_ERROR(logger) << "Bad in-stream";
-		return false;
-	}
-
-	if (dir_entry.flags & LAYOUT_VISIBILITY)
-		chunk->initPassThroughs(dir_entry.visibility);
-
-	chunk->finishInitialization();
-
-	return true;
+void ChunkArchive::loadChunks(const std::vector<Chunk *> &chunks) {
+	_backend->loadChunks(chunks);
 }
 
-void ArchiveFile::storeChunk(const Chunk &chunk) {
-	if (!_good) return;
-
-	_last_access = getCurrentTime();
-
-	vec3i64 cc = chunk.getCC();
-	size_t x = cycle(cc[0], _region_size);
-	size_t y = cycle(cc[1], _region_size);
-	size_t z = cycle(cc[2], _region_size);
-	size_t id = x + (_region_size * (y + (_region_size * z)));
-
-	_dir_lock.lockRead();
-	DirectoryEntry dir_entry = _dir[id];
-	_dir_lock.unlockRead();
-
-	dir_entry.revision = chunk.getRevision();
-
-	if (chunk.isEmpty()) {
-		dir_entry.offset = 0;
-		dir_entry.size = 0;
-		dir_entry.visibility = 0;
-		dir_entry.flags = LAYOUT_EMPTY;
-	}
-	
-	else {
-		// leave some wiggle room, so we can detect whether a chunk actually grew
-		uint8 *const buffer = new uint8[Chunk::SIZE + 4];
-		int bytes_written;
-		uint num_blocks;
-
-		// try RLE encoding
-		bytes_written = encodeBlocks_RLE(chunk.getBlocks(), buffer, Chunk::SIZE);
-		if (bytes_written <= 0) {
-			LOG_ERROR(logger) << "Chunk (" << cc << ") could not be written";
-			return;
-		}
-		num_blocks = ((uint)bytes_written - 1) / _header.heap_block_size + 1;
-		dir_entry.flags = LAYOUT_RLE;
-
-		// use plain encoding if we didn't compress the chunk enough
-		if (num_blocks >= Chunk::SIZE / _header.heap_block_size) {
-			bytes_written = encodeBlocks_PLAIN(chunk.getBlocks(), buffer, Chunk::SIZE);
-			if (bytes_written <= 0) {
-				LOG_ERROR(logger) << "Chunk (" << cc << ") could not be written";
-				return;
-			}
-			num_blocks = ((uint)bytes_written - 1) / _header.heap_block_size + 1;
-			dir_entry.flags = LAYOUT_PLAIN;
-		}
-
-		if (num_blocks > dir_entry.size) {
-			//LOG_DEBUG(logger) << "Resized Chunk (" << cc << ")";
-			_file.seekg(0, ios_base::end);
-			size_t file_end = (size_t) _file.tellg();
-			size_t chunk_heap_size = file_end - getChunkHeapStart();
-			size_t start;
-			if (chunk_heap_size > 0)
-				start = (chunk_heap_size - 1) / _header.heap_block_size + 1;
-			else
-				start = 0;
-			dir_entry.offset = (uint32) start;
-			dir_entry.size = num_blocks;
-		}
-
-		_file.seekp(getChunkHeapStart() + dir_entry.offset * _header.heap_block_size);
-		_file.write((char *) buffer, bytes_written);
-		_file.flush();
-
-		delete[] buffer;
-
-		if (chunk.isVisual()) {
-			dir_entry.flags |= LAYOUT_VISIBILITY;
-			dir_entry.visibility = chunk.getPassThroughs();
-		} else {
-			dir_entry.visibility = 0;
-		}
-	}
-
-	_dir_lock.lockWrite();
-	_dir[id] = dir_entry;
-	_dir_lock.unlockWrite();
-
-	_file.seekp(_header.directory_offset + id * sizeof (DirectoryEntry));
-	_file.write((char *)(&dir_entry), sizeof (DirectoryEntry));
-	_file.flush();
-
-	if (!_file.good()) {
-		LOG_ERROR(logger) << "Safe operation failed for chunk "
-				<< cc[0] << " " << cc[1] << " "<< cc[2];
-	}
+bool ChunkArchive::compact() {
+	return _backend->compact();
 }
 
-int ArchiveFile::getFileSize() {
-	using namespace boost::filesystem;
-	return (int) file_size(path(_filename));
+size_t ChunkArchive::collectGarbage() {
+	return _backend->collectGarbage();
 }
 
-int ArchiveFile::getUsedChunkBytes() {
-	size_t blocks = 0;
-	for (auto &entry : _dir) {
-		blocks += entry.size;
-	}
-	return (int) blocks * _header.heap_block_size;
+void ChunkArchive::clean(Time t) {
+	_backend->clean(t);
 }
 
-int ArchiveFile::getTotalChunkBytes() {
-	size_t blocks = 0;
-	for (auto &entry : _dir) {
-		blocks = std::max(blocks, (size_t) entry.size + entry.offset);
-	}
-	return (int) blocks * _header.heap_block_size;
+ContentStore *ChunkArchive::getContentStore() {
+	return _backend->getContentStore();
 }
 
-float ArchiveFile::getChunkFragmentation() {
-	size_t used = getUsedChunkBytes();
-	size_t total = getTotalChunkBytes();
-	return total > 0 ? (float) (total - used) / total : 0.0f;
+size_t ChunkArchive::getNumOpenRegions() {
+	return _backend->getNumOpenFiles();
 }
 
-size_t ArchiveFile::getChunkHeapStart() {
-	return _header.directory_offset + _header.dir_size * sizeof(DirectoryEntry);
+std::vector<vec3i64> ChunkArchive::getRegions() {
+	return _backend->getRegions();
 }
 
-ChunkArchive::~ChunkArchive() {
-	clean();
+vec3i64 ChunkArchive::getRegionCoords(vec3i64 cc) {
+	vec3i64 rc;
+	rc[0] = cc[0] / REGION_SIZE - (cc[0] < 0 ? 1 : 0);
+	rc[1] = cc[1] / REGION_SIZE - (cc[1] < 0 ? 1 : 0);
+	rc[2] = cc[2] / REGION_SIZE - (cc[2] < 0 ? 1 : 0);
+	return rc;
 }
 
-ChunkArchive::ChunkArchive(const char *str) :
-	_path(str), _file_map(0, vec3i64HashFunc)
-{
-	using namespace boost::filesystem;
-	path p(str);
-	if (!exists(status(p))) {
-		create_directories(p);
-	} else {
-		if (!is_directory(p)) {
-			LOG_ERROR(logger) << "World path is not a directory";
-			return;
-		}
-	}
-
-	size_t bytes = 0;
-	size_t used_bytes = 0;
-	size_t total_bytes = 0;
-
-	directory_iterator iter(str);
-	directory_iterator end;
-	while (iter != end) {
-		if (exists(iter->path()) && is_regular_file(iter->path())) {
-			ArchiveFile af(iter->path().string().c_str());
-			bytes += af.getFileSize();
-			used_bytes += af.getUsedChunkBytes();
-			total_bytes += af.getTotalChunkBytes();
+std::vector<vec3i64> ChunkArchive::getRegionChunks(vec3i64 rc) {
+	// regions don't start at a multiple of their size for negative coordinates
+	std::vector<int64> coords[3];
+	for (int i = 0; i < 3; ++i) {
+		for (int64 c = rc[i] * REGION_SIZE - REGION_SIZE; c < rc[i] * REGION_SIZE + 2 * REGION_SIZE; ++c) {
+			if (getRegionCoords(vec3i64(c, c, c))[i] == rc[i])
+				coords[i].push_back(c);
 		}
-		++iter;
 	}
 
-	LOG_INFO(logger) << "Chunk archive '" << str << "' has " << bytes / 1024 / 1024 << " MB";
-	LOG_INFO(logger) << "Chunk archive '" << str << "' uses "
-			<< used_bytes / 1024 / 1024 << " MB of " << total_bytes / 1024 / 1024 << " MB of space";
-}
-
-bool ChunkArchive::hasChunk(vec3i64 cc, uint32 *revision) {
-	_file_map_lock.lockRead();
-	ArchiveFile *archive_file = unsafe_getArchiveFile(cc);
-	bool result = archive_file->hasChunk(cc, revision);
-	_file_map_lock.unlockRead();
-	return result;
-}
-
-bool ChunkArchive::loadChunk(Chunk *chunk) {
-	_file_map_lock.lockRead();
-	ArchiveFile *archive_file = unsafe_getArchiveFile(chunk->getCC());
-	bool result = archive_file->loadChunk(chunk);
-	_file_map_lock.unlockRead();
-	return result;
-}
-
-void ChunkArchive::storeChunk(const Chunk &chunk) {
-	_file_map_lock.lockRead();
-	ArchiveFile *archive_file = unsafe_getArchiveFile(chunk.getCC());
-	archive_file->storeChunk(chunk);
-	_file_map_lock.unlockRead();
+	std::vector<vec3i64> chunks;
+	for (int64 z : coords[2])
+	for (int64 y : coords[1])
+	for (int64 x : coords[0])
+		chunks.push_back(vec3i64(x, y, z));
+	std::sort(chunks.begin(), chunks.end(), [](const vec3i64 &a, const vec3i64 &b) {
+		return getMortonCode(vec3i64(cycle(a[0], REGION_SIZE), cycle(a[1], REGION_SIZE), cycle(a[2], REGION_SIZE)))
+				< getMortonCode(vec3i64(cycle(b[0], REGION_SIZE), cycle(b[1], REGION_SIZE), cycle(b[2], REGION_SIZE)));
+	});
+	return chunks;
 }
 
-void ChunkArchive::clean(Time t) {
-	_file_map_lock.lockWrite();
-	unsafe_clean(t);
-	_file_map_lock.unlockWrite();
+bool ChunkArchive::parseRegionFilename(const std::string &filename, vec3i64 *rc) {
+	vec3i64 coords;
+	// the whole name has to match, not just its beginning
+	int end = -1;
+	if (sscanf(filename.c_str(), "%" SCNd64 "_%" SCNd64 "_%" SCNd64 ".region%n",
+			&coords[0], &coords[1], &coords[2], &end) != 3 || end != (int) filename.size())
+		return false;
+	*rc = coords;
+	return true;
 }
 
-// the caller of this function needs to hold a read-lock
-ArchiveFile *ChunkArchive::unsafe_getArchiveFile(vec3i64 cc) {
-	vec3i64 rc;
-	rc[0] = cc[0] / REGION_SIZE - (cc[0] < 0 ? 1 : 0);
-	rc[1] = cc[1] / REGION_SIZE - (cc[1] < 0 ? 1 : 0);
-	rc[2] = cc[2] / REGION_SIZE - (cc[2] < 0 ? 1 : 0);
-
-	auto iter = _file_map.find(rc);
-	while (iter == _file_map.end()) {
-		_file_map_lock.unlockRead();
-		_file_map_lock.lockWrite();
-
-		iter = _file_map.find(rc);
-		if (iter == _file_map.end()) {
-			unsafe_addArchiveFile(rc);
+bool ChunkArchive::repackRegion(const char *filename, vec3i64 rc, const ArchiveConf &conf,
+		WorldGenerator *generator, Mutex *generator_lock, ContentStore *content_store,
+		RegionRepackStats *stats) {
+	*stats = RegionRepackStats();
+	// a region file without a generator can't hold diffs anymore
+	ArchiveConf repack_conf = conf;
+	if (!generator)
+		repack_conf.policy = ArchivePolicy::FULL;
+	// every chunk gets the smallest of its encodings with and without zlib, the file is only written once
+	repack_conf.compression = ArchiveCompression::ZLIB;
+	repack_conf.compression_level = 9;
+	// the new file is synced once at the end
+	repack_conf.sync = false;
+
+	ArchiveFile old_file(REGION_SIZE, conf, generator, generator_lock, content_store);
+	old_file.open(filename, rc);
+	stats->file_bytes_before = old_file.getFileSize();
+	stats->used_bytes_before = old_file.getUsedChunkBytes();
+	stats->total_bytes_before = old_file.getTotalChunkBytes();
+
+	std::vector<vec3i64> order = getRegionChunks(rc);
+
+	std::string temp_filename = std::string(filename) + ".repack";
+	boost::system::error_code ec;
+	boost::filesystem::remove(temp_filename, ec);
+
+	// the heap of a new file grows with every chunk, so storing in order lays them out in order
+	ArchiveFile new_file(REGION_SIZE, repack_conf, generator, generator_lock, content_store);
+	new_file.open(temp_filename.c_str(), rc);
+	bool good = true;
+	for (vec3i64 cc : order) {
+		bool has_chunk = false;
+		old_file.tryHasChunk(rc, cc, &has_chunk, nullptr);
+		if (!has_chunk)
+			continue;
+		Chunk chunk(Chunk::VISUAL);
+		chunk.initCC(cc);
+		if (!old_file.loadChunk(&chunk)) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") of '" << filename << "' could not be loaded";
+			good = false;
+			break;
+		}
+		new_file.storeChunk(chunk);
+		++stats->chunks;
+	}
+
+	// read everything back from the disk, not from what we just wrote
+	if (good) {
+		new_file.open(temp_filename.c_str(), rc);
+		std::unique_ptr<uint8[]> old_blocks(new uint8[Chunk::SIZE]);
+		std::unique_ptr<uint8[]> new_blocks(new uint8[Chunk::SIZE]);
+		for (size_t i = 0; i < order.size() && good; ++i) {
+			bool has_chunk = false;
+			old_file.tryHasChunk(rc, order[i], &has_chunk, nullptr);
+			if (!has_chunk)
+				continue;
+			Chunk old_chunk, new_chunk;
+			old_chunk.initCC(order[i]);
+			new_chunk.initCC(order[i]);
+			old_file.loadChunk(&old_chunk);
+			if (!new_file.loadChunk(&new_chunk)) {
+				// unedited chunks are generated again anyway
+				if (repack_conf.policy == ArchivePolicy::DIFF && old_chunk.getRevision() == 0)
+					continue;
+				good = false;
+			} else {
+				old_chunk.getBlocks(old_blocks.get());
+				new_chunk.getBlocks(new_blocks.get());
+				good = old_chunk.getRevision() == new_chunk.getRevision()
+						&& memcmp(old_blocks.get(), new_blocks.get(), Chunk::SIZE) == 0;
+			}
+			if (!good)
+				LOG_ERROR(logger) << "Chunk (" << order[i] << ") of '" << filename << "' did not survive repacking";
 		}
-
-		_file_map_lock.unlockWrite();
-		_file_map_lock.lockRead();
-		iter = _file_map.find(rc);
 	}
 
-	return iter->second;
-}
+	if (good)
+		good = new_file.sync();
+	stats->file_bytes_after = new_file.getFileSize();
+	stats->used_bytes_after = new_file.getUsedChunkBytes();
+	stats->total_bytes_after = new_file.getTotalChunkBytes();
+	old_file.close();
+	new_file.close();
 
-// the caller of this function needs to hold a write-lock
-void ChunkArchive::unsafe_addArchiveFile(vec3i64 rc) {
-	unsafe_clean(seconds(10));
-	char buffer[200];
-	sprintf(buffer, "%" PRId64 "_%" PRId64 "_%" PRId64 ".region",
-			rc[0], rc[1], rc[2]);
-	std::string filename = _path + std::string(buffer);
-	ArchiveFile *archive_file = new ArchiveFile(filename.c_str(), REGION_SIZE);
-	_file_map.insert({rc, archive_file});
-}
-
-// the caller of this function needs to hold a write lock
-void ChunkArchive::unsafe_clean(Time t) {
-	int num_cleaned = 0;
-	Time now = getCurrentTime();
-	auto iter = _file_map.begin();
-	while (iter != _file_map.end()) {
-		bool should_delete = now - iter->second->getLastAccess() > t;
-		if (should_delete) {
-			delete iter->second;
-			iter = _file_map.erase(iter);
-			++num_cleaned;
-		} else {
-			++iter;
+	if (good) {
+		boost::filesystem::rename(temp_filename, filename, ec);
+		if (ec) {
+			LOG_ERROR(logger) << "Could not replace '" << filename << "': " << ec.message();
+			good = false;
 		}
 	}
-	if (num_cleaned)
-		LOG_DEBUG(logger) << "Cleaned " << num_cleaned << " file handles";
+	if (!good) {
+		boost::filesystem::remove(temp_filename, ec);
+		stats->file_bytes_after = stats->file_bytes_before;
+		stats->used_bytes_after = stats->used_bytes_before;
+		stats->total_bytes_after = stats->total_bytes_before;
+	}
+	return good;
 }
@@ -1,23 +1,87 @@
 #ifndef CHUNK_ARCHIVE_HPP_
 #define CHUNK_ARCHIVE_HPP_
 
-#include <fstream>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
 #include "engine/vmath.hpp"
 #include "engine/macros.hpp"
 #include "engine/time.hpp"
-#include "engine/rwlock.hpp"
+#include "engine/mutex.hpp"
+
+#include "archive_storage.hpp"
 
 #include "game/chunk.hpp"
 
-class ArchiveFile;
+class ChunkBackend;
+class ContentStore;
+class WorldGenerator;
+
+enum class ArchiveCompression {
+	// run-length encoding only, cheapest to load and store
+	RLE,
+	// zlib on top of run-length encoding, for worlds limited by disk space or bandwidth
+	ZLIB,
+};
+
+enum class ArchivePolicy {
+	// store every chunk in full
+	FULL,
+	// store only edits to what the world generator produces, loading costs a generator run
+	DIFF,
+};
+
+enum class ArchiveBackend {
+	// a file per region, chunks are updated in place
+	REGIONS,
+	// chunks are appended to a log of segment files and merged in the background
+	LOG,
+};
+
+struct ArchiveConf {
+	ArchiveBackend backend = ArchiveBackend::REGIONS;
+	ArchiveIO io = ArchiveIO::MMAP;
+	ArchivePolicy policy = ArchivePolicy::FULL;
+	ArchiveCompression compression = ArchiveCompression::RLE;
+	// zlib level from 1 (fast) to 9 (small)
+	int compression_level = 6;
+	// region files get compacted once this fraction of their chunk heap is unused
+	float compaction_threshold = 0.25f;
+	// wait for every batch of stored chunks to reach the disk before continuing
+	bool sync = false;
+	// threads a chunk manager loads and stores chunks with, regions are spread over them
+	int io_threads = 4;
+	// region files kept open at once, the least recently used one is closed to make room
+	int max_open_regions = 64;
+	// memory all open region directories may use together, can lower max_open_regions
+	size_t max_directory_bytes = 8 * 1024 * 1024;
+	// open regions in the background once chunks close to their border are accessed
+	bool prefetch = true;
+	// chunks encoded to the same bytes share one copy in the world's content store
+	bool deduplicate = true;
+	// the log backend starts a new segment once the current one grew this large
+	size_t log_segment_bytes = 32 * 1024 * 1024;
+	// the log backend merges segments once this fraction of them is overwritten chunks
+	float log_merge_threshold = 0.5f;
+};
+
+// sizes of a region file before and after ChunkArchive::repackRegion
+struct RegionRepackStats {
+	size_t chunks = 0;
+	size_t file_bytes_before = 0;
+	size_t used_bytes_before = 0;
+	size_t total_bytes_before = 0;
+	size_t file_bytes_after = 0;
+	size_t used_bytes_after = 0;
+	size_t total_bytes_after = 0;
+};
 
 class ChunkArchive {
 public:
 	~ChunkArchive();
-	ChunkArchive(const char *);
+	ChunkArchive(const char *, const ArchiveConf & = ArchiveConf(),
+			std::unique_ptr<WorldGenerator> generator = nullptr);
 
 	ChunkArchive() = delete;
 	ChunkArchive(const ChunkArchive &) = delete;
@@ -31,35 +95,109 @@ public:
 		If a chunk exists and revision is not nullptr, the current revision of the chunk is written
 		to the address pointed to by revision.
 
-		Calling any number of instances of this function and up to one instance of either
-		loadChunk or storeChunk concurrently is safe.
+		Calling this function concurrently to any of the others is safe.
 	*/
 	bool hasChunk(vec3i64, uint32 *revision = nullptr);
 
 	/** Load and store chunks
 
-		Calling any number of instances of hasChunk concurrently to these functions is safe.  
-		However, calling more than one instance of either loadChunk or storeChunk concurrently
-		is NOT safe.  Only one thread should ever make calls to these functions.
+		With ArchiveBackend::REGIONS, every region file has its own lock, so calls concerning
+		different regions run in parallel while calls concerning the same region wait for each
+		other.  With ArchiveBackend::LOG, loads run in parallel and stores wait for each other.
+		hasChunk never waits for them.
+
+		With ArchivePolicy::DIFF, chunks that were never edited (revision 0) are not stored at
+		all and the caller has to generate them again.
 	*/
 	bool loadChunk(Chunk *);
 	void storeChunk(const Chunk &);
 
+	/** Store many chunks at once
+
+		Chunks of the same region share a single heap write and a single directory write.
+		The heap data is always written to unused blocks and reaches the file before the
+		directory points to it, so a crash leaves every chunk either in its old or its new
+		state.  With ArchiveConf::sync, both writes are synced to the disk as well.  Locks one
+		region at a time, like storeChunk.  The log backend appends the whole batch with a
+		single write.
+	*/
+	void storeChunks(const std::vector<const Chunk *> &);
+
+	/** Load many chunks at once
+
+		The region backend reads all chunks of a region with one batch of reads, which
+		uses io_uring where the kernel has it (see ArchiveStorage::readBatch).  Chunks
+		that loadChunk would return false for stay uninitialized.
+	*/
+	void loadChunks(const std::vector<Chunk *> &);
+
+	/** Moves chunks into unused space of fragmented region files
+
+		Only does a small amount of work per call, so it can be called whenever there is
+		nothing else to do.  Regions another thread is busy with are skipped.  Once there is
+		nothing to move, the open region files are synced and the shared chunks they let go
+		of are freed.  The log backend merges the live chunks of its emptiest segment into the
+		current one instead.  Returns false if there was nothing to compact.
+	*/
+	bool compact();
+
+	/** Frees shared chunks that no region file references anymore
+
+		Counts the references in every region file, which takes a while and blocks all other
+		calls.  Only needed after crashes or replacing region files, otherwise unreferenced
+		chunks are freed right away with ArchiveConf::sync and else by compact once the region
+		files were synced, at the latest when the archive is closed.  Returns the number of
+		freed chunks, always 0 for the log backend, which doesn't share chunks.
+	*/
+	size_t collectGarbage();
+
 	/** Closes all file handles that were not used recently
 
+		Not needed to limit the number of handles, ChunkArchive never keeps more open than
+		ArchiveConf::max_open_regions and ArchiveConf::max_directory_bytes allow.
+
 		E.g. clean(seconds(1)) closes all handles that were not accessed for more than one second
 		and clean() closes all file handles.
 	*/
 	void clean(Time t = 0);
 
-private:
-	ArchiveFile *unsafe_getArchiveFile(vec3i64);
-	void unsafe_addArchiveFile(vec3i64);
-	void unsafe_clean(Time t = 0);
+	const ArchiveConf &getConf() const { return _conf; }
+	// nullptr unless ArchiveConf::deduplicate is set and the backend stores regions
+	ContentStore *getContentStore();
+	// files the backend holds open, region files or log segments
+	size_t getNumOpenRegions();
+
+	static const uint REGION_SIZE = 16;
+
+	// coordinates of the region file a chunk is stored in
+	static vec3i64 getRegionCoords(vec3i64);
+	// all chunks a region file can hold, in Morton order of their place in the file
+	static std::vector<vec3i64> getRegionChunks(vec3i64 rc);
+	// every region that has a stored chunk
+	std::vector<vec3i64> getRegions();
+	// returns false if filename is not the name of a region file
+	static bool parseRegionFilename(const std::string &filename, vec3i64 *rc);
+
+	/** Rewrites a region file without any unused heap space
+
+		Every chunk is encoded again according to conf, except that it gets the smaller of its
+		encodings with and without zlib whatever compression conf asks for.  Diffs are only
+		tried with ArchivePolicy::DIFF.  The chunks are laid out in Morton order of their
+		position within the region, so neighboring chunks are read sequentially.  The new file
+		replaces the old one only after every chunk was read back from it and compared to the
+		original.  No ChunkArchive may use the region meanwhile.  Returns false if the file was
+		left as it was because of an error.
+
+		The references the old file held to content_store are not released, collectGarbage
+		takes care of them once all regions are repacked.
+	*/
+	static bool repackRegion(const char *filename, vec3i64 rc, const ArchiveConf &conf,
+			WorldGenerator *generator, Mutex *generator_lock, ContentStore *content_store,
+			RegionRepackStats *stats);
 
-	std::string _path;
-	std::unordered_map<vec3i64, ArchiveFile *, size_t(*)(vec3i64)> _file_map;
-	ReadWriteLock _file_map_lock;
+private:
+	ArchiveConf _conf;
+	std::unique_ptr<ChunkBackend> _backend;
 };
 
 #endif // CHUNK_ARCHIVE_HPP_
@@ -0,0 +1,42 @@
+#ifndef CHUNK_BACKEND_HPP_
+#define CHUNK_BACKEND_HPP_
+
+#include <vector>
+
+#include "engine/vmath.hpp"
+#include "engine/time.hpp"
+
+#include "game/chunk.hpp"
+
+class ContentStore;
+
+/** How a ChunkArchive keeps its chunks on the disk
+
+	ChunkArchive forwards every call to its backend, see there for what the
+	functions have to do.  All of them may be called concurrently.
+*/
+class ChunkBackend {
+public:
+	virtual ~ChunkBackend() = default;
+
+	virtual bool hasChunk(vec3i64, uint32 *revision) = 0;
+	virtual bool loadChunk(Chunk *) = 0;
+	virtual void storeChunk(const Chunk &) = 0;
+	virtual void storeChunks(const std::vector<const Chunk *> &) = 0;
+	virtual void loadChunks(const std::vector<Chunk *> &chunks) {
+		for (Chunk *chunk : chunks)
+			loadChunk(chunk);
+	}
+
+	// returns false if there was nothing to do
+	virtual bool compact() = 0;
+	virtual size_t collectGarbage() { return 0; }
+	virtual void clean(Time t) = 0;
+
+	virtual ContentStore *getContentStore() { return nullptr; }
+	virtual size_t getNumOpenFiles() = 0;
+	// every region that has a stored chunk, in no particular order
+	virtual std::vector<vec3i64> getRegions() = 0;
+};
+
+#endif // CHUNK_BACKEND_HPP_
@@ -1,190 +1,318 @@
 #include "chunk_compression.hpp"
 
+#include <algorithm>
 #include <cstring>
 
+#include <zlib.h>
+
 #include "shared/game/chunk.hpp"
 
 #include "shared/engine/logging.hpp"
+#include "shared/engine/math.hpp"
 
 static logging::Logger logger("io");
 
 static const uint8 ESCAPE_CHAR = (uint8) (-1);
 
-void decodeBlocks_RLE(std::istream *is, uint8 *blocks) {
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define RLE_SSE2
+	#include <emmintrin.h>
+	#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		#define RLE_AVX2
+		#include <immintrin.h>
+	#endif
+#endif
+
+// returns the first index after begin with a different block than blocks[begin], or end
+typedef size_t (*FindRunEndFunc)(const uint8 *blocks, size_t begin, size_t end);
+
+static size_t findRunEnd_scalar(const uint8 *blocks, size_t begin, size_t end) {
+	const uint8 type = blocks[begin];
+	size_t i = begin + 1;
+	while (i < end && blocks[i] == type)
+		++i;
+	return i;
+}
+
+#ifdef RLE_SSE2
+static size_t findRunEnd_sse2(const uint8 *blocks, size_t begin, size_t end) {
+	const uint8 type = blocks[begin];
+	const __m128i pattern = _mm_set1_epi8((char) type);
+	size_t i = begin + 1;
+	for (; i + 16 <= end; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (blocks + i));
+		uint32 mask = (uint32) _mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern));
+		if (mask != 0xFFFF)
+			return i + countTrailingZeros(~mask);
+	}
+	while (i < end && blocks[i] == type)
+		++i;
+	return i;
+}
+#endif
+
+#ifdef RLE_AVX2
+__attribute__((target("avx2")))
+static size_t findRunEnd_avx2(const uint8 *blocks, size_t begin, size_t end) {
+	const uint8 type = blocks[begin];
+	const __m256i pattern = _mm256_set1_epi8((char) type);
+	size_t i = begin + 1;
+	for (; i + 32 <= end; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (blocks + i));
+		uint32 mask = (uint32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+		if (mask != 0xFFFFFFFFu)
+			return i + countTrailingZeros(~mask);
+	}
+	while (i < end && blocks[i] == type)
+		++i;
+	return i;
+}
+#endif
+
+static FindRunEndFunc getRunFinder(RunFinder runFinder) {
+	switch (runFinder) {
+	case RUN_FINDER_SCALAR:
+		return findRunEnd_scalar;
+#ifdef RLE_SSE2
+	case RUN_FINDER_SSE2:
+		return findRunEnd_sse2;
+#endif
+#ifdef RLE_AVX2
+	case RUN_FINDER_AVX2:
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			return findRunEnd_avx2;
+		return nullptr;
+#endif
+	case RUN_FINDER_BEST:
+		if (FindRunEndFunc func = getRunFinder(RUN_FINDER_AVX2))
+			return func;
+		if (FindRunEndFunc func = getRunFinder(RUN_FINDER_SSE2))
+			return func;
+		return findRunEnd_scalar;
+	default:
+		return nullptr;
+	}
+}
+
+static FindRunEndFunc findRunEnd = getRunFinder(RUN_FINDER_BEST);
+
+bool selectRunFinder(RunFinder runFinder) {
+	FindRunEndFunc func = getRunFinder(runFinder);
+	if (!func)
+		return false;
+	findRunEnd = func;
+	return true;
+}
+
+/* Reads encoded blocks from memory
+
+	Literal blocks are copied in one go up to the next ESCAPE_CHAR.
+*/
+class BufferSource {
+	const uint8 *encoded;
+	size_t size;
+
+public:
+	BufferSource(const uint8 *encoded, size_t size) : encoded(encoded), size(size) {}
+
+	bool peek(uint8 *byte) {
+		if (size < 1)
+			return false;
+		*byte = *encoded;
+		return true;
+	}
+
+	bool next(uint8 *byte) {
+		if (size < 1)
+			return false;
+		*byte = *encoded++;
+		size--;
+		return true;
+	}
+
+	size_t readLiterals(uint8 *blocks, size_t maxBlocks) {
+		size_t n = std::min(size, maxBlocks);
+		const void *escape = memchr(encoded, ESCAPE_CHAR, n);
+		if (escape)
+			n = (const uint8 *) escape - encoded;
+		memcpy(blocks, encoded, n);
+		encoded += n;
+		size -= n;
+		return n;
+	}
+};
+
+/* Reads encoded blocks from a stream
+
+	Goes through the stream buffer directly, so we don't pay for a sentry per
+	byte and never read beyond the encoded blocks.
+*/
+class StreamSource {
+	std::istream *is;
+	std::streambuf *sb;
+
+	bool fail() {
+		is->setstate(std::ios_base::eofbit | std::ios_base::failbit);
+		return false;
+	}
+
+public:
+	StreamSource(std::istream *is) : is(is), sb(is->rdbuf()) {}
+
+	bool peek(uint8 *byte) {
+		if (!is->good())
+			return false;
+		int c = sb->sgetc();
+		if (c == std::char_traits<char>::eof())
+			return fail();
+		*byte = (uint8) c;
+		return true;
+	}
+
+	bool next(uint8 *byte) {
+		if (!is->good())
+			return false;
+		int c = sb->sbumpc();
+		if (c == std::char_traits<char>::eof())
+			return fail();
+		*byte = (uint8) c;
+		return true;
+	}
+
+	size_t readLiterals(uint8 *blocks, size_t maxBlocks) {
+		size_t n = 0;
+		while (n < maxBlocks) {
+			int c = sb->sgetc();
+			if (c == std::char_traits<char>::eof() || (uint8) c == ESCAPE_CHAR)
+				break;
+			blocks[n++] = (uint8) c;
+			sb->sbumpc();
+		}
+		return n;
+	}
+};
+
+template <typename Source>
+static bool decodeBlocks_RLE(Source &source, uint8 *blocks) {
 	size_t index = 0;
 	while (index < Chunk::SIZE) {
 		uint8 next_block;
-		if (!is->good()) {
+		if (!source.peek(&next_block)) {
 			LOG_ERROR(logger) << "encoded stream ended abruptly";
-			return;
+			return false;
 		}
-		is->read((char *) &next_block, sizeof (uint8));
 
-		if (next_block == ESCAPE_CHAR) {
-			uint8 next_byte, block_type;
-			uint32 run_length;
-			if (!is->good()) {
-				LOG_ERROR(logger) << "encoded stream ended abruptly";
-				return;
-			}
-			is->read((char *) &next_byte, sizeof (uint8));
-
-			// Like UTF8, the first bit signals a multi-byte sequence
-			if ((next_byte & 0x80) == 0) {
-				// This is the only byte
-				run_length = next_byte;
-			} else {
-				// There is exactly one extra byte, the other 7 bits can be used for the value
-				uint32 encoded_run_length = next_byte & 0x7F;
-				if (!is->good()) {
-					LOG_ERROR(logger) << "encoded stream ended abruptly";
-					return;
-				}
-				is->read((char *) &next_byte, sizeof (uint8));
-				encoded_run_length = (encoded_run_length << 8) | next_byte;
-				// we count from 1 and not from 0 to save space
-				run_length = encoded_run_length + 1;
-			}
+		if (next_block != ESCAPE_CHAR) {
+			index += source.readLiterals(blocks + index, Chunk::SIZE - index);
+			continue;
+		}
+		source.next(&next_block);
+
+		uint8 next_byte, block_type;
+		uint32 run_length;
+		if (!source.next(&next_byte)) {
+			LOG_ERROR(logger) << "encoded stream ended abruptly";
+			return false;
+		}
 
-			if (!is->good()) {
+		// Like UTF8, the first bit signals a multi-byte sequence
+		if ((next_byte & 0x80) == 0) {
+			// This is the only byte
+			run_length = next_byte;
+		} else {
+			// There is exactly one extra byte, the other 7 bits can be used for the value
+			uint32 encoded_run_length = next_byte & 0x7F;
+			if (!source.next(&next_byte)) {
 				LOG_ERROR(logger) << "encoded stream ended abruptly";
-				return;
-			}
-			is->read((char *) &block_type, sizeof (uint8));
-			for (uint32 i = 0; i < run_length; ++i) {
-				if (index >= Chunk::SIZE) {
-					LOG_ERROR(logger) << "Block data exceeded Chunk size";
-					break;
-				}
-				blocks[index++] = block_type;
+				return false;
 			}
-		} else {
-			blocks[index++] = next_block;
+			encoded_run_length = (encoded_run_length << 8) | next_byte;
+			// we count from 1 and not from 0 to save space
+			run_length = encoded_run_length + 1;
 		}
-	}
-}
 
-void decodeBlocks_RLE(const uint8 *encoded, size_t size, uint8 *blocks) {
-	size_t index = 0;
-	while (index < Chunk::SIZE) {
-		uint8 next_block;
-		if (size < 1) {
+		if (!source.next(&block_type)) {
 			LOG_ERROR(logger) << "encoded stream ended abruptly";
-			return;
+			return false;
 		}
-		next_block = *encoded;
-		encoded++;
-		size--;
+		if (run_length > Chunk::SIZE - index) {
+			LOG_ERROR(logger) << "Block data exceeded Chunk size";
+			memset(blocks + index, block_type, Chunk::SIZE - index);
+			return false;
+		}
+		memset(blocks + index, block_type, run_length);
+		index += run_length;
+	}
+	return true;
+}
 
-		if (next_block == ESCAPE_CHAR) {
-			uint8 next_byte, block_type;
-			uint32 run_length;
-			if (size < 1) {
-				LOG_ERROR(logger) << "encoded stream ended abruptly";
-				return;
-			}
-			next_byte = *encoded;
-			encoded++;
-			size--;
-
-			// Like UTF8, the first bit signals a multi-byte sequence
-			if ((next_byte & 0x80) == 0) {
-				// This is the only byte
-				run_length = next_byte;
-			} else {
-				// There is exactly one extra byte, the other 7 bits can be used for the value
-				uint32 encoded_run_length = next_byte & 0x7F;
-				if (size < 1) {
-					LOG_ERROR(logger) << "encoded stream ended abruptly";
-					return;
-				}
-				next_byte = *encoded;
-				encoded++;
-				size--;
-				encoded_run_length = (encoded_run_length << 8) | next_byte;
-				// we count from 1 and not from 0 to save space
-				run_length = encoded_run_length + 1;
-			}
+bool decodeBlocks_RLE(std::istream *is, uint8 *blocks) {
+	StreamSource source(is);
+	return decodeBlocks_RLE(source, blocks);
+}
 
-			if (size < 1) {
-				LOG_ERROR(logger) << "encoded stream ended abruptly";
-				return;
-			}
-			block_type = *encoded;
-			encoded++;
-			size--;
-			for (uint32 i = 0; i < run_length; ++i) {
-				if (index >= Chunk::SIZE) {
-					LOG_ERROR(logger) << "Block data exceeded Chunk size";
-					break;
-				}
-				blocks[index++] = block_type;
-			}
+bool decodeBlocks_RLE(const uint8 *encoded, size_t size, uint8 *blocks) {
+	BufferSource source(encoded, size);
+	return decodeBlocks_RLE(source, blocks);
+}
+
+// appends a single run to the buffer, returns false if it doesn't fit
+static bool writeRun(uint8 *&head, const uint8 *buffer_end, uint8 type, size_t length) {
+	size_t space = buffer_end - head;
+	if (length > 3 || type == ESCAPE_CHAR) {
+		if (length < 0x80) {
+			if (space < 3)
+				return false;
+			*head++ = ESCAPE_CHAR;
+			*head++ = length & 0xFF;
+			*head++ = type;
 		} else {
-			blocks[index++] = next_block;
+			// we count from 1 and not from 0 to save space
+			size_t encoded_run_length = length - 1;
+			if (space < 4)
+				return false;
+			*head++ = ESCAPE_CHAR;
+			*head++ = ((encoded_run_length >> 8) & 0xFF) | 0x80;
+			*head++ = encoded_run_length & 0xFF;
+			*head++ = type;
 		}
+	} else {
+		if (space < length)
+			return false;
+		for (size_t j = 0; j < length; ++j)
+			*head++ = type;
 	}
+	return true;
 }
 
 int encodeBlocks_RLE(const uint8 *blocks, uint8 *buffer, size_t size) {
-	uint8 cur_run_type = blocks[0];
-	size_t cur_run_length = 1;
+	const uint8 *const buffer_end = buffer + size;
+	const size_t num_blocks = std::min(size, (size_t) Chunk::SIZE);
 	uint8 *head = buffer;
 
-	auto finishRun = [&]() -> int {
-		if (cur_run_length == 0)
-			return 0;
-		if (cur_run_length > 3 || cur_run_type == ESCAPE_CHAR) {
-			if (cur_run_length < 0x80) {
-				if ((uint) (head - buffer) + 3u <= size) {
-					*head++ = ESCAPE_CHAR;
-					*head++ = cur_run_length & 0xFF;
-					*head++ = cur_run_type;
-				} else {
-					return -1;
-				}
-			} else {
-				// we count from 1 and not from 0 to save space
-				size_t encoded_run_length = cur_run_length - 1;
-				if ((uint) (head - buffer) + 4u <= size) {
-					*head++ = ESCAPE_CHAR;
-					*head++ = (encoded_run_length >> 8) & 0xFF | 0x80;
-					*head++ = encoded_run_length & 0xFF;
-					*head++ = cur_run_type;
-				} else {
-					return -1;
-				}
-			}
-		} else {
-			if (head - buffer + cur_run_length <= size) {
-				for (size_t j = 0; j < cur_run_length; ++j)
-					*head++ = cur_run_type;
-			} else {
-				return -1;
-			}
-		}
-		return 0;
-	};
-
-	for (size_t i = 1; i < size; ++i) {
-		uint8 next_block = blocks[i];
-		if (cur_run_length >= 0x8000) {
-			if (finishRun() != 0)
-				return (int)(head - buffer);
-			cur_run_length = 0;
-		}
-		if (cur_run_type == next_block) {
-			cur_run_length++;
-		} else {
-			if (finishRun() != 0)
-				return (int)(head - buffer);
-			cur_run_type = next_block;
-			cur_run_length = 1;
+	size_t i = 0;
+	while (i < num_blocks) {
+		const uint8 type = blocks[i];
+		size_t run_end;
+		// most runs in noisy terrain are single blocks, don't bother the run finder with them
+		if (i + 1 < num_blocks && blocks[i + 1] != type)
+			run_end = i + 1;
+		else
+			run_end = findRunEnd(blocks, i, num_blocks);
+
+		// the run length needs to fit into 15 bits
+		size_t length = run_end - i;
+		while (length > 0) {
+			size_t part = std::min(length, (size_t) 0x8000);
+			if (!writeRun(head, buffer_end, type, part))
+				return (int) (head - buffer);
+			length -= part;
 		}
+		i = run_end;
 	}
 
-	finishRun();
-	return (int)(head - buffer);
+	return (int) (head - buffer);
 }
 
 void decodeBlocks_PLAIN(std::istream *is, uint8 *blocks) {
@@ -196,3 +324,93 @@ int encodeBlocks_PLAIN(const uint8 *blocks, uint8 *buffer, size_t size) {
 	memcpy(buffer, blocks, actual_size);
 	return (int) actual_size;
 }
+
+bool decodeBlocks_DIFF(const uint8 *encoded, size_t size, uint8 *blocks) {
+	if (size < 2) {
+		LOG_ERROR(logger) << "encoded stream ended abruptly";
+		return false;
+	}
+	uint16 num_edits;
+	memcpy(&num_edits, encoded, sizeof(uint16));
+	if (size < 2 + 3 * (size_t) num_edits) {
+		LOG_ERROR(logger) << "encoded stream ended abruptly";
+		return false;
+	}
+	const uint8 *edit = encoded + 2;
+	for (uint i = 0; i < num_edits; ++i, edit += 3) {
+		uint16 index;
+		memcpy(&index, edit, sizeof(uint16));
+		if (index >= Chunk::SIZE) {
+			LOG_ERROR(logger) << "Block data exceeded Chunk size";
+			return false;
+		}
+		blocks[index] = edit[2];
+	}
+	return true;
+}
+
+int encodeBlocks_DIFF(const uint8 *blocks, const uint8 *base, uint8 *buffer, size_t size) {
+	if (size < 2)
+		return -1;
+	uint8 *head = buffer + 2;
+	const uint8 *const buffer_end = buffer + size;
+	uint num_edits = 0;
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (blocks[i] == base[i])
+			continue;
+		if (buffer_end - head < 3)
+			return -1;
+		uint16 index = (uint16) i;
+		memcpy(head, &index, sizeof(uint16));
+		head[2] = blocks[i];
+		head += 3;
+		num_edits++;
+	}
+	// Chunk::SIZE edits still fit into 16 bits
+	uint16 encoded_num_edits = (uint16) num_edits;
+	memcpy(buffer, &encoded_num_edits, sizeof(uint16));
+	return (int) (head - buffer);
+}
+
+int decodeBytes_ZLIB(const uint8 *encoded, size_t size, uint8 *buffer, size_t buffer_size) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (inflateInit(&stream) != Z_OK) {
+		LOG_ERROR(logger) << "zlib could not be initialized";
+		return -1;
+	}
+	stream.next_in = (Bytef *) encoded;
+	stream.avail_in = (uInt) size;
+	stream.next_out = buffer;
+	stream.avail_out = (uInt) buffer_size;
+
+	int ret = inflate(&stream, Z_FINISH);
+	int bytes_written = (int) stream.total_out;
+	inflateEnd(&stream);
+	if (ret != Z_STREAM_END) {
+		LOG_ERROR(logger) << "zlib stream was corrupt (" << ret << ")";
+		return -1;
+	}
+	return bytes_written;
+}
+
+int encodeBytes_ZLIB(const uint8 *data, size_t size, uint8 *buffer, size_t buffer_size, int level) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit(&stream, level) != Z_OK) {
+		LOG_ERROR(logger) << "zlib could not be initialized with level " << level;
+		return -1;
+	}
+	stream.next_in = (Bytef *) data;
+	stream.avail_in = (uInt) size;
+	stream.next_out = buffer;
+	stream.avail_out = (uInt) buffer_size;
+
+	int ret = deflate(&stream, Z_FINISH);
+	int bytes_written = (int) stream.total_out;
+	deflateEnd(&stream);
+	// the buffer was too small, this is not an error, the data just didn't compress well
+	if (ret != Z_STREAM_END)
+		return -1;
+	return bytes_written;
+}
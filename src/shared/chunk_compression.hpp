@@ -5,10 +5,52 @@
 
 #include "shared/engine/std_types.hpp"
 
-void decodeBlocks_RLE(std::istream *is, uint8 *blocks);
-void decodeBlocks_RLE(const uint8 *encoded, size_t size, uint8 *blocks);
+// returns false if the encoded blocks end too early or don't fit into a chunk
+bool decodeBlocks_RLE(std::istream *is, uint8 *blocks);
+bool decodeBlocks_RLE(const uint8 *encoded, size_t size, uint8 *blocks);
+/* Encodes the first size blocks, but at most a chunk, into a buffer of size bytes
+
+	Once the buffer is full the encoding just stops, which looks like a complete
+	one.  With escape characters a chunk can take more than Chunk::SIZE bytes,
+	with a buffer of Chunk::SIZE + 4 bytes every encoding that was cut off is
+	longer than Chunk::SIZE.
+*/
 int encodeBlocks_RLE(const uint8 *blocks, uint8 *, size_t);
+/* RLE encoding finds runs with vector compares when the CPU supports it
+
+	All run finders produce exactly the same output, selecting one is only
+	useful for testing and benchmarking.  RUN_FINDER_BEST picks the fastest
+	one available, which is also the default.
+*/
+enum RunFinder {
+	RUN_FINDER_SCALAR,
+	RUN_FINDER_SSE2,
+	RUN_FINDER_AVX2,
+	RUN_FINDER_BEST,
+};
+
+// returns false and leaves the current run finder in place if the CPU can't run it
+bool selectRunFinder(RunFinder);
+
 void decodeBlocks_PLAIN(std::istream *is, uint8 *blocks);
 int encodeBlocks_PLAIN(const uint8 *blocks, uint8 *, size_t);
 
+/* Edit lists against a base chunk, usually the one the world generator produces
+
+	The encoding is the number of edits followed by (index, type) pairs.  Encoding
+	returns -1 if the edits don't fit into the buffer, decoding applies the edits
+	to blocks, which have to contain the base chunk already.
+*/
+bool decodeBlocks_DIFF(const uint8 *encoded, size_t size, uint8 *blocks);
+int encodeBlocks_DIFF(const uint8 *blocks, const uint8 *base, uint8 *, size_t);
+
+/* General purpose compression on top of the block encodings
+
+	These work on the output of the block encoders rather than on blocks.  Both
+	return the number of bytes written to the buffer or -1 if it was too small
+	or the data was corrupt.
+*/
+int decodeBytes_ZLIB(const uint8 *encoded, size_t size, uint8 *buffer, size_t buffer_size);
+int encodeBytes_ZLIB(const uint8 *data, size_t size, uint8 *buffer, size_t buffer_size, int level);
+
 #endif // CHUNK_COMPRESSION_HPP_
@@ -0,0 +1,163 @@
+#include "chunk_encoder.hpp"
+
+#include <cstring>
+
+#include "engine/logging.hpp"
+
+#include "game/world_generator.hpp"
+
+#include "chunk_compression.hpp"
+
+static logging::Logger logger("io");
+
+// the number of units of granularity bytes it takes to store size bytes
+static uint getUnits(int size, uint granularity) {
+	return ((uint)size - 1) / granularity + 1;
+}
+
+ChunkEncoder::ChunkEncoder(const ArchiveConf &conf, WorldGenerator *generator,
+		Mutex *generator_lock) :
+	_conf(conf), _generator(generator), _generator_lock(generator_lock)
+{
+	// nothing
+}
+
+int ChunkEncoder::encode(const Chunk &chunk, uint16 *flags, uint16 *visibility,
+		uint8 *uniform_type, uint8 *buffer, uint granularity) {
+	*visibility = 0;
+	*uniform_type = 0;
+
+	if (chunk.isEmpty()) {
+		*flags = LAYOUT_EMPTY;
+		return 0;
+	}
+
+	if (chunk.isUniform()) {
+		*uniform_type = chunk.getUniformType();
+		*flags = LAYOUT_UNIFORM;
+		return 0;
+	}
+
+	_blocks_buffer.resize(Chunk::SIZE);
+	uint8 *const blocks = _blocks_buffer.data();
+	chunk.getBlocks(blocks);
+
+	// the extra bytes tell encodings that grew beyond a chunk from those that just fit
+	int bytes_written = encodeBlocks_RLE(blocks, buffer, Chunk::SIZE + 4);
+	if (bytes_written <= 0)
+		return -1;
+	uint16 layout = LAYOUT_RLE;
+
+	// use plain encoding if we didn't compress the chunk enough
+	if (getUnits(bytes_written, granularity) >= getUnits(Chunk::SIZE, granularity)) {
+		bytes_written = encodeBlocks_PLAIN(blocks, buffer, Chunk::SIZE);
+		if (bytes_written <= 0)
+			return -1;
+		layout = LAYOUT_PLAIN;
+	}
+
+	bytes_written = compress(buffer, bytes_written, &layout, granularity);
+
+	// store only the edits if they end up smaller, compressed or not
+	if (_conf.policy == ArchivePolicy::DIFF && _generator) {
+		_base_buffer.resize(Chunk::SIZE);
+		generateBlocks(chunk.getCC(), _base_buffer.data());
+		_diff_buffer.resize(Chunk::SIZE + 4);
+		// without zlib, edits that take more bytes can stop early
+		size_t limit = _conf.compression == ArchiveCompression::ZLIB ? Chunk::SIZE : bytes_written - 1;
+		int diff_size = encodeBlocks_DIFF(blocks, _base_buffer.data(), _diff_buffer.data(), limit);
+		uint16 diff_layout = LAYOUT_DIFF;
+		if (diff_size > 0)
+			diff_size = compress(_diff_buffer.data(), diff_size, &diff_layout, granularity);
+		if (diff_size > 0 && diff_size < bytes_written) {
+			memcpy(buffer, _diff_buffer.data(), diff_size);
+			bytes_written = diff_size;
+			layout = diff_layout;
+		}
+	}
+	*flags = layout;
+
+	if (chunk.isVisual()) {
+		*flags |= LAYOUT_VISIBILITY;
+		*visibility = chunk.getPassThroughs();
+	}
+	return bytes_written;
+}
+
+bool ChunkEncoder::decode(Chunk *chunk, uint16 flags, uint16 visibility, uint8 uniform_type,
+		const uint8 *data, size_t size) {
+	vec3i64 cc = chunk->getCC();
+	if (flags == LAYOUT_EMPTY) {
+		chunk->initUniform(0);
+		chunk->finishInitialization();
+		return true;
+	} else if (flags == LAYOUT_UNIFORM) {
+		chunk->initUniform(uniform_type);
+		chunk->finishInitialization();
+		return true;
+	}
+
+	if (flags & LAYOUT_ZLIB) {
+		_scratch_buffer.resize(Chunk::SIZE);
+		int inflated_size = decodeBytes_ZLIB(data, size, _scratch_buffer.data(), _scratch_buffer.size());
+		if (inflated_size < 0) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") was corrupt";
+			return false;
+		}
+		data = _scratch_buffer.data();
+		size = inflated_size;
+	}
+
+	const uint encoding = flags & LAYOUT_ENC_MASK & ~LAYOUT_ZLIB;
+	if (encoding == LAYOUT_RLE) {
+		if (!decodeBlocks_RLE(data, size, chunk->getBlocksForInit())) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") was corrupt";
+			return false;
+		}
+	} else if (encoding == LAYOUT_PLAIN && size >= Chunk::SIZE) {
+		memcpy(chunk->getBlocksForInit(), data, Chunk::SIZE);
+	} else if (encoding == LAYOUT_DIFF && _generator) {
+		uint8 *blocks = chunk->getBlocksForInit();
+		generateBlocks(cc, blocks);
+		if (size > 0 && !decodeBlocks_DIFF(data, size, blocks)) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") was corrupt";
+			return false;
+		}
+	} else {
+		LOG_ERROR(logger) << "Chunk Layout " << flags << " unsupported";
+		return false;
+	}
+
+	if (flags & LAYOUT_VISIBILITY)
+		chunk->initPassThroughs(visibility);
+
+	chunk->finishInitialization();
+	return true;
+}
+
+void ChunkEncoder::generateBlocks(vec3i64 cc, uint8 *blocks) {
+	Chunk base;
+	base.initCC(cc);
+	if (_generator_lock) _generator_lock->lock();
+	_generator->generateChunk(&base);
+	if (_generator_lock) _generator_lock->unlock();
+	base.getBlocks(blocks);
+}
+
+/* Compresses encoded blocks with zlib if the configuration asks for it
+
+	The result is only kept if it takes fewer units of granularity bytes, then
+	LAYOUT_ZLIB is added to flags.  Returns the size of data afterwards.
+*/
+int ChunkEncoder::compress(uint8 *data, int size, uint16 *flags, uint granularity) {
+	if (_conf.compression != ArchiveCompression::ZLIB)
+		return size;
+	_scratch_buffer.resize(Chunk::SIZE + 4);
+	int compressed_size = encodeBytes_ZLIB(data, size,
+			_scratch_buffer.data(), Chunk::SIZE + 4, _conf.compression_level);
+	if (compressed_size <= 0 || getUnits(compressed_size, granularity) >= getUnits(size, granularity))
+		return size;
+	memcpy(data, _scratch_buffer.data(), compressed_size);
+	*flags |= LAYOUT_ZLIB;
+	return compressed_size;
+}
@@ -0,0 +1,77 @@
+#ifndef CHUNK_ENCODER_HPP_
+#define CHUNK_ENCODER_HPP_
+
+#include <vector>
+
+#include "engine/vmath.hpp"
+#include "engine/std_types.hpp"
+#include "engine/mutex.hpp"
+
+#include "chunk_archive.hpp"
+
+#include "game/chunk.hpp"
+
+class WorldGenerator;
+
+// how a chunk is encoded, region files and log records use the same bits
+enum ChunkLayout {
+	LAYOUT_PLAIN      = 0x0000,
+	LAYOUT_DIFF       = 0x0001,
+	LAYOUT_RLE        = 0x0002,
+	LAYOUT_ZLIB       = 0x0004,
+	LAYOUT_ENC_MASK   = 0x0007,
+	LAYOUT_VISIBILITY = 0x0008,
+	// the encoded chunk is in the content store, only region files use this
+	LAYOUT_SHARED     = 0x2000,
+	LAYOUT_UNIFORM    = 0x4000,
+	LAYOUT_EMPTY      = 0x8000,
+};
+
+/** Turns chunks into the bytes the archive backends store and back
+
+	Encoding picks the smallest of the encodings the configuration allows.
+	The encoder keeps its scratch space between calls, so every thread needs
+	its own.
+*/
+class ChunkEncoder {
+public:
+	ChunkEncoder(const ArchiveConf &, WorldGenerator *generator, Mutex *generator_lock);
+
+	ChunkEncoder(const ChunkEncoder &) = delete;
+	ChunkEncoder &operator = (const ChunkEncoder &) = delete;
+
+	/** Encodes the chunk into buffer, which has to hold Chunk::SIZE + 4 bytes
+
+		Fills in the layout and returns the number of bytes written, 0 if the
+		chunk doesn't need any and -1 on failure.  Sizes are compared in units
+		of granularity bytes, region files pass their heap block size.  An
+		empty edit list takes 2 bytes, the caller may drop those.
+	*/
+	int encode(const Chunk &, uint16 *flags, uint16 *visibility, uint8 *uniform_type,
+			uint8 *buffer, uint granularity = 1);
+
+	/** Initializes the blocks of the chunk, its revision has to be initialized already
+
+		An empty edit list may come without any data.  Returns false if the
+		data was corrupt or has a layout this encoder can't decode.
+	*/
+	bool decode(Chunk *, uint16 flags, uint16 visibility, uint8 uniform_type,
+			const uint8 *data, size_t size);
+
+	// writes the blocks the world generator makes for this chunk to blocks
+	void generateBlocks(vec3i64, uint8 *blocks);
+
+private:
+	int compress(uint8 *data, int size, uint16 *flags, uint granularity);
+
+	ArchiveConf _conf;
+	WorldGenerator *_generator;
+	Mutex *_generator_lock;
+
+	std::vector<uint8> _blocks_buffer;
+	std::vector<uint8> _base_buffer;
+	std::vector<uint8> _diff_buffer;
+	std::vector<uint8> _scratch_buffer;
+};
+
+#endif // CHUNK_ENCODER_HPP_
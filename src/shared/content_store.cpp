@@ -0,0 +1,396 @@
+#include "content_store.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <boost/filesystem.hpp>
+
+#include "engine/logging.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+static const char *INDEX_NAME = "content.index";
+static const char *HEAP_NAME = "content.heap";
+
+PACKED(
+struct ContentIndexHeader {
+	uint8 magic[4];
+	int32 endianess_bytes;
+	int32 version;
+	uint16 heap_block_size;
+	uint8 reserved[2];
+});
+
+static const uint8 INDEX_MAGIC[4] = { 0x59, 0x97, 0x22, 0xE2 };
+static const int32 INDEX_ENDIANESS_BYTES = 0x01020304;
+static const int32 INDEX_VERSION = 1;
+static const uint HEAP_BLOCK_SIZE = 256;
+
+// forgetting payloads we have seen only once is cheaper than remembering all of them
+static const size_t MAX_SEEN = 1 << 16;
+
+static uint64 hashBytes(const uint8 *data, size_t size) {
+	static const uint64 K1 = 0x9E3779B97F4A7C15ull;
+	static const uint64 K2 = 0xC2B2AE3D27D4EB4Full;
+	uint64 hash = size * K1;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64 word;
+		memcpy(&word, data + i, 8);
+		hash ^= word * K2;
+		hash = ((hash << 31) | (hash >> 33)) * K1;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ data[i]) * K1;
+	hash ^= hash >> 29;
+	hash *= K2;
+	return hash ^ (hash >> 32);
+}
+
+ContentStore::ContentStore(const std::string &path, ArchiveIO io, bool sync) :
+	_path(path), _io(io), _sync(sync)
+{
+	open(false);
+}
+
+/* Opens the files, unless they don't exist and create is false
+
+	The caller of this function needs to hold the lock, or be the
+	constructor.
+*/
+bool ContentStore::open(bool create) {
+	if (_index)
+		return true;
+	boost::system::error_code ec;
+	if (!create && !boost::filesystem::exists(_path + INDEX_NAME, ec))
+		return false;
+
+	_index = ArchiveStorage::create(_io);
+	_heap = ArchiveStorage::create(_io);
+	if (!_index->open((_path + INDEX_NAME).c_str()) || !_heap->open((_path + HEAP_NAME).c_str())) {
+		LOG_ERROR(logger) << "Could not open content store in '" << _path << "'";
+		_good = false;
+		return true;
+	}
+	if (_index->getSize() == 0)
+		initialize();
+	else
+		load();
+	return true;
+}
+
+void ContentStore::initialize() {
+	ContentIndexHeader header;
+	memset((char *) &header, 0, sizeof(ContentIndexHeader));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.endianess_bytes = INDEX_ENDIANESS_BYTES;
+	header.version = INDEX_VERSION;
+	header.heap_block_size = HEAP_BLOCK_SIZE;
+	if (!_index->write(0, &header, sizeof(ContentIndexHeader)) || !_heap->truncate(0)) {
+		LOG_ERROR(logger) << "Could not initialize content store in '" << _path << "'";
+		_good = false;
+	}
+}
+
+void ContentStore::load() {
+	ContentIndexHeader header;
+	if (_index->read(0, &header, sizeof(ContentIndexHeader)) < sizeof(ContentIndexHeader)
+			|| memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0
+			|| header.endianess_bytes != INDEX_ENDIANESS_BYTES
+			|| header.version != INDEX_VERSION
+			|| header.heap_block_size != HEAP_BLOCK_SIZE) {
+		LOG_ERROR(logger) << "Content store in '" << _path << "' had a bad header";
+		_good = false;
+		return;
+	}
+
+	// a torn write at the end of the index only loses the last entry
+	size_t num_entries = (_index->getSize() - sizeof(ContentIndexHeader)) / sizeof(IndexEntry);
+	_entries.resize(num_entries);
+	size_t bytes = num_entries * sizeof(IndexEntry);
+	if (_index->read(sizeof(ContentIndexHeader), _entries.data(), bytes) < bytes) {
+		LOG_ERROR(logger) << "Content store in '" << _path << "' ended abruptly";
+		_good = false;
+		return;
+	}
+
+	size_t heap_bytes = _heap->getSize();
+	for (uint32 id = 0; id < _entries.size(); ++id) {
+		IndexEntry &entry = _entries[id];
+		uint num_blocks = (entry.size + HEAP_BLOCK_SIZE - 1) / HEAP_BLOCK_SIZE;
+		if (entry.references == 0 || entry.size == 0
+				|| (size_t) entry.offset * HEAP_BLOCK_SIZE + entry.size > heap_bytes) {
+			memset((char *) &entry, 0, sizeof(IndexEntry));
+			_free_ids.push_back(id);
+			continue;
+		}
+		markBlocks(entry.offset, num_blocks, true);
+		_by_hash.insert({(uint64) entry.hash, id});
+	}
+	// ids are handed out from the back
+	std::reverse(_free_ids.begin(), _free_ids.end());
+}
+
+bool ContentStore::acquire(const uint8 *data, size_t size, uint64 owner, uint32 *id) {
+	if (!_good || size == 0)
+		return false;
+	uint64 hash = hashBytes(data, size);
+
+	_lock.lock();
+	auto range = _by_hash.equal_range(hash);
+	for (auto iter = range.first; iter != range.second; ++iter) {
+		IndexEntry &entry = _entries[iter->second];
+		if (equals(entry, data, size)) {
+			++entry.references;
+			bool written = writeIndexEntry(iter->second);
+			if (!written)
+				--entry.references;
+			else
+				*id = iter->second;
+			_lock.unlock();
+			return written;
+		}
+	}
+
+	// only the second chunk with these bytes makes them worth sharing
+	auto seen = _seen.find(hash);
+	if (seen == _seen.end() || seen->second == owner) {
+		if (_seen.size() >= MAX_SEEN)
+			_seen.clear();
+		_seen[hash] = owner;
+		_lock.unlock();
+		return false;
+	}
+	_seen.erase(seen);
+
+	open(true);
+	if (!_good) {
+		_lock.unlock();
+		return false;
+	}
+	uint32 new_id;
+	if (!_free_ids.empty()) {
+		new_id = _free_ids.back();
+		_free_ids.pop_back();
+	} else {
+		new_id = (uint32) _entries.size();
+		_entries.emplace_back();
+	}
+	IndexEntry &entry = _entries[new_id];
+	memset((char *) &entry, 0, sizeof(IndexEntry));
+	uint num_blocks = (uint) ((size + HEAP_BLOCK_SIZE - 1) / HEAP_BLOCK_SIZE);
+	entry.hash = hash;
+	entry.offset = allocateBlocks(num_blocks);
+	entry.size = (uint32) size;
+	entry.references = 1;
+
+	// the payload has to be on the disk before the index points to it
+	bool written = _heap->write((size_t) entry.offset * HEAP_BLOCK_SIZE, data, size);
+	if (written && _sync)
+		written = _heap->sync();
+	if (written)
+		written = writeIndexEntry(new_id);
+	if (!written) {
+		LOG_ERROR(logger) << "Could not write to content store in '" << _path << "'";
+		markBlocks(entry.offset, num_blocks, false);
+		memset((char *) &entry, 0, sizeof(IndexEntry));
+		_free_ids.push_back(new_id);
+		_lock.unlock();
+		return false;
+	}
+	_by_hash.insert({hash, new_id});
+	*id = new_id;
+	_lock.unlock();
+	return true;
+}
+
+void ContentStore::release(uint32 id) {
+	_lock.lock();
+	if (id >= _entries.size() || _entries[id].references == 0) {
+		LOG_ERROR(logger) << "Released content " << id << " that was not referenced";
+	} else if (!_sync) {
+		// the directory that let go of the payload might not be on the disk yet
+		_releases.push_back(id);
+		++_num_releases;
+	} else if (--_entries[id].references == 0) {
+		freeEntry(id);
+	} else {
+		writeIndexEntry(id);
+	}
+	_lock.unlock();
+}
+
+size_t ContentStore::dropReleases(uint64 num_releases) {
+	size_t num_freed = 0;
+	_lock.lock();
+	// the first pending release has the number _num_releases - _releases.size()
+	uint64 first = _num_releases - _releases.size();
+	size_t num_dropped = 0;
+	if (num_releases > first)
+		num_dropped = (size_t) std::min(num_releases - first, (uint64) _releases.size());
+	for (size_t i = 0; i < num_dropped; ++i) {
+		uint32 id = _releases[i];
+		if (--_entries[id].references == 0) {
+			freeEntry(id);
+			++num_freed;
+		} else {
+			writeIndexEntry(id);
+		}
+	}
+	_releases.erase(_releases.begin(), _releases.begin() + num_dropped);
+	if (num_freed > 0)
+		cutHeap();
+	_lock.unlock();
+	return num_freed;
+}
+
+uint64 ContentStore::getNumReleases() {
+	_lock.lock();
+	uint64 num_releases = _num_releases;
+	_lock.unlock();
+	return num_releases;
+}
+
+size_t ContentStore::getNumPendingReleases() {
+	_lock.lock();
+	size_t num_pending = _releases.size();
+	_lock.unlock();
+	return num_pending;
+}
+
+bool ContentStore::read(uint32 id, std::vector<uint8> *buffer) {
+	_lock.lock();
+	bool good = id < _entries.size() && _entries[id].references > 0;
+	if (good) {
+		const IndexEntry &entry = _entries[id];
+		buffer->resize(entry.size);
+		good = _heap->read((size_t) entry.offset * HEAP_BLOCK_SIZE, buffer->data(), entry.size) == entry.size;
+	}
+	_lock.unlock();
+	return good;
+}
+
+size_t ContentStore::setReferences(const std::vector<uint32> &references) {
+	size_t num_freed = 0;
+	_lock.lock();
+	for (uint32 id = 0; id < _entries.size(); ++id) {
+		IndexEntry &entry = _entries[id];
+		if (entry.references == 0)
+			continue;
+		uint32 count = id < references.size() ? references[id] : 0;
+		if (count == entry.references)
+			continue;
+		entry.references = count;
+		if (count == 0) {
+			freeEntry(id);
+			++num_freed;
+		} else {
+			writeIndexEntry(id);
+		}
+	}
+	// the counts include what the pending releases let go of
+	_releases.clear();
+	cutHeap();
+	_lock.unlock();
+	return num_freed;
+}
+
+size_t ContentStore::getNumPayloads() {
+	_lock.lock();
+	size_t num_payloads = _by_hash.size();
+	_lock.unlock();
+	return num_payloads;
+}
+
+size_t ContentStore::getPayloadBytes() {
+	size_t bytes = 0;
+	_lock.lock();
+	for (auto &entry : _by_hash)
+		bytes += _entries[entry.second].size;
+	_lock.unlock();
+	return bytes;
+}
+
+size_t ContentStore::getFileSize() {
+	_lock.lock();
+	size_t bytes = _good && _index ? _index->getSize() + _heap->getSize() : 0;
+	_lock.unlock();
+	return bytes;
+}
+
+// the caller of this function needs to hold the lock
+void ContentStore::freeEntry(uint32 id) {
+	IndexEntry &entry = _entries[id];
+	auto range = _by_hash.equal_range((uint64) entry.hash);
+	for (auto iter = range.first; iter != range.second; ++iter) {
+		if (iter->second == id) {
+			_by_hash.erase(iter);
+			break;
+		}
+	}
+	markBlocks(entry.offset, (entry.size + HEAP_BLOCK_SIZE - 1) / HEAP_BLOCK_SIZE, false);
+	memset((char *) &entry, 0, sizeof(IndexEntry));
+	writeIndexEntry(id);
+	_free_ids.push_back(id);
+}
+
+// cuts off unused blocks at the end of the heap, the caller needs to hold the lock
+void ContentStore::cutHeap() {
+	size_t heap_end = _heap_map.size();
+	while (heap_end > 0 && !_heap_map[heap_end - 1])
+		heap_end--;
+	if (heap_end < _heap_map.size()) {
+		_heap_map.resize(heap_end);
+		if (_heap->getSize() > heap_end * HEAP_BLOCK_SIZE)
+			_heap->truncate(heap_end * HEAP_BLOCK_SIZE);
+	}
+}
+
+// the caller of this function needs to hold the lock
+bool ContentStore::writeIndexEntry(uint32 id) {
+	bool written = _index->write(sizeof(ContentIndexHeader) + (size_t) id * sizeof(IndexEntry),
+			&_entries[id], sizeof(IndexEntry));
+	if (written && _sync)
+		written = _index->sync();
+	if (!written)
+		LOG_ERROR(logger) << "Could not write index of content store in '" << _path << "'";
+	return written;
+}
+
+// the caller of this function needs to hold the lock
+bool ContentStore::equals(const IndexEntry &entry, const uint8 *data, size_t size) {
+	if (entry.size != size)
+		return false;
+	size_t offset = (size_t) entry.offset * HEAP_BLOCK_SIZE;
+	size_t mapped_size = size;
+	const uint8 *stored = _heap->map(offset, &mapped_size);
+	if (!stored || mapped_size < size) {
+		_compare_buffer.resize(size);
+		if (_heap->read(offset, _compare_buffer.data(), size) < size)
+			return false;
+		stored = _compare_buffer.data();
+	}
+	return memcmp(stored, data, size) == 0;
+}
+
+// first fit, the heap grows if there is no gap
+uint32 ContentStore::allocateBlocks(uint num_blocks) {
+	size_t gap_start = 0;
+	for (size_t i = 0; i < _heap_map.size(); ++i) {
+		if (_heap_map[i]) {
+			gap_start = i + 1;
+		} else if (i + 1 - gap_start == num_blocks) {
+			break;
+		}
+	}
+	markBlocks((uint32) gap_start, num_blocks, true);
+	return (uint32) gap_start;
+}
+
+void ContentStore::markBlocks(uint32 offset, uint num_blocks, bool used) {
+	if (offset + num_blocks > _heap_map.size())
+		_heap_map.resize(offset + num_blocks, false);
+	std::fill(_heap_map.begin() + offset, _heap_map.begin() + offset + num_blocks, used);
+}
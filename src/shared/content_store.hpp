@@ -0,0 +1,126 @@
+#ifndef CONTENT_STORE_HPP_
+#define CONTENT_STORE_HPP_
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "engine/std_types.hpp"
+#include "engine/macros.hpp"
+#include "engine/mutex.hpp"
+
+#include "archive_storage.hpp"
+
+/** Encoded chunks that several region files share, addressed by their content
+
+	Lives next to the region files of a world, an index file holds the hash,
+	place and reference count of every payload and a heap file the payloads
+	themselves.  Region files reference payloads by their index.  Both files
+	are only created once there is something to share.
+
+	A payload only moves here once a second chunk was encoded to the same
+	bytes, chunks that are unique stay in their region file.  Reference counts
+	are raised before a directory points to a payload and lowered after it
+	stopped doing so, so a crash can only leak payloads.  collectGarbage in
+	ChunkArchive counts the references again to free those.
+
+	Without sync, the directory that stopped pointing to a payload might not
+	be on the disk yet.  Releases then wait in a queue until the region files
+	were synced and dropReleases is called, so neither the id nor the heap
+	blocks of the payload are reused while a directory could still point there.
+
+	All functions lock the store, so region files can use it concurrently.
+*/
+class ContentStore {
+public:
+	ContentStore(const std::string &path, ArchiveIO io, bool sync);
+
+	ContentStore(const ContentStore &) = delete;
+	ContentStore &operator = (const ContentStore &) = delete;
+
+	bool isGood() const { return _good; }
+
+	/** Take a reference to a stored copy of the payload
+
+		Returns false if the payload should stay in the region file, which is
+		the case the first time a payload is seen.  owner identifies the chunk
+		the payload belongs to, a chunk that's stored over and over again is not
+		a reason to share it.
+	*/
+	bool acquire(const uint8 *data, size_t size, uint64 owner, uint32 *id);
+	// without sync the reference is only dropped by dropReleases or setReferences
+	void release(uint32 id);
+
+	/** Drops the references released without sync
+
+		Releases are numbered in the order they happened, only those before
+		num_releases are dropped.  The caller has to make sure the directories
+		that let go of them are on the disk.  Returns the number of freed
+		payloads.
+	*/
+	size_t dropReleases(uint64 num_releases);
+	// the number of releases so far and how many of them wait for dropReleases
+	uint64 getNumReleases();
+	size_t getNumPendingReleases();
+
+	// copies the payload into buffer, returns false if id doesn't reference one
+	bool read(uint32 id, std::vector<uint8> *buffer);
+
+	/** Replaces all reference counts
+
+		references[id] is the new count of payload id, payloads that are not
+		referenced anymore are freed.  Pending releases are dropped without
+		counting them again.  Returns the number of freed payloads.
+	*/
+	size_t setReferences(const std::vector<uint32> &references);
+
+	size_t getNumPayloads();
+	size_t getPayloadBytes();
+	size_t getFileSize();
+
+private:
+	PACKED(
+	struct IndexEntry {
+		uint64 hash;
+		uint32 offset;
+		uint32 size;
+		uint32 references;
+		uint8 reserved[4];
+	});
+
+	bool open(bool create);
+	void load();
+	void initialize();
+	uint32 allocateBlocks(uint num_blocks);
+	void markBlocks(uint32 offset, uint num_blocks, bool used);
+	bool writeIndexEntry(uint32 id);
+	void freeEntry(uint32 id);
+	void cutHeap();
+	bool equals(const IndexEntry &, const uint8 *data, size_t size);
+
+	std::string _path;
+	ArchiveIO _io;
+	bool _sync;
+	bool _good = true;
+
+	std::unique_ptr<ArchiveStorage> _index;
+	std::unique_ptr<ArchiveStorage> _heap;
+
+	std::vector<IndexEntry> _entries;
+	// live payloads by hash, collisions are told apart by comparing the bytes
+	std::unordered_multimap<uint64, uint32> _by_hash;
+	std::vector<uint32> _free_ids;
+	// one entry per heap block, true if a payload uses it
+	std::vector<bool> _heap_map;
+	// hashes of payloads that were seen once and the chunk they belonged to
+	std::unordered_map<uint64, uint64> _seen;
+	// ids released without sync, the last one is release number _num_releases - 1
+	std::vector<uint32> _releases;
+	uint64 _num_releases = 0;
+
+	std::vector<uint8> _compare_buffer;
+	Mutex _lock;
+};
+
+#endif // CONTENT_STORE_HPP_
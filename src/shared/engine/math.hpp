@@ -7,6 +7,10 @@
 
 #include "std_types.hpp"
 
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
 static const double TAU = atan(1) * 8;
 
 template<typename T> inline
@@ -35,6 +39,17 @@ cycle(T d, T range) {
     return d - std::floor(d / range) * range;
 }
 
+// x must not be 0
+inline uint countTrailingZeros(uint32 x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, x);
+	return (uint) index;
+#else
+	return (uint) __builtin_ctz(x);
+#endif
+}
+
 using std::min;
 using std::max;
 
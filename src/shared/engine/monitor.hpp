@@ -17,7 +17,11 @@ public:
 
 	// pass the handle back in
 	// returns true, if the read was successful
-    inline bool finishRead(handle_t handle) { return handle == rev1; }
+	inline bool finishRead(handle_t handle) {
+		// the reads in between must not be moved past the check
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return handle == rev1.load(std::memory_order_relaxed);
+	}
 
 private:
     std::atomic<handle_t> rev1;
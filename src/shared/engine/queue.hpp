@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <cstddef>
+#include <utility>
 
 template <class T>
 class ProducerQueue {
@@ -65,7 +66,7 @@ bool ProducerQueue<T>::pop(T &object) {
 	if (tail == _head.load(std::memory_order_acquire)) {
 		return false;
 	}
-	object = _data[tail];
+	object = std::move(_data[tail]);
 	_tail.store((tail + 1) % _size, std::memory_order_release);
 	return true;
 }
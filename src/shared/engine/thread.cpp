@@ -102,10 +102,10 @@ void setName(const char *name) {
 #else
 
 void setName(const char *) {
-	static bool b = false;
-	if (!b) {
+	// several threads can start at once
+	static std::atomic<bool> b(false);
+	if (!b.exchange(true)) {
 		LOG_DEBUG(logger) << "Naming threads not implemented";
-		b = true;
 	}
 }
 
@@ -0,0 +1,290 @@
+#include "air_components.hpp"
+
+#include <cstring>
+
+#include "chunk.hpp"
+
+static const uint W = Chunk::WIDTH;
+// solid blocks
+static const uint16 NO_LABEL = 0xFFFF;
+// air that build didn't get to yet
+static const uint16 UNLABELED = 0xFFFE;
+
+// the faces of the chunk a block lies on, in the order of DIRS
+static int getBlockFaces(size_t index) {
+	size_t x = index % W, y = index / W % W, z = index / (W * W);
+	return (x == W - 1) | ((y == W - 1) << 1) | ((z == W - 1) << 2)
+			| ((x == 0) << 3) | ((y == 0) << 4) | ((z == 0) << 5);
+}
+
+// the pairs of faces that are connected when all of faces are
+static uint16 getPairs(int faces) {
+	uint16 pairs = 0;
+	int shift = 0;
+	for (int d1 = 0; d1 < 5; d1++) {
+		for (int d2 = d1 + 1; d2 < 6; d2++, shift++) {
+			if ((faces & (1 << d1)) && (faces & (1 << d2)))
+				pairs |= 1 << shift;
+		}
+	}
+	return pairs;
+}
+
+void AirComponents::build(const uint32 *air) {
+	labels.assign(Chunk::SIZE, NO_LABEL);
+	components.clear();
+	freeLabels.clear();
+	memset(pairCounts, 0, sizeof(pairCounts));
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (air[i / W] & (1u << (i % W)))
+			labels[i] = UNLABELED;
+	}
+
+	std::vector<uint16> &queue = queues[0];
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (labels[i] != UNLABELED)
+			continue;
+		uint16 label = newLabel();
+		labels[i] = label;
+		queue.assign(1, (uint16) i);
+		for (size_t head = 0; head < queue.size(); ++head) {
+			size_t neighbors[6];
+			size_t numNeighbors = getNeighbors(queue[head], neighbors);
+			for (size_t n = 0; n < numNeighbors; ++n) {
+				if (labels[neighbors[n]] == UNLABELED) {
+					labels[neighbors[n]] = label;
+					queue.push_back((uint16) neighbors[n]);
+				}
+			}
+			addBlocks(label, queue[head], 1);
+		}
+	}
+}
+
+void AirComponents::addAir(size_t index) {
+	if (labels[index] != NO_LABEL)
+		return;
+	size_t neighbors[6];
+	size_t numNeighbors = getNeighbors(index, neighbors);
+
+	// the largest component keeps its label
+	uint16 target = NO_LABEL;
+	for (size_t n = 0; n < numNeighbors; ++n) {
+		uint16 label = labels[neighbors[n]];
+		if (label != NO_LABEL && (target == NO_LABEL || components[label].size > components[target].size))
+			target = label;
+	}
+	if (target == NO_LABEL)
+		target = newLabel();
+
+	for (size_t n = 0; n < numNeighbors; ++n) {
+		uint16 label = labels[neighbors[n]];
+		if (label == NO_LABEL || label == target)
+			continue;
+		Component merged = components[label];
+		relabel(neighbors[n], label, target);
+		addComponent(target, merged, 1);
+		addComponent(label, merged, -1);
+		freeLabel(label);
+	}
+	labels[index] = target;
+	addBlocks(target, index, 1);
+}
+
+void AirComponents::removeAir(size_t index) {
+	uint16 label = labels[index];
+	if (label == NO_LABEL)
+		return;
+	labels[index] = NO_LABEL;
+	addBlocks(label, index, -1);
+
+	size_t starts[6];
+	size_t numSearches = getNeighbors(index, starts);
+	size_t n = 0;
+	for (size_t i = 0; i < numSearches; ++i) {
+		if (labels[starts[i]] == label)
+			starts[n++] = starts[i];
+	}
+	numSearches = n;
+	if (numSearches == 0)
+		freeLabel(label);
+	if (numSearches <= 1)
+		return;
+
+	// every search marks its blocks with a label of its own, searches that meet are joined
+	uint16 searchLabels[6];
+	size_t heads[6];
+	size_t joined[6];
+	bool finished[6];
+	for (size_t s = 0; s < numSearches; ++s) {
+		searchLabels[s] = newLabel();
+		labels[starts[s]] = searchLabels[s];
+		queues[s].assign(1, (uint16) starts[s]);
+		heads[s] = 0;
+		joined[s] = s;
+		finished[s] = false;
+	}
+	auto find = [&joined](size_t s) {
+		while (joined[s] != s)
+			s = joined[s];
+		return s;
+	};
+
+	size_t numPieces = numSearches;
+	while (numPieces > 1) {
+		for (size_t s = 0; s < numSearches; ++s) {
+			if (finished[s] || heads[s] >= queues[s].size())
+				continue;
+			size_t neighbors[6];
+			size_t numNeighbors = getNeighbors(queues[s][heads[s]++], neighbors);
+			for (size_t i = 0; i < numNeighbors; ++i) {
+				uint16 neighborLabel = labels[neighbors[i]];
+				if (neighborLabel == label) {
+					labels[neighbors[i]] = searchLabels[s];
+					queues[s].push_back((uint16) neighbors[i]);
+					continue;
+				}
+				for (size_t other = 0; other < numSearches; ++other) {
+					if (neighborLabel != searchLabels[other] || find(other) == find(s))
+						continue;
+					joined[find(other)] = find(s);
+					--numPieces;
+				}
+			}
+		}
+
+		// a piece whose searches all ran out of blocks was cut off from the rest
+		for (size_t s = 0; s < numSearches && numPieces > 1; ++s) {
+			if (finished[s] || find(s) != s)
+				continue;
+			bool exhausted = true;
+			for (size_t other = 0; other < numSearches; ++other) {
+				if (find(other) == s && heads[other] < queues[other].size())
+					exhausted = false;
+			}
+			if (!exhausted)
+				continue;
+
+			Component piece = Component();
+			for (size_t other = 0; other < numSearches; ++other) {
+				if (find(other) != s)
+					continue;
+				for (uint16 block : queues[other]) {
+					labels[block] = searchLabels[s];
+					++piece.size;
+					int faces = getBlockFaces(block);
+					for (int f = 0; f < 6; ++f)
+						piece.faceCounts[f] += (faces >> f) & 1;
+				}
+				if (other != s)
+					freeLabel(searchLabels[other]);
+				finished[other] = true;
+			}
+			addComponent(searchLabels[s], piece, 1);
+			addComponent(label, piece, -1);
+			--numPieces;
+		}
+	}
+
+	// what no search finished is still connected to the rest of the component
+	for (size_t s = 0; s < numSearches; ++s) {
+		if (finished[s])
+			continue;
+		for (uint16 block : queues[s])
+			labels[block] = label;
+		freeLabel(searchLabels[s]);
+	}
+}
+
+uint16 AirComponents::getPassThroughs() const {
+	uint16 passThroughs = 0;
+	for (int i = 0; i < 15; ++i) {
+		if (pairCounts[i] > 0)
+			passThroughs |= 1 << i;
+	}
+	return passThroughs;
+}
+
+uint16 AirComponents::newLabel() {
+	if (!freeLabels.empty()) {
+		uint16 label = freeLabels.back();
+		freeLabels.pop_back();
+		return label;
+	}
+	components.push_back(Component());
+	return (uint16) (components.size() - 1);
+}
+
+void AirComponents::freeLabel(uint16 label) {
+	components[label] = Component();
+	freeLabels.push_back(label);
+}
+
+void AirComponents::addBlocks(uint16 label, size_t index, int sign) {
+	int oldFaces = getFaces(label);
+	Component &component = components[label];
+	component.size += sign;
+	int faces = getBlockFaces(index);
+	for (int f = 0; f < 6; ++f) {
+		if (faces & (1 << f))
+			component.faceCounts[f] += sign;
+	}
+	setFaces(label, oldFaces);
+}
+
+void AirComponents::addComponent(uint16 label, const Component &other, int sign) {
+	int oldFaces = getFaces(label);
+	Component &component = components[label];
+	component.size += sign * (int) other.size;
+	for (int f = 0; f < 6; ++f)
+		component.faceCounts[f] += sign * other.faceCounts[f];
+	setFaces(label, oldFaces);
+}
+
+// updates the pairs of faces after the faces of a component might have changed
+void AirComponents::setFaces(uint16 label, int oldFaces) {
+	int faces = getFaces(label);
+	if (faces == oldFaces)
+		return;
+	uint16 oldPairs = getPairs(oldFaces);
+	uint16 pairs = getPairs(faces);
+	for (int i = 0; i < 15; ++i)
+		pairCounts[i] += ((pairs >> i) & 1) - ((oldPairs >> i) & 1);
+}
+
+int AirComponents::getFaces(uint16 label) const {
+	int faces = 0;
+	for (int f = 0; f < 6; ++f) {
+		if (components[label].faceCounts[f] > 0)
+			faces |= 1 << f;
+	}
+	return faces;
+}
+
+size_t AirComponents::getNeighbors(size_t index, size_t *neighbors) const {
+	size_t x = index % W, y = index / W % W, z = index / (W * W);
+	size_t numNeighbors = 0;
+	if (x < W - 1) neighbors[numNeighbors++] = index + 1;
+	if (y < W - 1) neighbors[numNeighbors++] = index + W;
+	if (z < W - 1) neighbors[numNeighbors++] = index + W * W;
+	if (x > 0) neighbors[numNeighbors++] = index - 1;
+	if (y > 0) neighbors[numNeighbors++] = index - W;
+	if (z > 0) neighbors[numNeighbors++] = index - W * W;
+	return numNeighbors;
+}
+
+void AirComponents::relabel(size_t start, uint16 from, uint16 to) {
+	std::vector<uint16> &queue = queues[0];
+	labels[start] = to;
+	queue.assign(1, (uint16) start);
+	for (size_t head = 0; head < queue.size(); ++head) {
+		size_t neighbors[6];
+		size_t numNeighbors = getNeighbors(queue[head], neighbors);
+		for (size_t n = 0; n < numNeighbors; ++n) {
+			if (labels[neighbors[n]] == from) {
+				labels[neighbors[n]] = to;
+				queue.push_back((uint16) neighbors[n]);
+			}
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef AIR_COMPONENTS_HPP
+#define AIR_COMPONENTS_HPP
+
+#include <vector>
+
+#include "shared/engine/std_types.hpp"
+
+/* The connected components of the air in a chunk, kept up to date block by block
+
+	Every air block has the label of its component, every component knows how
+	many of its blocks lie on each face of the chunk.  That is all it takes to
+	know which faces are connected through air.
+
+	A block becoming air merges the components around it, the smaller ones get
+	the label of the largest.  A block becoming solid can only split its own
+	component.  Its air neighbors are searched from all at once, one block each
+	in turn, until the searches have met or all but one ran out of blocks, so
+	mostly only the pieces that were cut off are visited.
+*/
+class AirComponents {
+public:
+	// air is laid out like Chunk::getSolidRows, but with the bits of the air blocks set
+	void build(const uint32 *air);
+
+	void addAir(size_t index);
+	void removeAir(size_t index);
+
+	// in the format of Chunk::getPassThroughs
+	uint16 getPassThroughs() const;
+
+private:
+	struct Component {
+		uint size;
+		uint16 faceCounts[6];
+	};
+
+	uint16 newLabel();
+	void freeLabel(uint16 label);
+	void addBlocks(uint16 label, size_t index, int sign);
+	void addComponent(uint16 label, const Component &, int sign);
+	void setFaces(uint16 label, int oldFaces);
+	int getFaces(uint16 label) const;
+	size_t getNeighbors(size_t index, size_t *neighbors) const;
+	void relabel(size_t start, uint16 from, uint16 to);
+
+	std::vector<uint16> labels;
+	std::vector<Component> components;
+	std::vector<uint16> freeLabels;
+	// how many components connect each pair of faces
+	uint16 pairCounts[15];
+
+	// blocks visited by the searches of removeAir
+	std::vector<uint16> queues[6];
+};
+
+#endif // AIR_COMPONENTS_HPP
@@ -1,5 +1,7 @@
 #include "chunk.hpp"
 
+#include <cstring>
+
 #include "shared/engine/logging.hpp"
 #include "shared/block_utils.hpp"
 
@@ -7,6 +9,7 @@ static logging::Logger logger("chunk");
 
 Chunk::Chunk(int flags) {
 	this->flags = flags & VISUAL;
+	makeUniform(0);
 }
 
 void Chunk::initCC(vec3i64 chunkCoords) {
@@ -25,20 +28,45 @@ void Chunk::initPassThroughs(uint16 passThroughs) {
 }
 
 void Chunk::initBlock(vec3ui8 intraChunkCoords, uint8 type) {
-	blocks[getBlockIndex(intraChunkCoords)] = type;
+	getBlocksForInit()[getBlockIndex(intraChunkCoords)] = type;
 }
 
 void Chunk::initBlock(size_t index, uint8 type) {
-	blocks[index] = type;
+	getBlocksForInit()[index] = type;
+}
+
+void Chunk::initUniform(uint8 type) {
+	initBlocks.reset();
+	airComponents.reset();
+	makeUniform(type);
+	initNumAirBlocks(type == 0 ? SIZE : 0);
+}
+
+uint8 *Chunk::getBlocksForInit() {
+	if (!initBlocks)
+		initBlocks.reset(new uint8[SIZE]());
+	return initBlocks.get();
 }
 
 void Chunk::finishInitialization() {
 	if (!(flags & COORDS_INITIALIZED))
 		LOG_ERROR(logger) << "Chunk coordinates not initialized";
+	// the labels were of the blocks before
+	airComponents.reset();
+	// chunks that never had a block initialized stay uniform
+	const uint8 *blocks = initBlocks.get();
+	if (blocks)
+		packBlocks(blocks);
+
 	if (!(flags & NUM_AIR_BLOCKS_INITIALIZED)) {
-		for (size_t i = 0; i < SIZE; i++) {
-			if (blocks[i] == 0)
-				numAirBlocks++;
+		if (flags & UNIFORM) {
+			numAirBlocks = palette[0] == 0 ? SIZE : 0;
+		} else {
+			numAirBlocks = 0;
+			for (size_t i = 0; i < SIZE; i++) {
+				if (blocks[i] == 0)
+					numAirBlocks++;
+			}
 		}
 		flags |= NUM_AIR_BLOCKS_INITIALIZED;
 	}
@@ -47,102 +75,302 @@ void Chunk::finishInitialization() {
 		makePassThroughs();
 		flags |= PASSTHROUGHS_INITIALIZED;
 	}
+
+	initBlocks.reset();
 	flags |= INITIALIZED;
 }
 
+void Chunk::initCopy(const Chunk &chunk) {
+	initBlocks.reset();
+	airComponents.reset();
+	cc = chunk.cc;
+	numAirBlocks = chunk.numAirBlocks;
+	revision = chunk.revision;
+	passThroughs = chunk.passThroughs;
+	flags = (flags & VISUAL) | (chunk.flags & ~VISUAL);
+	paletteExponent = chunk.paletteExponent;
+	paletteSize = chunk.paletteSize;
+	memcpy(palette, chunk.palette, sizeof(palette));
+	packedBlocks = chunk.packedBlocks;
+	solidRows = chunk.solidRows;
+}
+
 void Chunk::reset() {
 	flags = flags & VISUAL;
 	numAirBlocks = 0;
 	passThroughs = 0;
 	revision = 0;
+	initBlocks.reset();
+	airComponents.reset();
+	makeUniform(0);
 }
 
 void Chunk::setBlock(size_t index, uint8 type) {
-	if (blocks[index] == type)
+	uint8 oldType = getBlock(index);
+	if (oldType == type)
 		return;
 
-	blocks[index] = type;
-	if (type == 0)
+	if (flags & UNIFORM) {
+		// materialize the packed blocks, palette[0] stays the old type
+		packedBlocks.assign(SIZE / 32, 0);
+		solidRows.assign(WIDTH * WIDTH, palette[0] != 0 ? 0xFFFFFFFFu : 0);
+		paletteExponent = 0;
+		flags &= ~UNIFORM;
+	}
+	setPackedIndex(index, getPaletteIndex(type));
+	if (type == 0) {
 		numAirBlocks++;
-	else
+		solidRows[index / WIDTH] &= ~(1u << (index % WIDTH));
+	} else if (oldType == 0) {
 		numAirBlocks--;
+		solidRows[index / WIDTH] |= 1u << (index % WIDTH);
+	}
 	revision++;
-	if (flags & VISUAL)
+	if (flags & VISUAL) {
+		// the first edit labels all the air, later ones only change the labels around the block
+		if (!airComponents) {
+			uint32 air[WIDTH * WIDTH];
+			getSolidRows(air);
+			for (uint32 &row : air)
+				row = ~row;
+			airComponents.reset(new AirComponents());
+			airComponents->build(air);
+		} else if (type == 0) {
+			airComponents->addAir(index);
+		} else if (oldType == 0) {
+			airComponents->removeAir(index);
+		}
 		makePassThroughs();
+	}
+}
+
+void Chunk::getBlocks(uint8 *blocks) const {
+	if (flags & UNIFORM) {
+		memset(blocks, palette[0], SIZE);
+		return;
+	}
+	const uint bits = 1 << paletteExponent;
+	const uint32 mask = (1u << bits) - 1;
+	const uint blocksPerWord = 32 >> paletteExponent;
+	for (uint32 word : packedBlocks) {
+		for (uint j = 0; j < blocksPerWord; ++j) {
+			*blocks++ = palette[word & mask];
+			word >>= bits;
+		}
+	}
+}
+
+void Chunk::getSolidRows(uint32 *rows) const {
+	if (flags & UNIFORM) {
+		memset(rows, palette[0] != 0 ? 0xFF : 0x00, WIDTH * WIDTH * sizeof(uint32));
+		return;
+	}
+	memcpy(rows, solidRows.data(), WIDTH * WIDTH * sizeof(uint32));
+}
+
+void Chunk::packBlocks(const uint8 *blocks) {
+	// build the palette in order of first appearance
+	int16 lookup[256];
+	for (int i = 0; i < 256; ++i)
+		lookup[i] = -1;
+	paletteSize = 0;
+	for (size_t i = 0; i < SIZE; ++i) {
+		if (lookup[blocks[i]] < 0) {
+			lookup[blocks[i]] = (int16) paletteSize;
+			palette[paletteSize++] = blocks[i];
+		}
+	}
+
+	if (paletteSize == 1) {
+		makeUniform(palette[0]);
+		return;
+	}
+	flags &= ~UNIFORM;
+
+	solidRows.assign(WIDTH * WIDTH, 0);
+	for (size_t r = 0; r < WIDTH * WIDTH; ++r) {
+		uint32 row = 0;
+		for (uint x = 0; x < WIDTH; ++x)
+			row |= (uint32) (blocks[r * WIDTH + x] != 0) << x;
+		solidRows[r] = row;
+	}
+
+	paletteExponent = 0;
+	while ((1u << (1 << paletteExponent)) < paletteSize)
+		paletteExponent++;
+
+	const uint bits = 1 << paletteExponent;
+	const uint blocksPerWord = 32 >> paletteExponent;
+	packedBlocks.assign(SIZE / blocksPerWord, 0);
+	packedBlocks.shrink_to_fit();
+	for (size_t w = 0, i = 0; w < packedBlocks.size(); ++w) {
+		uint32 word = 0;
+		for (uint j = 0; j < blocksPerWord; ++j, ++i)
+			word |= (uint32) lookup[blocks[i]] << (j * bits);
+		packedBlocks[w] = word;
+	}
+}
+
+void Chunk::repackBlocks(uint8 newPaletteExponent) {
+	std::vector<uint32> oldPackedBlocks;
+	oldPackedBlocks.swap(packedBlocks);
+	const uint8 oldPaletteExponent = paletteExponent;
+
+	const uint oldBits = 1 << oldPaletteExponent;
+	const uint32 oldMask = (1u << oldBits) - 1;
+	const uint oldBlocksPerWord = 32 >> oldPaletteExponent;
+	const uint bits = 1 << newPaletteExponent;
+	const uint blocksPerWord = 32 >> newPaletteExponent;
+
+	packedBlocks.assign(SIZE / blocksPerWord, 0);
+	size_t i = 0;
+	for (uint32 word : oldPackedBlocks) {
+		for (uint j = 0; j < oldBlocksPerWord; ++j, ++i) {
+			packedBlocks[i / blocksPerWord] |= (word & oldMask) << ((i % blocksPerWord) * bits);
+			word >>= oldBits;
+		}
+	}
+	paletteExponent = newPaletteExponent;
+}
+
+void Chunk::makeUniform(uint8 type) {
+	palette[0] = type;
+	paletteSize = 1;
+	paletteExponent = 0;
+	// give the memory back, the chunk might stay in the pool for a long time
+	std::vector<uint32>().swap(packedBlocks);
+	std::vector<uint32>().swap(solidRows);
+	flags |= UNIFORM;
+}
+
+uint8 Chunk::getPaletteIndex(uint8 type) {
+	for (uint i = 0; i < paletteSize; ++i) {
+		if (palette[i] == type)
+			return (uint8) i;
+	}
+
+	// palette entries are never removed, so a full palette means we need more bits
+	if (paletteSize >= (1u << (1 << paletteExponent)))
+		repackBlocks(paletteExponent + 1);
+	palette[paletteSize] = type;
+	return (uint8) paletteSize++;
 }
 
-uint8 Chunk::getBlock(vec3ui8 icc) const {
-	return blocks[getBlockIndex(icc)];
+void Chunk::setPackedIndex(size_t index, uint8 paletteIndex) {
+	const uint wordExponent = 5 - paletteExponent;
+	uint32 &word = packedBlocks[index >> wordExponent];
+	const uint shift = (uint) (index & ((1 << wordExponent) - 1)) << paletteExponent;
+	const uint32 mask = (1u << (1 << paletteExponent)) - 1;
+	word = (word & ~(mask << shift)) | ((uint32) paletteIndex << shift);
 }
 
-size_t Chunk::getBlockIndex(vec3ui8 icc) {
-	return (icc[2] * WIDTH + icc[1]) * WIDTH + icc[0];
+// extends the bits of m along x to all bits of open they are connected to
+static uint32 fillRow(uint32 m, uint32 open) {
+	uint32 up = m, down = m;
+	uint32 upOpen = open, downOpen = open;
+	for (uint shift = 1; shift < 32; shift <<= 1) {
+		up |= upOpen & (up << shift);
+		upOpen &= upOpen << shift;
+		down |= downOpen & (down >> shift);
+		downOpen &= downOpen >> shift;
+	}
+	return up | down;
 }
 
+/* Finds which faces of the chunk are connected through air
+
+	Works on rows of WIDTH blocks along x, one bit per block.  A region of
+	air grows a whole row at a time and spreads to the neighboring rows
+	with bitwise ands, so only air connected to a face is ever visited.
+*/
 void Chunk::makePassThroughs() {
-	if (numAirBlocks > SIZE - WIDTH * WIDTH) {
+	if (flags & UNIFORM) {
+		passThroughs = palette[0] == 0 ? 0x7FFF : 0x0000;
+		return;
+	} else if (numAirBlocks > SIZE - WIDTH * WIDTH) {
 		passThroughs = 0x7FFF;
 		return;
 	} else if (numAirBlocks == 0) {
 		passThroughs = 0x0000;
 		return;
+	} else if (airComponents) {
+		passThroughs = airComponents->getPassThroughs();
+		return;
 	}
 	passThroughs = 0;
-	bool visited[SIZE];
 
-	for (uint i = 0; i < SIZE; i++) {
-		visited[i] = false;
-	}
+	const uint NUM_ROWS = WIDTH * WIDTH;
+	const uint32 SIDES = 1u | (1u << (WIDTH - 1));
+	uint32 air[NUM_ROWS];
+	uint32 visited[NUM_ROWS];
+	uint16 fringe[NUM_ROWS];
+	bool onFringe[NUM_ROWS];
+	getSolidRows(air);
+	for (uint32 &row : air)
+		row = ~row;
+	memset(visited, 0, sizeof(visited));
+	memset(onFringe, 0, sizeof(onFringe));
 
-	size_t index = 0;
-	uint foundAirBlocks = 0;
-	for (uint8 z = 0; z < WIDTH; z++) {
-		for (uint8 y = 0; y < WIDTH; y++) {
-			for (uint8 x = 0; x < WIDTH; x++) {
-				visited[index] = true;
-				if (blocks[index] != 0) {
-					index++;
-					continue;
-				}
+	// the faces of the chunk a row touches, in the order of DIRS
+	auto getBorders = [](uint r, uint32 bits) -> int {
+		uint y = r % WIDTH, z = r / WIDTH;
+		return ((bits >> (WIDTH - 1)) & 1) | ((y == WIDTH - 1) << 1) | ((z == WIDTH - 1) << 2)
+				| ((bits & 1) << 3) | ((y == 0) << 4) | ((z == 0) << 5);
+	};
 
-				vec3ui8 fringe[SIZE];
-				fringe[0] = vec3ui8(x, y, z);
-				int fringeSize = 1;
-				int borderSet = 0;
-				while (fringeSize > 0) {
-					foundAirBlocks++;
-					vec3ui8 icc = fringe[--fringeSize];
-					for (int d = 0; d < 6; d++) {
-						if (icc[DIR_DIMS[d]] == (1 - d / 3) * (WIDTH - 1))
-							borderSet |= (1 << d);
-						else {
-							vec3ui8 nIcc = icc + DIRS[d].cast<uint8>();
-							size_t nIndex = getBlockIndex(nIcc);
-							if (blocks[nIndex] == 0 && !visited[nIndex]) {
-								visited[nIndex] = true;
-								fringe[fringeSize++] = nIcc;
-							}
-						}
-					}
-				}
+	for (uint r = 0; r < NUM_ROWS; ++r) {
+		uint y = r % WIDTH, z = r / WIDTH;
+		// air not on a face can only matter if it is connected to air on one
+		bool onFace = y == 0 || y == WIDTH - 1 || z == 0 || z == WIDTH - 1;
+		uint32 seeds = air[r] & ~visited[r] & (onFace ? ~0u : SIDES);
+		while (seeds) {
+			uint32 seedRun = fillRow(seeds & (~seeds + 1), air[r]);
+			visited[r] |= seedRun;
+			int borderSet = getBorders(r, seedRun);
+			uint fringeSize = 0;
+			fringe[fringeSize++] = (uint16) r;
+			onFringe[r] = true;
 
-				int shift = 0;
-				for (int d1 = 0; d1 < 5; d1++) {
-					if (borderSet & (1 << d1)) {
-						for (int d2 = d1 + 1; d2 < 6; d2++) {
-							if (borderSet & (1 << d2))
-								passThroughs |= (1 << shift);
-							shift++;
-						}
-					} else
-						shift += 5 - d1;
+			// rows on the fringe got air the rows around them haven't seen yet
+			while (fringeSize > 0) {
+				uint cur = fringe[--fringeSize];
+				onFringe[cur] = false;
+				uint cy = cur % WIDTH, cz = cur / WIDTH;
+				uint neighbors[4];
+				uint numNeighbors = 0;
+				if (cy > 0) neighbors[numNeighbors++] = cur - 1;
+				if (cy < WIDTH - 1) neighbors[numNeighbors++] = cur + 1;
+				if (cz > 0) neighbors[numNeighbors++] = cur - WIDTH;
+				if (cz < WIDTH - 1) neighbors[numNeighbors++] = cur + WIDTH;
+				for (uint i = 0; i < numNeighbors; ++i) {
+					uint n = neighbors[i];
+					uint32 reached = visited[cur] & air[n] & ~visited[n];
+					if (!reached)
+						continue;
+					uint32 added = fillRow(reached, air[n] & ~visited[n]);
+					visited[n] |= added;
+					borderSet |= getBorders(n, added);
+					if (!onFringe[n]) {
+						fringe[fringeSize++] = (uint16) n;
+						onFringe[n] = true;
+					}
 				}
+			}
 
-				if (foundAirBlocks >= numAirBlocks)
-					return;
-
-				index++;
+			int shift = 0;
+			for (int d1 = 0; d1 < 5; d1++) {
+				if (borderSet & (1 << d1)) {
+					for (int d2 = d1 + 1; d2 < 6; d2++) {
+						if (borderSet & (1 << d2))
+							passThroughs |= (1 << shift);
+						shift++;
+					}
+				} else
+					shift += 5 - d1;
 			}
+			if (passThroughs == 0x7FFF)
+				return;
+			seeds &= ~visited[r];
 		}
 	}
 }
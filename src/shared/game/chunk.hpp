@@ -1,8 +1,13 @@
 #ifndef CHUNK_HPP
 #define CHUNK_HPP
 
+#include <memory>
+#include <vector>
+
 #include "shared/engine/vmath.hpp"
 
+#include "air_components.hpp"
+
 class Chunk {
 public:
 	static const uint WIDTH_EXPONENT = 5;
@@ -15,6 +20,7 @@ public:
 		COORDS_INITIALIZED = 4,
 		NUM_AIR_BLOCKS_INITIALIZED = 8,
 		PASSTHROUGHS_INITIALIZED = 16,
+		UNIFORM = 32,
 	};
 
 private:
@@ -24,7 +30,32 @@ private:
 	uint16 passThroughs = 0;
 	uint8 flags = 0;
 
-	uint8 blocks[WIDTH * WIDTH * WIDTH];
+	/* Blocks are stored as indices into a palette of block types
+
+		Every block uses 1, 2, 4 or 8 bits (1 << paletteExponent), depending on how many
+		different block types the chunk contains.  Indices never straddle two words.
+
+		Chunks consisting of only one block type are UNIFORM, they have no packed blocks
+		at all and palette[0] is their block type.  The packed blocks are only created
+		once a different block is set.
+	*/
+	uint8 paletteExponent = 0;
+	uint16 paletteSize = 0;
+	uint8 palette[256];
+	std::vector<uint32> packedBlocks;
+
+	/* One bit per block, set for solid blocks, in rows of WIDTH blocks along x
+
+		Row z * WIDTH + y holds the blocks at y and z, bit x is the block at x.  Kept up to
+		date along with the packed blocks and, like them, doesn't exist for UNIFORM chunks.
+	*/
+	std::vector<uint32> solidRows;
+
+	// dense block array, only exists between the first initBlock and finishInitialization
+	std::unique_ptr<uint8[]> initBlocks;
+
+	// only exists once a visual chunk was edited, keeps passThroughs up to date block by block
+	std::unique_ptr<AirComponents> airComponents;
 
 public:
 	Chunk(int flags = 0);
@@ -35,19 +66,36 @@ public:
 	void initPassThroughs(uint16 passThroughs);
 	void initBlock(vec3ui8 intraChunkCoords, uint8 type);
 	void initBlock(size_t index, uint8 type);
-	uint8 *getBlocksForInit() { return blocks; }
+	void initUniform(uint8 type);
+	uint8 *getBlocksForInit();
 	void finishInitialization();
+	// initializes the chunk as a copy of an initialized chunk, which it shares nothing with
+	void initCopy(const Chunk &chunk);
 	void reset();
 
 	void setBlock(size_t index, uint8 type);
 	uint8 getBlock(vec3ui8 intraChunkCoords) const;
+	uint8 getBlock(size_t index) const;
+
+	// decodes all blocks into the dense array blocks, which must hold SIZE entries
+	void getBlocks(uint8 *blocks) const;
+
+	bool isSolid(size_t index) const;
+	bool isSolid(vec3ui8 intraChunkCoords) const;
+	// the solid blocks at y and z, bit x is the block at x
+	uint32 getSolidRow(uint y, uint z) const;
+	// rows must hold WIDTH * WIDTH entries, see getSolidRow
+	void getSolidRows(uint32 *rows) const;
 
 	vec3i64 getCC() const { return cc; }
 	uint32 getRevision() const {return revision; }
 	uint16 getPassThroughs() const { return passThroughs; }
 	uint getNumAirBlocks() const { return numAirBlocks; }
-	const uint8 *getBlocks() const { return blocks; }
+	uint getBitsPerBlock() const { return isUniform() ? 0 : 1 << paletteExponent; }
+	size_t getBlockMemory() const { return packedBlocks.capacity() * sizeof(uint32); }
 	bool isEmpty() const { return numAirBlocks == SIZE; }
+	bool isUniform() const { return (flags & UNIFORM) != 0; }
+	uint8 getUniformType() const { return palette[0]; }
 	bool isVisual() const { return (flags & VISUAL) != 0; }
 	bool isInitialized() const { return (flags & INITIALIZED) != 0; }
 
@@ -58,7 +106,50 @@ public:
 	static size_t getBlockIndex(vec3ui8 icc);
 
 private:
+	void packBlocks(const uint8 *blocks);
+	void repackBlocks(uint8 newPaletteExponent);
+	void makeUniform(uint8 type);
+	uint8 getPaletteIndex(uint8 type);
+	uint8 getPackedIndex(size_t index) const;
+	void setPackedIndex(size_t index, uint8 paletteIndex);
 	void makePassThroughs();
 };
 
+inline uint8 Chunk::getPackedIndex(size_t index) const {
+	const uint wordExponent = 5 - paletteExponent;
+	const uint32 word = packedBlocks[index >> wordExponent];
+	const uint shift = (uint) (index & ((1 << wordExponent) - 1)) << paletteExponent;
+	return (uint8) ((word >> shift) & ((1u << (1 << paletteExponent)) - 1));
+}
+
+inline uint8 Chunk::getBlock(size_t index) const {
+	if (flags & UNIFORM)
+		return palette[0];
+	return palette[getPackedIndex(index)];
+}
+
+inline uint8 Chunk::getBlock(vec3ui8 icc) const {
+	return getBlock(getBlockIndex(icc));
+}
+
+inline bool Chunk::isSolid(size_t index) const {
+	if (flags & UNIFORM)
+		return palette[0] != 0;
+	return (solidRows[index / WIDTH] >> (index % WIDTH)) & 1;
+}
+
+inline bool Chunk::isSolid(vec3ui8 icc) const {
+	return isSolid(getBlockIndex(icc));
+}
+
+inline uint32 Chunk::getSolidRow(uint y, uint z) const {
+	if (flags & UNIFORM)
+		return palette[0] != 0 ? 0xFFFFFFFFu : 0;
+	return solidRows[z * WIDTH + y];
+}
+
+inline size_t Chunk::getBlockIndex(vec3ui8 icc) {
+	return (icc[2] * WIDTH + icc[1]) * WIDTH + icc[0];
+}
+
 #endif // CHUNK_HPP
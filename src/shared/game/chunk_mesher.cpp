@@ -0,0 +1,201 @@
+#include "chunk_mesher.hpp"
+
+#include <cstring>
+
+#include "shared/engine/math.hpp"
+#include "shared/block_utils.hpp"
+
+static const uint W = Chunk::WIDTH;
+static const uint P = ChunkMesher::PADDED_WIDTH;
+
+static size_t getPaddedIndex(vec3ui8 icc) {
+	return ((icc[2] + 1) * P + icc[1] + 1) * P + icc[0] + 1;
+}
+
+// the block at x, y and z of the padded blocks
+static uint8 getPaddedBlock(const Chunk *const *chunks, uint x, uint y, uint z) {
+	vec3i icc((int) x - 1, (int) y - 1, (int) z - 1);
+	vec3i8 ncc(0, 0, 0);
+	for (int i = 0; i < 3; i++) {
+		if (icc[i] < 0) {
+			ncc[i] = -1;
+			icc[i] += W;
+		} else if (icc[i] >= (int) W) {
+			ncc[i] = 1;
+			icc[i] -= W;
+		}
+	}
+	return chunks[vec2BigCubeCycleIndex(ncc)]->getBlock(icc.cast<uint8>());
+}
+
+// row i of the result is bit i of every row, rows are transposed in place
+static void transpose(uint32 *rows) {
+	uint32 m = 0x0000FFFFu;
+	for (uint j = 16; j != 0; j >>= 1, m ^= m << j) {
+		for (uint k = 0; k < 32; k = (k + j + 1) & ~j) {
+			uint32 t = ((rows[k] >> j) ^ rows[k + j]) & m;
+			rows[k] ^= t << j;
+			rows[k + j] ^= t;
+		}
+	}
+}
+
+void ChunkMesher::copyBlocks(const Chunk *const *chunks, uint8 *blocks) {
+	uint8 chunkBlocks[Chunk::SIZE];
+	chunks[BIG_CUBE_CYCLE_BASE_INDEX]->getBlocks(chunkBlocks);
+	for (uint z = 0; z < P; z++) {
+		for (uint y = 0; y < P; y++) {
+			uint8 *row = blocks + (z * P + y) * P;
+			if (z == 0 || z == P - 1 || y == 0 || y == P - 1) {
+				for (uint x = 0; x < P; x++)
+					row[x] = getPaddedBlock(chunks, x, y, z);
+			} else {
+				row[0] = getPaddedBlock(chunks, 0, y, z);
+				memcpy(row + 1, chunkBlocks + ((z - 1) * W + y - 1) * W, W);
+				row[P - 1] = getPaddedBlock(chunks, P - 1, y, z);
+			}
+		}
+	}
+}
+
+vec3ui8 ChunkMesher::Quad::getSize() const {
+	vec3ui8 size(1, 1, 1);
+	size[faceDir % 3 == 0 ? 1 : 0] = width;
+	size[faceDir % 3 == 2 ? 1 : 2] = height;
+	return size;
+}
+
+void ChunkMesher::mesh(const uint8 *blocks, bool greedy, std::vector<Quad> *quads,
+		const uint8 *unmergedFaces) {
+	this->blocks = blocks;
+	makeFaceMasks();
+
+	for (uint8 d = 0; d < 6; d++) {
+		uint aDim = d % 3 == 0 ? 1 : 0;
+		uint bDim = d % 3 == 2 ? 1 : 2;
+		// where the blocks around a face are from the block of the face
+		int cornerOffsets[8];
+		for (int j = 0; j < 8; j++) {
+			vec3i v = DIR_QUAD_EIGHT_NEIGHBOR_CYCLES[d][j];
+			cornerOffsets[j] = (v[2] * (int) P + v[1]) * (int) P + v[0];
+		}
+		for (uint layer = 0; layer < W; layer++) {
+			uint32 *rows = faces[d][layer];
+			vec3ui8 icc(0, 0, 0);
+			icc[d % 3] = (uint8) layer;
+
+			if (!greedy) {
+				for (uint b = 0; b < W; b++) {
+					icc[bDim] = (uint8) b;
+					for (uint32 row = rows[b]; row; row &= row - 1) {
+						icc[aDim] = (uint8) countTrailingZeros(row);
+						quads->push_back(makeQuad(d, icc, getLook(cornerOffsets, icc)));
+					}
+				}
+				continue;
+			}
+
+			for (uint b = 0; b < W; b++) {
+				icc[bDim] = (uint8) b;
+				for (uint32 row = rows[b]; row; row &= row - 1) {
+					uint a = countTrailingZeros(row);
+					icc[aDim] = (uint8) a;
+					looks[b][a] = getLook(cornerOffsets, icc);
+				}
+			}
+
+			for (uint b = 0; b < W; b++) {
+				while (rows[b]) {
+					uint a = countTrailingZeros(rows[b]);
+					uint32 look = looks[b][a];
+					bool apart = unmergedFaces && ((unmergedFaces[(uint8) look] >> d) & 1);
+					uint width = 1;
+					while (!apart && a + width < W && ((rows[b] >> (a + width)) & 1)
+							&& looks[b][a + width] == look)
+						width++;
+					uint32 run = (width == W ? 0xFFFFFFFFu : (1u << width) - 1) << a;
+
+					uint height = 1;
+					for (; !apart && b + height < W && (rows[b + height] & run) == run; height++) {
+						bool same = true;
+						for (uint i = a; i < a + width && same; i++)
+							same = looks[b + height][i] == look;
+						if (!same)
+							break;
+					}
+					for (uint i = b; i < b + height; i++)
+						rows[i] &= ~run;
+
+					icc[aDim] = (uint8) a;
+					icc[bDim] = (uint8) b;
+					Quad quad = makeQuad(d, icc, look);
+					quad.width = (uint8) width;
+					quad.height = (uint8) height;
+					quads->push_back(quad);
+				}
+			}
+		}
+	}
+}
+
+void ChunkMesher::makeFaceMasks() {
+	for (size_t r = 0; r < P * P; r++) {
+		const uint8 *row = blocks + r * P;
+		uint64 bits = 0;
+		for (uint x = 0; x < P; x++)
+			bits |= (uint64) (row[x] != 0) << x;
+		solid[r] = bits;
+	}
+
+	for (uint z = 0; z < W; z++) {
+		// the x direction needs the rows along y
+		uint32 right[W];
+		uint32 left[W];
+		for (uint y = 0; y < W; y++) {
+			uint64 row = solid[(z + 1) * P + y + 1];
+			uint32 inner = (uint32) (row >> 1);
+			right[y] = inner & ~(uint32) (row >> 2);
+			left[y] = inner & ~(uint32) row;
+			faces[1][y][z] = inner & ~(uint32) (solid[(z + 1) * P + y + 2] >> 1);
+			faces[4][y][z] = inner & ~(uint32) (solid[(z + 1) * P + y] >> 1);
+			faces[2][z][y] = inner & ~(uint32) (solid[(z + 2) * P + y + 1] >> 1);
+			faces[5][z][y] = inner & ~(uint32) (solid[z * P + y + 1] >> 1);
+		}
+		transpose(right);
+		transpose(left);
+		for (uint x = 0; x < W; x++) {
+			faces[0][x][z] = right[x];
+			faces[3][x][z] = left[x];
+		}
+	}
+}
+
+uint32 ChunkMesher::getLook(const int *cornerOffsets, vec3ui8 icc) const {
+	size_t index = getPaddedIndex(icc);
+	uint8 corners = 0;
+	for (int j = 0; j < 8; ++j) {
+		if (blocks[index + cornerOffsets[j]] != 0)
+			corners |= 1 << j;
+	}
+
+	uint32 look = blocks[index];
+	for (int j = 0; j < 4; j++) {
+		bool s1 = (corners & QUAD_CORNER_MASK[j][0]) > 0;
+		bool s2 = (corners & QUAD_CORNER_MASK[j][2]) > 0;
+		bool m = (corners & QUAD_CORNER_MASK[j][1]) > 0;
+		uint32 shadowLevel = (uint32) s1 + (uint32) s2 + (uint32) (m || (s1 && s2));
+		look |= shadowLevel << (8 + 2 * j);
+	}
+	return look;
+}
+
+auto ChunkMesher::makeQuad(uint8 faceDir, vec3ui8 icc, uint32 look) const -> Quad {
+	Quad quad;
+	quad.icc = icc;
+	quad.faceType = (uint8) look;
+	quad.faceDir = faceDir;
+	quad.shadowLevels = (uint8) (look >> 8);
+	quad.width = 1;
+	quad.height = 1;
+	return quad;
+}
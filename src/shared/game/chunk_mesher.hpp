@@ -0,0 +1,83 @@
+#ifndef CHUNK_MESHER_HPP
+#define CHUNK_MESHER_HPP
+
+#include <vector>
+
+#include "shared/engine/vmath.hpp"
+#include "shared/engine/std_types.hpp"
+
+#include "chunk.hpp"
+
+/* Turns the block faces of a chunk that lie next to air into quads
+
+	Meshing works on a copy of the blocks of the chunk with one layer of
+	blocks of its neighbors around it, so it doesn't touch the chunks
+	themselves and every block it looks at is a fixed stride away.
+
+	The faces are found with bit operations on whole rows of blocks.  A block
+	has a face in a direction if it is solid and the block behind it isn't,
+	so the faces of a row are its solid blocks without the solid blocks of
+	the row moved by one block against the direction.
+
+	There is a mask of faces for every direction and every layer of blocks
+	along it.  With a < b being the two other dimensions, bit a of row b is
+	the face at a and b.  For the x direction that means the rows are
+	transposed.
+
+	Only the set bits of the masks become quads.  Greedy meshing merges faces
+	that look the same: a quad grows along a over the run of set bits, then
+	along b as long as the next row has the whole run set.
+*/
+class ChunkMesher {
+public:
+	static const uint PADDED_WIDTH = Chunk::WIDTH + 2;
+	static const uint PADDED_SIZE = PADDED_WIDTH * PADDED_WIDTH * PADDED_WIDTH;
+
+	// 8 bytes, the block coordinates are those of the chunk plus icc
+	struct Quad {
+		vec3ui8 icc;
+		uint8 faceType;
+		uint8 faceDir;
+		// two bits per corner
+		uint8 shadowLevels;
+		// in blocks along a and b, see above
+		uint8 width;
+		uint8 height;
+
+		int getShadowLevel(int corner) const { return (shadowLevels >> 2 * corner) & 3; }
+		// in blocks along every axis, 1 along faceDir
+		vec3ui8 getSize() const;
+	};
+
+	/* Copies what meshing a chunk needs
+
+		chunks are the chunk and its neighbors in the order of BIG_CUBE_CYCLE.
+		blocks must hold PADDED_SIZE entries, the block at x, y and z of the
+		chunk goes to ((z + 1) * PADDED_WIDTH + y + 1) * PADDED_WIDTH + x + 1.
+	*/
+	static void copyBlocks(const Chunk *const *chunks, uint8 *blocks);
+
+	/* blocks as made by copyBlocks, the quads are appended
+
+		Faces of block type t in direction d aren't merged if bit d of
+		unmergedFaces[t] is set, for textures that differ from block to block.
+	*/
+	void mesh(const uint8 *blocks, bool greedy, std::vector<Quad> *quads,
+			const uint8 *unmergedFaces = nullptr);
+
+private:
+	void makeFaceMasks();
+	// the block type and the shadow levels of a face, the same look can be merged
+	uint32 getLook(const int *cornerOffsets, vec3ui8 icc) const;
+	Quad makeQuad(uint8 faceDir, vec3ui8 icc, uint32 look) const;
+
+	const uint8 *blocks = nullptr;
+	// bit x of row z * PADDED_WIDTH + y is set for the solid blocks of the padded blocks
+	uint64 solid[PADDED_WIDTH * PADDED_WIDTH];
+	// faces[d][layer][b], see above
+	uint32 faces[6][Chunk::WIDTH][Chunk::WIDTH];
+	// of the faces in the layer being merged
+	uint32 looks[Chunk::WIDTH][Chunk::WIDTH];
+};
+
+#endif // CHUNK_MESHER_HPP
@@ -133,7 +133,7 @@ int World::shootRay(vec3i64 start, vec3d ray, double maxDist,
 
 				vec3i8 dir = DIRS[d];
 				vec3i64 nextBlock = block + dir.cast<int64>();
-				if (getBlock(nextBlock)) {
+				if (isSolid(nextBlock)) {
 					if (outHit != nullptr)
 						*outHit = start + vec3i64((int64)round(hit[0]), (int64)round(hit[1]), (int64)round(hit[2]));
 					if (outFaceDir != nullptr)
@@ -164,7 +164,7 @@ bool World::hasCollision(vec3i64 wc) const {
 	for (int x = 0; x <= onFace[0]; x++) {
 		for (int y = 0; y <= onFace[1]; y++) {
 			for (int z = 0; z <= onFace[2]; z++) {
-				if (!getBlock(block - vec3i64(x, y, z)))
+				if (!isSolid(block - vec3i64(x, y, z)))
 					return false;
 			}
 		}
@@ -187,6 +187,13 @@ uint8 World::getBlock(vec3i64 bc) const {
 	return chunk->getBlock(bc2icc(bc));
 }
 
+bool World::isSolid(vec3i64 bc) const {
+	if (!chunkManager)
+		return false;
+	const Chunk *chunk = chunkManager->getChunk(bc2cc(bc));
+	return chunk && chunk->isSolid(bc2icc(bc));
+}
+
 size_t World::getNumNeededChunks() const {
 	return neededChunks.size();
 }
@@ -47,6 +47,8 @@ public:
 
 	bool isChunkLoaded(vec3i64 cc) const;
 	uint8 getBlock(vec3i64 bc) const;
+	// unloaded blocks aren't solid
+	bool isSolid(vec3i64 bc) const;
 
 	size_t getNumNeededChunks() const;
 
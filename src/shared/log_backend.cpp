@@ -0,0 +1,672 @@
+#include "log_backend.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <unordered_set>
+
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+
+#include "engine/logging.hpp"
+#include "engine/macros.hpp"
+
+#include "game/world_generator.hpp"
+
+#include "archive_storage.hpp"
+#include "block_utils.hpp"
+#include "chunk_encoder.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+static const uint8 SEGMENT_MAGIC[4] = { 0x59, 0x97, 0x22, 0xE3 };
+static const int32 ENDIANESS_BYTES = 0x01020304;
+static const int32 SEGMENT_VERSION = 1;
+
+// offsets in the index are 32 bits
+static const size_t MIN_SEGMENT_BYTES = 64 * 1024;
+static const size_t MAX_SEGMENT_BYTES = 1024 * 1024 * 1024;
+
+// records looked at per call of compact
+static const size_t MERGE_RECORDS = 64;
+
+PACKED(
+struct SegmentHeader {
+	uint8 magic[4];
+	int32 endianess_bytes;
+	int32 version;
+	uint32 id;
+	uint8 reserved[16];
+});
+
+PACKED(
+struct RecordHeader {
+	int64 cc[3];
+	uint32 revision;
+	uint32 size;
+	// crc32 of the header with checksum set to 0, followed by the payload
+	uint32 checksum;
+	uint16 flags;
+	uint16 visibility;
+	uint8 uniform_type;
+	uint8 reserved[3];
+});
+
+static uint32 getChecksum(const RecordHeader &record, const uint8 *payload) {
+	RecordHeader header = record;
+	header.checksum = 0;
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const Bytef *) &header, sizeof(RecordHeader));
+	// zlib starts over when given Z_NULL
+	if (record.size > 0)
+		crc = crc32(crc, payload, record.size);
+	return (uint32) crc;
+}
+
+struct LogBackend::Segment {
+	~Segment();
+
+	uint32 id;
+	std::string filename;
+	// nullptr while closed, guarded by io_lock like everything done with it
+	std::unique_ptr<ArchiveStorage> storage;
+	Time last_access = 0;
+	Mutex io_lock;
+	// end of the last record, only the newest segment still grows
+	std::atomic<size_t> bytes{0};
+	// bytes of the records the index points to, guarded by _index_lock
+	size_t live_bytes = 0;
+	// set once merged, the file goes away with the last reference to the segment
+	bool obsolete = false;
+};
+
+LogBackend::Segment::~Segment() {
+	storage.reset();
+	if (obsolete) {
+		boost::system::error_code ec;
+		boost::filesystem::remove(filename, ec);
+		if (ec)
+			LOG_ERROR(logger) << "Could not remove log segment '" << filename << "': " << ec.message();
+	}
+}
+
+LogBackend::~LogBackend() {
+	// nothing
+}
+
+LogBackend::LogBackend(const char *str, const ArchiveConf &conf,
+		std::unique_ptr<WorldGenerator> generator) :
+	_path(str), _conf(conf), _generator(std::move(generator)), _index(0, vec3i64HashFunc)
+{
+	_conf.log_segment_bytes = std::min(std::max(_conf.log_segment_bytes, MIN_SEGMENT_BYTES), MAX_SEGMENT_BYTES);
+
+	if (_conf.policy == ArchivePolicy::DIFF && !_generator)
+		LOG_WARNING(logger) << "Chunk archive '" << str << "' has no world generator, storing full chunks";
+
+	using namespace boost::filesystem;
+	path p(str);
+	if (!exists(status(p))) {
+		create_directories(p);
+	} else if (!is_directory(p)) {
+		LOG_ERROR(logger) << "World path is not a directory";
+		_good = false;
+		return;
+	}
+
+	std::vector<uint32> ids;
+	for (directory_iterator iter(p), end; iter != end; ++iter) {
+		uint32 id;
+		if (is_regular_file(iter->path()) && parseSegmentFilename(iter->path().filename().string(), &id))
+			ids.push_back(id);
+	}
+	std::sort(ids.begin(), ids.end());
+
+	// later records win, so segments have to be replayed in the order they were written
+	uint32 next_id = 0;
+	for (uint32 id : ids) {
+		std::shared_ptr<Segment> segment(new Segment());
+		segment->id = id;
+		segment->filename = getSegmentFilename(id);
+		_segments.insert({id, segment});
+		if (!replaySegment(segment.get(), id == ids.back()))
+			_segments.erase(id);
+		next_id = id + 1;
+	}
+
+	// records are only appended to the newest segment, even if it is broken
+	if (_segments.empty() || _segments.rbegin()->first + 1 != next_id
+			|| _segments.rbegin()->second->bytes >= _conf.log_segment_bytes) {
+		std::shared_ptr<Segment> segment = startSegment(next_id);
+		if (segment)
+			_segments.insert({next_id, segment});
+		else
+			_good = false;
+	}
+
+	size_t bytes = 0;
+	size_t live_bytes = 0;
+	for (auto &segment : _segments) {
+		bytes += segment.second->bytes;
+		live_bytes += segment.second->live_bytes;
+	}
+	LOG_INFO(logger) << "Chunk archive '" << str << "' has " << _index.size() << " chunks in "
+			<< _segments.size() << " log segments with " << bytes / 1024 / 1024 << " MB";
+	LOG_INFO(logger) << "Chunk archive '" << str << "' uses "
+			<< live_bytes / 1024 / 1024 << " MB of " << bytes / 1024 / 1024 << " MB of space";
+}
+
+bool LogBackend::hasChunk(vec3i64 cc, uint32 *revision) {
+	_index_lock.lockRead();
+	auto it = _index.find(cc);
+	bool has_chunk = it != _index.end();
+	if (has_chunk && revision)
+		*revision = it->second.revision;
+	_index_lock.unlockRead();
+	return has_chunk;
+}
+
+bool LogBackend::loadChunk(Chunk *chunk) {
+	vec3i64 cc = chunk->getCC();
+	_index_lock.lockRead();
+	auto it = _index.find(cc);
+	if (it == _index.end()) {
+		_index_lock.unlockRead();
+		return false;
+	}
+	// a merge might drop the segment, but not while we hold on to it
+	const IndexEntry entry = it->second;
+	auto segment_it = _segments.find(entry.segment);
+	std::shared_ptr<Segment> segment = segment_it != _segments.end() ? segment_it->second : nullptr;
+	_index_lock.unlockRead();
+
+	chunk->initRevision(entry.revision);
+	ChunkEncoder encoder(_conf, _generator.get(), &_generator_lock);
+	if (entry.flags == LAYOUT_EMPTY || entry.flags == LAYOUT_UNIFORM)
+		return encoder.decode(chunk, entry.flags, entry.visibility, entry.uniform_type, nullptr, 0);
+
+	std::vector<uint8> buffer;
+	if (!segment || !readRecord(segment.get(), entry, cc, &buffer)) {
+		LOG_ERROR(logger) << "Chunk (" << cc << ") was corrupt";
+		return false;
+	}
+	return encoder.decode(chunk, entry.flags, entry.visibility, entry.uniform_type,
+			buffer.data() + sizeof(RecordHeader), entry.size);
+}
+
+void LogBackend::storeChunk(const Chunk &chunk) {
+	storeChunks(std::vector<const Chunk *>(1, &chunk));
+}
+
+/* Appends a batch of chunks with a single write
+
+	Chunks are encoded before taking any lock, so several threads can encode
+	at once.  The index only points to the new records once they are
+	written, and with ArchiveConf::sync once they are on the disk.
+*/
+void LogBackend::storeChunks(const std::vector<const Chunk *> &chunks) {
+	if (!_good) return;
+
+	std::vector<uint8> records;
+	ChunkEncoder encoder(_conf, _generator.get(), &_generator_lock);
+	std::vector<std::pair<vec3i64, IndexEntry>> entries;
+	for (const Chunk *chunk : chunks) {
+		// chunks that were never edited can be generated again
+		if (_conf.policy == ArchivePolicy::DIFF && _generator && chunk->getRevision() == 0)
+			continue;
+
+		size_t start = records.size();
+		records.resize(start + sizeof(RecordHeader) + Chunk::SIZE + 4);
+		IndexEntry entry;
+		entry.revision = chunk->getRevision();
+		int bytes_written = encoder.encode(*chunk, &entry.flags, &entry.visibility, &entry.uniform_type,
+				&records[start + sizeof(RecordHeader)]);
+		if (bytes_written < 0) {
+			LOG_ERROR(logger) << "Chunk (" << chunk->getCC() << ") could not be written";
+			records.resize(start);
+			continue;
+		}
+		entry.offset = (uint32) start;
+		entry.size = (uint32) bytes_written;
+
+		RecordHeader record;
+		memset((char *) &record, 0, sizeof(RecordHeader));
+		for (int i = 0; i < 3; ++i)
+			record.cc[i] = chunk->getCC()[i];
+		record.revision = entry.revision;
+		record.size = entry.size;
+		record.flags = entry.flags;
+		record.visibility = entry.visibility;
+		record.uniform_type = entry.uniform_type;
+		record.checksum = getChecksum(record, &records[start + sizeof(RecordHeader)]);
+		memcpy(&records[start], &record, sizeof(RecordHeader));
+		records.resize(start + sizeof(RecordHeader) + bytes_written);
+		entries.push_back({chunk->getCC(), entry});
+	}
+	if (entries.empty())
+		return;
+
+	// the index has to see the records in the order they are in the log
+	_append_lock.lock();
+	uint32 segment;
+	uint32 offset;
+	if (unsafe_append(records, entries.size(), &segment, &offset)) {
+		_index_lock.lockWrite();
+		for (auto &entry : entries) {
+			entry.second.segment = segment;
+			entry.second.offset += offset;
+			unsafe_updateIndex(entry.first, entry.second);
+		}
+		_index_lock.unlockWrite();
+	}
+	_append_lock.unlock();
+}
+
+bool LogBackend::compact() {
+	// one merge at a time is plenty, the others have better things to do
+	if (!_good || !_merge_lock.tryLock())
+		return false;
+	bool merged = mergeRecords();
+	_merge_lock.unlock();
+	return merged;
+}
+
+void LogBackend::clean(Time t) {
+	std::vector<std::shared_ptr<Segment>> segments;
+	_index_lock.lockRead();
+	for (auto &segment : _segments)
+		segments.push_back(segment.second);
+	_index_lock.unlockRead();
+
+	int num_cleaned = 0;
+	Time now = getCurrentTime();
+	for (auto &segment : segments) {
+		segment->io_lock.lock();
+		if (segment->storage && now - segment->last_access > t) {
+			segment->storage.reset();
+			++num_cleaned;
+		}
+		segment->io_lock.unlock();
+	}
+	if (num_cleaned)
+		LOG_DEBUG(logger) << "Cleaned " << num_cleaned << " file handles";
+}
+
+size_t LogBackend::getNumOpenFiles() {
+	std::vector<std::shared_ptr<Segment>> segments;
+	_index_lock.lockRead();
+	for (auto &segment : _segments)
+		segments.push_back(segment.second);
+	_index_lock.unlockRead();
+
+	size_t num_open_files = 0;
+	for (auto &segment : segments) {
+		segment->io_lock.lock();
+		if (segment->storage)
+			++num_open_files;
+		segment->io_lock.unlock();
+	}
+	return num_open_files;
+}
+
+std::vector<vec3i64> LogBackend::getRegions() {
+	std::unordered_set<vec3i64, size_t(*)(vec3i64)> regions(0, vec3i64HashFunc);
+	_index_lock.lockRead();
+	for (auto &entry : _index)
+		regions.insert(ChunkArchive::getRegionCoords(entry.first));
+	_index_lock.unlockRead();
+	return std::vector<vec3i64>(regions.begin(), regions.end());
+}
+
+bool LogBackend::parseSegmentFilename(const std::string &filename, uint32 *id) {
+	uint number;
+	// the whole name has to match, not just its beginning
+	int end = -1;
+	if (sscanf(filename.c_str(), "log.%u.segment%n", &number, &end) != 1 || end != (int) filename.size())
+		return false;
+	*id = (uint32) number;
+	return true;
+}
+
+std::string LogBackend::getSegmentFilename(uint32 id) const {
+	char buffer[64];
+	sprintf(buffer, "log.%u.segment", (uint) id);
+	return _path + std::string(buffer);
+}
+
+/* Opens the file of a segment unless it is open already
+
+	Updates the last access of the segment either way.  The caller of this
+	function needs to hold the segment's io_lock, unless nobody else knows
+	about the segment yet.
+*/
+bool LogBackend::openSegment(Segment *segment) {
+	segment->last_access = getCurrentTime();
+	if (segment->storage)
+		return true;
+
+	segment->storage = ArchiveStorage::create(_conf.io);
+	bool opened = segment->storage->open(segment->filename.c_str());
+	if (!opened && _conf.io != ArchiveIO::STREAM) {
+		LOG_WARNING(logger) << "Could not map log segment '" << segment->filename << "', falling back to streams";
+		segment->storage = ArchiveStorage::create(ArchiveIO::STREAM);
+		opened = segment->storage->open(segment->filename.c_str());
+	}
+	if (!opened) {
+		LOG_ERROR(logger) << "Could not open log segment '" << segment->filename << "'";
+		segment->storage.reset();
+	}
+	return opened;
+}
+
+// writes the header of an empty segment, the caller needs to be the only one knowing the segment
+bool LogBackend::initializeSegment(Segment *segment) {
+	SegmentHeader header;
+	memset((char *) &header, 0, sizeof(SegmentHeader));
+	memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+	header.endianess_bytes = ENDIANESS_BYTES;
+	header.version = SEGMENT_VERSION;
+	header.id = segment->id;
+
+	if (!segment->storage->truncate(0)
+			|| !segment->storage->write(0, &header, sizeof(SegmentHeader))
+			|| !segment->storage->sync()) {
+		LOG_ERROR(logger) << "Could not initialize log segment '" << segment->filename << "'";
+		return false;
+	}
+	segment->bytes = sizeof(SegmentHeader);
+	return true;
+}
+
+/* Adds the records of a segment to the index
+
+	Only the newest segment can have torn records at its end, every other one
+	was synced before the next one was started.  So only the newest one has
+	its checksums verified, which means reading it whole, and its tail is cut
+	off where the first broken record starts.  Records of the other segments
+	are verified whenever they are loaded.  Returns false if the segment
+	isn't usable at all.  Only to be called by the constructor.
+*/
+bool LogBackend::replaySegment(Segment *segment, bool newest) {
+	if (!openSegment(segment))
+		return false;
+	ArchiveStorage *storage = segment->storage.get();
+	size_t file_size = storage->getSize();
+
+	// we died while creating the segment
+	if (newest && file_size < sizeof(SegmentHeader))
+		return initializeSegment(segment);
+
+	SegmentHeader header;
+	if (storage->read(0, &header, sizeof(SegmentHeader)) < sizeof(SegmentHeader)
+			|| memcmp(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0
+			|| header.endianess_bytes != ENDIANESS_BYTES
+			|| header.version != SEGMENT_VERSION
+			|| header.id != segment->id) {
+		LOG_ERROR(logger) << "Log segment '" << segment->filename << "' had bad header";
+		segment->storage.reset();
+		return false;
+	}
+
+	size_t offset = sizeof(SegmentHeader);
+	std::vector<uint8> payload;
+	while (offset + sizeof(RecordHeader) <= file_size) {
+		RecordHeader record;
+		storage->read(offset, &record, sizeof(RecordHeader));
+		size_t end = offset + sizeof(RecordHeader) + record.size;
+		if (record.size > Chunk::SIZE + 4 || end > file_size)
+			break;
+		if (newest) {
+			payload.resize(record.size);
+			storage->read(offset + sizeof(RecordHeader), payload.data(), record.size);
+			if (getChecksum(record, payload.data()) != record.checksum)
+				break;
+		}
+
+		IndexEntry entry;
+		entry.segment = segment->id;
+		entry.offset = (uint32) offset;
+		entry.size = record.size;
+		entry.revision = record.revision;
+		entry.flags = record.flags;
+		entry.visibility = record.visibility;
+		entry.uniform_type = record.uniform_type;
+		unsafe_updateIndex(vec3i64(record.cc[0], record.cc[1], record.cc[2]), entry);
+		offset = end;
+	}
+
+	if (offset < file_size && newest) {
+		LOG_WARNING(logger) << "Log segment '" << segment->filename << "' had " << file_size - offset
+				<< " bytes of torn records at its end, dropping them";
+		storage->truncate(offset);
+	} else if (offset < file_size) {
+		LOG_ERROR(logger) << "Log segment '" << segment->filename << "' was broken after "
+				<< offset << " bytes";
+	}
+	segment->bytes = offset;
+	return true;
+}
+
+// creates a new empty segment, returns nullptr on failure
+std::shared_ptr<LogBackend::Segment> LogBackend::startSegment(uint32 id) {
+	std::shared_ptr<Segment> segment(new Segment());
+	segment->id = id;
+	segment->filename = getSegmentFilename(id);
+	if (!openSegment(segment.get()) || !initializeSegment(segment.get()))
+		return nullptr;
+	return segment;
+}
+
+/* Reads a whole record, header and payload, into buffer
+
+	Returns false if the record isn't the one the entry describes or its
+	checksum is wrong.
+*/
+bool LogBackend::readRecord(Segment *segment, const IndexEntry &entry, vec3i64 cc,
+		std::vector<uint8> *buffer) {
+	buffer->resize(sizeof(RecordHeader) + entry.size);
+	segment->io_lock.lock();
+	bool read = openSegment(segment)
+			&& segment->storage->read(entry.offset, buffer->data(), buffer->size()) == buffer->size();
+	segment->io_lock.unlock();
+	if (!read)
+		return false;
+
+	RecordHeader record;
+	memcpy(&record, buffer->data(), sizeof(RecordHeader));
+	return vec3i64(record.cc[0], record.cc[1], record.cc[2]) == cc
+			&& record.size == entry.size
+			&& getChecksum(record, buffer->data() + sizeof(RecordHeader)) == record.checksum;
+}
+
+/* Appends records to the newest segment, starting a new one if it is full
+
+	Returns the segment and offset the records were written to.  A segment
+	is cut to its last record and synced before the next one is started.
+	The caller of this function needs to hold _append_lock.
+*/
+bool LogBackend::unsafe_append(const std::vector<uint8> &records, size_t num_records,
+		uint32 *segment_id, uint32 *offset) {
+	_index_lock.lockRead();
+	std::shared_ptr<Segment> segment = _segments.rbegin()->second;
+	_index_lock.unlockRead();
+
+	// a segment never stays empty, a batch larger than a whole segment gets one for itself
+	if (segment->bytes > sizeof(SegmentHeader)
+			&& segment->bytes + records.size() > _conf.log_segment_bytes) {
+		segment->io_lock.lock();
+		bool sealed = openSegment(segment.get()) && segment->storage->truncate(segment->bytes)
+				&& segment->storage->sync();
+		segment->io_lock.unlock();
+		std::shared_ptr<Segment> next = sealed ? startSegment(segment->id + 1) : nullptr;
+		if (!next) {
+			LOG_ERROR(logger) << "Could not start a new log segment in '" << _path << "'";
+			return false;
+		}
+		_index_lock.lockWrite();
+		_segments.insert({next->id, next});
+		_index_lock.unlockWrite();
+		segment = next;
+	}
+
+	// whatever a failed write left behind is overwritten by the next one
+	segment->io_lock.lock();
+	bool written = openSegment(segment.get())
+			&& segment->storage->write(segment->bytes, records.data(), records.size());
+	if (written && _conf.sync)
+		written = segment->storage->sync();
+	segment->io_lock.unlock();
+	if (!written) {
+		LOG_ERROR(logger) << "Could not write " << num_records << " chunks to '" << segment->filename << "'";
+		return false;
+	}
+
+	*segment_id = segment->id;
+	*offset = (uint32) segment->bytes;
+	segment->bytes += records.size();
+	return true;
+}
+
+// the caller of this function needs to hold a write lock, or be the constructor
+void LogBackend::unsafe_updateIndex(vec3i64 cc, const IndexEntry &entry) {
+	auto it = _index.find(cc);
+	if (it != _index.end()) {
+		auto old_segment = _segments.find(it->second.segment);
+		if (old_segment != _segments.end())
+			old_segment->second->live_bytes -= sizeof(RecordHeader) + it->second.size;
+		it->second = entry;
+	} else {
+		_index.insert({cc, entry});
+	}
+	_segments[entry.segment]->live_bytes += sizeof(RecordHeader) + entry.size;
+}
+
+/* Does a small part of merging a segment
+
+	Picks the older segment with the fewest live records, if less than
+	1 - ArchiveConf::log_merge_threshold of it is live, and copies the next
+	few records of it that are still live to the newest segment.  Once all
+	are copied and synced, the segment is dropped.  The caller of this
+	function needs to hold _merge_lock.
+*/
+bool LogBackend::mergeRecords() {
+	if (!_merge_segment) {
+		_index_lock.lockRead();
+		double min_live = 1.0 - _conf.log_merge_threshold;
+		for (auto it = _segments.begin(); std::next(it) != _segments.end(); ++it) {
+			Segment &segment = *it->second;
+			double live = (double) segment.live_bytes / std::max(segment.bytes - sizeof(SegmentHeader), (size_t) 1);
+			if (live < min_live || segment.live_bytes == 0) {
+				min_live = live;
+				_merge_segment = it->second;
+			}
+		}
+		_index_lock.unlockRead();
+		if (!_merge_segment)
+			return false;
+		_merge_offset = sizeof(SegmentHeader);
+	}
+
+	Segment *segment = _merge_segment.get();
+	_index_lock.lockRead();
+	bool has_live_records = segment->live_bytes > 0;
+	_index_lock.unlockRead();
+	if (!has_live_records)
+		_merge_offset = segment->bytes;
+
+	// find the live records, they aren't stored again while we look at them
+	std::vector<std::pair<vec3i64, IndexEntry>> candidates;
+	size_t offset = _merge_offset;
+	for (size_t i = 0; i < MERGE_RECORDS && offset < segment->bytes; ++i) {
+		RecordHeader record;
+		segment->io_lock.lock();
+		bool read = openSegment(segment)
+				&& segment->storage->read(offset, &record, sizeof(RecordHeader)) == sizeof(RecordHeader);
+		segment->io_lock.unlock();
+		if (!read) {
+			LOG_ERROR(logger) << "Could not read log segment '" << segment->filename << "', not merging it";
+			_merge_segment.reset();
+			return false;
+		}
+
+		vec3i64 cc(record.cc[0], record.cc[1], record.cc[2]);
+		_index_lock.lockRead();
+		auto it = _index.find(cc);
+		if (it != _index.end() && it->second.segment == segment->id && it->second.offset == offset)
+			candidates.push_back({cc, it->second});
+		_index_lock.unlockRead();
+		offset += sizeof(RecordHeader) + record.size;
+	}
+
+	std::vector<uint8> records;
+	std::vector<uint8> buffer;
+	std::vector<std::pair<vec3i64, IndexEntry>> moved;
+	_append_lock.lock();
+	// with _append_lock, nobody else changes the index
+	for (auto &candidate : candidates) {
+		_index_lock.lockRead();
+		auto it = _index.find(candidate.first);
+		bool live = it != _index.end() && it->second.segment == candidate.second.segment
+				&& it->second.offset == candidate.second.offset;
+		_index_lock.unlockRead();
+		if (!live)
+			continue;
+		if (!readRecord(segment, candidate.second, candidate.first, &buffer)) {
+			LOG_ERROR(logger) << "Chunk (" << candidate.first << ") was corrupt, not merging '"
+					<< segment->filename << "'";
+			_append_lock.unlock();
+			_merge_segment.reset();
+			return false;
+		}
+		IndexEntry entry = candidate.second;
+		entry.offset = (uint32) records.size();
+		records.insert(records.end(), buffer.begin(), buffer.end());
+		moved.push_back({candidate.first, entry});
+	}
+
+	uint32 new_segment;
+	uint32 new_offset;
+	bool appended = moved.empty() || unsafe_append(records, moved.size(), &new_segment, &new_offset);
+	if (appended && !moved.empty()) {
+		_index_lock.lockWrite();
+		for (auto &entry : moved) {
+			entry.second.segment = new_segment;
+			entry.second.offset += new_offset;
+			unsafe_updateIndex(entry.first, entry.second);
+		}
+		_index_lock.unlockWrite();
+	}
+	_append_lock.unlock();
+	if (!appended) {
+		_merge_segment.reset();
+		return false;
+	}
+	_merge_offset = offset;
+	if (offset < segment->bytes)
+		return true;
+
+	// the copies have to be on the disk before the originals go
+	_append_lock.lock();
+	_index_lock.lockRead();
+	std::shared_ptr<Segment> newest = _segments.rbegin()->second;
+	has_live_records = segment->live_bytes > 0;
+	_index_lock.unlockRead();
+	newest->io_lock.lock();
+	bool synced = openSegment(newest.get()) && newest->storage->sync();
+	newest->io_lock.unlock();
+	_append_lock.unlock();
+
+	if (synced && !has_live_records) {
+		_index_lock.lockWrite();
+		_segments.erase(segment->id);
+		segment->obsolete = true;
+		_index_lock.unlockWrite();
+		LOG_DEBUG(logger) << "Merged log segment '" << segment->filename << "'";
+	} else if (has_live_records) {
+		LOG_ERROR(logger) << "Log segment '" << segment->filename << "' still had live records after merging";
+	}
+	_merge_segment.reset();
+	return true;
+}
@@ -0,0 +1,104 @@
+#ifndef LOG_BACKEND_HPP_
+#define LOG_BACKEND_HPP_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "engine/vmath.hpp"
+#include "engine/time.hpp"
+#include "engine/rwlock.hpp"
+#include "engine/mutex.hpp"
+
+#include "chunk_archive.hpp"
+#include "chunk_backend.hpp"
+
+class WorldGenerator;
+
+/** Appends every stored chunk to a log of segment files
+
+	A record holds a chunk's coordinates, revision and encoded blocks, the
+	newest record of a chunk is the valid one.  Which record that is, is kept
+	in an index in memory, which is built again from the segments when the
+	world is opened.  Once a segment grew larger than
+	ArchiveConf::log_segment_bytes it is synced and a new one is started.
+
+	Storing never overwrites anything, so a crash can only tear the records
+	at the end of the newest segment, which are dropped when the world is
+	opened again.  compact merges segments that are mostly overwritten
+	records: it copies their live records to the newest segment and then
+	deletes them.
+*/
+class LogBackend : public ChunkBackend {
+public:
+	~LogBackend();
+	LogBackend(const char *, const ArchiveConf &, std::unique_ptr<WorldGenerator> generator);
+
+	LogBackend(const LogBackend &) = delete;
+	LogBackend &operator = (const LogBackend &) = delete;
+
+	bool hasChunk(vec3i64, uint32 *revision) override;
+	bool loadChunk(Chunk *) override;
+	void storeChunk(const Chunk &) override;
+	void storeChunks(const std::vector<const Chunk *> &) override;
+
+	bool compact() override;
+	void clean(Time t = 0) override;
+
+	size_t getNumOpenFiles() override;
+	std::vector<vec3i64> getRegions() override;
+
+	// returns false if filename is not the name of a segment
+	static bool parseSegmentFilename(const std::string &filename, uint32 *id);
+
+private:
+	struct Segment;
+
+	// where the newest record of a chunk is
+	struct IndexEntry {
+		uint32 segment;
+		uint32 offset;
+		uint32 size;
+		uint32 revision;
+		uint16 flags;
+		uint16 visibility;
+		uint8 uniform_type;
+	};
+
+	std::string getSegmentFilename(uint32 id) const;
+	bool openSegment(Segment *);
+	bool initializeSegment(Segment *);
+	bool replaySegment(Segment *, bool newest);
+	std::shared_ptr<Segment> startSegment(uint32 id);
+
+	bool readRecord(Segment *, const IndexEntry &, vec3i64 cc, std::vector<uint8> *buffer);
+	bool unsafe_append(const std::vector<uint8> &records, size_t num_records,
+			uint32 *segment, uint32 *offset);
+	void unsafe_updateIndex(vec3i64 cc, const IndexEntry &);
+	bool mergeRecords();
+
+	std::string _path;
+	ArchiveConf _conf;
+	std::unique_ptr<WorldGenerator> _generator;
+	// the generator isn't thread safe
+	Mutex _generator_lock;
+	bool _good = true;
+
+	// newest record of every chunk
+	std::unordered_map<vec3i64, IndexEntry, size_t(*)(vec3i64)> _index;
+	// all segments by id, the last one is the one records are appended to
+	std::map<uint32, std::shared_ptr<Segment>> _segments;
+	// held for reading while the index is used, for writing while it changes
+	ReadWriteLock _index_lock;
+	// held while appending to the newest segment
+	Mutex _append_lock;
+
+	// the segment compact is merging and how far it got
+	std::shared_ptr<Segment> _merge_segment;
+	size_t _merge_offset = 0;
+	Mutex _merge_lock;
+};
+
+#endif // LOG_BACKEND_HPP_
@@ -0,0 +1,687 @@
+#include "region_backend.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+
+#include <boost/filesystem.hpp>
+
+#include "engine/math.hpp"
+#include "engine/logging.hpp"
+#include "engine/thread.hpp"
+
+#include "game/world_generator.hpp"
+
+#include "archive_file.hpp"
+#include "block_utils.hpp"
+#include "content_store.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+static const int32 ENDIANESS_BYTES = 0x01020304;
+
+static const uint COMPACTION_MOVES = 16;
+
+static const char *MANIFEST_NAME = "regions.manifest";
+static const uint8 MANIFEST_MAGIC[4] = { 0x59, 0x97, 0x22, 0xE0 };
+static const int32 MANIFEST_VERSION = 1;
+
+PACKED(
+struct ManifestHeader {
+	uint8 magic[4];
+	int32 endianess_bytes;
+	int32 version;
+	uint32 num_regions;
+});
+
+PACKED(
+struct ManifestEntry {
+	int64 rc[3];
+	uint64 file_bytes;
+	uint64 used_bytes;
+	uint64 total_bytes;
+});
+
+// open region files, all of them have to be found within a few probes
+static const size_t FILE_TABLE_SIZE = 256;
+static const size_t FILE_TABLE_PROBES = 16;
+
+// chunks this close to the border of their region make the prefetcher open the neighbor
+static const int64 PREFETCH_MARGIN = 4;
+static const size_t PREFETCH_QUEUE_SIZE = 64;
+// the prefetcher never closes a file that was used more recently than this
+static const Time PREFETCH_MIN_IDLE = seconds(1);
+
+/* Opens region files before anybody needs them
+
+	Requests come from threads holding a read lock on the file map, so they
+	are only queued and the files are opened later by this thread.  When the
+	queue is full, requests are dropped, a region that's actually needed
+	will be opened on demand anyway.
+*/
+class RegionBackend::Prefetcher : public Thread {
+public:
+	Prefetcher(RegionBackend *backend) : Thread("prefetch"), _backend(backend) {}
+
+	void request(vec3i64 rc);
+	void doWork() override;
+
+private:
+	RegionBackend *_backend;
+	std::deque<vec3i64> _requests;
+	Mutex _requests_lock;
+};
+
+void RegionBackend::Prefetcher::request(vec3i64 rc) {
+	_requests_lock.lock();
+	if (_requests.size() < PREFETCH_QUEUE_SIZE
+			&& std::find(_requests.begin(), _requests.end(), rc) == _requests.end())
+		_requests.push_back(rc);
+	_requests_lock.unlock();
+}
+
+void RegionBackend::Prefetcher::doWork() {
+	_requests_lock.lock();
+	bool empty = _requests.empty();
+	vec3i64 rc;
+	if (!empty) {
+		rc = _requests.front();
+		_requests.pop_front();
+	}
+	_requests_lock.unlock();
+
+	if (empty)
+		sleepFor(millis(20));
+	else
+		_backend->prefetchRegion(rc);
+}
+
+RegionBackend::~RegionBackend() {
+	if (_prefetcher) {
+		_prefetcher->requestTermination();
+		_prefetcher->wait();
+	}
+	clean();
+	// every file was synced when it was closed
+	if (_content_store)
+		_content_store->dropReleases(_content_store->getNumReleases());
+	for (size_t i = 0; i < FILE_TABLE_SIZE; ++i)
+		delete _file_table[i].load();
+}
+
+RegionBackend::RegionBackend(const char *str, const ArchiveConf &conf,
+		std::unique_ptr<WorldGenerator> generator) :
+	_path(str), _conf(conf), _generator(std::move(generator)),
+	_file_table(new std::atomic<ArchiveFile *>[FILE_TABLE_SIZE]), _regions(0, vec3i64HashFunc),
+	_stored_manifest_version(0)
+{
+	// half of the table stays free, so probe sequences remain short
+	_max_open_files = std::min((size_t) std::max(_conf.max_open_regions, 1), FILE_TABLE_SIZE / 2);
+	_max_open_files = std::min(_max_open_files,
+			std::max(_conf.max_directory_bytes / ArchiveFile::getDirectoryBytes(ChunkArchive::REGION_SIZE), (size_t) 1));
+
+	for (size_t i = 0; i < FILE_TABLE_SIZE; ++i)
+		_file_table[i] = nullptr;
+
+	if (_conf.policy == ArchivePolicy::DIFF && !_generator)
+		LOG_WARNING(logger) << "Chunk archive '" << str << "' has no world generator, storing full chunks";
+
+	using namespace boost::filesystem;
+	path p(str);
+	if (!exists(status(p))) {
+		create_directories(p);
+	} else {
+		if (!is_directory(p)) {
+			LOG_ERROR(logger) << "World path is not a directory";
+			return;
+		}
+	}
+
+	if (_conf.deduplicate)
+		_content_store.reset(new ContentStore(_path, _conf.io, _conf.sync));
+
+	// only worlds from before the manifest need to look at every region file
+	if (!loadManifest()) {
+		LOG_INFO(logger) << "Chunk archive '" << str << "' has no manifest, scanning region files";
+		scanRegions();
+		++_manifest_version;
+		storeManifest();
+	}
+
+	size_t bytes = 0;
+	size_t used_bytes = 0;
+	size_t total_bytes = 0;
+	for (auto &entry : _regions) {
+		bytes += entry.second.file_bytes;
+		used_bytes += entry.second.used_bytes;
+		total_bytes += entry.second.total_bytes;
+	}
+
+	LOG_INFO(logger) << "Chunk archive '" << str << "' has " << _regions.size() << " regions with "
+			<< bytes / 1024 / 1024 << " MB";
+	LOG_INFO(logger) << "Chunk archive '" << str << "' uses "
+			<< used_bytes / 1024 / 1024 << " MB of " << total_bytes / 1024 / 1024 << " MB of space";
+	if (_content_store) {
+		LOG_INFO(logger) << "Chunk archive '" << str << "' shares " << _content_store->getNumPayloads()
+				<< " chunks in " << _content_store->getFileSize() / 1024 / 1024 << " MB";
+	}
+
+	if (_conf.prefetch) {
+		_prefetcher.reset(new Prefetcher(this));
+		_prefetcher->dispatch();
+	}
+}
+
+bool RegionBackend::hasChunk(vec3i64 cc, uint32 *revision) {
+	vec3i64 rc = ChunkArchive::getRegionCoords(cc);
+	bool has_chunk = false;
+	// the region is usually open already, then we don't need any lock
+	size_t slot = vec3i64HashFunc(rc) % FILE_TABLE_SIZE;
+	for (size_t i = 0; i < FILE_TABLE_PROBES; ++i) {
+		ArchiveFile *archive_file = _file_table[(slot + i) % FILE_TABLE_SIZE].load(std::memory_order_acquire);
+		if (!archive_file)
+			break;
+		if (archive_file->tryHasChunk(rc, cc, &has_chunk, revision))
+			return has_chunk;
+	}
+
+	// the file can't be closed while we hold the read lock
+	_file_map_lock.lockRead();
+	ArchiveFile *archive_file = unsafe_getArchiveFile(cc, false);
+	if (archive_file)
+		archive_file->tryHasChunk(rc, cc, &has_chunk, revision);
+	unsafe_prefetchNeighbors(cc);
+	_file_map_lock.unlockRead();
+	return has_chunk;
+}
+
+bool RegionBackend::loadChunk(Chunk *chunk) {
+	_file_map_lock.lockRead();
+	ArchiveFile *archive_file = unsafe_getArchiveFile(chunk->getCC(), false);
+	bool result = archive_file && archive_file->loadChunk(chunk);
+	unsafe_prefetchNeighbors(chunk->getCC());
+	_file_map_lock.unlockRead();
+	return result;
+}
+
+void RegionBackend::storeChunk(const Chunk &chunk) {
+	_file_map_lock.lockRead();
+	ArchiveFile *archive_file = unsafe_getArchiveFile(chunk.getCC(), true);
+	archive_file->storeChunk(chunk);
+	unsafe_prefetchNeighbors(chunk.getCC());
+	_file_map_lock.unlockRead();
+}
+
+void RegionBackend::storeChunks(const std::vector<const Chunk *> &chunks) {
+	// sort by region, so every file gets all of its chunks at once
+	std::vector<std::pair<vec3i64, const Chunk *>> sorted;
+	sorted.reserve(chunks.size());
+	for (const Chunk *chunk : chunks)
+		sorted.push_back({ChunkArchive::getRegionCoords(chunk->getCC()), chunk});
+	std::stable_sort(sorted.begin(), sorted.end(),
+			[](const std::pair<vec3i64, const Chunk *> &a, const std::pair<vec3i64, const Chunk *> &b) {
+		const vec3i64 &ra = a.first, &rb = b.first;
+		return ra[0] != rb[0] ? ra[0] < rb[0] : ra[1] != rb[1] ? ra[1] < rb[1] : ra[2] < rb[2];
+	});
+
+	std::vector<const Chunk *> region_chunks;
+	_file_map_lock.lockRead();
+	for (size_t i = 0; i < sorted.size();) {
+		region_chunks.clear();
+		size_t j = i;
+		for (; j < sorted.size() && sorted[j].first == sorted[i].first; ++j) {
+			region_chunks.push_back(sorted[j].second);
+			unsafe_prefetchNeighbors(sorted[j].second->getCC());
+		}
+		ArchiveFile *archive_file = unsafe_getArchiveFile(sorted[i].second->getCC(), true);
+		archive_file->storeChunks(region_chunks.data(), region_chunks.size());
+		i = j;
+	}
+	_file_map_lock.unlockRead();
+}
+
+void RegionBackend::loadChunks(const std::vector<Chunk *> &chunks) {
+	// sort by region, so every file reads all of its chunks in one batch
+	std::vector<std::pair<vec3i64, Chunk *>> sorted;
+	sorted.reserve(chunks.size());
+	for (Chunk *chunk : chunks)
+		sorted.push_back({ChunkArchive::getRegionCoords(chunk->getCC()), chunk});
+	std::stable_sort(sorted.begin(), sorted.end(),
+			[](const std::pair<vec3i64, Chunk *> &a, const std::pair<vec3i64, Chunk *> &b) {
+		const vec3i64 &ra = a.first, &rb = b.first;
+		return ra[0] != rb[0] ? ra[0] < rb[0] : ra[1] != rb[1] ? ra[1] < rb[1] : ra[2] < rb[2];
+	});
+
+	std::vector<Chunk *> region_chunks;
+	_file_map_lock.lockRead();
+	for (size_t i = 0; i < sorted.size();) {
+		region_chunks.clear();
+		size_t j = i;
+		for (; j < sorted.size() && sorted[j].first == sorted[i].first; ++j) {
+			region_chunks.push_back(sorted[j].second);
+			unsafe_prefetchNeighbors(sorted[j].second->getCC());
+		}
+		ArchiveFile *archive_file = unsafe_getArchiveFile(sorted[i].second->getCC(), false);
+		if (archive_file)
+			archive_file->loadChunks(region_chunks.data(), region_chunks.size());
+		i = j;
+	}
+	_file_map_lock.unlockRead();
+}
+
+bool RegionBackend::compact() {
+	bool moved = false;
+	_file_map_lock.lockRead();
+	for (size_t i = 0; i < FILE_TABLE_SIZE && !moved; ++i) {
+		ArchiveFile *archive_file = _file_table[i].load();
+		if (archive_file && archive_file->isOpen())
+			moved = archive_file->compact(COMPACTION_MOVES, _conf.compaction_threshold);
+	}
+	// with nothing to move, there is time to free the shared chunks the files let go of
+	if (!moved)
+		moved = unsafe_dropReleases();
+	_file_map_lock.unlockRead();
+	return moved;
+}
+
+/* Frees the shared chunks region files let go of without sync
+
+	Closed files were synced when they were closed, so once the open ones are
+	synced, the directories behind all releases so far are on the disk.
+	Returns whether anything was freed.  The caller needs to hold a lock.
+*/
+bool RegionBackend::unsafe_dropReleases() {
+	if (!_content_store || _content_store->getNumPendingReleases() == 0)
+		return false;
+	// another thread is syncing already
+	if (!_release_lock.tryLock())
+		return false;
+	uint64 num_releases = _content_store->getNumReleases();
+	bool good = true;
+	for (size_t i = 0; i < FILE_TABLE_SIZE; ++i) {
+		ArchiveFile *archive_file = _file_table[i].load();
+		if (archive_file && archive_file->isOpen())
+			good = archive_file->sync() && good;
+	}
+	size_t num_freed = 0;
+	if (good)
+		num_freed = _content_store->dropReleases(num_releases);
+	else
+		LOG_ERROR(logger) << "Could not sync region files of '" << _path << "', keeping shared chunks";
+	_release_lock.unlock();
+	return num_freed > 0;
+}
+
+size_t RegionBackend::collectGarbage() {
+	if (!_content_store)
+		return 0;
+	_file_map_lock.lockWrite();
+	// open files don't get to change their references while we count
+	unsafe_clean();
+	std::vector<uint32> references;
+	bool good = true;
+	for (auto &region : _regions) {
+		ArchiveFile archive_file(ChunkArchive::REGION_SIZE, _conf, nullptr, nullptr, _content_store.get());
+		archive_file.open(getRegionFilename(region.first).c_str(), region.first);
+		good = archive_file.countSharedReferences(&references) && good;
+		// the counts may only drop for directories that are on the disk
+		if (!_conf.sync)
+			good = archive_file.sync() && good;
+	}
+	// a file we couldn't read might still reference anything
+	size_t num_freed = 0;
+	if (good)
+		num_freed = _content_store->setReferences(references);
+	else
+		LOG_ERROR(logger) << "Chunk archive '" << _path << "' has broken region files, not collecting garbage";
+	_file_map_lock.unlockWrite();
+	storeManifest();
+	return num_freed;
+}
+
+void RegionBackend::clean(Time t) {
+	_file_map_lock.lockWrite();
+	unsafe_clean(t);
+	_file_map_lock.unlockWrite();
+	storeManifest();
+}
+
+size_t RegionBackend::getNumOpenFiles() {
+	_file_map_lock.lockRead();
+	size_t num_open_files = _num_open_files;
+	_file_map_lock.unlockRead();
+	return num_open_files;
+}
+
+std::vector<vec3i64> RegionBackend::getRegions() {
+	std::vector<vec3i64> regions;
+	_file_map_lock.lockRead();
+	regions.reserve(_regions.size());
+	for (auto &region : _regions)
+		regions.push_back(region.first);
+	_file_map_lock.unlockRead();
+	return regions;
+}
+
+/* Get the file of the region the chunk is in and open it if necessary
+
+	Returns nullptr if the region was never stored and create is false, so
+	looking at unexplored areas doesn't touch the disk.  With create, the
+	manifest knows about the region before the file is returned, so stored
+	chunks can't get lost in a region nobody remembers.  The caller of this
+	function needs to hold a read-lock.
+*/
+ArchiveFile *RegionBackend::unsafe_getArchiveFile(vec3i64 cc, bool create) {
+	vec3i64 rc = ChunkArchive::getRegionCoords(cc);
+	ArchiveFile *archive_file = unsafe_findArchiveFile(rc);
+	while (!archive_file || (create && _manifest_version != _stored_manifest_version.load())) {
+		if (!archive_file && !create && _regions.find(rc) == _regions.end())
+			return nullptr;
+
+		_file_map_lock.unlockRead();
+		if (!archive_file) {
+			_file_map_lock.lockWrite();
+			if (!unsafe_findArchiveFile(rc))
+				unsafe_addArchiveFile(rc);
+			_file_map_lock.unlockWrite();
+		}
+		if (create)
+			storeManifest();
+		_file_map_lock.lockRead();
+		archive_file = unsafe_findArchiveFile(rc);
+	}
+
+	return archive_file;
+}
+
+// the caller of this function needs to hold a lock
+ArchiveFile *RegionBackend::unsafe_findArchiveFile(vec3i64 rc) {
+	size_t slot = vec3i64HashFunc(rc) % FILE_TABLE_SIZE;
+	for (size_t i = 0; i < FILE_TABLE_PROBES; ++i) {
+		ArchiveFile *archive_file = _file_table[(slot + i) % FILE_TABLE_SIZE].load();
+		if (!archive_file)
+			return nullptr;
+		if (archive_file->isOpen() && archive_file->getRegion() == rc)
+			return archive_file;
+	}
+	return nullptr;
+}
+
+ArchiveFile *RegionBackend::newArchiveFile() {
+	return new ArchiveFile(ChunkArchive::REGION_SIZE, _conf, _generator.get(), &_generator_lock,
+			_content_store.get());
+}
+
+/* Finds the slot a file of the region can go into
+
+	That is the first slot of the probe sequence that is empty or holds a
+	closed file.  If all of them are in use, the least recently used file
+	among them is closed.  The caller of this function needs to hold a write
+	lock.
+*/
+std::atomic<ArchiveFile *> &RegionBackend::unsafe_getFreeSlot(vec3i64 rc) {
+	size_t slot = vec3i64HashFunc(rc) % FILE_TABLE_SIZE;
+	std::atomic<ArchiveFile *> *least_recent = nullptr;
+	for (size_t i = 0; i < FILE_TABLE_PROBES; ++i) {
+		std::atomic<ArchiveFile *> &entry = _file_table[(slot + i) % FILE_TABLE_SIZE];
+		ArchiveFile *candidate = entry.load();
+		if (!candidate || !candidate->isOpen())
+			return entry;
+		if (!least_recent || candidate->getLastAccess() < least_recent->load()->getLastAccess())
+			least_recent = &entry;
+	}
+	unsafe_closeArchiveFile(least_recent->load());
+	return *least_recent;
+}
+
+/* Opens a region file in the first free slot of its probe sequence
+
+	If as many files are open as the configuration allows, the least recently
+	used one is closed first.  Slots never become empty again, closed files
+	stay in them and are reused, so lock-free readers never see a file being
+	deleted.  A new region only goes into the manifest in memory, whoever
+	stores into it has to call storeManifest first.  The caller of this
+	function needs to hold a write lock.
+*/
+void RegionBackend::unsafe_addArchiveFile(vec3i64 rc) {
+	if (_num_open_files >= _max_open_files)
+		unsafe_closeArchiveFile(unsafe_findLeastRecentFile());
+
+	if (_regions.find(rc) == _regions.end()) {
+		_regions.insert({rc, RegionStats()});
+		++_manifest_version;
+	}
+
+	std::atomic<ArchiveFile *> &entry = unsafe_getFreeSlot(rc);
+	ArchiveFile *archive_file = entry.load();
+	if (!archive_file) {
+		archive_file = newArchiveFile();
+		entry.store(archive_file, std::memory_order_release);
+	}
+	archive_file->open(getRegionFilename(rc).c_str(), rc);
+	++_num_open_files;
+}
+
+// the caller of this function needs to hold a write lock
+void RegionBackend::unsafe_closeArchiveFile(ArchiveFile *archive_file) {
+	RegionStats &stats = _regions[archive_file->getRegion()];
+	stats.file_bytes = archive_file->getFileSize();
+	stats.used_bytes = archive_file->getUsedChunkBytes();
+	stats.total_bytes = archive_file->getTotalChunkBytes();
+	++stats.num_closes;
+	// the shared chunks it let go of are freed once its directory is on the disk
+	if (_content_store && !_conf.sync)
+		archive_file->sync();
+	archive_file->close();
+	--_num_open_files;
+}
+
+std::string RegionBackend::getRegionFilename(vec3i64 rc) const {
+	char buffer[200];
+	sprintf(buffer, "%" PRId64 "_%" PRId64 "_%" PRId64 ".region",
+			rc[0], rc[1], rc[2]);
+	return _path + std::string(buffer);
+}
+
+// the caller of this function needs to hold a write lock
+void RegionBackend::unsafe_clean(Time t) {
+	int num_cleaned = 0;
+	Time now = getCurrentTime();
+	for (size_t i = 0; i < FILE_TABLE_SIZE; ++i) {
+		ArchiveFile *archive_file = _file_table[i].load();
+		if (archive_file && archive_file->isOpen() && now - archive_file->getLastAccess() > t) {
+			unsafe_closeArchiveFile(archive_file);
+			++num_cleaned;
+		}
+	}
+	if (num_cleaned) {
+		LOG_DEBUG(logger) << "Cleaned " << num_cleaned << " file handles";
+		++_manifest_version;
+	}
+}
+
+// the caller of this function needs to hold a write lock
+ArchiveFile *RegionBackend::unsafe_findLeastRecentFile() {
+	ArchiveFile *least_recent = nullptr;
+	for (size_t i = 0; i < FILE_TABLE_SIZE; ++i) {
+		ArchiveFile *archive_file = _file_table[i].load();
+		if (archive_file && archive_file->isOpen()
+				&& (!least_recent || archive_file->getLastAccess() < least_recent->getLastAccess()))
+			least_recent = archive_file;
+	}
+	return least_recent;
+}
+
+/* Asks the prefetcher for the regions next to a chunk close to their border
+
+	Only regions that have a file and aren't open yet are requested.  The
+	caller of this function needs to hold a lock.
+*/
+void RegionBackend::unsafe_prefetchNeighbors(vec3i64 cc) {
+	if (!_prefetcher)
+		return;
+	vec3i64 rc = ChunkArchive::getRegionCoords(cc);
+	for (int i = 0; i < 3; ++i) {
+		int64 local = cc[i] - rc[i] * (int64) ChunkArchive::REGION_SIZE;
+		int dir = local < PREFETCH_MARGIN ? -1 : local >= (int64) ChunkArchive::REGION_SIZE - PREFETCH_MARGIN ? 1 : 0;
+		if (!dir)
+			continue;
+		vec3i64 neighbor = rc;
+		neighbor[i] += dir;
+		if (_regions.find(neighbor) != _regions.end() && !unsafe_findArchiveFile(neighbor))
+			_prefetcher->request(neighbor);
+	}
+}
+
+/* Opens a region file unless that would close one that's still in use
+
+	Reading the directory is the slow part, it happens without any lock in
+	a file of our own.  Only swapping it into the file table needs the write
+	lock.  The file that was in the slot before is closed already and stays
+	alive as our next one, lock-free readers might still look at it.
+*/
+void RegionBackend::prefetchRegion(vec3i64 rc) {
+	_file_map_lock.lockRead();
+	auto it = _regions.find(rc);
+	bool wanted = !unsafe_findArchiveFile(rc) && it != _regions.end();
+	uint32 num_closes = wanted ? it->second.num_closes : 0;
+	_file_map_lock.unlockRead();
+	if (!wanted)
+		return;
+
+	if (!_prefetch_file)
+		_prefetch_file.reset(newArchiveFile());
+	_prefetch_file->open(getRegionFilename(rc).c_str(), rc);
+
+	_file_map_lock.lockWrite();
+	// somebody else might have opened, written and closed the file while we read it
+	it = _regions.find(rc);
+	if (!unsafe_findArchiveFile(rc) && it != _regions.end() && it->second.num_closes == num_closes) {
+		ArchiveFile *least_recent = _num_open_files >= _max_open_files ? unsafe_findLeastRecentFile() : nullptr;
+		if (!least_recent || getCurrentTime() - least_recent->getLastAccess() > PREFETCH_MIN_IDLE) {
+			if (least_recent)
+				unsafe_closeArchiveFile(least_recent);
+			std::atomic<ArchiveFile *> &entry = unsafe_getFreeSlot(rc);
+			ArchiveFile *old_file = entry.load();
+			entry.store(_prefetch_file.release(), std::memory_order_release);
+			_prefetch_file.reset(old_file);
+			++_num_open_files;
+		}
+	}
+	_file_map_lock.unlockWrite();
+
+	// the region was opened by somebody else in the meantime or what we read is stale
+	if (_prefetch_file)
+		_prefetch_file->close();
+}
+
+/* Reads which regions exist and how large they were when last closed
+
+	Returns false if there is no valid manifest.
+*/
+bool RegionBackend::loadManifest() {
+	std::ifstream file(_path + MANIFEST_NAME, ios_base::in | ios_base::binary);
+	if (!file.is_open())
+		return false;
+
+	ManifestHeader header;
+	if (!file.read((char *) &header, sizeof(ManifestHeader))
+			|| memcmp(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0
+			|| header.endianess_bytes != ENDIANESS_BYTES
+			|| header.version != MANIFEST_VERSION) {
+		LOG_WARNING(logger) << "Manifest of chunk archive '" << _path << "' was invalid";
+		return false;
+	}
+
+	std::vector<ManifestEntry> entries(header.num_regions);
+	if (!file.read((char *) entries.data(), entries.size() * sizeof(ManifestEntry))) {
+		LOG_WARNING(logger) << "Manifest of chunk archive '" << _path << "' ended abruptly";
+		return false;
+	}
+
+	_regions.clear();
+	for (const ManifestEntry &entry : entries) {
+		RegionStats stats;
+		stats.file_bytes = entry.file_bytes;
+		stats.used_bytes = entry.used_bytes;
+		stats.total_bytes = entry.total_bytes;
+		_regions.insert({vec3i64(entry.rc[0], entry.rc[1], entry.rc[2]), stats});
+	}
+	return true;
+}
+
+// builds the manifest from the region files themselves, like worlds without one need
+void RegionBackend::scanRegions() {
+	using namespace boost::filesystem;
+	_regions.clear();
+	for (directory_iterator iter(_path), end; iter != end; ++iter) {
+		if (!is_regular_file(iter->path()))
+			continue;
+		vec3i64 rc;
+		if (!ChunkArchive::parseRegionFilename(iter->path().filename().string(), &rc))
+			continue;
+		ArchiveFile af;
+		af.open(iter->path().string().c_str());
+		RegionStats stats;
+		stats.file_bytes = af.getFileSize();
+		stats.used_bytes = af.getUsedChunkBytes();
+		stats.total_bytes = af.getTotalChunkBytes();
+		_regions.insert({rc, stats});
+	}
+}
+
+/* Replaces the manifest, so a crash leaves either the old or the new one
+
+	Threads that changed _regions at the same time share a single write.
+*/
+void RegionBackend::storeManifest() {
+	_manifest_lock.lock();
+	_file_map_lock.lockRead();
+	uint64 version = _manifest_version;
+	if (version == _stored_manifest_version.load()) {
+		_file_map_lock.unlockRead();
+		_manifest_lock.unlock();
+		return;
+	}
+
+	ManifestHeader header;
+	memset((char *) &header, 0, sizeof(ManifestHeader));
+	memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	header.endianess_bytes = ENDIANESS_BYTES;
+	header.version = MANIFEST_VERSION;
+	header.num_regions = (uint32) _regions.size();
+
+	std::vector<ManifestEntry> entries;
+	entries.reserve(_regions.size());
+	for (auto &region : _regions) {
+		ManifestEntry entry;
+		for (int i = 0; i < 3; ++i)
+			entry.rc[i] = region.first[i];
+		entry.file_bytes = region.second.file_bytes;
+		entry.used_bytes = region.second.used_bytes;
+		entry.total_bytes = region.second.total_bytes;
+		entries.push_back(entry);
+	}
+	_file_map_lock.unlockRead();
+
+	std::string filename = _path + MANIFEST_NAME;
+	std::string temp_filename = filename + ".tmp";
+	{
+		std::ofstream file(temp_filename, ios_base::out | ios_base::binary | ios_base::trunc);
+		file.write((const char *) &header, sizeof(ManifestHeader));
+		file.write((const char *) entries.data(), entries.size() * sizeof(ManifestEntry));
+		if (!file.good())
+			LOG_ERROR(logger) << "Could not write manifest of chunk archive '" << _path << "'";
+	}
+	boost::system::error_code ec;
+	boost::filesystem::rename(temp_filename, filename, ec);
+	if (ec)
+		LOG_ERROR(logger) << "Could not replace manifest of chunk archive '" << _path << "': " << ec.message();
+	// a manifest we couldn't write is not retried over and over
+	_stored_manifest_version = version;
+	_manifest_lock.unlock();
+}
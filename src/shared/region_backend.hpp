@@ -0,0 +1,110 @@
+#ifndef REGION_BACKEND_HPP_
+#define REGION_BACKEND_HPP_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "engine/vmath.hpp"
+#include "engine/time.hpp"
+#include "engine/rwlock.hpp"
+#include "engine/mutex.hpp"
+
+#include "chunk_archive.hpp"
+#include "chunk_backend.hpp"
+
+class ArchiveFile;
+class ContentStore;
+class WorldGenerator;
+
+/** Keeps every region of ChunkArchive::REGION_SIZE³ chunks in a file of its own
+
+	Chunks are updated in place, a chunk's directory entry points to where
+	its data is on the heap of the region file.  Identical chunks can be
+	shared across regions through a content store.  A manifest remembers
+	which region files exist, so opening a world doesn't have to list them.
+*/
+class RegionBackend : public ChunkBackend {
+public:
+	~RegionBackend();
+	RegionBackend(const char *, const ArchiveConf &, std::unique_ptr<WorldGenerator> generator);
+
+	RegionBackend(const RegionBackend &) = delete;
+	RegionBackend &operator = (const RegionBackend &) = delete;
+
+	bool hasChunk(vec3i64, uint32 *revision) override;
+	bool loadChunk(Chunk *) override;
+	void storeChunk(const Chunk &) override;
+	void storeChunks(const std::vector<const Chunk *> &) override;
+	void loadChunks(const std::vector<Chunk *> &) override;
+
+	bool compact() override;
+	size_t collectGarbage() override;
+	void clean(Time t = 0) override;
+
+	ContentStore *getContentStore() override { return _content_store.get(); }
+	size_t getNumOpenFiles() override;
+	std::vector<vec3i64> getRegions() override;
+
+private:
+	// what the manifest remembers about a region file, as of when it was closed
+	struct RegionStats {
+		size_t file_bytes = 0;
+		size_t used_bytes = 0;
+		size_t total_bytes = 0;
+		// not persisted, tells the prefetcher whether the file was written while it read it
+		uint32 num_closes = 0;
+	};
+
+	class Prefetcher;
+
+	ArchiveFile *unsafe_getArchiveFile(vec3i64, bool create);
+	ArchiveFile *unsafe_findArchiveFile(vec3i64);
+	ArchiveFile *newArchiveFile();
+	std::atomic<ArchiveFile *> &unsafe_getFreeSlot(vec3i64 rc);
+	void unsafe_addArchiveFile(vec3i64);
+	void unsafe_closeArchiveFile(ArchiveFile *);
+	void unsafe_clean(Time t = 0);
+	bool unsafe_dropReleases();
+	std::string getRegionFilename(vec3i64 rc) const;
+	ArchiveFile *unsafe_findLeastRecentFile();
+
+	void unsafe_prefetchNeighbors(vec3i64 cc);
+	void prefetchRegion(vec3i64 rc);
+
+	bool loadManifest();
+	void scanRegions();
+	// writes the manifest if _regions changed, the caller must not hold _file_map_lock
+	void storeManifest();
+
+	std::string _path;
+	ArchiveConf _conf;
+	std::unique_ptr<WorldGenerator> _generator;
+	// the generator isn't thread safe, but all region files share it
+	Mutex _generator_lock;
+	std::unique_ptr<ContentStore> _content_store;
+	// open addressing by region, hasChunk reads it without locking
+	std::unique_ptr<std::atomic<ArchiveFile *>[]> _file_table;
+	// every region that has a file, persisted in the manifest
+	std::unordered_map<vec3i64, RegionStats, size_t(*)(vec3i64)> _regions;
+	// held for reading while files are used, for writing while they are opened or closed
+	ReadWriteLock _file_map_lock;
+	size_t _max_open_files;
+	size_t _num_open_files = 0;
+	std::unique_ptr<Prefetcher> _prefetcher;
+	// opened by the prefetcher without any lock, then swapped into the file table
+	std::unique_ptr<ArchiveFile> _prefetch_file;
+	// held while the open files are synced for the content store's releases
+	Mutex _release_lock;
+
+	// serializes writing the manifest, which happens without _file_map_lock
+	Mutex _manifest_lock;
+	// counts the changes to _regions, guarded by _file_map_lock
+	uint64 _manifest_version = 0;
+	// the changes the manifest on disk has
+	std::atomic<uint64> _stored_manifest_version;
+};
+
+#endif // REGION_BACKEND_HPP_
@@ -42,6 +42,43 @@ Save::Save(std::string id) :
 		_good = false;
 	}
 
+	string backend = pt.get<string>("world.archive.backend", "regions");
+	if (backend == "regions") {
+		_archive_conf.backend = ArchiveBackend::REGIONS;
+	} else if (backend == "log") {
+		_archive_conf.backend = ArchiveBackend::LOG;
+	} else {
+		LOG_WARNING(logger) << "'" << filename << "' had unknown archive backend '" << backend << "'";
+	}
+	string policy = pt.get<string>("world.archive.policy", "full");
+	if (policy == "full") {
+		_archive_conf.policy = ArchivePolicy::FULL;
+	} else if (policy == "diff") {
+		_archive_conf.policy = ArchivePolicy::DIFF;
+	} else {
+		LOG_WARNING(logger) << "'" << filename << "' had unknown archive policy '" << policy << "'";
+	}
+	string compression = pt.get<string>("world.archive.compression", "rle");
+	if (compression == "rle") {
+		_archive_conf.compression = ArchiveCompression::RLE;
+	} else if (compression == "zlib") {
+		_archive_conf.compression = ArchiveCompression::ZLIB;
+	} else {
+		LOG_WARNING(logger) << "'" << filename << "' had unknown compression '" << compression << "'";
+	}
+	_archive_conf.compression_level = pt.get<int>("world.archive.compression_level",
+			_archive_conf.compression_level);
+	_archive_conf.sync = pt.get<bool>("world.archive.sync", _archive_conf.sync);
+	_archive_conf.io_threads = pt.get<int>("world.archive.io_threads", _archive_conf.io_threads);
+	_archive_conf.max_open_regions = pt.get<int>("world.archive.max_open_regions",
+			_archive_conf.max_open_regions);
+	_archive_conf.prefetch = pt.get<bool>("world.archive.prefetch", _archive_conf.prefetch);
+	_archive_conf.deduplicate = pt.get<bool>("world.archive.deduplicate", _archive_conf.deduplicate);
+	_archive_conf.log_segment_bytes = pt.get<size_t>("world.archive.log_segment_bytes",
+			_archive_conf.log_segment_bytes);
+	_archive_conf.log_merge_threshold = pt.get<float>("world.archive.log_merge_threshold",
+			_archive_conf.log_merge_threshold);
+
 	bool needs_new_spawn = false;
 	if (!pt.get_child_optional("world.spawn")) {
 		needs_new_spawn = true;
@@ -72,6 +109,8 @@ Save::~Save() {
 void Save::initialize(std::string name, uint64 seed) {
 	_name = name;
 	_seed = seed;
+	// new worlds only store what players changed, old ones keep storing everything
+	_archive_conf.policy = ArchivePolicy::DIFF;
 	auto world_gen = getWorldGenerator();
 	_spawn = world_gen->getSpawnLocation();
 	store();
@@ -85,6 +124,26 @@ void Save::store() {
 	pt.put("world.spawn.x", _spawn[0]);
 	pt.put("world.spawn.y", _spawn[1]);
 	pt.put("world.spawn.z", _spawn[2]);
+	switch (_archive_conf.backend) {
+	case ArchiveBackend::REGIONS: pt.put("world.archive.backend", "regions"); break;
+	case ArchiveBackend::LOG:     pt.put("world.archive.backend", "log");     break;
+	}
+	switch (_archive_conf.policy) {
+	case ArchivePolicy::FULL: pt.put("world.archive.policy", "full"); break;
+	case ArchivePolicy::DIFF: pt.put("world.archive.policy", "diff"); break;
+	}
+	switch (_archive_conf.compression) {
+	case ArchiveCompression::RLE:  pt.put("world.archive.compression", "rle");  break;
+	case ArchiveCompression::ZLIB: pt.put("world.archive.compression", "zlib"); break;
+	}
+	pt.put("world.archive.compression_level", _archive_conf.compression_level);
+	pt.put("world.archive.sync", _archive_conf.sync);
+	pt.put("world.archive.io_threads", _archive_conf.io_threads);
+	pt.put("world.archive.max_open_regions", _archive_conf.max_open_regions);
+	pt.put("world.archive.prefetch", _archive_conf.prefetch);
+	pt.put("world.archive.deduplicate", _archive_conf.deduplicate);
+	pt.put("world.archive.log_segment_bytes", _archive_conf.log_segment_bytes);
+	pt.put("world.archive.log_merge_threshold", _archive_conf.log_merge_threshold);
 	
 	string filename = string(_path) + "world.txt";
 	write_info(filename, pt);
@@ -97,6 +156,7 @@ unique_ptr<WorldGenerator> Save::getWorldGenerator() const {
 
 unique_ptr<ChunkArchive> Save::getChunkArchive() const {
 	string filename = string(_path) + "region/";
-	ChunkArchive *p_chunk_archive = new ChunkArchive(filename.c_str());
+	ChunkArchive *p_chunk_archive = new ChunkArchive(filename.c_str(), _archive_conf,
+			getWorldGenerator());
 	return unique_ptr<ChunkArchive>(p_chunk_archive);
 }
@@ -5,9 +5,9 @@
 #include <string>
 
 #include "shared/engine/vmath.hpp"
+#include "shared/chunk_archive.hpp"
 
 class WorldGenerator;
-class ChunkArchive;
 
 class Save {
 public:
@@ -19,6 +19,7 @@ public:
 	std::string getName() const { return _name; }
 	uint64 getSeed() const { return _seed; }
 	vec3i64 getSpawn() const { return _spawn; }
+	const ArchiveConf &getArchiveConf() const { return _archive_conf; }
 	bool isGood() const { return _good; }
 
 	void initialize(std::string name, uint64 seed);
@@ -33,6 +34,7 @@ private:
 	std::string _name;
 	uint64 _seed = 0;
 	vec3i64 _spawn;
+	ArchiveConf _archive_conf;
 	bool _good = true;
 };
 
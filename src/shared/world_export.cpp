@@ -0,0 +1,356 @@
+#include "world_export.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "engine/logging.hpp"
+#include "engine/macros.hpp"
+#include "engine/math.hpp"
+
+#include "game/chunk.hpp"
+
+#include "block_utils.hpp"
+#include "chunk_archive.hpp"
+#include "chunk_compression.hpp"
+
+using namespace std;
+
+static logging::Logger logger("io");
+
+static const uint8 EXPORT_MAGIC[4] = { 0x59, 0x97, 0x22, 0xE1 };
+static const int32 EXPORT_ENDIANESS_BYTES = 0x01020304;
+static const int32 EXPORT_VERSION = 1;
+
+// zlib gets faster than most disks around this level
+static const int EXPORT_COMPRESSION_LEVEL = 3;
+// frames being encoded or decoded at once per thread
+static const size_t FRAMES_PER_THREAD = 4;
+
+PACKED(
+struct ExportHeader {
+	uint8 magic[4];
+	int32 endianess_bytes;
+	int32 version;
+	uint8 reserved[4];
+});
+
+PACKED(
+struct ExportIndexEntry {
+	int64 rc[3];
+	uint64 offset;
+	uint32 size;
+	uint32 raw_size;
+	uint32 num_chunks;
+	uint8 reserved[4];
+});
+
+PACKED(
+struct ExportFooter {
+	uint64 index_offset;
+	uint32 num_regions;
+	uint8 magic[4];
+});
+
+enum ExportLayout {
+	EXPORT_UNIFORM = 0,
+	EXPORT_RLE = 1,
+	EXPORT_PLAIN = 2,
+};
+
+// precedes the encoded blocks of every chunk within a frame
+PACKED(
+struct ExportChunkRecord {
+	int64 cc[3];
+	uint32 revision;
+	uint32 size;
+	uint8 layout;
+	uint8 uniform_type;
+	uint8 reserved[2];
+});
+
+struct ExportFrame {
+	ExportIndexEntry entry;
+	std::vector<uint8> data;
+	bool good;
+};
+
+// runs work(i) for every i in [begin, end) on up to num_threads threads
+template <typename Func>
+static void runParallel(size_t begin, size_t end, int num_threads, Func work) {
+	std::atomic<size_t> next(begin);
+	std::vector<std::thread> threads;
+	size_t count = std::min(end - begin, (size_t) std::max(num_threads, 1));
+	for (size_t t = 0; t < count; ++t) {
+		threads.emplace_back([&]() {
+			for (size_t i = next++; i < end; i = next++)
+				work(i);
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+}
+
+static void encodeFrame(ChunkArchive *archive, vec3i64 rc, ExportFrame *frame) {
+	memset((char *) &frame->entry, 0, sizeof(ExportIndexEntry));
+	for (int i = 0; i < 3; ++i)
+		frame->entry.rc[i] = rc[i];
+	frame->good = true;
+
+	std::vector<uint8> raw;
+	std::unique_ptr<uint8[]> blocks(new uint8[Chunk::SIZE]);
+	for (vec3i64 cc : ChunkArchive::getRegionChunks(rc)) {
+		if (!archive->hasChunk(cc))
+			continue;
+		Chunk chunk;
+		chunk.initCC(cc);
+		if (!archive->loadChunk(&chunk)) {
+			LOG_ERROR(logger) << "Chunk (" << cc << ") could not be exported";
+			frame->good = false;
+			return;
+		}
+
+		ExportChunkRecord record;
+		memset((char *) &record, 0, sizeof(ExportChunkRecord));
+		for (int i = 0; i < 3; ++i)
+			record.cc[i] = cc[i];
+		record.revision = chunk.getRevision();
+		size_t start = raw.size();
+		raw.resize(start + sizeof(ExportChunkRecord) + Chunk::SIZE + 4);
+		uint8 *encoded = &raw[start + sizeof(ExportChunkRecord)];
+		if (chunk.isUniform()) {
+			record.layout = EXPORT_UNIFORM;
+			record.uniform_type = chunk.getUniformType();
+		} else {
+			// like in region files, chunks that don't get smaller are stored plainly,
+			// the extra bytes tell those from encodings that just fit
+			chunk.getBlocks(blocks.get());
+			int size = encodeBlocks_RLE(blocks.get(), encoded, Chunk::SIZE + 4);
+			record.layout = EXPORT_RLE;
+			if (size >= (int) Chunk::SIZE) {
+				size = encodeBlocks_PLAIN(blocks.get(), encoded, Chunk::SIZE);
+				record.layout = EXPORT_PLAIN;
+			}
+			if (size <= 0) {
+				LOG_ERROR(logger) << "Chunk (" << cc << ") could not be encoded";
+				frame->good = false;
+				return;
+			}
+			record.size = size;
+		}
+		memcpy(&raw[start], &record, sizeof(ExportChunkRecord));
+		raw.resize(start + sizeof(ExportChunkRecord) + record.size);
+		++frame->entry.num_chunks;
+	}
+
+	frame->entry.raw_size = (uint32) raw.size();
+	frame->data.resize(raw.size() + raw.size() / 8 + 64);
+	int size = encodeBytes_ZLIB(raw.data(), raw.size(), frame->data.data(), frame->data.size(),
+			EXPORT_COMPRESSION_LEVEL);
+	if (size < 0) {
+		LOG_ERROR(logger) << "Region (" << rc << ") could not be compressed";
+		frame->good = false;
+		return;
+	}
+	frame->data.resize(size);
+	frame->entry.size = (uint32) size;
+}
+
+bool exportWorld(ChunkArchive *archive, const char *filename, int num_threads,
+		WorldExportStats *stats) {
+	WorldExportStats local_stats;
+	if (!stats)
+		stats = &local_stats;
+	*stats = WorldExportStats();
+
+	std::vector<vec3i64> regions = archive->getRegions();
+	std::sort(regions.begin(), regions.end(), [](const vec3i64 &a, const vec3i64 &b) {
+		return getMortonCode(a) < getMortonCode(b);
+	});
+
+	std::ofstream file(filename, ios_base::out | ios_base::binary | ios_base::trunc);
+	if (!file.is_open()) {
+		LOG_ERROR(logger) << "Could not create '" << filename << "'";
+		return false;
+	}
+	ExportHeader header;
+	memset((char *) &header, 0, sizeof(ExportHeader));
+	memcpy(header.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+	header.endianess_bytes = EXPORT_ENDIANESS_BYTES;
+	header.version = EXPORT_VERSION;
+	file.write((const char *) &header, sizeof(ExportHeader));
+
+	// a window of frames is encoded in parallel, then written in order
+	std::vector<ExportIndexEntry> index;
+	std::vector<ExportFrame> frames(std::max(num_threads, 1) * FRAMES_PER_THREAD);
+	uint64 offset = sizeof(ExportHeader);
+	for (size_t begin = 0; begin < regions.size(); begin += frames.size()) {
+		size_t end = std::min(begin + frames.size(), regions.size());
+		runParallel(begin, end, num_threads, [&](size_t i) {
+			encodeFrame(archive, regions[i], &frames[i - begin]);
+		});
+		for (size_t i = 0; i < end - begin; ++i) {
+			ExportFrame &frame = frames[i];
+			if (!frame.good)
+				return false;
+			// empty regions don't need a frame
+			if (frame.entry.num_chunks == 0)
+				continue;
+			frame.entry.offset = offset;
+			file.write((const char *) frame.data.data(), frame.data.size());
+			offset += frame.data.size();
+			index.push_back(frame.entry);
+			stats->chunks += frame.entry.num_chunks;
+		}
+	}
+
+	ExportFooter footer;
+	memset((char *) &footer, 0, sizeof(ExportFooter));
+	footer.index_offset = offset;
+	footer.num_regions = (uint32) index.size();
+	memcpy(footer.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC));
+	file.write((const char *) index.data(), index.size() * sizeof(ExportIndexEntry));
+	file.write((const char *) &footer, sizeof(ExportFooter));
+	file.flush();
+	if (!file.good()) {
+		LOG_ERROR(logger) << "Could not write '" << filename << "'";
+		return false;
+	}
+
+	stats->regions = index.size();
+	stats->file_bytes = offset + index.size() * sizeof(ExportIndexEntry) + sizeof(ExportFooter);
+	return true;
+}
+
+static bool decodeFrame(ChunkArchive *archive, const char *filename, const ExportIndexEntry &entry) {
+	vec3i64 rc(entry.rc[0], entry.rc[1], entry.rc[2]);
+	std::ifstream file(filename, ios_base::in | ios_base::binary);
+	std::vector<uint8> data(entry.size);
+	file.seekg(entry.offset);
+	if (!file.read((char *) data.data(), data.size())) {
+		LOG_ERROR(logger) << "Region (" << rc << ") of '" << filename << "' ended abruptly";
+		return false;
+	}
+	std::vector<uint8> raw(entry.raw_size);
+	if (decodeBytes_ZLIB(data.data(), data.size(), raw.data(), raw.size()) != (int) raw.size()) {
+		LOG_ERROR(logger) << "Region (" << rc << ") of '" << filename << "' was corrupt";
+		return false;
+	}
+
+	std::vector<std::unique_ptr<Chunk>> chunks;
+	chunks.reserve(entry.num_chunks);
+	size_t pos = 0;
+	while (pos < raw.size()) {
+		ExportChunkRecord record;
+		if (raw.size() - pos < sizeof(ExportChunkRecord))
+			break;
+		memcpy(&record, &raw[pos], sizeof(ExportChunkRecord));
+		pos += sizeof(ExportChunkRecord);
+		vec3i64 cc(record.cc[0], record.cc[1], record.cc[2]);
+		if (record.size > raw.size() - pos || ChunkArchive::getRegionCoords(cc) != rc)
+			break;
+
+		std::unique_ptr<Chunk> chunk(new Chunk(Chunk::VISUAL));
+		chunk->initCC(cc);
+		chunk->initRevision(record.revision);
+		bool good;
+		if (record.layout == EXPORT_UNIFORM) {
+			chunk->initUniform(record.uniform_type);
+			good = true;
+		} else if (record.layout == EXPORT_RLE) {
+			good = decodeBlocks_RLE(&raw[pos], record.size, chunk->getBlocksForInit());
+		} else if (record.layout == EXPORT_PLAIN && record.size == Chunk::SIZE) {
+			memcpy(chunk->getBlocksForInit(), &raw[pos], Chunk::SIZE);
+			good = true;
+		} else {
+			good = false;
+		}
+		if (!good)
+			break;
+		chunk->finishInitialization();
+		chunks.push_back(std::move(chunk));
+		pos += record.size;
+	}
+	if (pos != raw.size() || chunks.size() != entry.num_chunks) {
+		LOG_ERROR(logger) << "Region (" << rc << ") of '" << filename << "' was corrupt";
+		return false;
+	}
+
+	std::vector<const Chunk *> chunk_ptrs;
+	chunk_ptrs.reserve(chunks.size());
+	for (auto &chunk : chunks)
+		chunk_ptrs.push_back(chunk.get());
+	archive->storeChunks(chunk_ptrs);
+	return true;
+}
+
+bool importWorld(ChunkArchive *archive, const char *filename, int num_threads,
+		WorldExportStats *stats) {
+	WorldExportStats local_stats;
+	if (!stats)
+		stats = &local_stats;
+	*stats = WorldExportStats();
+
+	std::ifstream file(filename, ios_base::in | ios_base::binary);
+	if (!file.is_open()) {
+		LOG_ERROR(logger) << "Could not open '" << filename << "'";
+		return false;
+	}
+	file.seekg(0, ios_base::end);
+	uint64 file_bytes = (uint64) file.tellg();
+
+	ExportHeader header;
+	ExportFooter footer;
+	file.seekg(0);
+	bool good = file_bytes >= sizeof(ExportHeader) + sizeof(ExportFooter)
+			&& file.read((char *) &header, sizeof(ExportHeader));
+	if (good) {
+		file.seekg(file_bytes - sizeof(ExportFooter));
+		good = file.read((char *) &footer, sizeof(ExportFooter))
+				&& memcmp(header.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC)) == 0
+				&& memcmp(footer.magic, EXPORT_MAGIC, sizeof(EXPORT_MAGIC)) == 0
+				&& header.endianess_bytes == EXPORT_ENDIANESS_BYTES
+				&& header.version == EXPORT_VERSION
+				&& footer.index_offset + (uint64) footer.num_regions * sizeof(ExportIndexEntry)
+						+ sizeof(ExportFooter) == file_bytes;
+	}
+	if (!good) {
+		LOG_ERROR(logger) << "'" << filename << "' is not a world export";
+		return false;
+	}
+
+	std::vector<ExportIndexEntry> index(footer.num_regions);
+	file.seekg(footer.index_offset);
+	if (!file.read((char *) index.data(), index.size() * sizeof(ExportIndexEntry))) {
+		LOG_ERROR(logger) << "Index of '" << filename << "' could not be read";
+		return false;
+	}
+	// no region can hold more than this, anything bigger is corrupt rather than a reason to run out of memory
+	size_t max_raw_size = ChunkArchive::getRegionChunks(vec3i64(0, 0, 0)).size()
+			* (sizeof(ExportChunkRecord) + Chunk::SIZE);
+	for (const ExportIndexEntry &entry : index) {
+		if (entry.offset + entry.size > footer.index_offset || entry.raw_size > max_raw_size) {
+			LOG_ERROR(logger) << "Index of '" << filename << "' was corrupt";
+			return false;
+		}
+	}
+
+	// every thread reads its frames with its own stream
+	std::atomic<bool> all_good(true);
+	runParallel(0, index.size(), num_threads, [&](size_t i) {
+		if (all_good && !decodeFrame(archive, filename, index[i]))
+			all_good = false;
+	});
+	if (!all_good)
+		return false;
+
+	stats->regions = index.size();
+	for (const ExportIndexEntry &entry : index)
+		stats->chunks += entry.num_chunks;
+	stats->file_bytes = file_bytes;
+	return true;
+}
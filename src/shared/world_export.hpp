@@ -0,0 +1,32 @@
+#ifndef WORLD_EXPORT_HPP_
+#define WORLD_EXPORT_HPP_
+
+#include "engine/std_types.hpp"
+
+class ChunkArchive;
+
+struct WorldExportStats {
+	size_t regions = 0;
+	size_t chunks = 0;
+	size_t file_bytes = 0;
+};
+
+/** Single file copies of a chunk archive, for backups and moving worlds
+
+	The file holds one compressed frame per region, ordered along a Morton
+	curve over the regions, with the chunk records of a frame in Morton order
+	as well.  An index at the end of the file points to every frame.  Frames
+	are encoded and decoded by num_threads threads, while the file itself is
+	written sequentially.
+
+	Chunks are read from and written to the archive like the game does it,
+	so its configuration decides how the imported region files are encoded.
+	Both return false if something went wrong, chunks that were imported up
+	to that point stay in the archive.
+*/
+bool exportWorld(ChunkArchive *, const char *filename, int num_threads = 4,
+		WorldExportStats * = nullptr);
+bool importWorld(ChunkArchive *, const char *filename, int num_threads = 4,
+		WorldExportStats * = nullptr);
+
+#endif // WORLD_EXPORT_HPP_
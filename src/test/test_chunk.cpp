@@ -0,0 +1,400 @@
+#include "test/gtest.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "shared/engine/std_types.hpp"
+#include "shared/engine/time.hpp"
+#include "shared/game/chunk.hpp"
+#include "shared/block_utils.hpp"
+
+using namespace testing;
+
+template <class Func>
+static void initChunk(Chunk &chunk, Func func) {
+	chunk.initCC({ 0, 0, 0 });
+	for (size_t index = 0; index < Chunk::SIZE; ++index)
+		chunk.initBlock(index, func(index));
+	chunk.finishInitialization();
+}
+
+static size_t countDifferences(const Chunk &chunk, const uint8 *expected) {
+	uint8 blocks[Chunk::SIZE];
+	chunk.getBlocks(blocks);
+	size_t failed = 0;
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (blocks[i] != expected[i] || chunk.getBlock(i) != expected[i])
+			++failed;
+	}
+	return failed;
+}
+
+TEST(ChunkTest, PaletteWidth) {
+	const uint numTypes[] = { 1, 2, 3, 4, 5, 16, 17, 256 };
+	const uint expectedBits[] = { 0, 1, 2, 2, 4, 4, 8, 8 };
+	for (size_t t = 0; t < sizeof(numTypes) / sizeof(numTypes[0]); ++t) {
+		Chunk chunk;
+		uint n = numTypes[t];
+		initChunk(chunk, [n](size_t index) { return (uint8) (index % n); });
+		EXPECT_EQ(expectedBits[t], chunk.getBitsPerBlock()) << n << " block types";
+		EXPECT_EQ(Chunk::SIZE * expectedBits[t] / 8, chunk.getBlockMemory()) << n << " block types";
+	}
+}
+
+TEST(ChunkTest, GetBlocks) {
+	std::minstd_rand rng;
+	rng.seed(1);
+	std::uniform_int_distribution<uint> distr(0, 9);
+
+	uint8 expected[Chunk::SIZE];
+	for (size_t i = 0; i < Chunk::SIZE; ++i)
+		expected[i] = (uint8) (distr(rng) * 13);
+
+	Chunk chunk;
+	initChunk(chunk, [&expected](size_t index) { return expected[index]; });
+	EXPECT_EQ(4u, chunk.getBitsPerBlock());
+	EXPECT_EQ(0u, countDifferences(chunk, expected)) << "Paletted blocks differ from initialization";
+}
+
+TEST(ChunkTest, SetBlockGrowsPalette) {
+	uint8 expected[Chunk::SIZE];
+	memset(expected, 1, sizeof(expected));
+
+	Chunk chunk;
+	initChunk(chunk, [](size_t) { return (uint8) 1; });
+	EXPECT_TRUE(chunk.isUniform());
+
+	std::minstd_rand rng;
+	rng.seed(2);
+	std::uniform_int_distribution<uint> indexDistr(0, Chunk::SIZE - 1);
+	for (uint type = 0; type < 256; ++type) {
+		for (int i = 0; i < 50; ++i) {
+			size_t index = indexDistr(rng);
+			expected[index] = (uint8) type;
+			chunk.setBlock(index, (uint8) type);
+		}
+		ASSERT_EQ(0u, countDifferences(chunk, expected)) << "Blocks changed after adding type " << type;
+	}
+	EXPECT_EQ(8u, chunk.getBitsPerBlock());
+
+	uint numAirBlocks = 0;
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (expected[i] == 0)
+			++numAirBlocks;
+	}
+	EXPECT_EQ(numAirBlocks, chunk.getNumAirBlocks());
+}
+
+TEST(ChunkTest, ResetReleasesBlocks) {
+	Chunk chunk(Chunk::VISUAL);
+	initChunk(chunk, [](size_t index) { return (uint8) (index % 7); });
+	EXPECT_NE(0u, chunk.getBlockMemory());
+	chunk.reset();
+	EXPECT_EQ(0u, chunk.getBlockMemory());
+	EXPECT_FALSE(chunk.isInitialized());
+}
+
+TEST(ChunkTest, Copy) {
+	uint8 expected[Chunk::SIZE];
+	for (size_t i = 0; i < Chunk::SIZE; ++i)
+		expected[i] = (uint8) (i % 5);
+
+	Chunk chunk(Chunk::VISUAL);
+	initChunk(chunk, [&expected](size_t index) { return expected[index]; });
+	Chunk copy(Chunk::VISUAL);
+	copy.initCopy(chunk);
+	EXPECT_TRUE(copy.isInitialized());
+	EXPECT_EQ(chunk.getRevision(), copy.getRevision());
+	EXPECT_EQ(chunk.getNumAirBlocks(), copy.getNumAirBlocks());
+	EXPECT_EQ(chunk.getPassThroughs(), copy.getPassThroughs());
+
+	// neither chunk sees what happens to the other one
+	chunk.setBlock(0, 7);
+	chunk.reset();
+	EXPECT_EQ(0u, countDifferences(copy, expected)) << "Copy changed with the original";
+	copy.setBlock(1, 0);
+	EXPECT_EQ(0u, chunk.getBlockMemory());
+}
+
+TEST(ChunkTest, Uniform) {
+	Chunk chunk(Chunk::VISUAL);
+	initChunk(chunk, [](size_t) { return (uint8) 3; });
+	ASSERT_TRUE(chunk.isUniform());
+	EXPECT_EQ(3, chunk.getUniformType());
+	EXPECT_EQ(0u, chunk.getBlockMemory());
+	EXPECT_EQ(0u, chunk.getNumAirBlocks());
+	EXPECT_EQ(0, chunk.getPassThroughs());
+
+	uint8 expected[Chunk::SIZE];
+	memset(expected, 3, sizeof(expected));
+	EXPECT_EQ(0u, countDifferences(chunk, expected));
+
+	expected[1234] = 0;
+	chunk.setBlock(1234, 0);
+	EXPECT_FALSE(chunk.isUniform());
+	EXPECT_EQ(1u, chunk.getNumAirBlocks());
+	EXPECT_EQ(0u, countDifferences(chunk, expected));
+
+	Chunk air(Chunk::VISUAL);
+	air.initCC({ 0, 0, 0 });
+	air.initUniform(0);
+	air.finishInitialization();
+	EXPECT_TRUE(air.isEmpty());
+	EXPECT_EQ(0x7FFF, air.getPassThroughs());
+}
+
+static size_t countSolidDifferences(const Chunk &chunk) {
+	const uint W = Chunk::WIDTH;
+	uint32 rows[W * W];
+	chunk.getSolidRows(rows);
+	size_t failed = 0;
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		bool solid = chunk.getBlock(i) != 0;
+		if (chunk.isSolid(i) != solid || (((rows[i / W] >> (i % W)) & 1) != 0) != solid
+				|| (((chunk.getSolidRow(i / W % W, i / W / W) >> (i % W)) & 1) != 0) != solid)
+			++failed;
+	}
+	return failed;
+}
+
+TEST(ChunkTest, SolidRows) {
+	std::minstd_rand rng;
+	rng.seed(6);
+	std::uniform_int_distribution<uint> distr(0, 3);
+	Chunk chunk;
+	initChunk(chunk, [&rng, &distr](size_t) { return (uint8) distr(rng); });
+	EXPECT_EQ(0u, countSolidDifferences(chunk));
+
+	std::uniform_int_distribution<size_t> indexDistr(0, Chunk::SIZE - 1);
+	for (int i = 0; i < 1000; ++i)
+		chunk.setBlock(indexDistr(rng), (uint8) distr(rng));
+	EXPECT_EQ(0u, countSolidDifferences(chunk)) << "Solid blocks did not follow setBlock";
+
+	for (uint8 type : { 0, 5 }) {
+		Chunk uniform;
+		initChunk(uniform, [type](size_t) { return type; });
+		EXPECT_EQ(0u, countSolidDifferences(uniform)) << "Uniform chunk of type " << (int) type;
+		uniform.setBlock(77, type == 0 ? 1 : 0);
+		EXPECT_EQ(0u, countSolidDifferences(uniform)) << "Edited uniform chunk of type " << (int) type;
+	}
+}
+
+// flood fills the air block by block, like passThroughs were computed before
+static uint16 referencePassThroughs(const uint8 *blocks) {
+	const uint W = Chunk::WIDTH;
+	uint numAirBlocks = 0;
+	for (size_t i = 0; i < Chunk::SIZE; ++i) {
+		if (blocks[i] == 0)
+			++numAirBlocks;
+	}
+	if (numAirBlocks == Chunk::SIZE || numAirBlocks > Chunk::SIZE - W * W)
+		return 0x7FFF;
+	else if (numAirBlocks == 0)
+		return 0;
+
+	uint16 passThroughs = 0;
+	std::vector<bool> visited(Chunk::SIZE, false);
+	std::vector<vec3ui8> fringe(Chunk::SIZE);
+	size_t index = 0;
+	for (uint8 z = 0; z < W; z++)
+	for (uint8 y = 0; y < W; y++)
+	for (uint8 x = 0; x < W; x++, index++) {
+		if (visited[index] || blocks[index] != 0)
+			continue;
+		visited[index] = true;
+		fringe[0] = vec3ui8(x, y, z);
+		int fringeSize = 1;
+		int borderSet = 0;
+		while (fringeSize > 0) {
+			vec3ui8 icc = fringe[--fringeSize];
+			for (int d = 0; d < 6; d++) {
+				if (icc[DIR_DIMS[d]] == (1 - d / 3) * (W - 1)) {
+					borderSet |= (1 << d);
+				} else {
+					vec3ui8 nIcc = icc + DIRS[d].cast<uint8>();
+					size_t nIndex = Chunk::getBlockIndex(nIcc);
+					if (blocks[nIndex] == 0 && !visited[nIndex]) {
+						visited[nIndex] = true;
+						fringe[fringeSize++] = nIcc;
+					}
+				}
+			}
+		}
+		int shift = 0;
+		for (int d1 = 0; d1 < 5; d1++) {
+			for (int d2 = d1 + 1; d2 < 6; d2++, shift++) {
+				if ((borderSet & (1 << d1)) && (borderSet & (1 << d2)))
+					passThroughs |= (1 << shift);
+			}
+		}
+	}
+	return passThroughs;
+}
+
+// solid blocks with air in random tunnels, which are the hard case for a flood fill
+static void makeCaveBlocks(std::minstd_rand &rng, uint8 *blocks, int numTunnels) {
+	memset(blocks, 1, Chunk::SIZE);
+	std::uniform_int_distribution<int> posDistr(0, Chunk::WIDTH - 1);
+	std::uniform_int_distribution<int> dirDistr(0, 5);
+	for (int t = 0; t < numTunnels; ++t) {
+		vec3i64 p(posDistr(rng), posDistr(rng), posDistr(rng));
+		for (int step = 0; step < 200; ++step) {
+			blocks[Chunk::getBlockIndex(p.cast<uint8>())] = 0;
+			vec3i64 next = p + DIRS[dirDistr(rng)].cast<int64>();
+			if (next[0] >= 0 && next[1] >= 0 && next[2] >= 0 && next[0] < Chunk::WIDTH
+					&& next[1] < Chunk::WIDTH && next[2] < Chunk::WIDTH)
+				p = next;
+		}
+	}
+}
+
+TEST(ChunkTest, PassThroughs) {
+	std::minstd_rand rng;
+	rng.seed(3);
+	uint8 blocks[Chunk::SIZE];
+	for (int i = 0; i < 200; ++i) {
+		if (i % 2 == 0) {
+			// from almost all air to almost no air, around where the air stops percolating
+			std::uniform_int_distribution<uint> distr(0, 99);
+			uint solidPercent = 5 + i * 90 / 200;
+			// and with every width of palette indices
+			const uint numTypes[] = { 1, 3, 10, 100 };
+			uint n = numTypes[i / 2 % 4];
+			for (size_t j = 0; j < Chunk::SIZE; ++j)
+				blocks[j] = distr(rng) < solidPercent ? (uint8) (1 + j % n) : 0;
+		} else {
+			makeCaveBlocks(rng, blocks, 1 + i % 20);
+		}
+		Chunk chunk(Chunk::VISUAL);
+		initChunk(chunk, [&blocks](size_t index) { return blocks[index]; });
+		ASSERT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs()) << "Chunk " << i;
+	}
+
+	// walls that only let some faces through, edited block by block
+	Chunk chunk(Chunk::VISUAL);
+	initChunk(chunk, [](size_t) { return (uint8) 0; });
+	memset(blocks, 0, sizeof(blocks));
+	for (uint8 a = 0; a < Chunk::WIDTH; ++a)
+	for (uint8 b = 0; b < Chunk::WIDTH; ++b) {
+		size_t index = Chunk::getBlockIndex(vec3ui8(a, 16, b));
+		blocks[index] = 1;
+		chunk.setBlock(index, 1);
+	}
+	EXPECT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs());
+	size_t hole = Chunk::getBlockIndex(vec3ui8(31, 16, 0));
+	blocks[hole] = 0;
+	chunk.setBlock(hole, 0);
+	EXPECT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs());
+	EXPECT_EQ(0x7FFF, chunk.getPassThroughs());
+}
+
+TEST(ChunkTest, EditPassThroughs) {
+	std::minstd_rand rng;
+	rng.seed(5);
+	std::uniform_int_distribution<size_t> indexDistr(0, Chunk::SIZE - 1);
+	uint8 blocks[Chunk::SIZE];
+	for (int c = 0; c < 4; ++c) {
+		makeCaveBlocks(rng, blocks, 2 + c * 4);
+		Chunk chunk(Chunk::VISUAL);
+		initChunk(chunk, [&blocks](size_t index) { return blocks[index]; });
+
+		// edits along the tunnels, which cut them apart and join them again
+		for (int i = 0; i < 300; ++i) {
+			size_t index = indexDistr(rng);
+			while (blocks[index] != 0)
+				index = indexDistr(rng);
+			if (i % 3 == 0) {
+				blocks[index] = 1;
+			} else {
+				vec3ui8 icc(index % Chunk::WIDTH, index / Chunk::WIDTH % Chunk::WIDTH, index / Chunk::WIDTH / Chunk::WIDTH);
+				int d = (int) (indexDistr(rng) % 6);
+				vec3i64 n = icc.cast<int64>() + DIRS[d].cast<int64>();
+				if (n[0] < 0 || n[1] < 0 || n[2] < 0 || n[0] >= Chunk::WIDTH || n[1] >= Chunk::WIDTH || n[2] >= Chunk::WIDTH)
+					continue;
+				index = Chunk::getBlockIndex(n.cast<uint8>());
+				blocks[index] = blocks[index] == 0 ? 1 : 0;
+			}
+			chunk.setBlock(index, blocks[index]);
+			ASSERT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs()) << "Chunk " << c << ", edit " << i;
+		}
+	}
+
+	// a wall that is closed and opened again, block by block
+	Chunk chunk(Chunk::VISUAL);
+	initChunk(chunk, [](size_t) { return (uint8) 0; });
+	memset(blocks, 0, sizeof(blocks));
+	for (int pass = 0; pass < 2; ++pass) {
+		for (uint8 a = 0; a < Chunk::WIDTH; ++a)
+		for (uint8 b = 0; b < Chunk::WIDTH; ++b) {
+			size_t index = Chunk::getBlockIndex(vec3ui8(a, b, 7));
+			blocks[index] = pass == 0 ? 2 : 0;
+			chunk.setBlock(index, blocks[index]);
+			if (b % 8 == 0) {
+				ASSERT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs()) << (int) a << " " << (int) b;
+			}
+		}
+		EXPECT_EQ(referencePassThroughs(blocks), chunk.getPassThroughs());
+	}
+}
+
+TEST(ChunkTest, DISABLED_PassThroughsThroughput) {
+	const int NUM_CHUNKS = 32;
+	const int ITERATIONS = 10;
+	const int EDITS = 1000;
+	std::minstd_rand rng;
+	rng.seed(4);
+	std::vector<uint8> blocks(NUM_CHUNKS * Chunk::SIZE);
+	for (int i = 0; i < NUM_CHUNKS; ++i)
+		makeCaveBlocks(rng, &blocks[i * Chunk::SIZE], 1 + i);
+
+	auto measure = [&](std::function<void(int)> func) {
+		Time start = getCurrentTime();
+		for (int k = 0; k < ITERATIONS; ++k) {
+			for (int i = 0; i < NUM_CHUNKS; ++i)
+				func(i);
+		}
+		return (getCurrentTime() - start) / ((double) ITERATIONS * NUM_CHUNKS);
+	};
+
+	// keeps the reference from being optimized away
+	volatile uint16 result = 0;
+	double reference = measure([&](int i) { result = referencePassThroughs(&blocks[i * Chunk::SIZE]); });
+	(void) result;
+
+	// initializing a visual chunk computes its passThroughs, other chunks don't
+	std::vector<Chunk> chunks;
+	for (int i = 0; i < NUM_CHUNKS; ++i)
+		chunks.emplace_back(Chunk::VISUAL);
+	auto initialize = [&](int i) {
+		const uint8 *chunkBlocks = &blocks[i * Chunk::SIZE];
+		chunks[i].reset();
+		initChunk(chunks[i], [chunkBlocks](size_t index) { return chunkBlocks[index]; });
+	};
+	double visual = measure(initialize);
+	for (int i = 0; i < NUM_CHUNKS; ++i)
+		chunks[i] = Chunk();
+	double plain = measure(initialize);
+
+	// after the first edit of a chunk, edits only update the labels around the block
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		chunks[i] = Chunk(Chunk::VISUAL);
+		initialize(i);
+		chunks[i].setBlock(0, chunks[i].getBlock(0));
+		chunks[i].setBlock(0, chunks[i].getBlock(0) == 0 ? 1 : 0);
+	}
+	std::uniform_int_distribution<size_t> indexDistr(0, Chunk::SIZE - 1);
+	Time start = getCurrentTime();
+	for (int e = 0; e < EDITS; ++e) {
+		Chunk &chunk = chunks[e % NUM_CHUNKS];
+		size_t index = indexDistr(rng);
+		chunk.setBlock(index, chunk.getBlock(index) == 0 ? 1 : 0);
+	}
+	double edit = (getCurrentTime() - start) / (double) EDITS;
+
+	printf("flood fill   %8.1f us per chunk\n", reference);
+	printf("row bitmasks %8.1f us per chunk\n", visual - plain);
+	printf("setBlock     %8.1f us per edit\n", edit);
+}
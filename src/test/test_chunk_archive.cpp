@@ -1,12 +1,29 @@
 #include "test/gtest.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstring>
 #include <cstdlib>
+#include <fstream>
+#include <memory>
 #include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <boost/filesystem.hpp>
 
 #include "shared/engine/std_types.hpp"
+#include "shared/engine/time.hpp"
 #include "shared/game/chunk.hpp"
+#include "shared/game/world_generator.hpp"
+#include "shared/archive_storage.hpp"
+#include "shared/archive_workers.hpp"
 #include "shared/chunk_archive.hpp"
+#include "shared/content_store.hpp"
+#include "shared/log_backend.hpp"
 
 using namespace testing;
 
@@ -14,7 +31,7 @@ float getRelativeChunkDifference(const Chunk &lhs, const Chunk &rhs) {
 	size_t failed = 0;
 
 	for (size_t i = 0; i < Chunk::SIZE; ++i) {
-		if (lhs.getBlocks()[i] != rhs.getBlocks()[i])
+		if (lhs.getBlock(i) != rhs.getBlock(i))
 			++failed;
 	}
 
@@ -24,12 +41,6 @@ float getRelativeChunkDifference(const Chunk &lhs, const Chunk &rhs) {
 		return (float) failed / Chunk::SIZE;
 }
 
-void store_and_load(const Chunk &supposed, Chunk *actual) {
-	ChunkArchive archive("./test/temp/");
-	archive.storeChunk(supposed);
-	actual->initCC(supposed.getCC());
-	archive.loadChunk(actual);
-}
 
 template <class Func>
 void initChunk(Chunk &chunk, Func func) {
@@ -43,7 +54,46 @@ void initChunk(Chunk &chunk, Func func) {
 	chunk.finishInitialization();
 }
 
-TEST(ChunkArchiveTest, AirChunk) {
+class ChunkArchiveTest : public TestWithParam<std::tuple<ArchiveBackend, ArchiveIO>> {
+protected:
+	// every kind of storage gets its own directories, so they can't read each other's files
+	std::string getPath(const char *name = "temp") const {
+		std::string path = std::string("./test/") + name + (isRegionBackend() ? "" : "_log")
+				+ (std::get<1>(GetParam()) == ArchiveIO::STREAM ? "_stream/" : "_mmap/");
+		paths.insert(path);
+		return path;
+	}
+
+	void TearDown() override {
+		for (const std::string &path : paths)
+			boost::filesystem::remove_all(path);
+	}
+
+	ArchiveConf getConf() const {
+		ArchiveConf conf;
+		conf.backend = std::get<0>(GetParam());
+		conf.io = std::get<1>(GetParam());
+		return conf;
+	}
+
+	// tests of region files, the manifest and the content store don't apply to the other backends
+	bool isRegionBackend() const {
+		return std::get<0>(GetParam()) == ArchiveBackend::REGIONS;
+	}
+
+	void store_and_load(const Chunk &supposed, Chunk *actual) {
+		ChunkArchive archive(getPath().c_str(), getConf());
+		archive.storeChunk(supposed);
+		actual->initCC(supposed.getCC());
+		archive.loadChunk(actual);
+	}
+
+private:
+	// the directories of the test, removed after it
+	mutable std::set<std::string> paths;
+};
+
+TEST_P(ChunkArchiveTest, AirChunk) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -55,7 +105,7 @@ TEST(ChunkArchiveTest, AirChunk) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Air chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, StoneChunk) {
+TEST_P(ChunkArchiveTest, StoneChunk) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -67,7 +117,7 @@ TEST(ChunkArchiveTest, StoneChunk) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Stone chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, UncompressibleChunk) {
+TEST_P(ChunkArchiveTest, UncompressibleChunk) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -81,7 +131,47 @@ TEST(ChunkArchiveTest, UncompressibleChunk) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Checkered chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, RandomChunk) {
+TEST_P(ChunkArchiveTest, EscapeCharacters) {
+	Chunk supposed;
+	supposed.initCC({ 0, 0, 0 });
+	Chunk actual;
+
+	// every escape character takes 3 bytes, RLE runs out of room 2 bytes short of a chunk
+	initChunk(supposed, [](size_t, size_t, size_t, size_t index) -> uint8 {
+		return index == 0 ? 1 : (index % 2 ? 7 : 255);
+	});
+
+	store_and_load(supposed, &actual);
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Escape character chunk did not store and load properly";
+}
+
+TEST_P(ChunkArchiveTest, TruncatedRegion) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_truncated");
+	boost::filesystem::remove_all(path);
+
+	Chunk supposed;
+	supposed.initCC({ 0, 0, 0 });
+	// short runs, so it is stored with RLE
+	initChunk(supposed, [](size_t, size_t, size_t, size_t index) -> uint8 {
+		return (index / 5) % 7;
+	});
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		archive.storeChunk(supposed);
+	}
+
+	// the end of the chunk never made it to the disk
+	std::string region = path + "0_0_0.region";
+	boost::filesystem::resize_file(region, boost::filesystem::file_size(region) - 1000);
+	ChunkArchive archive(path.c_str(), getConf());
+	Chunk actual;
+	actual.initCC(supposed.getCC());
+	EXPECT_FALSE(archive.loadChunk(&actual)) << "Truncated chunk was loaded";
+}
+
+TEST_P(ChunkArchiveTest, RandomChunk) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -99,7 +189,7 @@ TEST(ChunkArchiveTest, RandomChunk) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Random chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, RunLengths) {
+TEST_P(ChunkArchiveTest, RunLengths) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -118,7 +208,7 @@ TEST(ChunkArchiveTest, RunLengths) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "RunLengths chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, FarFromSpawnChunk) {
+TEST_P(ChunkArchiveTest, FarFromSpawnChunk) {
 	Chunk supposed;
 	supposed.initCC({ 9999999, 9999999, 0 });
 	Chunk actual;
@@ -136,7 +226,7 @@ TEST(ChunkArchiveTest, FarFromSpawnChunk) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Far from spawn chunk did not store and load properly";
 }
 
-TEST(ChunkArchiveTest, RegionWrapAround) {
+TEST_P(ChunkArchiveTest, RegionWrapAround) {
 	Chunk supposed;
 	supposed.initCC({ 0, 0, 0 });
 	Chunk actual;
@@ -149,7 +239,7 @@ TEST(ChunkArchiveTest, RegionWrapAround) {
 		return distr(rng);
 	});
 
-	ChunkArchive archive("./test/temp/");
+	ChunkArchive archive(getPath().c_str(), getConf());
 	archive.storeChunk(supposed);
 
 	Chunk other;
@@ -165,7 +255,7 @@ TEST(ChunkArchiveTest, RegionWrapAround) {
 	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Chunks from different regions overlap";
 }
 
-TEST(ChunkArchiveTest, SameRegion) {
+TEST_P(ChunkArchiveTest, SameRegion) {
 	Chunk c1;
 	Chunk c2;
 	Chunk c3;
@@ -182,7 +272,7 @@ TEST(ChunkArchiveTest, SameRegion) {
 	initChunk(c2, [&rng, &distr](size_t, size_t, size_t, size_t) {return distr(rng);});
 	initChunk(c3, [&rng, &distr](size_t, size_t, size_t, size_t) {return distr(rng);});
 
-	ChunkArchive archive("./test/temp/");
+	ChunkArchive archive(getPath().c_str(), getConf());
 	archive.storeChunk(c1);
 	archive.storeChunk(c2);
 	archive.storeChunk(c3);
@@ -199,3 +289,848 @@ TEST(ChunkArchiveTest, SameRegion) {
 	archive.loadChunk(&actual);
 	ASSERT_EQ(0, getRelativeChunkDifference(c3, actual)) << "Chunks from same region collide";
 }
+
+TEST_P(ChunkArchiveTest, ZlibCompression) {
+	Chunk supposed;
+	supposed.initCC({ 0, 0, 0 });
+	Chunk actual;
+
+	// few block types without long runs compress badly with RLE, but well with zlib
+	std::minstd_rand rng;
+	rng.seed(1);
+	std::uniform_int_distribution<uint> distr(1, 4);
+	initChunk(supposed, [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+		return distr(rng);
+	});
+
+	ArchiveConf conf = getConf();
+	conf.compression = ArchiveCompression::ZLIB;
+	conf.compression_level = 9;
+	{
+		ChunkArchive archive(getPath("temp_zlib").c_str(), conf);
+		archive.storeChunk(supposed);
+	}
+	ChunkArchive archive(getPath("temp_zlib").c_str(), conf);
+	actual.initCC(supposed.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Zlib chunk did not store and load properly";
+
+	// archives without compression have to be able to read compressed chunks
+	ChunkArchive rle_archive(getPath("temp_zlib").c_str(), getConf());
+	Chunk other;
+	other.initCC(supposed.getCC());
+	ASSERT_TRUE(rle_archive.loadChunk(&other));
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, other)) << "Zlib chunk could not be read by RLE archive";
+}
+
+TEST_P(ChunkArchiveTest, DiffPolicy) {
+	std::string path = getPath("temp_diff");
+	boost::filesystem::remove_all(path);
+	WorldGenerator generator(42, WorldParams());
+	ArchiveConf conf = getConf();
+	conf.policy = ArchivePolicy::DIFF;
+
+	// the chunk at the spawn contains the surface, so it's neither empty nor uniform
+	vec3i64 spawn = generator.getSpawnLocation();
+	Chunk supposed(Chunk::VISUAL);
+	supposed.initCC(vec3i64(spawn[0] >> Chunk::WIDTH_EXPONENT,
+			spawn[1] >> Chunk::WIDTH_EXPONENT, spawn[2] >> Chunk::WIDTH_EXPONENT));
+	generator.generateChunk(&supposed);
+	ASSERT_FALSE(supposed.isUniform());
+
+	{
+		ChunkArchive archive(path.c_str(), conf, std::unique_ptr<WorldGenerator>(new WorldGenerator(42, WorldParams())));
+		archive.storeChunk(supposed);
+		EXPECT_FALSE(archive.hasChunk(supposed.getCC())) << "Untouched chunk was stored";
+
+		supposed.setBlock(0, 7);
+		supposed.setBlock(1000, 0);
+		supposed.setBlock(Chunk::SIZE - 1, 3);
+		archive.storeChunk(supposed);
+	}
+
+	ChunkArchive archive(path.c_str(), conf, std::unique_ptr<WorldGenerator>(new WorldGenerator(42, WorldParams())));
+	uint32 revision = 0;
+	ASSERT_TRUE(archive.hasChunk(supposed.getCC(), &revision));
+	EXPECT_EQ(supposed.getRevision(), revision);
+
+	Chunk actual(Chunk::VISUAL);
+	actual.initCC(supposed.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, actual)) << "Edited chunk did not store and load properly";
+	EXPECT_EQ(supposed.getRevision(), actual.getRevision());
+	EXPECT_EQ(supposed.getPassThroughs(), actual.getPassThroughs());
+
+	// undoing all edits leaves an empty edit list, but the revision has to survive
+	Chunk generated;
+	generated.initCC(supposed.getCC());
+	generator.generateChunk(&generated);
+	supposed.setBlock(0, generated.getBlock((size_t) 0));
+	supposed.setBlock(1000, generated.getBlock((size_t) 1000));
+	supposed.setBlock(Chunk::SIZE - 1, generated.getBlock((size_t) Chunk::SIZE - 1));
+	archive.storeChunk(supposed);
+
+	Chunk reverted;
+	reverted.initCC(supposed.getCC());
+	ASSERT_TRUE(archive.loadChunk(&reverted));
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, reverted)) << "Reverted chunk did not store and load properly";
+	EXPECT_EQ(supposed.getRevision(), reverted.getRevision());
+}
+
+TEST_P(ChunkArchiveTest, RevertedDiff) {
+	std::string path = getPath("temp_reverted");
+	boost::filesystem::remove_all(path);
+	WorldGenerator generator(42, WorldParams());
+	ArchiveConf conf = getConf();
+	conf.policy = ArchivePolicy::DIFF;
+
+	vec3i64 spawn = generator.getSpawnLocation();
+	Chunk supposed(Chunk::VISUAL);
+	supposed.initCC(vec3i64(spawn[0] >> Chunk::WIDTH_EXPONENT,
+			spawn[1] >> Chunk::WIDTH_EXPONENT, spawn[2] >> Chunk::WIDTH_EXPONENT));
+	generator.generateChunk(&supposed);
+	uint8 original = supposed.getBlock((size_t) 0);
+	{
+		ChunkArchive archive(path.c_str(), conf, std::unique_ptr<WorldGenerator>(new WorldGenerator(42, WorldParams())));
+		supposed.setBlock(0, original == 7 ? 3 : 7);
+		archive.storeChunk(supposed);
+		supposed.setBlock(0, original);
+		archive.storeChunk(supposed);
+	}
+
+	// nothing was read from the file before, so there is no buffer the empty edit list could be in
+	ChunkArchive archive(path.c_str(), conf, std::unique_ptr<WorldGenerator>(new WorldGenerator(42, WorldParams())));
+	Chunk reverted(Chunk::VISUAL);
+	reverted.initCC(supposed.getCC());
+	ASSERT_TRUE(archive.loadChunk(&reverted));
+	EXPECT_EQ(0, getRelativeChunkDifference(supposed, reverted)) << "Reverted chunk did not store and load properly";
+	EXPECT_EQ(supposed.getRevision(), reverted.getRevision());
+	EXPECT_EQ(supposed.getPassThroughs(), reverted.getPassThroughs());
+}
+
+TEST_P(ChunkArchiveTest, GrowingFile) {
+	std::string path = getPath("temp_grow");
+	boost::filesystem::remove_all(path);
+
+	// enough uncompressible chunks to grow the file by a few megabytes
+	const int NUM_CHUNKS = 100;
+	std::minstd_rand rng;
+	rng.seed(1);
+	std::uniform_int_distribution<uint> distr(0, 254);
+	std::vector<std::unique_ptr<Chunk>> chunks;
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		chunks.emplace_back(new Chunk());
+		chunks.back()->initCC({ i % 16, i / 16, 0 });
+		initChunk(*chunks.back(), [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+			return distr(rng);
+		});
+	}
+
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		for (int i = 0; i < NUM_CHUNKS; ++i) {
+			archive.storeChunk(*chunks[i]);
+			// load an older chunk after every store, so the storage has to follow the file
+			Chunk actual;
+			actual.initCC(chunks[i / 2]->getCC());
+			ASSERT_TRUE(archive.loadChunk(&actual));
+			ASSERT_EQ(0, getRelativeChunkDifference(*chunks[i / 2], actual)) << "Chunk " << i / 2 << " changed";
+		}
+	}
+
+	ChunkArchive archive(path.c_str(), getConf());
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		Chunk actual;
+		actual.initCC(chunks[i]->getCC());
+		ASSERT_TRUE(archive.loadChunk(&actual));
+		ASSERT_EQ(0, getRelativeChunkDifference(*chunks[i], actual)) << "Chunk " << i << " did not survive reopening";
+	}
+}
+
+TEST_P(ChunkArchiveTest, ReuseAndCompaction) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_compact");
+	boost::filesystem::remove_all(path);
+	std::string region = path + "0_0_0.region";
+
+	std::minstd_rand rng;
+	rng.seed(1);
+	std::uniform_int_distribution<uint> distr(0, 254);
+	Chunk chunks[3];
+	for (int i = 0; i < 3; ++i) {
+		chunks[i].initCC({ i, 0, 0 });
+		initChunk(chunks[i], [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+			return distr(rng);
+		});
+	}
+	Chunk stone;
+	stone.initCC(chunks[0].getCC());
+	initChunk(stone, [](size_t, size_t, size_t, size_t) -> uint8 { return 1; });
+	Chunk runs;
+	runs.initCC({ 3, 0, 0 });
+	initChunk(runs, [](size_t, size_t, size_t, size_t index) -> uint8 { return (index / 64) % 2; });
+
+	ChunkArchive archive(path.c_str(), getConf());
+	archive.storeChunk(chunks[0]);
+	archive.storeChunk(chunks[1]);
+	archive.storeChunk(chunks[2]);
+	const auto full_size = boost::filesystem::file_size(region);
+
+	// chunk 0 becomes uniform, a chunk that fits into its space must not grow the file
+	archive.storeChunk(stone);
+	archive.storeChunk(runs);
+	EXPECT_EQ(full_size, boost::filesystem::file_size(region)) << "Freed heap blocks were not reused";
+
+	// now most of the heap in front of chunk 2 is unused
+	stone.initCC(chunks[1].getCC());
+	archive.storeChunk(stone);
+	int num_passes = 0;
+	while (archive.compact())
+		ASSERT_LT(++num_passes, 100) << "Compaction did not finish";
+	EXPECT_GT(num_passes, 0);
+	// two uncompressible chunks were replaced by one small one
+	EXPECT_GE(full_size - Chunk::SIZE * 3 / 2, boost::filesystem::file_size(region)) << "Region was not compacted";
+
+	Chunk actual;
+	actual.initCC(chunks[2].getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(chunks[2], actual)) << "Moved chunk did not survive compaction";
+	actual.reset();
+	actual.initCC(runs.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(runs, actual)) << "Moved chunk did not survive compaction";
+
+	// the heap map has to be rebuilt correctly from the directory
+	ChunkArchive reopened(path.c_str(), getConf());
+	actual.reset();
+	actual.initCC(chunks[2].getCC());
+	ASSERT_TRUE(reopened.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(chunks[2], actual)) << "Compacted region did not reopen properly";
+}
+
+TEST_P(ChunkArchiveTest, BatchedStore) {
+	std::string path = getPath("temp_batch");
+	boost::filesystem::remove_all(path);
+
+	std::minstd_rand rng;
+	rng.seed(2);
+	std::uniform_int_distribution<uint> distr(0, 7);
+	// spread over two regions, with an empty and a uniform chunk in between
+	const int NUM_CHUNKS = 40;
+	std::vector<Chunk> chunks(NUM_CHUNKS);
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		chunks[i].initCC({ i - NUM_CHUNKS / 2, 3, 0 });
+		if (i == 5) {
+			initChunk(chunks[i], [](size_t, size_t, size_t, size_t) -> uint8 { return 0; });
+		} else if (i == 6) {
+			initChunk(chunks[i], [](size_t, size_t, size_t, size_t) -> uint8 { return 2; });
+		} else {
+			initChunk(chunks[i], [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+				return distr(rng);
+			});
+		}
+	}
+	// a later version of the same chunk in the same batch wins
+	Chunk replaced;
+	replaced.initCC(chunks[10].getCC());
+	initChunk(replaced, [](size_t, size_t, size_t, size_t index) -> uint8 { return (index / 32) % 3; });
+
+	ArchiveConf conf = getConf();
+	conf.sync = true;
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		std::vector<const Chunk *> batch;
+		for (const Chunk &chunk : chunks)
+			batch.push_back(&chunk);
+		batch.push_back(&replaced);
+		archive.storeChunks(batch);
+
+		// the second batch can't overwrite the first, but the third has to reuse its blocks
+		archive.storeChunks(batch);
+		archive.storeChunks(batch);
+	}
+
+	ChunkArchive archive(path.c_str(), conf);
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		const Chunk &expected = i == 10 ? replaced : chunks[i];
+		Chunk actual;
+		actual.initCC(expected.getCC());
+		ASSERT_TRUE(archive.loadChunk(&actual)) << "Chunk " << i << " was not stored";
+		EXPECT_EQ(0, getRelativeChunkDifference(expected, actual)) << "Chunk " << i << " did not store and load properly";
+	}
+
+	// two regions with at most two copies of every chunk on their heaps, or three batches in a log
+	boost::uintmax_t max_size = 2 * 65568 + 2 * NUM_CHUNKS * (Chunk::SIZE + 256);
+	if (!isRegionBackend())
+		max_size = 3 * (NUM_CHUNKS + 1) * (Chunk::SIZE + 256);
+	boost::uintmax_t size = 0;
+	for (boost::filesystem::directory_iterator iter(path), end; iter != end; ++iter)
+		size += boost::filesystem::file_size(iter->path());
+	EXPECT_GE(max_size, size) << "Batches did not reuse freed heap blocks";
+}
+
+TEST_P(ChunkArchiveTest, BatchedLoad) {
+	std::string path = getPath("temp_batch_load");
+	boost::filesystem::remove_all(path);
+
+	std::minstd_rand rng;
+	rng.seed(3);
+	std::uniform_int_distribution<uint> distr(0, 7);
+	// spread over two regions, with a uniform chunk and a compressible one in between
+	const int NUM_CHUNKS = 40;
+	std::vector<Chunk> chunks(NUM_CHUNKS);
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		chunks[i].initCC({ 2, i - NUM_CHUNKS / 2, -1 });
+		if (i == 5) {
+			initChunk(chunks[i], [](size_t, size_t, size_t, size_t) -> uint8 { return 2; });
+		} else if (i == 6) {
+			initChunk(chunks[i], [](size_t, size_t, size_t, size_t index) -> uint8 { return (index / 32) % 3; });
+		} else {
+			initChunk(chunks[i], [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+				return distr(rng);
+			});
+		}
+	}
+
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		std::vector<const Chunk *> batch;
+		for (const Chunk &chunk : chunks)
+			batch.push_back(&chunk);
+		archive.storeChunks(batch);
+	}
+
+	// with io_uring if the kernel has it and without
+	for (bool uring : {true, false}) {
+		bool enabled = ArchiveStorage::enableUring(uring);
+		ChunkArchive archive(path.c_str(), getConf());
+		std::vector<Chunk> actual(NUM_CHUNKS + 1);
+		std::vector<Chunk *> batch;
+		for (int i = 0; i < NUM_CHUNKS; ++i) {
+			actual[i].initCC(chunks[i].getCC());
+			batch.push_back(&actual[i]);
+		}
+		// never stored
+		actual[NUM_CHUNKS].initCC({ 2, NUM_CHUNKS, -1 });
+		batch.push_back(&actual[NUM_CHUNKS]);
+		std::reverse(batch.begin(), batch.end());
+		archive.loadChunks(batch);
+
+		for (int i = 0; i < NUM_CHUNKS; ++i) {
+			ASSERT_TRUE(actual[i].isInitialized()) << "Chunk " << i << " was not loaded";
+			EXPECT_EQ(0, getRelativeChunkDifference(chunks[i], actual[i]))
+					<< "Chunk " << i << " did not load properly in a batch";
+		}
+		EXPECT_FALSE(actual[NUM_CHUNKS].isInitialized()) << "A chunk that was never stored was loaded";
+		ArchiveStorage::enableUring(enabled);
+	}
+}
+
+TEST_P(ChunkArchiveTest, ConcurrentRegions) {
+	std::string path = getPath("temp_concurrent");
+	boost::filesystem::remove_all(path);
+
+	// every thread has its own region and the first row of the shared one
+	const int NUM_THREADS = 4;
+	const int NUM_CHUNKS = 16;
+	ChunkArchive archive(path.c_str(), getConf());
+	std::vector<int> failures(NUM_THREADS, 0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < NUM_THREADS; ++t) {
+		threads.emplace_back([&archive, &failures, t]() {
+			for (int round = 0; round < 3; ++round) {
+				for (int i = 0; i < NUM_CHUNKS; ++i) {
+					vec3i64 cc = i % 2 ? vec3i64(i, t, 0) : vec3i64(i, 0, 16 * (t + 1));
+					Chunk supposed;
+					supposed.initCC(cc);
+					supposed.initRevision(round + 1);
+					initChunk(supposed, [t, i, round](size_t, size_t, size_t, size_t index) -> uint8 {
+						return (uint8) ((index / (i + 1) + t + round) % 5);
+					});
+					archive.storeChunk(supposed);
+
+					Chunk actual;
+					actual.initCC(cc);
+					uint32 revision = 0;
+					if (!archive.hasChunk(cc, &revision) || revision != (uint32) round + 1
+							|| !archive.loadChunk(&actual)
+							|| getRelativeChunkDifference(supposed, actual) != 0)
+						failures[t]++;
+				}
+			}
+		});
+	}
+	for (auto &thread : threads)
+		thread.join();
+	for (int t = 0; t < NUM_THREADS; ++t)
+		EXPECT_EQ(0, failures[t]) << "Thread " << t << " did not load what it stored";
+}
+
+static std::vector<std::string> listFiles(const std::string &path) {
+	std::vector<std::string> files;
+	for (boost::filesystem::directory_iterator iter(path), end; iter != end; ++iter)
+		files.push_back(iter->path().filename().string());
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+TEST_P(ChunkArchiveTest, Manifest) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_manifest");
+	boost::filesystem::remove_all(path);
+
+	Chunk chunk;
+	chunk.initCC({ 40, -3, 2 });
+	initChunk(chunk, [](size_t, size_t, size_t, size_t index) -> uint8 { return index % 5; });
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		// looking at regions that were never stored must not create files
+		for (int64 x = -100; x < 100; x += 16) {
+			Chunk missing;
+			missing.initCC({ x, 7, 7 });
+			EXPECT_FALSE(archive.hasChunk(missing.getCC()));
+			EXPECT_FALSE(archive.loadChunk(&missing));
+		}
+		EXPECT_EQ(std::vector<std::string>({ "regions.manifest" }), listFiles(path));
+		archive.storeChunk(chunk);
+	}
+	std::vector<std::string> expected_files = { "2_-1_0.region", "regions.manifest" };
+	EXPECT_EQ(expected_files, listFiles(path));
+
+	// with and without the manifest, the region has to be found again
+	for (int pass = 0; pass < 2; ++pass) {
+		if (pass == 1)
+			boost::filesystem::remove(path + "regions.manifest");
+		ChunkArchive archive(path.c_str(), getConf());
+		EXPECT_TRUE(archive.hasChunk(chunk.getCC())) << "Pass " << pass;
+		Chunk actual;
+		actual.initCC(chunk.getCC());
+		ASSERT_TRUE(archive.loadChunk(&actual)) << "Pass " << pass;
+		EXPECT_EQ(0, getRelativeChunkDifference(chunk, actual)) << "Pass " << pass;
+		EXPECT_EQ(expected_files, listFiles(path)) << "Pass " << pass;
+	}
+}
+
+TEST_P(ChunkArchiveTest, HasChunkWhileReopening) {
+	std::string path = getPath("temp_reopen");
+	boost::filesystem::remove_all(path);
+
+	// readers must never see a revision go backwards, even while the file is closed and reopened
+	const int NUM_READERS = 3;
+	const uint32 NUM_REVISIONS = 200;
+	ChunkArchive archive(path.c_str(), getConf());
+	Chunk chunk;
+	chunk.initCC({ 5, 6, 7 });
+	initChunk(chunk, [](size_t, size_t, size_t, size_t index) -> uint8 { return index % 3; });
+	archive.storeChunk(chunk);
+
+	std::atomic<bool> done(false);
+	std::vector<int> failures(NUM_READERS, 0);
+	std::vector<std::thread> readers;
+	for (int t = 0; t < NUM_READERS; ++t) {
+		readers.emplace_back([&archive, &chunk, &done, &failures, t]() {
+			uint32 last_revision = 0;
+			while (!done) {
+				uint32 revision = 0;
+				if (!archive.hasChunk(chunk.getCC(), &revision) || revision < last_revision)
+					failures[t]++;
+				last_revision = revision;
+			}
+		});
+	}
+	for (uint32 revision = 1; revision <= NUM_REVISIONS; ++revision) {
+		chunk.initRevision(revision);
+		archive.storeChunk(chunk);
+		if (revision % 10 == 0)
+			archive.clean();
+	}
+	done = true;
+	for (auto &reader : readers)
+		reader.join();
+
+	for (int t = 0; t < NUM_READERS; ++t)
+		EXPECT_EQ(0, failures[t]) << "Reader " << t << " saw an inconsistent directory";
+	uint32 revision = 0;
+	EXPECT_TRUE(archive.hasChunk(chunk.getCC(), &revision));
+	EXPECT_EQ(NUM_REVISIONS, revision);
+}
+
+TEST_P(ChunkArchiveTest, ArchiveWorkers) {
+	std::string path = getPath("temp_workers");
+	boost::filesystem::remove_all(path);
+
+	// a store and a load of the same chunk have to happen in order
+	const int NUM_CHUNKS = 64;
+	ChunkArchive archive(path.c_str(), getConf());
+	std::vector<Chunk> supposed(NUM_CHUNKS);
+	std::vector<Chunk> actual(NUM_CHUNKS);
+	{
+		ArchiveWorkers workers(&archive, 4);
+		for (int i = 0; i < NUM_CHUNKS; ++i) {
+			vec3i64 cc(i * 7, i % 3, -i);
+			supposed[i].initCC(cc);
+			initChunk(supposed[i], [i](size_t, size_t, size_t, size_t index) -> uint8 {
+				return (uint8) ((index / (i + 1)) % 4);
+			});
+			actual[i].initCC(cc);
+			ASSERT_TRUE(workers.push({&supposed[i], ArchiveWorkers::STORE}));
+			ASSERT_TRUE(workers.push({&actual[i], ArchiveWorkers::LOAD}));
+		}
+
+		int num_stored = 0;
+		int num_loaded = 0;
+		for (int tries = 0; tries < 1000 && num_stored + num_loaded < 2 * NUM_CHUNKS; ++tries) {
+			ArchiveWorkers::Operation op;
+			while (workers.pop(op))
+				++(op.type == ArchiveWorkers::LOAD ? num_loaded : num_stored);
+			sleepFor(millis(10));
+		}
+		EXPECT_EQ(NUM_CHUNKS, num_stored);
+		EXPECT_EQ(NUM_CHUNKS, num_loaded);
+	}
+
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		ASSERT_TRUE(actual[i].isInitialized()) << "Chunk " << i << " was loaded before it was stored";
+		EXPECT_EQ(0, getRelativeChunkDifference(supposed[i], actual[i])) << "Chunk " << i << " did not load properly";
+	}
+}
+
+TEST_P(ChunkArchiveTest, BoundedOpenRegions) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_bounded_regions");
+	boost::filesystem::remove_all(path);
+
+	ArchiveConf conf = getConf();
+	conf.max_open_regions = 3;
+	conf.prefetch = false;
+
+	std::vector<Chunk> chunks(10);
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		for (size_t i = 0; i < chunks.size(); ++i) {
+			chunks[i].initCC({ (int64) i * 16 + 5, -7, 3 });
+			initChunk(chunks[i], [i](size_t, size_t, size_t, size_t index) -> uint8 {
+				return (index + i) % 7;
+			});
+			archive.storeChunk(chunks[i]);
+			EXPECT_LE(archive.getNumOpenRegions(), 3u);
+		}
+		// going back and forth evicts the least recently used region every time
+		for (int pass = 0; pass < 2; ++pass) {
+			for (size_t i = 0; i < chunks.size(); ++i) {
+				Chunk actual;
+				actual.initCC(chunks[i].getCC());
+				ASSERT_TRUE(archive.loadChunk(&actual));
+				EXPECT_EQ(0, getRelativeChunkDifference(chunks[i], actual));
+				EXPECT_LE(archive.getNumOpenRegions(), 3u);
+			}
+		}
+	}
+
+	// a directory takes 64 KiB, so this allows a single region
+	conf.max_open_regions = 64;
+	conf.max_directory_bytes = 100 * 1024;
+	ChunkArchive archive(path.c_str(), conf);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		EXPECT_TRUE(archive.hasChunk(chunks[i].getCC()));
+		EXPECT_EQ(1u, archive.getNumOpenRegions());
+	}
+}
+
+TEST_P(ChunkArchiveTest, PrefetchNeighbors) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_prefetch");
+	boost::filesystem::remove_all(path);
+
+	Chunk inner, outer;
+	inner.initCC({ 15, 8, 8 });
+	outer.initCC({ 16, 8, 8 });
+	initChunk(inner, [](size_t, size_t, size_t, size_t index) -> uint8 { return index % 3; });
+	initChunk(outer, [](size_t, size_t, size_t, size_t index) -> uint8 { return index % 4; });
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		archive.storeChunk(inner);
+		archive.storeChunk(outer);
+	}
+
+	ChunkArchive archive(path.c_str(), getConf());
+	EXPECT_EQ(0u, archive.getNumOpenRegions());
+	Chunk actual;
+	actual.initCC(inner.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	// the chunk is at the border, so the region next to it gets opened as well
+	for (int i = 0; i < 200 && archive.getNumOpenRegions() < 2; ++i)
+		sleepFor(millis(10));
+	EXPECT_EQ(2u, archive.getNumOpenRegions());
+
+	actual.initCC(outer.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(outer, actual));
+}
+
+TEST_P(ChunkArchiveTest, RepackRegion) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_repack");
+	boost::filesystem::remove_all(path);
+
+	ArchiveConf conf = getConf();
+	conf.prefetch = false;
+	// a lot of these chunks are the same, they would end up in the content store
+	conf.deduplicate = false;
+	std::vector<Chunk> chunks(40);
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		// storing every chunk twice, one at a time, leaves holes in the heap
+		for (int pass = 0; pass < 2; ++pass) {
+			for (size_t i = 0; i < chunks.size(); ++i) {
+				chunks[i].initCC({ (int64) (i % 16), (int64) (i / 16), 3 });
+				initChunk(chunks[i], [i, pass](size_t x, size_t, size_t, size_t index) -> uint8 {
+					return (uint8) (pass == 0 ? index % 13 : (x + i) % 5);
+				});
+				archive.storeChunk(chunks[i]);
+			}
+		}
+	}
+
+	RegionRepackStats stats;
+	ASSERT_TRUE(ChunkArchive::repackRegion((path + "0_0_0.region").c_str(), vec3i64(0, 0, 0),
+			conf, nullptr, nullptr, nullptr, &stats));
+	EXPECT_EQ(chunks.size(), stats.chunks);
+	EXPECT_LT(stats.used_bytes_before, stats.total_bytes_before);
+	// the chunks were stored with RLE only, zlib makes them smaller
+	EXPECT_LT(stats.used_bytes_after, stats.used_bytes_before);
+	EXPECT_EQ(stats.used_bytes_after, stats.total_bytes_after);
+	EXPECT_LT(stats.file_bytes_after, stats.file_bytes_before);
+	EXPECT_FALSE(boost::filesystem::exists(path + "0_0_0.region.repack"));
+
+	ChunkArchive archive(path.c_str(), conf);
+	for (const Chunk &chunk : chunks) {
+		Chunk actual;
+		actual.initCC(chunk.getCC());
+		ASSERT_TRUE(archive.loadChunk(&actual));
+		EXPECT_EQ(0, getRelativeChunkDifference(chunk, actual));
+	}
+}
+
+TEST_P(ChunkArchiveTest, Deduplication) {
+	if (!isRegionBackend())
+		return;
+	std::string path = getPath("temp_dedup");
+	boost::filesystem::remove_all(path);
+
+	ArchiveConf conf = getConf();
+	conf.prefetch = false;
+
+	// the same layers of water and air in two regions
+	std::vector<Chunk> chunks(24);
+	std::vector<const Chunk *> chunk_ptrs;
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunks[i].initCC({ (int64) i * 2 - 12, 3, 0 });
+		initChunk(chunks[i], [](size_t, size_t, size_t z, size_t) -> uint8 { return z < 20 ? 5 : 0; });
+		chunk_ptrs.push_back(&chunks[i]);
+	}
+	Chunk unique;
+	unique.initCC({ 1, 3, 0 });
+	initChunk(unique, [](size_t x, size_t y, size_t z, size_t) -> uint8 { return (x ^ y ^ z) % 3; });
+	chunk_ptrs.push_back(&unique);
+
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		archive.storeChunks(chunk_ptrs);
+		ASSERT_TRUE(archive.getContentStore());
+		// only the first copy stays in its region file
+		EXPECT_EQ(1u, archive.getContentStore()->getNumPayloads());
+	}
+	EXPECT_TRUE(boost::filesystem::exists(path + "content.index"));
+
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		EXPECT_EQ(1u, archive.getContentStore()->getNumPayloads());
+		for (const Chunk *chunk : chunk_ptrs) {
+			Chunk actual;
+			actual.initCC(chunk->getCC());
+			ASSERT_TRUE(archive.loadChunk(&actual));
+			EXPECT_EQ(0, getRelativeChunkDifference(*chunk, actual));
+		}
+
+		// once nothing references the shared copy anymore, it goes away, without sync
+		// only after compact synced the region files
+		for (size_t i = 0; i < chunks.size(); ++i)
+			chunks[i].setBlock(i, 9);
+		chunk_ptrs.pop_back();
+		archive.storeChunks(chunk_ptrs);
+		if (!conf.sync) {
+			EXPECT_EQ(1u, archive.getContentStore()->getNumPayloads());
+			while (archive.compact());
+		}
+		EXPECT_EQ(0u, archive.getContentStore()->getNumPayloads());
+		EXPECT_EQ(0u, archive.collectGarbage());
+
+		// region files that disappeared don't keep their chunks alive
+		for (size_t i = 0; i < chunks.size(); ++i)
+			chunks[i].setBlock(i, 5);
+		archive.storeChunks(chunk_ptrs);
+		EXPECT_EQ(1u, archive.getContentStore()->getNumPayloads());
+		EXPECT_EQ(0u, archive.collectGarbage());
+	}
+	for (const std::string &filename : listFiles(path)) {
+		if (filename.find(".region") != std::string::npos)
+			boost::filesystem::remove(path + filename);
+	}
+	ChunkArchive archive(path.c_str(), conf);
+	EXPECT_EQ(1u, archive.getContentStore()->getNumPayloads());
+	EXPECT_EQ(1u, archive.collectGarbage());
+	EXPECT_EQ(0u, archive.getContentStore()->getNumPayloads());
+}
+
+static std::vector<std::string> listSegments(const std::string &path) {
+	std::vector<std::string> segments;
+	for (const std::string &file : listFiles(path)) {
+		if (file.compare(0, 4, "log.") == 0)
+			segments.push_back(file);
+	}
+	return segments;
+}
+
+TEST_P(ChunkArchiveTest, LogTornTail) {
+	if (isRegionBackend())
+		return;
+	std::string path = getPath("temp_torn");
+	boost::filesystem::remove_all(path);
+
+	std::vector<Chunk> chunks(4);
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		chunks[i].initCC({ (int64) i, 2, -9 });
+		initChunk(chunks[i], [i](size_t, size_t, size_t, size_t index) -> uint8 {
+			return (index / (i + 1)) % 5;
+		});
+	}
+	Chunk edited;
+	edited.initCC(chunks[0].getCC());
+	edited.initRevision(1);
+	initChunk(edited, [](size_t, size_t, size_t, size_t index) -> uint8 { return index % 7; });
+
+	std::string segment = path + "log.0.segment";
+	boost::uintmax_t intact_size;
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		for (const Chunk &chunk : chunks)
+			archive.storeChunk(chunk);
+		intact_size = boost::filesystem::file_size(segment);
+		archive.storeChunk(edited);
+	}
+	ASSERT_EQ(std::vector<std::string>({ "log.0.segment" }), listSegments(path));
+
+	// the last record only made it halfway to the disk
+	boost::filesystem::resize_file(segment, boost::filesystem::file_size(segment) - 100);
+	{
+		ChunkArchive archive(path.c_str(), getConf());
+		EXPECT_EQ(intact_size, boost::filesystem::file_size(segment)) << "Torn record was not cut off";
+		for (const Chunk &chunk : chunks) {
+			Chunk actual;
+			actual.initCC(chunk.getCC());
+			ASSERT_TRUE(archive.loadChunk(&actual));
+			EXPECT_EQ(0, getRelativeChunkDifference(chunk, actual)) << "Chunk did not survive the torn tail";
+			EXPECT_EQ(0u, actual.getRevision());
+		}
+		archive.storeChunk(edited);
+	}
+
+	// garbage instead of a record is just as torn
+	{
+		std::ofstream file(segment, std::ios_base::out | std::ios_base::binary | std::ios_base::app);
+		std::vector<char> garbage(300, 0x5A);
+		file.write(garbage.data(), garbage.size());
+	}
+	ChunkArchive archive(path.c_str(), getConf());
+	Chunk actual;
+	actual.initCC(edited.getCC());
+	ASSERT_TRUE(archive.loadChunk(&actual));
+	EXPECT_EQ(0, getRelativeChunkDifference(edited, actual)) << "Record in front of garbage was lost";
+	EXPECT_EQ(1u, actual.getRevision());
+}
+
+TEST_P(ChunkArchiveTest, LogMerge) {
+	if (isRegionBackend())
+		return;
+	std::string path = getPath("temp_merge");
+	boost::filesystem::remove_all(path);
+
+	// uncompressible chunks, so every segment holds only a few of them
+	ArchiveConf conf = getConf();
+	conf.log_segment_bytes = 128 * 1024;
+	conf.log_merge_threshold = 0.5f;
+	const int NUM_CHUNKS = 6;
+	std::minstd_rand rng;
+	rng.seed(3);
+	std::uniform_int_distribution<uint> distr(0, 254);
+	std::vector<Chunk> chunks(NUM_CHUNKS);
+	{
+		ChunkArchive archive(path.c_str(), conf);
+		for (int round = 0; round < 4; ++round) {
+			for (int i = 0; i < NUM_CHUNKS; ++i) {
+				chunks[i].reset();
+				chunks[i].initCC({ i, 0, 0 });
+				chunks[i].initRevision(round);
+				initChunk(chunks[i], [&rng, &distr](size_t, size_t, size_t, size_t) -> uint8 {
+					return distr(rng);
+				});
+				archive.storeChunk(chunks[i]);
+			}
+		}
+		EXPECT_LE(8u, listSegments(path).size());
+
+		int num_passes = 0;
+		while (archive.compact())
+			ASSERT_LT(++num_passes, 1000) << "Merging did not finish";
+		// the live chunks fit into two segments, but merging leaves some slack
+		EXPECT_GE(4u, listSegments(path).size()) << "Segments were not merged";
+
+		for (int i = 0; i < NUM_CHUNKS; ++i) {
+			Chunk actual;
+			actual.initCC(chunks[i].getCC());
+			ASSERT_TRUE(archive.loadChunk(&actual));
+			EXPECT_EQ(0, getRelativeChunkDifference(chunks[i], actual)) << "Chunk " << i << " did not survive merging";
+		}
+	}
+
+	ChunkArchive archive(path.c_str(), conf);
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		Chunk actual;
+		actual.initCC(chunks[i].getCC());
+		uint32 revision = 0;
+		EXPECT_TRUE(archive.hasChunk(chunks[i].getCC(), &revision));
+		EXPECT_EQ(3u, revision);
+		ASSERT_TRUE(archive.loadChunk(&actual));
+		EXPECT_EQ(0, getRelativeChunkDifference(chunks[i], actual)) << "Chunk " << i << " did not survive reopening";
+	}
+}
+
+TEST(ChunkArchiveFilenameTest, RegionFilenames) {
+	vec3i64 rc;
+	ASSERT_TRUE(ChunkArchive::parseRegionFilename("-1_0_12.region", &rc));
+	EXPECT_EQ(vec3i64(-1, 0, 12), rc);
+	// leftovers of an interrupted repack and the like
+	EXPECT_FALSE(ChunkArchive::parseRegionFilename("0_0_0.region.repack", &rc));
+	EXPECT_FALSE(ChunkArchive::parseRegionFilename("0_0_0.regionX", &rc));
+	EXPECT_FALSE(ChunkArchive::parseRegionFilename("0_0_0.regio", &rc));
+	EXPECT_FALSE(ChunkArchive::parseRegionFilename("regions.manifest", &rc));
+}
+
+TEST(ChunkArchiveFilenameTest, SegmentFilenames) {
+	uint32 id;
+	ASSERT_TRUE(LogBackend::parseSegmentFilename("log.3.segment", &id));
+	EXPECT_EQ(3u, id);
+	EXPECT_FALSE(LogBackend::parseSegmentFilename("log.3.segment.tmp", &id));
+	EXPECT_FALSE(LogBackend::parseSegmentFilename("log.3.segment~", &id));
+	EXPECT_FALSE(LogBackend::parseSegmentFilename("log.3.segmen", &id));
+}
+
+INSTANTIATE_TEST_SUITE_P(Storages, ChunkArchiveTest, Combine(
+		Values(ArchiveBackend::REGIONS, ArchiveBackend::LOG),
+		Values(ArchiveIO::STREAM, ArchiveIO::MMAP)));
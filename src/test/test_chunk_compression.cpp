@@ -0,0 +1,318 @@
+#include "test/gtest.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "shared/engine/std_types.hpp"
+#include "shared/engine/time.hpp"
+#include "shared/game/chunk.hpp"
+#include "shared/chunk_compression.hpp"
+
+using namespace testing;
+
+static const uint8 ESCAPE_CHAR = (uint8) (-1);
+
+// the original byte-wise codec, the fast one has to produce exactly the same output
+static int referenceEncode(const uint8 *blocks, uint8 *buffer, size_t size) {
+	uint8 cur_run_type = blocks[0];
+	size_t cur_run_length = 1;
+	uint8 *head = buffer;
+
+	auto finishRun = [&]() -> int {
+		if (cur_run_length == 0)
+			return 0;
+		if (cur_run_length > 3 || cur_run_type == ESCAPE_CHAR) {
+			if (cur_run_length < 0x80) {
+				if ((uint) (head - buffer) + 3u <= size) {
+					*head++ = ESCAPE_CHAR;
+					*head++ = cur_run_length & 0xFF;
+					*head++ = cur_run_type;
+				} else {
+					return -1;
+				}
+			} else {
+				size_t encoded_run_length = cur_run_length - 1;
+				if ((uint) (head - buffer) + 4u <= size) {
+					*head++ = ESCAPE_CHAR;
+					*head++ = ((encoded_run_length >> 8) & 0xFF) | 0x80;
+					*head++ = encoded_run_length & 0xFF;
+					*head++ = cur_run_type;
+				} else {
+					return -1;
+				}
+			}
+		} else {
+			if (head - buffer + cur_run_length <= size) {
+				for (size_t j = 0; j < cur_run_length; ++j)
+					*head++ = cur_run_type;
+			} else {
+				return -1;
+			}
+		}
+		return 0;
+	};
+
+	for (size_t i = 1; i < size; ++i) {
+		uint8 next_block = blocks[i];
+		if (cur_run_length >= 0x8000) {
+			if (finishRun() != 0)
+				return (int)(head - buffer);
+			cur_run_length = 0;
+		}
+		if (cur_run_type == next_block) {
+			cur_run_length++;
+		} else {
+			if (finishRun() != 0)
+				return (int)(head - buffer);
+			cur_run_type = next_block;
+			cur_run_length = 1;
+		}
+	}
+
+	finishRun();
+	return (int)(head - buffer);
+}
+
+static void referenceDecode(const uint8 *encoded, size_t size, uint8 *blocks) {
+	size_t index = 0;
+	while (index < Chunk::SIZE) {
+		if (size < 1)
+			return;
+		uint8 next_block = *encoded++;
+		size--;
+
+		if (next_block == ESCAPE_CHAR) {
+			uint32 run_length;
+			if (size < 1)
+				return;
+			uint8 next_byte = *encoded++;
+			size--;
+			if ((next_byte & 0x80) == 0) {
+				run_length = next_byte;
+			} else {
+				uint32 encoded_run_length = next_byte & 0x7F;
+				if (size < 1)
+					return;
+				next_byte = *encoded++;
+				size--;
+				encoded_run_length = (encoded_run_length << 8) | next_byte;
+				run_length = encoded_run_length + 1;
+			}
+			if (size < 1)
+				return;
+			uint8 block_type = *encoded++;
+			size--;
+			for (uint32 i = 0; i < run_length && index < Chunk::SIZE; ++i)
+				blocks[index++] = block_type;
+		} else {
+			blocks[index++] = next_block;
+		}
+	}
+}
+
+// runs of random length and type, optionally with a bias towards the escape character
+static void makeRandomBlocks(std::minstd_rand &rng, uint8 *blocks, bool escapes = true) {
+	std::uniform_int_distribution<uint> typeDistr(0, escapes ? 255 : 254);
+	std::uniform_int_distribution<uint> kindDistr(0, 3);
+	std::uniform_int_distribution<uint> shortDistr(1, 5);
+	std::uniform_int_distribution<uint> longDistr(1, 300);
+	size_t index = 0;
+	while (index < Chunk::SIZE) {
+		uint kind = kindDistr(rng);
+		uint8 type = kind == 0 && escapes ? ESCAPE_CHAR : (uint8) typeDistr(rng);
+		size_t length = kind == 3 ? longDistr(rng) : shortDistr(rng);
+		for (size_t i = 0; i < length && index < Chunk::SIZE; ++i)
+			blocks[index++] = type;
+	}
+}
+
+// air on top of stone with some noise, roughly what the world generator produces
+static void makeTerrainBlocks(std::minstd_rand &rng, uint8 *blocks) {
+	std::uniform_int_distribution<uint> heightDistr(0, Chunk::WIDTH - 1);
+	std::uniform_int_distribution<uint> noiseDistr(0, 15);
+	for (uint y = 0; y < Chunk::WIDTH; ++y) {
+		for (uint x = 0; x < Chunk::WIDTH; ++x) {
+			uint height = heightDistr(rng);
+			for (uint z = 0; z < Chunk::WIDTH; ++z) {
+				uint8 type = z < height ? (noiseDistr(rng) == 0 ? 3 : 1) : 0;
+				blocks[Chunk::getBlockIndex(vec3ui8(x, y, z))] = type;
+			}
+		}
+	}
+}
+
+static const RunFinder RUN_FINDERS[] = {
+	RUN_FINDER_SCALAR, RUN_FINDER_SSE2, RUN_FINDER_AVX2,
+};
+
+class ChunkCompressionTest : public TestWithParam<RunFinder> {
+protected:
+	void SetUp() override {
+		if (!selectRunFinder(GetParam()))
+			skip = true;
+	}
+
+	void TearDown() override {
+		selectRunFinder(RUN_FINDER_BEST);
+	}
+
+	void checkEncoding(const uint8 *blocks, size_t size) {
+		std::vector<uint8> expected(size + 4, 0xAA);
+		std::vector<uint8> actual(size + 4, 0xAA);
+		int expectedSize = referenceEncode(blocks, expected.data(), size);
+		int actualSize = encodeBlocks_RLE(blocks, actual.data(), size);
+		ASSERT_EQ(expectedSize, actualSize) << "Buffer size " << size;
+		ASSERT_EQ(expected, actual) << "Buffer size " << size;
+	}
+
+	bool skip = false;
+};
+
+TEST_P(ChunkCompressionTest, EncodeMatchesReference) {
+	if (skip)
+		return;
+	std::minstd_rand rng;
+	rng.seed(1);
+	uint8 blocks[Chunk::SIZE];
+
+	memset(blocks, 0, sizeof(blocks));
+	checkEncoding(blocks, Chunk::SIZE);
+	memset(blocks, ESCAPE_CHAR, sizeof(blocks));
+	checkEncoding(blocks, Chunk::SIZE);
+
+	for (int i = 0; i < 50; ++i) {
+		makeRandomBlocks(rng, blocks);
+		checkEncoding(blocks, Chunk::SIZE);
+		makeTerrainBlocks(rng, blocks);
+		checkEncoding(blocks, Chunk::SIZE);
+	}
+}
+
+TEST_P(ChunkCompressionTest, EncodeTruncatedMatchesReference) {
+	if (skip)
+		return;
+	std::minstd_rand rng;
+	rng.seed(2);
+	std::uniform_int_distribution<size_t> sizeDistr(1, Chunk::SIZE);
+	uint8 blocks[Chunk::SIZE];
+
+	for (int i = 0; i < 200; ++i) {
+		makeRandomBlocks(rng, blocks);
+		checkEncoding(blocks, sizeDistr(rng));
+	}
+	for (size_t size = 1; size < 40; ++size)
+		checkEncoding(blocks, size);
+}
+
+TEST_P(ChunkCompressionTest, RoundTrip) {
+	if (skip)
+		return;
+	std::minstd_rand rng;
+	rng.seed(3);
+	uint8 blocks[Chunk::SIZE];
+	uint8 encoded[Chunk::SIZE];
+	uint8 decoded[Chunk::SIZE];
+
+	for (int i = 0; i < 50; ++i) {
+		if (i % 2)
+			makeRandomBlocks(rng, blocks, false);
+		else
+			makeTerrainBlocks(rng, blocks);
+		// without escape characters, the encoding can't grow beyond the chunk size
+		int size = encodeBlocks_RLE(blocks, encoded, Chunk::SIZE);
+
+		memset(decoded, 0xAA, sizeof(decoded));
+		decodeBlocks_RLE(encoded, size, decoded);
+		ASSERT_EQ(0, memcmp(blocks, decoded, Chunk::SIZE)) << "Buffer decoding failed";
+
+		std::istringstream is(std::string((const char *) encoded, size) + "trailing data");
+		memset(decoded, 0xAA, sizeof(decoded));
+		decodeBlocks_RLE(&is, decoded);
+		ASSERT_TRUE(is.good());
+		ASSERT_EQ(0, memcmp(blocks, decoded, Chunk::SIZE)) << "Stream decoding failed";
+		ASSERT_EQ((std::streamoff) size, (std::streamoff) is.tellg()) << "Stream decoding read too much";
+	}
+}
+
+TEST(ChunkCompressionTest, DecodeMalformedMatchesReference) {
+	std::minstd_rand rng;
+	rng.seed(4);
+	std::uniform_int_distribution<uint> byteDistr(0, 255);
+	std::uniform_int_distribution<size_t> sizeDistr(0, 2000);
+	std::vector<uint8> encoded(2000);
+	uint8 expected[Chunk::SIZE];
+	uint8 actual[Chunk::SIZE];
+
+	for (int i = 0; i < 500; ++i) {
+		for (auto &byte : encoded)
+			byte = byteDistr(rng) < 32 ? ESCAPE_CHAR : (uint8) byteDistr(rng);
+		size_t size = sizeDistr(rng);
+		memset(expected, 0xAA, sizeof(expected));
+		memset(actual, 0xAA, sizeof(actual));
+		referenceDecode(encoded.data(), size, expected);
+		bool complete = decodeBlocks_RLE(encoded.data(), size, actual);
+		ASSERT_EQ(0, memcmp(expected, actual, Chunk::SIZE));
+
+		std::istringstream is(std::string((const char *) encoded.data(), size));
+		memset(actual, 0xAA, sizeof(actual));
+		EXPECT_EQ(complete, decodeBlocks_RLE(&is, actual));
+		ASSERT_EQ(0, memcmp(expected, actual, Chunk::SIZE));
+	}
+}
+
+INSTANTIATE_TEST_SUITE_P(RunFinders, ChunkCompressionTest, ValuesIn(RUN_FINDERS));
+
+TEST(ChunkCompressionTest, DISABLED_Throughput) {
+	const int NUM_CHUNKS = 64;
+	const int ITERATIONS = 20;
+	std::minstd_rand rng;
+	rng.seed(5);
+	std::vector<uint8> blocks(NUM_CHUNKS * Chunk::SIZE);
+	std::vector<uint8> encoded(NUM_CHUNKS * (Chunk::SIZE + 4));
+	std::vector<int> encodedSizes(NUM_CHUNKS);
+	uint8 decoded[Chunk::SIZE];
+	for (int i = 0; i < NUM_CHUNKS; ++i) {
+		if (i % 4 == 0)
+			makeRandomBlocks(rng, &blocks[i * Chunk::SIZE]);
+		else
+			makeTerrainBlocks(rng, &blocks[i * Chunk::SIZE]);
+	}
+
+	auto measure = [&](const char *name, std::function<void(int)> func) {
+		Time start = getCurrentTime();
+		for (int k = 0; k < ITERATIONS; ++k) {
+			for (int i = 0; i < NUM_CHUNKS; ++i)
+				func(i);
+		}
+		Time duration = getCurrentTime() - start;
+		double bytes = (double) ITERATIONS * NUM_CHUNKS * Chunk::SIZE;
+		printf("%-22s %8.1f MB/s\n", name, bytes / (duration > 0 ? duration : 1));
+	};
+
+	auto encode = [&](int i) {
+		encodedSizes[i] = encodeBlocks_RLE(&blocks[i * Chunk::SIZE],
+				&encoded[i * (Chunk::SIZE + 4)], Chunk::SIZE);
+	};
+	measure("encode reference", [&](int i) {
+		encodedSizes[i] = referenceEncode(&blocks[i * Chunk::SIZE],
+				&encoded[i * (Chunk::SIZE + 4)], Chunk::SIZE);
+	});
+	const char *names[] = { "encode scalar", "encode sse2", "encode avx2" };
+	for (RunFinder runFinder : RUN_FINDERS) {
+		if (selectRunFinder(runFinder))
+			measure(names[runFinder], encode);
+	}
+	selectRunFinder(RUN_FINDER_BEST);
+
+	measure("decode reference", [&](int i) {
+		referenceDecode(&encoded[i * (Chunk::SIZE + 4)], encodedSizes[i], decoded);
+	});
+	measure("decode buffer", [&](int i) {
+		decodeBlocks_RLE(&encoded[i * (Chunk::SIZE + 4)], encodedSizes[i], decoded);
+	});
+}
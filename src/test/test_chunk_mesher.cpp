@@ -0,0 +1,247 @@
+#include "test/gtest.hpp"
+
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "shared/engine/std_types.hpp"
+#include "shared/engine/time.hpp"
+#include "shared/game/chunk.hpp"
+#include "shared/game/chunk_mesher.hpp"
+#include "shared/block_utils.hpp"
+
+using namespace testing;
+
+typedef ChunkMesher::Quad Quad;
+
+// what the renderer did before the mesher, one block after the other
+static void referenceMesh(const Chunk *const *chunks, std::vector<Quad> *quads) {
+	const int W = (int) Chunk::WIDTH;
+	const Chunk &chunk = *chunks[BIG_CUBE_CYCLE_BASE_INDEX];
+	for (int z = 0; z < W; z++)
+	for (int y = 0; y < W; y++)
+	for (int x = 0; x < W; x++) {
+		uint8 type = chunk.getBlock(vec3ui8(x, y, z));
+		if (type == 0)
+			continue;
+		for (uint8 d = 0; d < 6; d++) {
+			Quad quad;
+			quad.icc = vec3ui8(x, y, z);
+			quad.faceDir = d;
+			quad.faceType = type;
+			quad.width = 1;
+			quad.height = 1;
+
+			uint8 corners = 0;
+			bool hidden = false;
+			for (int j = -1; j < 8; ++j) {
+				vec3i dIcc = quad.icc.cast<int>() + (j < 0 ? DIRS[d].cast<int>() : DIR_QUAD_EIGHT_NEIGHBOR_CYCLES[d][j]);
+				vec3i8 ncc(0, 0, 0);
+				for (int i = 0; i < 3; i++) {
+					if (dIcc[i] < 0) {
+						ncc[i] = -1;
+						dIcc[i] += W;
+					} else if (dIcc[i] >= W) {
+						ncc[i] = 1;
+						dIcc[i] -= W;
+					}
+				}
+				bool solid = chunks[vec2BigCubeCycleIndex(ncc)]->getBlock(dIcc.cast<uint8>()) != 0;
+				if (j < 0)
+					hidden = solid;
+				else if (solid)
+					corners |= 1 << j;
+			}
+			if (hidden)
+				continue;
+
+			quad.shadowLevels = 0;
+			for (int j = 0; j < 4; j++) {
+				int shadowLevel = 0;
+				bool s1 = (corners & QUAD_CORNER_MASK[j][0]) > 0;
+				bool s2 = (corners & QUAD_CORNER_MASK[j][2]) > 0;
+				bool m = (corners & QUAD_CORNER_MASK[j][1]) > 0;
+				if (s1)
+					shadowLevel++;
+				if (s2)
+					shadowLevel++;
+				if (m || (s1 && s2))
+					shadowLevel++;
+				quad.shadowLevels |= shadowLevel << 2 * j;
+			}
+			quads->push_back(quad);
+		}
+	}
+}
+
+typedef std::tuple<int, int, int, int, int, int> FaceKey;
+
+// the block faces the quads cover
+static std::multiset<FaceKey> getFaces(const std::vector<Quad> &quads) {
+	std::multiset<FaceKey> faces;
+	for (const Quad &quad : quads) {
+		vec3ui8 size = quad.getSize();
+		for (uint8 z = 0; z < size[2]; z++)
+		for (uint8 y = 0; y < size[1]; y++)
+		for (uint8 x = 0; x < size[0]; x++) {
+			vec3ui8 icc = quad.icc + vec3ui8(x, y, z);
+			faces.insert(FaceKey(icc[0], icc[1], icc[2], quad.faceDir, quad.faceType, quad.shadowLevels));
+		}
+	}
+	return faces;
+}
+
+// hills of two block types, with a tunnel of random blocks through every chunk
+static void makeArea(std::minstd_rand &rng, std::vector<Chunk> *chunks) {
+	const int W = (int) Chunk::WIDTH;
+	std::uniform_int_distribution<int> heightDistr(-W, 2 * W);
+	std::uniform_int_distribution<int> typeDistr(0, 3);
+	int base = heightDistr(rng);
+	int slope = typeDistr(rng);
+	chunks->clear();
+	chunks->resize(27);
+	for (int i = 0; i < 27; ++i) {
+		Chunk &chunk = (*chunks)[i];
+		vec3i64 cc = BIG_CUBE_CYCLE[i].cast<int64>();
+		chunk.initCC(cc);
+		int tunnelY = (int) (rng() % W);
+		for (size_t index = 0; index < Chunk::SIZE; ++index) {
+			vec3i64 bc = cc * (int64) W + vec3i64(index % W, index / W % W, index / (W * W));
+			int64 height = base + (bc[0] * slope + bc[1]) / 4;
+			uint8 type = bc[2] < height ? (bc[2] < height - 3 ? 1 : 2) : 0;
+			if (std::abs((int) (index / W % W) - tunnelY) < 3 && std::abs((int) (index / (W * W)) - W / 2) < 4)
+				type = (uint8) typeDistr(rng);
+			chunk.initBlock(index, type);
+		}
+		chunk.finishInitialization();
+	}
+}
+
+static void getArea(const std::vector<Chunk> &chunks, const Chunk **area) {
+	for (int i = 0; i < 27; ++i)
+		area[i] = &chunks[i];
+}
+
+TEST(ChunkMesherTest, Faces) {
+	std::minstd_rand rng;
+	rng.seed(1);
+	std::vector<Chunk> chunks;
+	const Chunk *area[27];
+	uint8 blocks[ChunkMesher::PADDED_SIZE];
+	ChunkMesher mesher;
+	for (int t = 0; t < 20; ++t) {
+		makeArea(rng, &chunks);
+		getArea(chunks, area);
+
+		std::vector<Quad> expected, quads, merged;
+		referenceMesh(area, &expected);
+		ChunkMesher::copyBlocks(area, blocks);
+		mesher.mesh(blocks, false, &quads);
+		mesher.mesh(blocks, true, &merged);
+
+		ASSERT_EQ(expected.size(), quads.size()) << "area " << t;
+		EXPECT_TRUE(getFaces(expected) == getFaces(quads)) << "area " << t;
+		EXPECT_TRUE(getFaces(expected) == getFaces(merged)) << "area " << t;
+		EXPECT_LE(merged.size(), quads.size()) << "area " << t;
+	}
+}
+
+TEST(ChunkMesherTest, MergeFlatLayer) {
+	std::vector<Chunk> chunks(27);
+	const Chunk *area[27];
+	for (int i = 0; i < 27; ++i) {
+		chunks[i].initCC(BIG_CUBE_CYCLE[i].cast<int64>());
+		if (BIG_CUBE_CYCLE[i][2] < 0)
+			chunks[i].initUniform(1);
+		else if (BIG_CUBE_CYCLE[i][2] > 0)
+			chunks[i].initUniform(0);
+		else {
+			for (size_t index = 0; index < Chunk::SIZE; ++index)
+				chunks[i].initBlock(index, index < Chunk::WIDTH * Chunk::WIDTH ? 1 : 0);
+			chunks[i].finishInitialization();
+		}
+	}
+	getArea(chunks, area);
+
+	uint8 blocks[ChunkMesher::PADDED_SIZE];
+	ChunkMesher::copyBlocks(area, blocks);
+	ChunkMesher mesher;
+	std::vector<Quad> quads;
+	mesher.mesh(blocks, true, &quads);
+	ASSERT_EQ(1u, quads.size());
+	EXPECT_EQ(2u, quads[0].faceDir);
+	EXPECT_EQ(vec3ui8(0, 0, 0), quads[0].icc);
+	EXPECT_EQ(vec3ui8(Chunk::WIDTH, Chunk::WIDTH, 1), quads[0].getSize());
+
+	// with a texture per block the faces stay apart
+	uint8 unmergedFaces[256] = {};
+	unmergedFaces[1] = 1 << 2;
+	quads.clear();
+	mesher.mesh(blocks, true, &quads, unmergedFaces);
+	EXPECT_EQ(Chunk::WIDTH * Chunk::WIDTH, quads.size());
+	unmergedFaces[1] = 1 << 5;
+	quads.clear();
+	mesher.mesh(blocks, true, &quads, unmergedFaces);
+	EXPECT_EQ(1u, quads.size());
+}
+
+TEST(ChunkMesherTest, QuadSize) {
+	// meshes are passed between threads and kept until they are uploaded
+	EXPECT_EQ(8u, sizeof(Quad));
+}
+
+TEST(ChunkMesherTest, DISABLED_MeshingThroughput) {
+	const int NUM_AREAS = 16;
+	const int ITERATIONS = 10;
+	std::minstd_rand rng;
+	rng.seed(2);
+	std::vector<std::vector<Chunk>> areas(NUM_AREAS);
+	for (int i = 0; i < NUM_AREAS; ++i)
+		makeArea(rng, &areas[i]);
+
+	size_t numQuads = 0;
+	auto measure = [&](std::function<void(const Chunk **, std::vector<Quad> *)> func) {
+		std::vector<Quad> quads;
+		const Chunk *area[27];
+		numQuads = 0;
+		Time start = getCurrentTime();
+		for (int k = 0; k < ITERATIONS; ++k) {
+			for (int i = 0; i < NUM_AREAS; ++i) {
+				getArea(areas[i], area);
+				quads.clear();
+				func(area, &quads);
+				numQuads += quads.size();
+			}
+		}
+		return (getCurrentTime() - start) / ((double) ITERATIONS * NUM_AREAS);
+	};
+
+	ChunkMesher mesher;
+	std::vector<uint8> blocks(ChunkMesher::PADDED_SIZE);
+	double reference = measure([](const Chunk **area, std::vector<Quad> *quads) {
+		referenceMesh(area, quads);
+	});
+	size_t referenceQuads = numQuads;
+	double copy = measure([&blocks](const Chunk **area, std::vector<Quad> *) {
+		ChunkMesher::copyBlocks(area, blocks.data());
+	});
+	double masks = measure([&mesher, &blocks](const Chunk **area, std::vector<Quad> *quads) {
+		ChunkMesher::copyBlocks(area, blocks.data());
+		mesher.mesh(blocks.data(), false, quads);
+	});
+	size_t maskQuads = numQuads;
+	double greedy = measure([&mesher, &blocks](const Chunk **area, std::vector<Quad> *quads) {
+		ChunkMesher::copyBlocks(area, blocks.data());
+		mesher.mesh(blocks.data(), true, quads);
+	});
+	size_t greedyQuads = numQuads;
+
+	double n = (double) ITERATIONS * NUM_AREAS;
+	printf("block loop  %8.1f us per chunk %8.0f quads\n", reference, referenceQuads / n);
+	printf("copy blocks %8.1f us per chunk\n", copy);
+	printf("face masks  %8.1f us per chunk %8.0f quads\n", masks, maskQuads / n);
+	printf("greedy      %8.1f us per chunk %8.0f quads\n", greedy, greedyQuads / n);
+}
@@ -0,0 +1,156 @@
+#include "test/gtest.hpp"
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "shared/engine/std_types.hpp"
+#include "shared/game/chunk.hpp"
+#include "shared/game/world_generator.hpp"
+#include "shared/chunk_archive.hpp"
+#include "shared/world_export.hpp"
+
+using namespace testing;
+
+static const uint64 SEED = 42;
+
+static bool haveSameBlocks(const Chunk &lhs, const Chunk &rhs) {
+	std::vector<uint8> lhs_blocks(Chunk::SIZE), rhs_blocks(Chunk::SIZE);
+	lhs.getBlocks(lhs_blocks.data());
+	rhs.getBlocks(rhs_blocks.data());
+	return memcmp(lhs_blocks.data(), rhs_blocks.data(), Chunk::SIZE) == 0;
+}
+
+class WorldExportTest : public Test {
+protected:
+	// an empty directory for the test, removed after it
+	std::string makeDirectory(const char *name) {
+		directory = std::string("./test/") + name + "/";
+		boost::filesystem::remove_all(directory);
+		boost::filesystem::create_directories(directory);
+		return directory;
+	}
+
+	void TearDown() override {
+		if (!directory.empty())
+			boost::filesystem::remove_all(directory);
+	}
+
+private:
+	std::string directory;
+};
+
+TEST_F(WorldExportTest, RoundTrip) {
+	std::string path = makeDirectory("temp_export");
+	std::string export_filename = path + "world.export";
+
+	// a generated world across several regions, some of them at negative coordinates
+	WorldGenerator generator(SEED, WorldParams());
+	vec3i64 spawn = generator.getSpawnLocation();
+	vec3i64 center(spawn[0] >> Chunk::WIDTH_EXPONENT, spawn[1] >> Chunk::WIDTH_EXPONENT,
+			spawn[2] >> Chunk::WIDTH_EXPONENT);
+	std::vector<std::unique_ptr<Chunk>> chunks;
+	for (int64 z = -1; z <= 0; ++z)
+	for (int64 y = -20; y <= 20; y += 20)
+	for (int64 x = -20; x <= 20; x += 20) {
+		std::unique_ptr<Chunk> chunk(new Chunk(Chunk::VISUAL));
+		chunk->initCC(center + vec3i64(x, y, z));
+		generator.generateChunk(chunk.get());
+		if ((x + y) % 40 == 0) {
+			chunk->setBlock((size_t) (x + 20) * 100, 7);
+			chunk->setBlock(Chunk::SIZE - 1, 3);
+		}
+		chunks.push_back(std::move(chunk));
+	}
+	// noise doesn't get smaller with run lengths
+	std::unique_ptr<Chunk> noise(new Chunk(Chunk::VISUAL));
+	noise->initCC(center + vec3i64(1, 1, 1));
+	uint8 *blocks = noise->getBlocksForInit();
+	for (size_t i = 0; i < Chunk::SIZE; ++i)
+		blocks[i] = (uint8) (i * 7919 % 5);
+	noise->finishInitialization();
+	noise->setBlock(0, 4);
+	chunks.push_back(std::move(noise));
+	// escape characters make RLE grow beyond a chunk, it runs out of room 2 bytes short
+	std::unique_ptr<Chunk> escapes(new Chunk(Chunk::VISUAL));
+	escapes->initCC(center + vec3i64(2, 1, 1));
+	blocks = escapes->getBlocksForInit();
+	for (size_t i = 0; i < Chunk::SIZE; ++i)
+		blocks[i] = i == 0 ? 1 : (i % 2 ? 7 : 255);
+	escapes->finishInitialization();
+	escapes->setBlock(0, 2);
+	chunks.push_back(std::move(escapes));
+
+	std::vector<const Chunk *> chunk_ptrs;
+	for (auto &chunk : chunks)
+		chunk_ptrs.push_back(chunk.get());
+
+	ArchiveConf conf;
+	conf.prefetch = false;
+	{
+		ChunkArchive archive((path + "original/").c_str(), conf);
+		archive.storeChunks(chunk_ptrs);
+		WorldExportStats stats;
+		ASSERT_TRUE(exportWorld(&archive, export_filename.c_str(), 3, &stats));
+		EXPECT_EQ(chunks.size(), stats.chunks);
+		EXPECT_EQ(archive.getRegions().size(), stats.regions);
+		EXPECT_EQ(boost::filesystem::file_size(export_filename), stats.file_bytes);
+	}
+
+	// the imported world is encoded however its own archive is configured
+	ArchiveConf diff_conf = conf;
+	diff_conf.policy = ArchivePolicy::DIFF;
+	diff_conf.compression = ArchiveCompression::ZLIB;
+	{
+		ChunkArchive archive((path + "imported/").c_str(), diff_conf,
+				std::unique_ptr<WorldGenerator>(new WorldGenerator(SEED, WorldParams())));
+		WorldExportStats stats;
+		ASSERT_TRUE(importWorld(&archive, export_filename.c_str(), 3, &stats));
+		EXPECT_EQ(chunks.size(), stats.chunks);
+	}
+
+	ChunkArchive archive((path + "imported/").c_str(), diff_conf,
+			std::unique_ptr<WorldGenerator>(new WorldGenerator(SEED, WorldParams())));
+	for (auto &chunk : chunks) {
+		Chunk actual(Chunk::VISUAL);
+		actual.initCC(chunk->getCC());
+		if (chunk->getRevision() == 0) {
+			// untouched chunks are generated again instead of being stored
+			generator.generateChunk(&actual);
+		} else {
+			ASSERT_TRUE(archive.loadChunk(&actual)) << "Chunk is missing";
+			EXPECT_EQ(chunk->getRevision(), actual.getRevision());
+		}
+		EXPECT_TRUE(haveSameBlocks(*chunk, actual)) << "Chunk differs";
+		EXPECT_EQ(chunk->getPassThroughs(), actual.getPassThroughs());
+	}
+}
+
+TEST_F(WorldExportTest, RejectsCorruptFiles) {
+	std::string path = makeDirectory("temp_export_corrupt");
+	std::string export_filename = path + "world.export";
+
+	Chunk chunk;
+	chunk.initCC({ 3, 4, 5 });
+	uint8 *blocks = chunk.getBlocksForInit();
+	for (size_t i = 0; i < Chunk::SIZE; ++i)
+		blocks[i] = i % 3;
+	chunk.finishInitialization();
+	ArchiveConf conf;
+	conf.prefetch = false;
+	{
+		ChunkArchive archive((path + "original/").c_str(), conf);
+		archive.storeChunk(chunk);
+		ASSERT_TRUE(exportWorld(&archive, export_filename.c_str()));
+	}
+
+	// cut off the footer
+	boost::filesystem::resize_file(export_filename, boost::filesystem::file_size(export_filename) - 1);
+	ChunkArchive archive((path + "imported/").c_str(), conf);
+	EXPECT_FALSE(importWorld(&archive, export_filename.c_str()));
+	EXPECT_FALSE(importWorld(&archive, (path + "missing.export").c_str()));
+	EXPECT_FALSE(archive.hasChunk(chunk.getCC()));
+}
@@ -0,0 +1,50 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "shared/engine/logging.hpp"
+#include "shared/chunk_archive.hpp"
+#include "shared/saves.hpp"
+#include "shared/world_export.hpp"
+
+/* Copies the chunks of a world into a single file and back
+
+	Usage: 3dgame_export export <world id> <file> [threads]
+	       3dgame_export import <world id> <file> [threads]
+
+	Importing needs an existing world, the chunks are added to its regions.
+	Neither may run while the world is in use.
+*/
+int main(int argc, char **argv) {
+	bool is_export = argc >= 2 && strcmp(argv[1], "export") == 0;
+	bool is_import = argc >= 2 && strcmp(argv[1], "import") == 0;
+	if (argc < 4 || argc > 5 || (!is_export && !is_import)) {
+		std::cerr << "Usage: " << argv[0] << " export|import <world id> <file> [threads]" << std::endl;
+		return 1;
+	}
+
+	logging::init("logging_srv.conf");
+
+	Save save(argv[2]);
+	if (!save.isGood())
+		return 1;
+
+	int num_threads = argc > 4 ? atoi(argv[4]) : (int) std::thread::hardware_concurrency();
+	num_threads = std::max(num_threads, 1);
+
+	std::unique_ptr<ChunkArchive> archive = save.getChunkArchive();
+	WorldExportStats stats;
+	bool good = is_export
+			? exportWorld(archive.get(), argv[3], num_threads, &stats)
+			: importWorld(archive.get(), argv[3], num_threads, &stats);
+	if (!good) {
+		std::cerr << (is_export ? "Export" : "Import") << " failed" << std::endl;
+		return 1;
+	}
+
+	std::cout << (is_export ? "Exported " : "Imported ") << stats.chunks << " chunks in "
+			<< stats.regions << " regions, " << stats.file_bytes / 1024 << " KB" << std::endl;
+	return 0;
+}
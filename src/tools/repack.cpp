@@ -0,0 +1,133 @@
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "shared/engine/logging.hpp"
+#include "shared/engine/mutex.hpp"
+#include "shared/game/world_generator.hpp"
+#include "shared/chunk_archive.hpp"
+#include "shared/content_store.hpp"
+#include "shared/saves.hpp"
+
+static logging::Logger logger("repack");
+
+/* Rewrites all region files of a world while the world is not in use
+
+	Worlds using the log backend get all of their segments merged instead.
+
+	Usage: 3dgame_repack <world id> [threads]
+*/
+int main(int argc, char **argv) {
+	if (argc < 2 || argc > 3) {
+		std::cerr << "Usage: " << argv[0] << " <world id> [threads]" << std::endl;
+		return 1;
+	}
+
+	logging::init("logging_srv.conf");
+
+	Save save(argv[1]);
+	if (!save.isGood())
+		return 1;
+
+	std::string path = save.getPath() + "region/";
+
+	// log worlds have no region files, merging every segment with overwritten chunks does the same
+	if (save.getArchiveConf().backend == ArchiveBackend::LOG) {
+		ArchiveConf conf = save.getArchiveConf();
+		conf.log_merge_threshold = 0.0f;
+		ChunkArchive archive(path.c_str(), conf);
+		size_t num_passes = 0;
+		while (archive.compact())
+			++num_passes;
+		std::cout << "Merged log segments in " << num_passes << " passes" << std::endl;
+		return 0;
+	}
+
+	std::vector<std::pair<std::string, vec3i64>> files;
+	boost::system::error_code ec;
+	for (boost::filesystem::directory_iterator iter(path, ec), end; !ec && iter != end; ++iter) {
+		vec3i64 rc;
+		if (ChunkArchive::parseRegionFilename(iter->path().filename().string(), &rc))
+			files.push_back({iter->path().string(), rc});
+	}
+	if (ec) {
+		LOG_ERROR(logger) << "Could not list '" << path << "': " << ec.message();
+		return 1;
+	}
+
+	int num_threads = argc > 2 ? atoi(argv[2]) : (int) std::thread::hardware_concurrency();
+	num_threads = std::max(num_threads, 1);
+
+	std::unique_ptr<WorldGenerator> generator = save.getWorldGenerator();
+	Mutex generator_lock;
+	std::unique_ptr<ContentStore> content_store;
+	if (save.getArchiveConf().deduplicate)
+		content_store.reset(new ContentStore(path, save.getArchiveConf().io, false));
+	std::atomic<size_t> next_file(0);
+	std::vector<RegionRepackStats> totals(num_threads);
+	std::vector<int> failures(num_threads, 0);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_threads; ++i) {
+		threads.emplace_back([&, i]() {
+			for (size_t f = next_file++; f < files.size(); f = next_file++) {
+				RegionRepackStats stats;
+				if (!ChunkArchive::repackRegion(files[f].first.c_str(), files[f].second,
+						save.getArchiveConf(), generator.get(), &generator_lock, content_store.get(), &stats))
+					++failures[i];
+				RegionRepackStats &total = totals[i];
+				total.chunks += stats.chunks;
+				total.file_bytes_before += stats.file_bytes_before;
+				total.used_bytes_before += stats.used_bytes_before;
+				total.total_bytes_before += stats.total_bytes_before;
+				total.file_bytes_after += stats.file_bytes_after;
+				total.used_bytes_after += stats.used_bytes_after;
+				total.total_bytes_after += stats.total_bytes_after;
+			}
+		});
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+
+	RegionRepackStats total;
+	int num_failures = 0;
+	for (int i = 0; i < num_threads; ++i) {
+		total.chunks += totals[i].chunks;
+		total.file_bytes_before += totals[i].file_bytes_before;
+		total.used_bytes_before += totals[i].used_bytes_before;
+		total.total_bytes_before += totals[i].total_bytes_before;
+		total.file_bytes_after += totals[i].file_bytes_after;
+		total.used_bytes_after += totals[i].used_bytes_after;
+		total.total_bytes_after += totals[i].total_bytes_after;
+		num_failures += failures[i];
+	}
+
+	content_store.reset();
+
+	// the manifest still has the old sizes, the archive builds a new one when it has none
+	boost::filesystem::remove(path + "regions.manifest", ec);
+	size_t num_freed;
+	{
+		ArchiveConf conf = save.getArchiveConf();
+		conf.prefetch = false;
+		ChunkArchive archive(path.c_str(), conf);
+		// the replaced files still hold references to shared chunks
+		num_freed = archive.collectGarbage();
+	}
+
+	std::cout << "Repacked " << total.chunks << " chunks in " << files.size() - num_failures
+			<< " of " << files.size() << " region files" << std::endl;
+	std::cout << "Files:       " << total.file_bytes_before / 1024 << " KB -> "
+			<< total.file_bytes_after / 1024 << " KB" << std::endl;
+	std::cout << "Chunk heaps: " << total.used_bytes_before / 1024 << " KB used of "
+			<< total.total_bytes_before / 1024 << " KB -> " << total.used_bytes_after / 1024
+			<< " KB used of " << total.total_bytes_after / 1024 << " KB" << std::endl;
+	std::cout << "Freed " << num_freed << " shared chunks" << std::endl;
+
+	return num_failures > 0 ? 1 : 0;
+}